@@ -209,15 +209,33 @@ net_kmsg_put(const ipc_kmsg_t kmsg)
 	(void) splx(s);
 }
 
-void
-net_kmsg_collect(void)
+/*
+ * Shrinker interface, through which the pageout daemon releases the
+ * free buffers beyond net_queue_free_min on memory pressure.
+ */
+static unsigned long
+net_kmsg_shrink_count(void)
+{
+	/* Harmless unsynchronized access, the count is only a hint */
+	if (net_queue_free_size <= net_queue_free_min)
+	    return 0;
+
+	return net_queue_free_size - net_queue_free_min;
+}
+
+static unsigned long
+net_kmsg_shrink_scan(unsigned long nr_to_scan)
 {
 	ipc_kmsg_t kmsg;
+	unsigned long nr_freed;
 	spl_t s;
 
+	nr_freed = 0;
+
 	s = splimp();
 	simple_lock(&net_queue_free_lock);
-	while (net_queue_free_size > net_queue_free_min) {
+	while ((nr_freed < nr_to_scan)
+	       && (net_queue_free_size > net_queue_free_min)) {
 	    kmsg = ipc_kmsg_dequeue(&net_queue_free);
 	    net_queue_free_size--;
 	    simple_unlock(&net_queue_free_lock);
@@ -227,14 +245,23 @@ net_kmsg_collect(void)
 	    simple_lock(&net_kmsg_total_lock);
 	    net_kmsg_total--;
 	    simple_unlock(&net_kmsg_total_lock);
+	    nr_freed++;
 
 	    s = splimp();
 	    simple_lock(&net_queue_free_lock);
 	}
 	simple_unlock(&net_queue_free_lock);
 	(void) splx(s);
+
+	return nr_freed;
 }
 
+static struct kmem_shrinker net_kmsg_shrinker = {
+	.name = "net_kmsg",
+	.count = net_kmsg_shrink_count,
+	.scan = net_kmsg_shrink_scan,
+};
+
 static void
 net_kmsg_more(void)
 {
@@ -1518,6 +1545,7 @@ net_io_init(void)
 
 	simple_lock_init(&net_queue_free_lock);
 	ipc_kmsg_queue_init(&net_queue_free);
+	kmem_shrinker_register(&net_kmsg_shrinker);
 
 	simple_lock_init(&net_queue_lock);
 	ipc_kmsg_queue_init(&net_queue_high);
@@ -89,8 +89,6 @@ extern io_return_t net_write(struct ifnet *, net_write_start_device_fn, io_req_t
 
 extern vm_size_t net_kmsg_size;
 
-extern void net_kmsg_collect (void);
-
 extern void net_io_init(void);
 extern void net_thread(void) __attribute__ ((noreturn));
 
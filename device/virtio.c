@@ -31,6 +31,8 @@
 #include <kern/kalloc.h>
 #include <vm/vm_map.h>
 #include <vm/vm_kern.h>
+#include <vm/vm_page.h>
+#include <vm/pmap.h>
 #include <ipc/ipc_port.h>
 #include <string.h>
 #include <machine/pio.h>
@@ -233,6 +235,139 @@ void virtio_free_device(struct virtio_device *dev)
     kfree((vm_offset_t)dev, sizeof(struct virtio_device));
 }
 
+/*
+ * Size of the legacy ring layout for a queue of num descriptors:
+ * descriptor table and available ring, then the used ring on the
+ * next VIRTIO_PCI_VRING_ALIGN boundary.  Both rings carry an extra
+ * event index slot.
+ */
+static vm_size_t virtio_vring_used_offset(unsigned int num)
+{
+    vm_size_t size;
+
+    size = num * sizeof(struct vring_desc)
+           + sizeof(uint16_t) * (3 + num);
+    return (size + VIRTIO_PCI_VRING_ALIGN - 1) & ~(VIRTIO_PCI_VRING_ALIGN - 1);
+}
+
+static vm_size_t virtio_vring_size(unsigned int num)
+{
+    vm_size_t size;
+
+    size = virtio_vring_used_offset(num)
+           + sizeof(uint16_t) * 3 + num * sizeof(struct vring_used_elem);
+    return (size + VIRTIO_PCI_VRING_ALIGN - 1) & ~(VIRTIO_PCI_VRING_ALIGN - 1);
+}
+
+/*
+ * Allocate the rings of a virtqueue and hand them to the device
+ */
+static kern_return_t virtio_vring_init(struct virtio_device *dev,
+                                       struct virtqueue *vq,
+                                       unsigned int index)
+{
+    struct vm_page *pages;
+    phys_addr_t pa;
+    vm_offset_t ring;
+    unsigned int num, i;
+
+    virtio_config_writew(dev, VIRTIO_PCI_QUEUE_SEL, index);
+    num = virtio_config_readw(dev, VIRTIO_PCI_QUEUE_NUM);
+
+    /* Legacy queues have a fixed, power of two size */
+    if (num == 0 || (num & (num - 1)) != 0) {
+        printf("VIRTIO: Invalid size %u for virtqueue %u\n", num, index);
+        return KERN_FAILURE;
+    }
+
+    if (virtio_config_readl(dev, VIRTIO_PCI_QUEUE_PFN) != 0) {
+        printf("VIRTIO: Virtqueue %u already active\n", index);
+        return KERN_FAILURE;
+    }
+
+    vq->ring_size = virtio_vring_size(num);
+    pages = vm_page_grab_contig(vq->ring_size, VM_PAGE_SEL_DMA32);
+    if (pages == NULL) {
+        return KERN_RESOURCE_SHORTAGE;
+    }
+
+    vq->desc_data = (void **)kalloc(num * sizeof(void *));
+    vq->desc_indirect = (struct vring_desc **)
+        kalloc(num * sizeof(struct vring_desc *));
+    if (!vq->desc_data || !vq->desc_indirect) {
+        if (vq->desc_data) {
+            kfree((vm_offset_t)vq->desc_data, num * sizeof(void *));
+        }
+        if (vq->desc_indirect) {
+            kfree((vm_offset_t)vq->desc_indirect,
+                  num * sizeof(struct vring_desc *));
+        }
+        vq->desc_data = NULL;
+        vq->desc_indirect = NULL;
+        vm_page_free_contig(pages, vq->ring_size);
+        return KERN_RESOURCE_SHORTAGE;
+    }
+    memset(vq->desc_data, 0, num * sizeof(void *));
+    memset(vq->desc_indirect, 0, num * sizeof(struct vring_desc *));
+
+    pa = vm_page_to_pa(pages);
+    ring = phystokv(pa);
+    memset((void *)ring, 0, vq->ring_size);
+
+    vq->ring_pages = pages;
+    vq->num = num;
+    vq->index = index;
+    vq->vdev = dev;
+    vq->desc = (struct vring_desc *)ring;
+    vq->avail = (struct vring_avail *)(ring + num * sizeof(struct vring_desc));
+    vq->used = (struct vring_used *)(ring + virtio_vring_used_offset(num));
+    vq->event_idx = virtio_has_feature(dev, VIRTIO_F_RING_EVENT_IDX);
+    vq->indirect = virtio_has_feature(dev, VIRTIO_F_RING_INDIRECT_DESC);
+
+    /* Chain all descriptors in the free list */
+    for (i = 0; i < num - 1; i++) {
+        vq->desc[i].next = i + 1;
+    }
+    vq->free_head = 0;
+    vq->num_free = num;
+
+    virtio_config_writel(dev, VIRTIO_PCI_QUEUE_PFN,
+                         pa >> VIRTIO_PCI_QUEUE_ADDR_SHIFT);
+    return KERN_SUCCESS;
+}
+
+/*
+ * Release the rings of a virtqueue
+ */
+static void virtio_vring_destroy(struct virtio_device *dev,
+                                 struct virtqueue *vq)
+{
+    unsigned int i;
+
+    if (!vq->ring_pages) {
+        return;
+    }
+
+    /* Detach the rings from the device before freeing them */
+    virtio_config_writew(dev, VIRTIO_PCI_QUEUE_SEL, vq->index);
+    virtio_config_writel(dev, VIRTIO_PCI_QUEUE_PFN, 0);
+
+    for (i = 0; i < vq->num; i++) {
+        if (vq->desc_indirect[i]) {
+            kfree((vm_offset_t)vq->desc_indirect[i], vq->desc[i].len);
+        }
+    }
+
+    kfree((vm_offset_t)vq->desc_data, vq->num * sizeof(void *));
+    kfree((vm_offset_t)vq->desc_indirect,
+          vq->num * sizeof(struct vring_desc *));
+    vm_page_free_contig(vq->ring_pages, vq->ring_size);
+    vq->ring_pages = NULL;
+    vq->desc = NULL;
+    vq->avail = NULL;
+    vq->used = NULL;
+}
+
 /*
  * Setup virtqueues for a device
  */
@@ -240,6 +375,7 @@ kern_return_t virtio_setup_vqs(struct virtio_device *dev,
                                unsigned int nvqs,
                                const char **names)
 {
+    kern_return_t kr;
     unsigned int i;
     
     if (!dev || nvqs == 0) {
@@ -255,19 +391,14 @@ kern_return_t virtio_setup_vqs(struct virtio_device *dev,
         return KERN_RESOURCE_SHORTAGE;
     }
     
+    memset(dev->vqs, 0, nvqs * sizeof(struct virtqueue *));
     dev->nvqs = nvqs;
     
     /* Initialize each virtqueue */
     for (i = 0; i < nvqs; i++) {
         dev->vqs[i] = (struct virtqueue *)kalloc(sizeof(struct virtqueue));
         if (!dev->vqs[i]) {
-            /* Clean up previously allocated queues */
-            while (i > 0) {
-                kfree((vm_offset_t)dev->vqs[--i], sizeof(struct virtqueue));
-            }
-            kfree((vm_offset_t)dev->vqs, nvqs * sizeof(struct virtqueue *));
-            dev->vqs = NULL;
-            dev->nvqs = 0;
+            virtio_cleanup_vqs(dev);
             return KERN_RESOURCE_SHORTAGE;
         }
         
@@ -275,8 +406,14 @@ kern_return_t virtio_setup_vqs(struct virtio_device *dev,
         memset(dev->vqs[i], 0, sizeof(struct virtqueue));
         simple_lock_init(&dev->vqs[i]->lock);
         
-        printf("VIRTIO: Initialized virtqueue %u (%s)\n", 
-               i, names ? names[i] : "unnamed");
+        kr = virtio_vring_init(dev, dev->vqs[i], i);
+        if (kr != KERN_SUCCESS) {
+            virtio_cleanup_vqs(dev);
+            return kr;
+        }
+        
+        printf("VIRTIO: Initialized virtqueue %u (%s), %u descriptors\n", 
+               i, names ? names[i] : "unnamed", dev->vqs[i]->num);
     }
     
     return KERN_SUCCESS;
@@ -299,12 +436,7 @@ void virtio_cleanup_vqs(struct virtio_device *dev)
     /* Free each virtqueue */
     for (i = 0; i < dev->nvqs; i++) {
         if (dev->vqs[i]) {
-            /* Free descriptor tables if allocated */
-            if (dev->vqs[i]->desc) {
-                kfree((vm_offset_t)dev->vqs[i]->desc, 
-                      dev->vqs[i]->num * sizeof(struct vring_desc));
-            }
-            
+            virtio_vring_destroy(dev, dev->vqs[i]);
             kfree((vm_offset_t)dev->vqs[i], sizeof(struct virtqueue));
         }
     }
@@ -419,7 +551,17 @@ void virtio_finalize_features(struct virtio_device *dev)
 }
 
 /*
- * Queue operations (simplified implementations)
+ * Queue operations
+ *
+ * The caller serializes all operations on a queue, normally by holding
+ * VIRTIO_QUEUE_LOCK.
+ */
+
+/*
+ * Make a buffer available to the device.  desc_list holds the address
+ * (guest-physical) and length of out_num device-readable segments
+ * followed by in_num device-writable ones.  data is returned by
+ * virtio_get_buf once the device is done with the buffer.
  */
 kern_return_t virtio_add_buf(struct virtqueue *vq, 
                             struct vring_desc *desc_list,
@@ -427,54 +569,365 @@ kern_return_t virtio_add_buf(struct virtqueue *vq,
                             unsigned int in_num,
                             void *data)
 {
-    /* Simplified implementation - would need full ring management */
-    if (!vq || !desc_list) {
+    struct vring_desc *table = NULL;
+    unsigned int total = out_num + in_num;
+    unsigned int i, n, prev, head;
+    
+    if (!vq || !vq->desc || !desc_list || total == 0 || !data) {
+        return KERN_INVALID_ARGUMENT;
+    }
+    
+    /*
+     * Chains longer than one segment go through an indirect table
+     * when possible, so that they only use a single ring slot.
+     */
+    if (vq->indirect && total > 1 && total <= VIRTIO_MAX_INDIRECT) {
+        table = (struct vring_desc *)kalloc(total * sizeof(struct vring_desc));
+    }
+    
+    if (table) {
+        if (vq->num_free == 0) {
+            kfree((vm_offset_t)table, total * sizeof(struct vring_desc));
+            return KERN_RESOURCE_SHORTAGE;
+        }
+        
+        for (n = 0; n < total; n++) {
+            table[n].addr = desc_list[n].addr;
+            table[n].len = desc_list[n].len;
+            table[n].flags = (n < total - 1) ? VRING_DESC_F_NEXT : 0;
+            if (n >= out_num) {
+                table[n].flags |= VRING_DESC_F_WRITE;
+            }
+            table[n].next = n + 1;
+        }
+        
+        head = vq->free_head;
+        vq->desc[head].addr = kvtophys((vm_offset_t)table);
+        vq->desc[head].len = total * sizeof(struct vring_desc);
+        vq->desc[head].flags = VRING_DESC_F_INDIRECT;
+        vq->free_head = vq->desc[head].next;
+        vq->num_free--;
+        vq->desc_indirect[head] = table;
+    } else {
+        if (vq->num_free < total) {
+            return KERN_RESOURCE_SHORTAGE;
+        }
+        
+        head = i = prev = vq->free_head;
+        for (n = 0; n < total; n++) {
+            vq->desc[i].addr = desc_list[n].addr;
+            vq->desc[i].len = desc_list[n].len;
+            vq->desc[i].flags = VRING_DESC_F_NEXT;
+            if (n >= out_num) {
+                vq->desc[i].flags |= VRING_DESC_F_WRITE;
+            }
+            prev = i;
+            i = vq->desc[i].next;
+        }
+        vq->desc[prev].flags &= ~VRING_DESC_F_NEXT;
+        vq->free_head = i;
+        vq->num_free -= total;
+    }
+    
+    vq->desc_data[head] = data;
+    
+    /* Publish the chain, then the new index */
+    vq->avail->ring[vq->avail->idx & (vq->num - 1)] = head;
+    __sync_synchronize();
+    vq->avail->idx++;
+    vq->num_added++;
+    vq->added++;
+    
+    return KERN_SUCCESS;
+}
+
+/*
+ * Make a buffer available to the device through an indirect table
+ * owned by the caller, which must stay untouched until virtio_get_buf
+ * returns data.  Unlike virtio_add_buf, this never allocates memory
+ * and can be used at interrupt level.  The table entries only need
+ * their address and length set.
+ */
+kern_return_t virtio_add_indirect(struct virtqueue *vq,
+                                  struct vring_desc *table,
+                                  unsigned int out_num,
+                                  unsigned int in_num,
+                                  void *data)
+{
+    unsigned int total = out_num + in_num;
+    unsigned int n, head;
+    
+    if (!vq || !vq->desc || !table || total == 0 || !data) {
         return KERN_INVALID_ARGUMENT;
     }
     
-    /* For now, just store the data pointer */
-    vq->data = data;
+    if (!vq->indirect || total > VIRTIO_MAX_INDIRECT) {
+        return KERN_INVALID_ARGUMENT;
+    }
+    
+    if (vq->num_free == 0) {
+        return KERN_RESOURCE_SHORTAGE;
+    }
+    
+    for (n = 0; n < total; n++) {
+        table[n].flags = (n < total - 1) ? VRING_DESC_F_NEXT : 0;
+        if (n >= out_num) {
+            table[n].flags |= VRING_DESC_F_WRITE;
+        }
+        table[n].next = n + 1;
+    }
+    
+    head = vq->free_head;
+    vq->desc[head].addr = kvtophys((vm_offset_t)table);
+    vq->desc[head].len = total * sizeof(struct vring_desc);
+    vq->desc[head].flags = VRING_DESC_F_INDIRECT;
+    vq->free_head = vq->desc[head].next;
+    vq->num_free--;
+    vq->desc_data[head] = data;
+    
+    vq->avail->ring[vq->avail->idx & (vq->num - 1)] = head;
+    __sync_synchronize();
+    vq->avail->idx++;
+    vq->num_added++;
+    vq->added++;
     
     return KERN_SUCCESS;
 }
 
+/*
+ * Describe a wired kernel buffer as guest-physical segments, split at
+ * page boundaries and merged where pages are physically contiguous.
+ * Returns the number of segments used, or 0 if more than max would be
+ * needed.
+ */
+unsigned int virtio_sg_init(struct vring_desc *sg, unsigned int max,
+                            vm_offset_t addr, vm_size_t size)
+{
+    unsigned int n = 0;
+    phys_addr_t pa;
+    vm_size_t len;
+    
+    while (size > 0) {
+        len = PAGE_SIZE - (addr & PAGE_MASK);
+        if (len > size) {
+            len = size;
+        }
+        pa = kvtophys(addr);
+        
+        if (n > 0 && sg[n - 1].addr + sg[n - 1].len == pa) {
+            sg[n - 1].len += len;
+        } else {
+            if (n == max) {
+                return 0;
+            }
+            sg[n].addr = pa;
+            sg[n].len = len;
+            sg[n].flags = 0;
+            sg[n].next = 0;
+            n++;
+        }
+        
+        addr += len;
+        size -= len;
+    }
+    
+    return n;
+}
+
+/*
+ * Return a descriptor chain to the free list
+ */
+static void virtio_detach_buf(struct virtqueue *vq, unsigned int head)
+{
+    unsigned int i = head;
+    
+    vq->desc_data[head] = NULL;
+    
+    if (vq->desc_indirect[head]) {
+        kfree((vm_offset_t)vq->desc_indirect[head], vq->desc[head].len);
+        vq->desc_indirect[head] = NULL;
+        vq->num_free++;
+    } else {
+        vq->num_free++;
+        while (vq->desc[i].flags & VRING_DESC_F_NEXT) {
+            i = vq->desc[i].next;
+            vq->num_free++;
+        }
+    }
+    
+    vq->desc[i].next = vq->free_head;
+    vq->free_head = head;
+}
+
+/*
+ * Get the next buffer used by the device, or NULL if there is none.
+ * The number of bytes the device wrote is returned in len.
+ */
 void *virtio_get_buf(struct virtqueue *vq, uint32_t *len)
 {
+    struct vring_used_elem *elem;
     void *data;
+    uint32_t id;
     
-    if (!vq) {
+    if (!vq || !vq->used) {
+        return NULL;
+    }
+    
+    if (vq->last_used_idx == *(volatile uint16_t *)&vq->used->idx) {
         return NULL;
     }
     
-    /* Simplified implementation */
-    data = vq->data;
-    vq->data = NULL;
+    /* Read the entry only after seeing the index move */
+    __sync_synchronize();
     
+    elem = &vq->used->ring[vq->last_used_idx & (vq->num - 1)];
+    id = elem->id;
+    if (id >= vq->num || !vq->desc_data[id]) {
+        printf("VIRTIO: Bogus used descriptor %u on virtqueue %u\n",
+               id, vq->index);
+        vq->last_used_idx++;
+        return NULL;
+    }
+    
+    data = vq->desc_data[id];
     if (len) {
-        *len = 0;  /* Would return actual length */
+        *len = elem->len;
+    }
+    
+    virtio_detach_buf(vq, id);
+    vq->last_used_idx++;
+    vq->completed++;
+    
+    /* Ask for an interrupt as soon as the next buffer is used */
+    if (vq->event_idx && !(vq->avail->flags & VRING_AVAIL_F_NO_INTERRUPT)) {
+        vring_used_event(vq) = vq->last_used_idx;
+        __sync_synchronize();
     }
     
     return data;
 }
 
+/*
+ * Notify the device of the buffers added since the last kick, unless
+ * it asked not to be.
+ */
 void virtio_kick(struct virtqueue *vq)
 {
-    /* Simplified implementation - would notify device */
-    if (vq) {
-        printf("VIRTIO: Kicked virtqueue\n");
+    uint16_t new_idx, old_idx;
+    boolean_t notify;
+    
+    if (!vq || !vq->avail || vq->num_added == 0) {
+        return;
+    }
+    
+    /* Make the new index visible before reading the event index */
+    __sync_synchronize();
+    
+    new_idx = vq->avail->idx;
+    old_idx = new_idx - vq->num_added;
+    vq->num_added = 0;
+    vq->kicks++;
+    
+    if (vq->event_idx) {
+        notify = vring_need_event(vring_avail_event(vq), new_idx, old_idx);
+    } else {
+        notify = !(vq->used->flags & VRING_USED_F_NO_NOTIFY);
+    }
+    
+    if (notify) {
+        virtio_config_writew(vq->vdev, VIRTIO_PCI_QUEUE_NOTIFY, vq->index);
+        vq->notifications++;
     }
 }
 
+/*
+ * Ask the device not to interrupt when it uses buffers.  This is only
+ * a hint, callbacks may still happen.
+ */
 void virtio_disable_cb(struct virtqueue *vq)
 {
-    /* Simplified implementation */
-    (void)vq;
+    if (!vq || !vq->avail) {
+        return;
+    }
+    
+    vq->avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
 }
 
+/*
+ * Ask the device to interrupt again when it uses buffers.  Returns
+ * FALSE if used buffers are already pending, in which case the caller
+ * must process them since no interrupt may come for them.
+ */
 boolean_t virtio_enable_cb(struct virtqueue *vq)
 {
-    /* Simplified implementation */
-    (void)vq;
+    if (!vq || !vq->avail) {
+        return TRUE;
+    }
+    
+    vq->avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+    if (vq->event_idx) {
+        vring_used_event(vq) = vq->last_used_idx;
+    }
+    __sync_synchronize();
+    
+    return vq->last_used_idx == *(volatile uint16_t *)&vq->used->idx;
+}
+
+/*
+ * Like virtio_enable_cb, but with event index in use, only ask for an
+ * interrupt once count more buffers have been used, so that the
+ * completions of a batch are reported together.  The caller must
+ * make sure that at least count buffers are outstanding, or no
+ * interrupt may ever come.  Returns FALSE if that many used buffers
+ * are already pending.
+ */
+boolean_t virtio_enable_cb_delayed(struct virtqueue *vq, unsigned int count)
+{
+    uint16_t used_idx;
+    
+    if (!vq || !vq->avail) {
+        return TRUE;
+    }
+    
+    if (!vq->event_idx || count <= 1) {
+        return virtio_enable_cb(vq);
+    }
+    
+    vq->avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+    vring_used_event(vq) = vq->last_used_idx + count - 1;
+    __sync_synchronize();
+    
+    used_idx = *(volatile uint16_t *)&vq->used->idx;
+    return (uint16_t)(used_idx - vq->last_used_idx) < count;
+}
+
+/*
+ * Interrupt handler helper for transports.  Reading the ISR status
+ * acknowledges the interrupt.  Returns FALSE if the device did not
+ * raise it.
+ */
+boolean_t virtio_interrupt(struct virtio_device *dev)
+{
+    unsigned int i;
+    uint8_t isr;
+    
+    if (!dev) {
+        return FALSE;
+    }
+    
+    isr = virtio_config_readb(dev, VIRTIO_PCI_ISR);
+    if (isr == 0) {
+        return FALSE;
+    }
+    
+    if (isr & VIRTIO_PCI_ISR_QUEUE) {
+        for (i = 0; i < dev->nvqs; i++) {
+            if (dev->vqs[i] && dev->vqs[i]->callback) {
+                dev->vqs[i]->callback(dev->vqs[i]);
+            }
+        }
+    }
+    
     return TRUE;
 }
 
@@ -499,6 +952,27 @@ void virtio_dump_device_info(struct virtio_device *dev)
     printf("  Driver: %s\n", dev->driver ? dev->driver->name : "none");
 }
 
+void virtio_dump_queue_info(struct virtqueue *vq)
+{
+    if (!vq) {
+        printf("VIRTIO: NULL virtqueue\n");
+        return;
+    }
+    
+    printf("VIRTIO Queue %u Info:\n", vq->index);
+    printf("  Descriptors: %u (%u free)\n", vq->num, vq->num_free);
+    printf("  Features: %s%s\n",
+           vq->indirect ? "indirect " : "",
+           vq->event_idx ? "event-idx" : "");
+    printf("  Avail idx: %u, used idx: %u, last used: %u\n",
+           vq->avail ? vq->avail->idx : 0,
+           vq->used ? vq->used->idx : 0,
+           vq->last_used_idx);
+    printf("  Added: %lu, completed: %lu\n", vq->added, vq->completed);
+    printf("  Kicks: %lu, notifications: %lu\n",
+           vq->kicks, vq->notifications);
+}
+
 void virtio_dump_subsystem_info(void)
 {
     struct virtio_device *dev;
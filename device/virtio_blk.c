@@ -25,11 +25,18 @@
  */
 
 #include <device/virtio.h>
+#include <device/virtio_blk.h>
 #include <device/ds_routines.h>
 #include <device/buf.h>
+#include <device/conf.h>
 #include <device/device_types.h>
+#include <kern/assert.h>
+#include <kern/cpu_number.h>
 #include <kern/printf.h>
 #include <kern/kalloc.h>
+#include <vm/pmap.h>
+#include <machine/model_dep.h>
+#include <machine/spl.h>
 #include <string.h>
 #include <device/param.h>
 #include <sys/types.h>
@@ -52,7 +59,8 @@ struct virtio_blk_config {
         uint32_t opt_io_size;          /* Optimal I/O size in logical blocks */
     } topology;
     uint8_t writeback;          /* Writeback mode */
-    uint8_t unused0[3];
+    uint8_t unused0;
+    uint16_t num_queues;        /* Number of request queues */
     uint32_t max_discard_sectors;      /* Maximum discard sectors */
     uint32_t max_discard_seg;          /* Maximum discard segments */
     uint32_t discard_sector_alignment; /* Discard sector alignment */
@@ -62,6 +70,13 @@ struct virtio_blk_config {
     uint8_t unused1[3];
 };
 
+/* Offsets of the configuration fields we read */
+#define VIRTIO_BLK_CONFIG_CAPACITY      0
+#define VIRTIO_BLK_CONFIG_SIZE_MAX      8
+#define VIRTIO_BLK_CONFIG_SEG_MAX       12
+#define VIRTIO_BLK_CONFIG_BLK_SIZE      20
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES    34
+
 /* Virtio block request header */
 struct virtio_blk_req {
     uint32_t type;              /* Request type */
@@ -71,6 +86,56 @@ struct virtio_blk_req {
     /* uint8_t status; */        /* Status byte (at end) */
 };
 
+/* Sectors are always 512 bytes, whatever the block size */
+#define VIRTIO_BLK_SECTOR_SIZE    512
+
+/*
+ * A command is the header, data segments and status byte of one
+ * device request.  Requests for adjacent sectors queued while the
+ * device is busy are merged into a single command, chained through
+ * io_link.
+ */
+struct virtio_blk_cmd {
+    struct {
+        uint32_t type;          /* Request type */
+        uint32_t reserved;      /* Reserved */
+        uint64_t sector;        /* Sector number */
+    } hdr;
+    uint8_t status;             /* Written by the device */
+    io_req_t ior;               /* Requests carried by this command */
+    struct virtio_blk_cmd *next;        /* Free list linkage */
+    struct vring_desc *table;   /* Descriptors, VIRTIO_MAX_INDIRECT entries */
+};
+
+/* Data segments per command, leaving room for header and status */
+#define VIRTIO_BLK_MAX_SEGS       (VIRTIO_MAX_INDIRECT - 2)
+
+/*
+ * Largest transfer per request and per merged command.  Reads are
+ * clipped to it, and writes never map more than one page list at a
+ * time, so a single request always fits in a command.
+ */
+#define VIRTIO_BLK_MAX_TRANSFER   (256 * 1024)
+
+/* Commands per request queue */
+#define VIRTIO_BLK_QUEUE_DEPTH    64
+
+/* Request queues used, at most one per processor */
+#define VIRTIO_BLK_MAX_QUEUES     8
+
+/*
+ * While the device is busy, requests are held back and handed over
+ * together, with a single notification, when a command completes or
+ * once this many are waiting.
+ */
+#define VIRTIO_BLK_BATCH          8
+
+/*
+ * With event index, ask for one interrupt per this many completions
+ * (or fewer, when fewer commands are in flight).
+ */
+#define VIRTIO_BLK_COALESCE       8
+
 /* Request types */
 #define VIRTIO_BLK_T_IN           0     /* Read */
 #define VIRTIO_BLK_T_OUT          1     /* Write */
@@ -92,17 +157,42 @@ struct virtio_blk_req {
 #define VIRTIO_BLK_F_FLUSH        9     /* Flush support */
 #define VIRTIO_BLK_F_TOPOLOGY     10    /* Topology information */
 #define VIRTIO_BLK_F_CONFIG_WCE   11    /* Writeback cache enable */
+#define VIRTIO_BLK_F_MQ           12    /* Multiple request queues */
 #define VIRTIO_BLK_F_DISCARD      13    /* Discard support */
 #define VIRTIO_BLK_F_WRITE_ZEROES 14    /* Write zeroes support */
 
+struct virtio_blk_dev;
+
+/* Request queue state */
+struct virtio_blk_queue {
+    struct virtio_blk_dev *blkdev;      /* Owning device */
+    struct virtqueue *vq;               /* Hardware queue, lock protects the rest */
+    io_req_t pending_head;              /* Requests not yet handed to the */
+    io_req_t pending_tail;              /*   device, linked through io_next */
+    unsigned int npending;              /* Number of pending requests */
+    unsigned int inflight;              /* Commands owned by the device */
+    struct virtio_blk_cmd *free_cmds;   /* Command pool */
+    struct virtio_blk_cmd *cmds;        /* Pool storage */
+    unsigned int ncmds;                 /* Pool size */
+
+    /* Statistics */
+    unsigned long requests;             /* Requests queued */
+    unsigned long merged;               /* Requests merged into a command */
+    unsigned long commands;             /* Commands submitted */
+    unsigned long batches;              /* Submission rounds */
+    unsigned long interrupts;           /* Completion callbacks */
+    unsigned long completions;          /* Commands completed */
+};
+
 /* Virtio block device private data */
 struct virtio_blk_dev {
     struct virtio_device *vdev;         /* Virtio device */
     struct virtio_blk_config config;   /* Device configuration */
-    struct virtqueue *vq;               /* Request virtqueue */
+    struct virtio_blk_queue *queues;    /* Request queues */
+    unsigned int nqueues;               /* Number of request queues */
     uint32_t features;                  /* Negotiated features */
     uint32_t block_size;                /* Logical block size */
-    uint64_t capacity;                  /* Device capacity in blocks */
+    uint64_t capacity;                  /* Device capacity in sectors */
     char name[16];                      /* Device name */
 };
 
@@ -116,157 +206,453 @@ static int virtio_blk_device_count = 0;
 static void virtio_blk_read_config(struct virtio_blk_dev *blkdev)
 {
     struct virtio_device *vdev = blkdev->vdev;
-    unsigned int offset = 0;
+    unsigned int base = VIRTIO_PCI_CONFIG;
     
     /* Read capacity (8 bytes) */
-    blkdev->config.capacity = virtio_config_readl(vdev, offset);
-    blkdev->config.capacity |= (uint64_t)virtio_config_readl(vdev, offset + 4) << 32;
-    offset += 8;
+    blkdev->config.capacity =
+        virtio_config_readl(vdev, base + VIRTIO_BLK_CONFIG_CAPACITY);
+    blkdev->config.capacity |= (uint64_t)virtio_config_readl(vdev,
+        base + VIRTIO_BLK_CONFIG_CAPACITY + 4) << 32;
     
     /* Read other configuration fields */
-    blkdev->config.size_max = virtio_config_readl(vdev, offset);
-    offset += 4;
-    blkdev->config.seg_max = virtio_config_readl(vdev, offset);
-    offset += 4;
-    
-    /* Skip geometry for now */
-    offset += 4;
+    blkdev->config.size_max =
+        virtio_config_readl(vdev, base + VIRTIO_BLK_CONFIG_SIZE_MAX);
+    blkdev->config.seg_max =
+        virtio_config_readl(vdev, base + VIRTIO_BLK_CONFIG_SEG_MAX);
     
     /* Read block size */
-    blkdev->config.blk_size = virtio_config_readl(vdev, offset);
+    if (blkdev->features & (1U << VIRTIO_BLK_F_BLK_SIZE)) {
+        blkdev->config.blk_size =
+            virtio_config_readl(vdev, base + VIRTIO_BLK_CONFIG_BLK_SIZE);
+    }
     if (blkdev->config.blk_size == 0) {
         blkdev->config.blk_size = 512;  /* Default sector size */
     }
     
+    /* Read number of request queues */
+    blkdev->config.num_queues = 1;
+    if (blkdev->features & (1U << VIRTIO_BLK_F_MQ)) {
+        blkdev->config.num_queues =
+            virtio_config_readw(vdev, base + VIRTIO_BLK_CONFIG_NUM_QUEUES);
+        if (blkdev->config.num_queues == 0) {
+            blkdev->config.num_queues = 1;
+        }
+    }
+    
     /* Set device parameters */
     blkdev->block_size = blkdev->config.blk_size;
     blkdev->capacity = blkdev->config.capacity;
     
     printf("VIRTIO-BLK: Device capacity: %llu sectors (%llu bytes)\n",
-           blkdev->capacity, blkdev->capacity * blkdev->block_size);
-    printf("VIRTIO-BLK: Block size: %u bytes\n", blkdev->block_size);
+           (unsigned long long)blkdev->capacity,
+           (unsigned long long)blkdev->capacity * VIRTIO_BLK_SECTOR_SIZE);
+    printf("VIRTIO-BLK: Block size: %u bytes, %u request queues\n",
+           blkdev->block_size, blkdev->config.num_queues);
 }
 
 /*
- * Process a block I/O request
+ * Number of sectors covered by a request
  */
-static io_return_t virtio_blk_request(struct virtio_blk_dev *blkdev, 
-                                     io_req_t ior)
+static inline uint64_t virtio_blk_sectors(io_req_t ior)
 {
-    struct virtio_blk_req *req;
-    uint32_t type;
-    uint64_t sector;
-    uint32_t length;
+    return ior->io_count / VIRTIO_BLK_SECTOR_SIZE;
+}
+
+/*
+ * First sector of a request
+ */
+static inline uint64_t virtio_blk_sector(struct virtio_blk_dev *blkdev,
+                                         io_req_t ior)
+{
+    return (uint64_t)ior->io_recnum
+           * (blkdev->block_size / VIRTIO_BLK_SECTOR_SIZE);
+}
+
+/*
+ * Build a command out of the requests at the head of the pending
+ * list, merging those which continue it on disk, and hand it to the
+ * device.  Returns FALSE if the command pool or the ring is full.
+ * Called with the queue locked.
+ */
+static boolean_t virtio_blk_submit(struct virtio_blk_queue *q)
+{
+    struct virtio_blk_dev *blkdev = q->blkdev;
+    struct virtio_blk_cmd *cmd;
+    struct vring_desc *table;
+    io_req_t ior, last;
+    uint64_t next_sector;
+    unsigned int nseg, n;
+    long total;
+    boolean_t write;
+    kern_return_t kr;
+    
+    cmd = q->free_cmds;
+    if (cmd == NULL) {
+        return FALSE;
+    }
     
-    if (!blkdev || !ior) {
-        return D_INVALID_OPERATION;
+    table = cmd->table;
+    ior = q->pending_head;
+    write = (ior->io_op & IO_READ) == 0;
+    
+    cmd->hdr.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    cmd->hdr.reserved = 0;
+    cmd->hdr.sector = virtio_blk_sector(blkdev, ior);
+    cmd->status = VIRTIO_BLK_S_IOERR;
+    
+    table[0].addr = kvtophys((vm_offset_t)&cmd->hdr);
+    table[0].len = sizeof(cmd->hdr);
+    nseg = virtio_sg_init(&table[1], VIRTIO_BLK_MAX_SEGS,
+                          (vm_offset_t)ior->io_data, ior->io_count);
+    assert(nseg != 0);
+    
+    total = ior->io_count;
+    next_sector = cmd->hdr.sector + virtio_blk_sectors(ior);
+    last = ior;
+    
+    /* Merge the following requests while they continue this one */
+    for (ior = ior->io_next; ior != NULL; ior = ior->io_next) {
+        if (((ior->io_op & IO_READ) == 0) != write
+            || virtio_blk_sector(blkdev, ior) != next_sector
+            || total + ior->io_count > VIRTIO_BLK_MAX_TRANSFER) {
+            break;
+        }
+        
+        n = virtio_sg_init(&table[1 + nseg], VIRTIO_BLK_MAX_SEGS - nseg,
+                           (vm_offset_t)ior->io_data, ior->io_count);
+        if (n == 0) {
+            break;
+        }
+        
+        last->io_link = ior;
+        last = ior;
+        nseg += n;
+        total += ior->io_count;
+        next_sector += virtio_blk_sectors(ior);
+        q->merged++;
     }
+    last->io_link = NULL;
     
-    /* Determine request type */
-    if (ior->io_op & IO_READ) {
-        type = VIRTIO_BLK_T_IN;
-    } else if (ior->io_op & IO_WRITE) {
-        type = VIRTIO_BLK_T_OUT;
+    table[1 + nseg].addr = kvtophys((vm_offset_t)&cmd->status);
+    table[1 + nseg].len = sizeof(cmd->status);
+    
+    if (q->vq->indirect) {
+        kr = write ? virtio_add_indirect(q->vq, table, nseg + 1, 1, cmd)
+                   : virtio_add_indirect(q->vq, table, 1, nseg + 1, cmd);
     } else {
-        return D_INVALID_OPERATION;
+        /* Direct descriptors, the ring gets a copy of the table */
+        kr = write ? virtio_add_buf(q->vq, table, nseg + 1, 1, cmd)
+                   : virtio_add_buf(q->vq, table, 1, nseg + 1, cmd);
     }
     
-    /* Calculate sector and length */
-    sector = ior->io_recnum;
-    length = ior->io_count;
+    if (kr != KERN_SUCCESS) {
+        return FALSE;
+    }
+    
+    /* The command now owns the merged requests */
+    cmd->ior = q->pending_head;
+    for (ior = q->pending_head; ior != last->io_next; ior = ior->io_next) {
+        q->npending--;
+    }
+    q->pending_head = last->io_next;
+    if (q->pending_head == NULL) {
+        q->pending_tail = NULL;
+    }
     
-    printf("VIRTIO-BLK: %s request - sector %llu, length %u\n",
-           (type == VIRTIO_BLK_T_IN) ? "Read" : "Write", sector, length);
+    q->free_cmds = cmd->next;
+    q->inflight++;
+    q->commands++;
+    return TRUE;
+}
+
+/*
+ * Hand over as many pending requests as possible, then notify the
+ * device once for all of them.  Called with the queue locked.
+ */
+static void virtio_blk_flush(struct virtio_blk_queue *q)
+{
+    unsigned int submitted = 0;
     
-    /* For this simplified implementation, just simulate success */
-    if (type == VIRTIO_BLK_T_IN && ior->io_data) {
-        /* Simulate read by filling with pattern */
-        memset(ior->io_data, 0xAB, length);
+    while (q->pending_head != NULL && virtio_blk_submit(q)) {
+        submitted++;
     }
     
-    /* Mark I/O as completed */
-    ior->io_residual = 0;
-    ior->io_error = 0;
+    if (submitted > 0) {
+        q->batches++;
+        virtio_kick(q->vq);
+    }
+}
+
+/*
+ * Report the status of a completed command to its requests and
+ * return it to the pool.  Called with the queue locked; the requests
+ * are added to the done list, to be passed to iodone once the lock
+ * is released.
+ */
+static void virtio_blk_complete(struct virtio_blk_queue *q,
+                                struct virtio_blk_cmd *cmd,
+                                io_req_t *done)
+{
+    io_req_t ior, next;
+    
+    for (ior = cmd->ior; ior != NULL; ior = next) {
+        next = ior->io_link;
+        if (cmd->status == VIRTIO_BLK_S_OK) {
+            ior->io_residual = 0;
+            ior->io_error = D_SUCCESS;
+        } else {
+            ior->io_residual = ior->io_count;
+            ior->io_error = D_IO_ERROR;
+        }
+        ior->io_link = *done;
+        *done = ior;
+    }
     
-    return D_SUCCESS;
+    cmd->ior = NULL;
+    cmd->next = q->free_cmds;
+    q->free_cmds = cmd;
+    q->inflight--;
+    q->completions++;
 }
 
 /*
- * Block device open
+ * Collect the commands completed by the device, refill it from the
+ * pending list, and re-arm the interrupt.  Returns the completed
+ * requests, linked through io_link.  Called with the queue locked.
  */
-static io_return_t virtio_blk_open(dev_t dev, dev_mode_t mode, io_req_t ior)
+static io_req_t virtio_blk_reap(struct virtio_blk_queue *q)
 {
-    int minor = minor(dev);
+    struct virtio_blk_cmd *cmd;
+    io_req_t done = NULL;
+    unsigned int count;
+    
+    do {
+        virtio_disable_cb(q->vq);
+        while ((cmd = virtio_get_buf(q->vq, NULL)) != NULL) {
+            virtio_blk_complete(q, cmd, &done);
+        }
+        
+        virtio_blk_flush(q);
+        
+        /*
+         * Batch completions, but never wait for more commands than
+         * are in flight, or the interrupt would never come.
+         */
+        count = q->inflight < VIRTIO_BLK_COALESCE ?
+                q->inflight : VIRTIO_BLK_COALESCE;
+    } while (!virtio_enable_cb_delayed(q->vq, count));
+    
+    return done;
+}
+
+/*
+ * Pass completed requests to the generic device code
+ */
+static void virtio_blk_iodone(io_req_t done)
+{
+    io_req_t ior;
     
-    if (minor >= virtio_blk_device_count || !virtio_blk_devices[minor]) {
-        return D_NO_SUCH_DEVICE;
+    while ((ior = done) != NULL) {
+        done = ior->io_link;
+        ior->io_link = NULL;
+        iodone(ior);
     }
+}
+
+/*
+ * Used buffer notification, at interrupt level
+ */
+static void virtio_blk_intr(struct virtqueue *vq)
+{
+    struct virtio_blk_queue *q = vq->data;
+    io_req_t done;
     
-    printf("VIRTIO-BLK: Opening device %s\n", virtio_blk_devices[minor]->name);
-    return D_SUCCESS;
+    VIRTIO_QUEUE_LOCK(vq);
+    q->interrupts++;
+    done = virtio_blk_reap(q);
+    VIRTIO_QUEUE_UNLOCK(vq);
+    
+    virtio_blk_iodone(done);
 }
 
 /*
- * Block device close
+ * Queue a request on the queue of the current processor.  It is
+ * handed to the device at once if the queue is idle, otherwise it
+ * waits for the next completion or for a full batch.
  */
-static void virtio_blk_close(dev_t dev)
+static void virtio_blk_strategy(struct virtio_blk_dev *blkdev, io_req_t ior)
 {
-    int minor = minor(dev);
+    struct virtio_blk_queue *q;
+    io_req_t done = NULL;
+    spl_t s;
+    
+    q = &blkdev->queues[cpu_number() % blkdev->nqueues];
+    
+    ior->io_next = NULL;
+    ior->io_link = NULL;
+    
+    /* Block the completion interrupt of this queue */
+    s = splsched();
+    VIRTIO_QUEUE_LOCK(q->vq);
+    
+    if (q->pending_tail != NULL) {
+        q->pending_tail->io_next = ior;
+    } else {
+        q->pending_head = ior;
+    }
+    q->pending_tail = ior;
+    q->npending++;
+    q->requests++;
+    
+    if (q->inflight == 0 || q->npending >= VIRTIO_BLK_BATCH) {
+        virtio_blk_flush(q);
+    }
     
-    if (minor < virtio_blk_device_count && virtio_blk_devices[minor]) {
-        printf("VIRTIO-BLK: Closing device %s\n", virtio_blk_devices[minor]->name);
+    /* Without an interrupt line, wait for the device to drain */
+    if (!blkdev->vdev->irq_enabled) {
+        while (q->inflight > 0 || q->pending_head != NULL) {
+            io_req_t more;
+            
+            machine_relax();
+            more = virtio_blk_reap(q);
+            while (more != NULL) {
+                io_req_t next = more->io_link;
+                
+                more->io_link = done;
+                done = more;
+                more = next;
+            }
+        }
     }
+    
+    VIRTIO_QUEUE_UNLOCK(q->vq);
+    splx(s);
+    
+    virtio_blk_iodone(done);
 }
 
 /*
- * Block device read
+ * Look up the device of a minor number
  */
-static io_return_t virtio_blk_read(dev_t dev, io_req_t ior)
+static struct virtio_blk_dev *virtio_blk_lookup(dev_t dev)
 {
     int minor = minor(dev);
     
-    if (minor >= virtio_blk_device_count || !virtio_blk_devices[minor]) {
-        return D_NO_SUCH_DEVICE;
+    if (minor < 0 || minor >= virtio_blk_device_count) {
+        return NULL;
     }
     
-    return virtio_blk_request(virtio_blk_devices[minor], ior);
+    return virtio_blk_devices[minor];
 }
 
 /*
- * Block device write
+ * Check a request and map its data, then queue it
  */
-static io_return_t virtio_blk_write(dev_t dev, io_req_t ior)
+static io_return_t virtio_blk_rw(dev_t dev, io_req_t ior)
 {
-    int minor = minor(dev);
+    struct virtio_blk_dev *blkdev;
+    boolean_t wait = FALSE;
+    uint64_t sector;
+    kern_return_t kr;
     
-    if (minor >= virtio_blk_device_count || !virtio_blk_devices[minor]) {
+    blkdev = virtio_blk_lookup(dev);
+    if (!blkdev) {
         return D_NO_SUCH_DEVICE;
     }
     
-    return virtio_blk_request(virtio_blk_devices[minor], ior);
+    if (ior->io_op & IO_READ) {
+        if (ior->io_count > VIRTIO_BLK_MAX_TRANSFER) {
+            ior->io_count = VIRTIO_BLK_MAX_TRANSFER;
+        }
+    } else if (blkdev->features & (1U << VIRTIO_BLK_F_RO)) {
+        return D_READ_ONLY;
+    }
+    
+    if (ior->io_count == 0 || (ior->io_count % blkdev->block_size) != 0) {
+        return D_INVALID_SIZE;
+    }
+    
+    sector = virtio_blk_sector(blkdev, ior);
+    if (sector + virtio_blk_sectors(ior) > blkdev->capacity) {
+        return D_INVALID_RECNUM;
+    }
+    
+    if (ior->io_op & IO_READ) {
+        kr = device_read_alloc(ior, (vm_size_t)ior->io_count);
+    } else {
+        kr = device_write_get(ior, &wait);
+    }
+    if (kr != KERN_SUCCESS) {
+        return D_NO_MEMORY;
+    }
+    
+    virtio_blk_strategy(blkdev, ior);
+    
+    if (wait) {
+        /* Part of a larger write, the caller continues it */
+        iowait(ior);
+        return D_SUCCESS;
+    }
+    
+    return D_IO_QUEUED;
+}
+
+/*
+ * Block device open
+ */
+io_return_t virtio_blk_open(dev_t dev, int flag, io_req_t ior)
+{
+    if (!virtio_blk_lookup(dev)) {
+        return D_NO_SUCH_DEVICE;
+    }
+    
+    return D_SUCCESS;
+}
+
+/*
+ * Block device close
+ */
+void virtio_blk_close(dev_t dev, int flag)
+{
+}
+
+/*
+ * Block device read
+ */
+io_return_t virtio_blk_read(dev_t dev, io_req_t ior)
+{
+    return virtio_blk_rw(dev, ior);
+}
+
+/*
+ * Block device write
+ */
+io_return_t virtio_blk_write(dev_t dev, io_req_t ior)
+{
+    return virtio_blk_rw(dev, ior);
 }
 
 /*
  * Block device get status
  */
-static io_return_t virtio_blk_get_status(dev_t dev, dev_flavor_t flavor,
-                                        dev_status_t status, natural_t *count)
+io_return_t virtio_blk_getstat(dev_t dev, dev_flavor_t flavor,
+                               dev_status_t status,
+                               mach_msg_type_number_t *count)
 {
-    int minor = minor(dev);
     struct virtio_blk_dev *blkdev;
     
-    if (minor >= virtio_blk_device_count || !virtio_blk_devices[minor]) {
+    blkdev = virtio_blk_lookup(dev);
+    if (!blkdev) {
         return D_NO_SUCH_DEVICE;
     }
     
-    blkdev = virtio_blk_devices[minor];
-    
     switch (flavor) {
         case DEV_GET_SIZE:
             if (*count < DEV_GET_SIZE_COUNT) {
                 return D_INVALID_OPERATION;
             }
-            status[DEV_GET_SIZE_DEVICE_SIZE] = blkdev->capacity * blkdev->block_size;
+            status[DEV_GET_SIZE_DEVICE_SIZE] =
+                blkdev->capacity * VIRTIO_BLK_SECTOR_SIZE;
             status[DEV_GET_SIZE_RECORD_SIZE] = blkdev->block_size;
             *count = DEV_GET_SIZE_COUNT;
             break;
@@ -279,29 +665,126 @@ static io_return_t virtio_blk_get_status(dev_t dev, dev_flavor_t flavor,
 }
 
 /*
- * Virtio block driver operations - simplified for now
- * In a full implementation, these would be integrated with
- * the device framework via device_emulation_ops
+ * Block device information for the generic device code
  */
+int virtio_blk_dev_info(dev_t dev, int flavor, int *info)
+{
+    struct virtio_blk_dev *blkdev;
+    
+    blkdev = virtio_blk_lookup(dev);
+    if (!blkdev) {
+        return D_NO_SUCH_DEVICE;
+    }
+    
+    switch (flavor) {
+        case D_INFO_BLOCK_SIZE:
+            *info = blkdev->block_size;
+            return D_SUCCESS;
+            
+        default:
+            return D_INVALID_OPERATION;
+    }
+}
 
-/* For now, comment out the device operations structure 
-static struct dev_ops virtio_blk_ops = {
-    virtio_blk_open,
-    virtio_blk_close,
-    virtio_blk_read,
-    virtio_blk_write,
-    virtio_blk_get_status,
-    NULL,  // set_status
-    NULL,  // get_recnum
-    NULL,  // set_recnum
-    NULL,  // map
-    NULL,  // async_in
-    NULL,  // reset
-    NULL,  // port_death
-    NULL,  // subdev
-    NULL   // dev_info
-};
-*/
+/*
+ * Print the request queue statistics of all devices
+ */
+void virtio_blk_dump_stats(void)
+{
+    struct virtio_blk_dev *blkdev;
+    struct virtio_blk_queue *q;
+    unsigned int i;
+    int d;
+    
+    for (d = 0; d < virtio_blk_device_count; d++) {
+        blkdev = virtio_blk_devices[d];
+        if (!blkdev) {
+            continue;
+        }
+        
+        printf("VIRTIO-BLK: %s, %u request queues\n",
+               blkdev->name, blkdev->nqueues);
+        for (i = 0; i < blkdev->nqueues; i++) {
+            q = &blkdev->queues[i];
+            printf("  queue %u: %lu requests, %lu merged, %lu commands "
+                   "in %lu batches\n", i, q->requests, q->merged,
+                   q->commands, q->batches);
+            printf("  queue %u: %lu completions in %lu interrupts, "
+                   "%u in flight, %u pending\n", i, q->completions,
+                   q->interrupts, q->inflight, q->npending);
+        }
+    }
+}
+
+/*
+ * Allocate the command pool of a request queue
+ */
+static kern_return_t virtio_blk_queue_init(struct virtio_blk_dev *blkdev,
+                                           struct virtio_blk_queue *q,
+                                           struct virtqueue *vq)
+{
+    struct virtio_blk_cmd *cmd;
+    unsigned int i;
+    
+    q->blkdev = blkdev;
+    q->vq = vq;
+    q->ncmds = VIRTIO_BLK_QUEUE_DEPTH;
+    q->cmds = (struct virtio_blk_cmd *)
+        kalloc(q->ncmds * sizeof(struct virtio_blk_cmd));
+    if (!q->cmds) {
+        return KERN_RESOURCE_SHORTAGE;
+    }
+    memset(q->cmds, 0, q->ncmds * sizeof(struct virtio_blk_cmd));
+    
+    for (i = 0; i < q->ncmds; i++) {
+        cmd = &q->cmds[i];
+        
+        /* Descriptor tables are read by the device, keep them in a page */
+        cmd->table = (struct vring_desc *)
+            kalloc(VIRTIO_MAX_INDIRECT * sizeof(struct vring_desc));
+        if (!cmd->table) {
+            return KERN_RESOURCE_SHORTAGE;
+        }
+        
+        cmd->next = q->free_cmds;
+        q->free_cmds = cmd;
+    }
+    
+    vq->data = q;
+    vq->callback = virtio_blk_intr;
+    return KERN_SUCCESS;
+}
+
+/*
+ * Release the request queues of a device
+ */
+static void virtio_blk_queues_destroy(struct virtio_blk_dev *blkdev)
+{
+    struct virtio_blk_queue *q;
+    unsigned int i, j;
+    
+    if (!blkdev->queues) {
+        return;
+    }
+    
+    for (i = 0; i < blkdev->nqueues; i++) {
+        q = &blkdev->queues[i];
+        if (!q->cmds) {
+            continue;
+        }
+        for (j = 0; j < q->ncmds; j++) {
+            if (q->cmds[j].table) {
+                kfree((vm_offset_t)q->cmds[j].table,
+                      VIRTIO_MAX_INDIRECT * sizeof(struct vring_desc));
+            }
+        }
+        kfree((vm_offset_t)q->cmds, q->ncmds * sizeof(struct virtio_blk_cmd));
+    }
+    
+    kfree((vm_offset_t)blkdev->queues,
+          blkdev->nqueues * sizeof(struct virtio_blk_queue));
+    blkdev->queues = NULL;
+}
 
 /*
  * Virtio block driver probe function
@@ -309,7 +792,11 @@ static struct dev_ops virtio_blk_ops = {
 static int virtio_blk_probe(struct virtio_device *vdev)
 {
     struct virtio_blk_dev *blkdev;
-    const char *vq_names[] = { "requests" };
+    const char *vq_names[VIRTIO_BLK_MAX_QUEUES] = {
+        "requests.0", "requests.1", "requests.2", "requests.3",
+        "requests.4", "requests.5", "requests.6", "requests.7"
+    };
+    unsigned int i;
     
     printf("VIRTIO-BLK: Probing virtio block device\n");
     
@@ -325,8 +812,11 @@ static int virtio_blk_probe(struct virtio_device *vdev)
     /* Negotiate features */
     blkdev->features = vdev->features & ((1U << VIRTIO_BLK_F_SIZE_MAX) |
                                         (1U << VIRTIO_BLK_F_SEG_MAX) |
+                                        (1U << VIRTIO_BLK_F_RO) |
                                         (1U << VIRTIO_BLK_F_BLK_SIZE) |
-                                        (1U << VIRTIO_BLK_F_FLUSH));
+                                        (1U << VIRTIO_BLK_F_FLUSH) |
+                                        (1U << VIRTIO_BLK_F_MQ) |
+                                        VIRTIO_RING_FEATURES);
     
     vdev->features = blkdev->features;
     virtio_finalize_features(vdev);
@@ -334,18 +824,36 @@ static int virtio_blk_probe(struct virtio_device *vdev)
     /* Read device configuration */
     virtio_blk_read_config(blkdev);
     
-    /* Setup virtqueue */
-    if (virtio_setup_vqs(vdev, 1, vq_names) != KERN_SUCCESS) {
+    /* One request queue per processor, as far as the device has them */
+    blkdev->nqueues = blkdev->config.num_queues;
+    if (blkdev->nqueues > NCPUS) {
+        blkdev->nqueues = NCPUS;
+    }
+    if (blkdev->nqueues > VIRTIO_BLK_MAX_QUEUES) {
+        blkdev->nqueues = VIRTIO_BLK_MAX_QUEUES;
+    }
+    
+    /* Setup virtqueues */
+    if (virtio_setup_vqs(vdev, blkdev->nqueues, vq_names) != KERN_SUCCESS) {
         printf("VIRTIO-BLK: Failed to setup virtqueues\n");
         kfree((vm_offset_t)blkdev, sizeof(struct virtio_blk_dev));
         return -1;
     }
     
-    blkdev->vq = virtio_find_vq(vdev, 0);
-    if (!blkdev->vq) {
-        printf("VIRTIO-BLK: Failed to find request virtqueue\n");
-        kfree((vm_offset_t)blkdev, sizeof(struct virtio_blk_dev));
-        return -1;
+    blkdev->queues = (struct virtio_blk_queue *)
+        kalloc(blkdev->nqueues * sizeof(struct virtio_blk_queue));
+    if (!blkdev->queues) {
+        goto fail;
+    }
+    memset(blkdev->queues, 0,
+           blkdev->nqueues * sizeof(struct virtio_blk_queue));
+    
+    for (i = 0; i < blkdev->nqueues; i++) {
+        if (virtio_blk_queue_init(blkdev, &blkdev->queues[i],
+                                  virtio_find_vq(vdev, i)) != KERN_SUCCESS) {
+            printf("VIRTIO-BLK: Failed to set up request queue %u\n", i);
+            goto fail;
+        }
     }
     
     /* Set driver private data */
@@ -354,8 +862,8 @@ static int virtio_blk_probe(struct virtio_device *vdev)
     /* Register device */
     if (virtio_blk_device_count < 8) {
         virtio_blk_devices[virtio_blk_device_count] = blkdev;
-        snprintf(blkdev->name, sizeof(blkdev->name), "vd%c", 
-                'a' + virtio_blk_device_count);
+        snprintf(blkdev->name, sizeof(blkdev->name), "vd%d", 
+                virtio_blk_device_count);
         
         printf("VIRTIO-BLK: Registered device %s\n", blkdev->name);
         virtio_blk_device_count++;
@@ -368,8 +876,15 @@ static int virtio_blk_probe(struct virtio_device *vdev)
                         VIRTIO_STATUS_FEATURES_OK |
                         VIRTIO_STATUS_DRIVER_OK);
     
-    printf("VIRTIO-BLK: Block device probe successful\n");
+    printf("VIRTIO-BLK: Block device probe successful, %u queues, %s\n",
+           blkdev->nqueues, vdev->irq_enabled ? "interrupts" : "polled");
     return 0;
+    
+fail:
+    virtio_blk_queues_destroy(blkdev);
+    virtio_cleanup_vqs(vdev);
+    kfree((vm_offset_t)blkdev, sizeof(struct virtio_blk_dev));
+    return -1;
 }
 
 /*
@@ -395,6 +910,7 @@ static void virtio_blk_remove(struct virtio_device *vdev)
     }
     
     /* Clean up */
+    virtio_blk_queues_destroy(blkdev);
     kfree((vm_offset_t)blkdev, sizeof(struct virtio_blk_dev));
     vdev->priv = NULL;
 }
@@ -407,6 +923,7 @@ static uint32_t virtio_blk_features[] = {
     VIRTIO_BLK_F_FLUSH,
     VIRTIO_BLK_F_TOPOLOGY,
     VIRTIO_BLK_F_CONFIG_WCE,
+    VIRTIO_BLK_F_MQ,
 };
 
 /* Virtio block driver structure */
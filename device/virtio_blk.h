@@ -0,0 +1,40 @@
+/*
+ * GNU Mach Operating System
+ * Copyright (c) 2024 Free Software Foundation, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _DEVICE_VIRTIO_BLK_H_
+#define _DEVICE_VIRTIO_BLK_H_
+
+#include <sys/types.h>
+
+#include <device/device_types.h>
+#include <device/io_req.h>
+
+extern kern_return_t virtio_blk_init(void);
+extern void virtio_blk_dump_stats(void);
+
+io_return_t virtio_blk_open(dev_t dev, int flag, io_req_t ior);
+void virtio_blk_close(dev_t dev, int flag);
+io_return_t virtio_blk_read(dev_t dev, io_req_t ior);
+io_return_t virtio_blk_write(dev_t dev, io_req_t ior);
+io_return_t virtio_blk_getstat(dev_t dev, dev_flavor_t flavor,
+			       dev_status_t status,
+			       mach_msg_type_number_t *count);
+int virtio_blk_dev_info(dev_t dev, int flavor, int *info);
+
+#endif /* _DEVICE_VIRTIO_BLK_H_ */
@@ -25,11 +25,22 @@
  */
 
 #include <device/virtio.h>
+#include <device/virtio_net.h>
 #include <device/ds_routines.h>
 #include <device/if_hdr.h>
+#include <device/if_ether.h>
+#include <device/net_io.h>
 #include <device/net_status.h>
+#include <device/subrs.h>
+#include <ipc/ipc_kmsg.h>
 #include <kern/printf.h>
 #include <kern/kalloc.h>
+#include <kern/sched.h>
+#include <kern/sched_prim.h>
+#include <kern/task.h>
+#include <kern/thread.h>
+#include <machine/spl.h>
+#include <vm/pmap.h>
 #include <string.h>
 #include <sys/types.h>
 
@@ -79,10 +90,38 @@ struct virtio_net_hdr {
 #define VIRTIO_NET_F_GUEST_ANNOUNCE   21  /* Guest can announce device on the network */
 #define VIRTIO_NET_F_MQ               22  /* Device supports Receive Flow Steering */
 
+/* Transmit buffer: virtio header and an Ethernet frame, within a page */
+#define VIRTIO_NET_TX_BUFSIZE         2048
+
 /* Status bits */
 #define VIRTIO_NET_S_LINK_UP          1   /* Link is up */
 #define VIRTIO_NET_S_ANNOUNCE         2   /* Announcement is needed */
 
+/*
+ * Receive buffers.  Each one posts a net_kmsg to the device, split so
+ * that the virtio header lands in the buffer, the Ethernet header in
+ * the message header area and the payload right behind the packet
+ * header: received frames need no copy before net_packet().
+ */
+#define VIRTIO_NET_RX_SEGS            4   /* Virtio header, Ethernet header, payload pages */
+
+/*
+ * Packets handled per round.  When a round at interrupt level fills
+ * it, interrupts are turned off and the receive thread polls the ring
+ * a round at a time until it is drained.
+ */
+#define VIRTIO_NET_RX_BUDGET          32
+
+/* Ticks between refill attempts while net_kmsgs are short */
+#define VIRTIO_NET_RX_RETRY           1
+
+struct virtio_net_rxbuf {
+    ipc_kmsg_t kmsg;                    /* Posted message */
+    struct virtio_net_rxbuf *next;      /* Free list linkage */
+    struct virtio_net_hdr hdr;          /* Written by the device */
+    struct vring_desc table[VIRTIO_NET_RX_SEGS]; /* Indirect descriptors */
+};
+
 /* Virtio network device private data */
 struct virtio_net_dev {
     struct virtio_device *vdev;         /* Virtio device */
@@ -90,11 +129,29 @@ struct virtio_net_dev {
     struct virtqueue *rx_vq;            /* Receive virtqueue */
     struct virtqueue *tx_vq;            /* Transmit virtqueue */
     struct virtqueue *ctrl_vq;          /* Control virtqueue */
+    struct ifnet ifnet;                 /* Generic network interface */
     uint32_t features;                  /* Negotiated features */
     uint8_t mac_addr[6];                /* MAC address */
     uint16_t mtu;                       /* Maximum transmission unit */
+    unsigned int hdr_len;               /* Size of the virtio header */
     char name[16];                      /* Device name */
     boolean_t link_up;                  /* Link status */
+
+    /* Receive side, protected by the receive queue lock */
+    struct virtio_net_rxbuf **rx_bufs;  /* All receive buffers */
+    unsigned int rx_nbufs;              /* Number of receive buffers */
+    struct virtio_net_rxbuf *rx_free;   /* Buffers not posted */
+    boolean_t rx_polling;               /* Interrupt off, ring being drained */
+    boolean_t rx_handoff;               /* Receive thread drains the ring */
+    boolean_t rx_started;               /* Receive thread running */
+
+    /* Receive statistics */
+    unsigned long rx_interrupts;        /* Receive interrupts */
+    unsigned long rx_rounds;            /* Rounds at interrupt level */
+    unsigned long rx_polls;             /* Rounds in the receive thread */
+    unsigned long rx_packets;           /* Packets passed to net_packet */
+    unsigned long rx_nokmsg;            /* Refills short of net_kmsgs */
+    unsigned long rx_errors;            /* Runt frames */
 };
 
 /* Global network device list */
@@ -111,7 +168,7 @@ static void virtio_net_read_config(struct virtio_net_dev *netdev)
     
     /* Read MAC address */
     for (i = 0; i < 6; i++) {
-        netdev->config.mac[i] = virtio_config_readb(vdev, i);
+        netdev->config.mac[i] = virtio_config_readb(vdev, VIRTIO_PCI_CONFIG + i);
         netdev->mac_addr[i] = netdev->config.mac[i];
     }
     
@@ -121,7 +178,7 @@ static void virtio_net_read_config(struct virtio_net_dev *netdev)
     
     /* Read status if supported */
     if (virtio_has_feature(vdev, VIRTIO_NET_F_STATUS)) {
-        netdev->config.status = virtio_config_readw(vdev, 6);
+        netdev->config.status = virtio_config_readw(vdev, VIRTIO_PCI_CONFIG + 6);
         netdev->link_up = !!(netdev->config.status & VIRTIO_NET_S_LINK_UP);
         printf("VIRTIO-NET: Link status: %s\n", netdev->link_up ? "up" : "down");
     } else {
@@ -130,7 +187,7 @@ static void virtio_net_read_config(struct virtio_net_dev *netdev)
     
     /* Read MTU if supported */
     if (virtio_has_feature(vdev, VIRTIO_NET_F_MTU)) {
-        netdev->config.mtu = virtio_config_readw(vdev, 10);
+        netdev->config.mtu = virtio_config_readw(vdev, VIRTIO_PCI_CONFIG + 10);
         netdev->mtu = netdev->config.mtu;
         printf("VIRTIO-NET: MTU: %u bytes\n", netdev->mtu);
     } else {
@@ -138,29 +195,87 @@ static void virtio_net_read_config(struct virtio_net_dev *netdev)
     }
 }
 
+/*
+ * Free the transmit buffers the device is done with.
+ * The transmit queue must be locked.
+ */
+static void virtio_net_free_tx(struct virtio_net_dev *netdev)
+{
+    void *buf;
+    
+    while ((buf = virtio_get_buf(netdev->tx_vq, NULL)) != NULL) {
+        kfree((vm_offset_t)buf, VIRTIO_NET_TX_BUFSIZE);
+    }
+}
+
 /*
  * Transmit a packet
+ *
+ * The frame is copied behind a virtio header into a buffer owned by
+ * the driver, so that the request completes at once; the buffer is
+ * freed when the device returns it.
  */
 static io_return_t virtio_net_transmit(struct virtio_net_dev *netdev,
                                       io_req_t ior)
 {
-    struct virtio_net_hdr hdr;
+    struct virtio_net_hdr *hdr;
+    struct vring_desc sg;
+    vm_offset_t buf;
+    boolean_t wait;
+    kern_return_t kr;
+    spl_t s;
     
-    if (!netdev || !ior || !ior->io_data) {
+    if (!netdev || !ior) {
         return D_INVALID_OPERATION;
     }
     
     if (!netdev->link_up) {
-        printf("VIRTIO-NET: Cannot transmit - link is down\n");
-        return D_IO_ERROR;
+        return D_DEVICE_DOWN;
+    }
+    
+    if (ior->io_count < netdev->ifnet.if_header_size ||
+        ior->io_count > netdev->ifnet.if_header_size + netdev->ifnet.if_mtu ||
+        ior->io_count > VIRTIO_NET_TX_BUFSIZE - netdev->hdr_len) {
+        return D_INVALID_SIZE;
+    }
+    
+    /* Map the data in, the generic code releases it once we return */
+    kr = device_write_get(ior, &wait);
+    if (kr != KERN_SUCCESS) {
+        return kr;
     }
     
-    printf("VIRTIO-NET: Transmitting packet, length %u\n", ior->io_count);
+    /* One page at most, so that the buffer is physically contiguous */
+    buf = kalloc(VIRTIO_NET_TX_BUFSIZE);
+    if (!buf) {
+        return D_NO_MEMORY;
+    }
     
     /* Prepare virtio net header */
-    memset(&hdr, 0, sizeof(hdr));
+    hdr = (struct virtio_net_hdr *)buf;
+    memset(hdr, 0, netdev->hdr_len);
+    memcpy((void *)(buf + netdev->hdr_len), ior->io_data, ior->io_count);
+    
+    sg.addr = kvtophys(buf);
+    sg.len = netdev->hdr_len + ior->io_count;
+    
+    s = splimp();
+    VIRTIO_QUEUE_LOCK(netdev->tx_vq);
+    virtio_net_free_tx(netdev);
+    kr = virtio_add_buf(netdev->tx_vq, &sg, 1, 0, (void *)buf);
+    if (kr == KERN_SUCCESS) {
+        virtio_kick(netdev->tx_vq);
+    }
+    VIRTIO_QUEUE_UNLOCK(netdev->tx_vq);
+    splx(s);
     
-    /* For this simplified implementation, just simulate transmission */
+    if (kr != KERN_SUCCESS) {
+        kfree(buf, VIRTIO_NET_TX_BUFSIZE);
+        netdev->ifnet.if_oerrors++;
+        return D_WOULD_BLOCK;
+    }
+    
+    netdev->ifnet.if_opackets++;
     ior->io_residual = 0;
     ior->io_error = 0;
     
@@ -168,123 +283,407 @@ static io_return_t virtio_net_transmit(struct virtio_net_dev *netdev,
 }
 
 /*
- * Receive a packet
+ * Post a receive buffer with a fresh net_kmsg.
+ * The receive queue must be locked.
  */
-static io_return_t virtio_net_receive(struct virtio_net_dev *netdev,
-                                     io_req_t ior)
+static boolean_t virtio_net_rx_post(struct virtio_net_dev *netdev,
+                                    struct virtio_net_rxbuf *rxbuf,
+                                    ipc_kmsg_t kmsg)
 {
-    if (!netdev || !ior) {
-        return D_INVALID_OPERATION;
+    struct vring_desc *table = rxbuf->table;
+    unsigned int nseg;
+    kern_return_t kr;
+    
+    table[0].addr = kvtophys((vm_offset_t)&rxbuf->hdr);
+    table[0].len = netdev->hdr_len;
+    table[1].addr = kvtophys((vm_offset_t)net_kmsg(kmsg)->header);
+    table[1].len = sizeof(struct ether_header);
+    nseg = virtio_sg_init(&table[2], VIRTIO_NET_RX_SEGS - 2,
+                          (vm_offset_t)(net_kmsg(kmsg)->packet
+                                        + sizeof(struct packet_header)),
+                          NET_RCV_MAX - sizeof(struct packet_header));
+    if (nseg == 0) {
+        return FALSE;
     }
     
-    if (!netdev->link_up) {
-        printf("VIRTIO-NET: Cannot receive - link is down\n");
-        return D_IO_ERROR;
+    if (netdev->rx_vq->indirect) {
+        kr = virtio_add_indirect(netdev->rx_vq, table, 0, nseg + 2, rxbuf);
+    } else {
+        kr = virtio_add_buf(netdev->rx_vq, table, 0, nseg + 2, rxbuf);
+    }
+    if (kr != KERN_SUCCESS) {
+        return FALSE;
+    }
+    
+    rxbuf->kmsg = kmsg;
+    return TRUE;
+}
+
+/*
+ * Post every idle receive buffer the net_kmsg pool can back, and
+ * notify the device once.  Returns FALSE if net_kmsgs ran out.
+ * The receive queue must be locked.
+ */
+static boolean_t virtio_net_rx_fill(struct virtio_net_dev *netdev)
+{
+    struct virtio_net_rxbuf *rxbuf;
+    ipc_kmsg_t kmsg;
+    boolean_t full = TRUE;
+    unsigned int posted = 0;
+    
+    while ((rxbuf = netdev->rx_free) != NULL) {
+        kmsg = net_kmsg_get();
+        if (kmsg == IKM_NULL) {
+            netdev->rx_nokmsg++;
+            full = FALSE;
+            break;
+        }
+        
+        if (!virtio_net_rx_post(netdev, rxbuf, kmsg)) {
+            net_kmsg_put(kmsg);
+            break;
+        }
+        netdev->rx_free = rxbuf->next;
+        posted++;
+    }
+    
+    if (posted > 0) {
+        virtio_kick(netdev->rx_vq);
+    }
+    return full;
+}
+
+/*
+ * One receive round: take up to budget frames from the device, post
+ * new buffers in their place, then pass the frames to net_packet()
+ * together.  Interrupts stay off while the ring keeps the round busy.
+ * Returns TRUE if there is more to receive, in which case the caller
+ * must poll again.  Called at splimp.
+ */
+static boolean_t virtio_net_rx_round(struct virtio_net_dev *netdev,
+                                     unsigned int budget)
+{
+    struct virtqueue *vq = netdev->rx_vq;
+    struct virtio_net_rxbuf *rxbuf;
+    struct ether_header *eh;
+    struct packet_header *ph;
+    struct ipc_kmsg_queue batch;
+    ipc_kmsg_t kmsg;
+    unsigned int count = 0;
+    uint32_t len;
+    boolean_t more;
+    
+    ipc_kmsg_queue_init(&batch);
+    
+    VIRTIO_QUEUE_LOCK(vq);
+    virtio_disable_cb(vq);
+    
+    while (count < budget
+           && (rxbuf = virtio_get_buf(vq, &len)) != NULL) {
+        count++;
+        kmsg = rxbuf->kmsg;
+        rxbuf->kmsg = IKM_NULL;
+        rxbuf->next = netdev->rx_free;
+        netdev->rx_free = rxbuf;
+        
+        if (len < netdev->hdr_len + sizeof(struct ether_header)) {
+            netdev->rx_errors++;
+            netdev->ifnet.if_ierrors++;
+            net_kmsg_put(kmsg);
+            continue;
+        }
+        len -= netdev->hdr_len + sizeof(struct ether_header);
+        
+        eh = (struct ether_header *)net_kmsg(kmsg)->header;
+        ph = (struct packet_header *)net_kmsg(kmsg)->packet;
+        ph->type = eh->ether_type;
+        ph->length = len + sizeof(struct packet_header);
+        net_kmsg(kmsg)->sent = FALSE; /* Mark packet as received.  */
+        ipc_kmsg_enqueue(&batch, kmsg);
     }
     
-    printf("VIRTIO-NET: Receive request\n");
+    virtio_net_rx_fill(netdev);
     
-    /* For this simplified implementation, simulate no data available */
-    ior->io_residual = ior->io_count;
-    ior->io_error = 0;
+    more = (count == budget);
+    if (!more) {
+        more = !virtio_enable_cb(vq);
+    }
+    netdev->rx_polling = more;
+    
+    VIRTIO_QUEUE_UNLOCK(vq);
     
-    return D_WOULD_BLOCK;  /* No data available */
+    while ((kmsg = ipc_kmsg_dequeue(&batch)) != IKM_NULL) {
+        ph = (struct packet_header *)net_kmsg(kmsg)->packet;
+        netdev->rx_packets++;
+        netdev->ifnet.if_ipackets++;
+        net_packet(&netdev->ifnet, kmsg, ph->length, ethernet_priority(kmsg));
+    }
+    
+    return more;
 }
 
 /*
- * Network device open
+ * Receive interrupt.  A quiet link is served right here; once a
+ * round fills its budget, interrupts stay off and the receive thread
+ * takes over until the ring is drained.
  */
-static io_return_t virtio_net_open(dev_t dev, dev_mode_t mode, io_req_t ior)
+static void virtio_net_rx_intr(struct virtqueue *vq)
 {
-    int minor = minor(dev);
+    struct virtio_net_dev *netdev = vq->data;
+    boolean_t polling;
     
-    if (minor >= virtio_net_device_count || !virtio_net_devices[minor]) {
-        return D_NO_SUCH_DEVICE;
+    VIRTIO_QUEUE_LOCK(vq);
+    netdev->rx_interrupts++;
+    polling = netdev->rx_polling;
+    netdev->rx_polling = TRUE;
+    VIRTIO_QUEUE_UNLOCK(vq);
+    
+    if (polling) {
+        return;
     }
     
-    printf("VIRTIO-NET: Opening device %s\n", virtio_net_devices[minor]->name);
-    return D_SUCCESS;
+    netdev->rx_rounds++;
+    if (virtio_net_rx_round(netdev, VIRTIO_NET_RX_BUDGET)) {
+        VIRTIO_QUEUE_LOCK(vq);
+        netdev->rx_handoff = TRUE;
+        VIRTIO_QUEUE_UNLOCK(vq);
+        thread_wakeup((event_t)&netdev->rx_handoff);
+    }
 }
 
 /*
- * Network device close
+ * Receive thread.  Drains the ring handed over by the interrupt
+ * handler, and retries refills that ran short of net_kmsgs.
  */
-static void virtio_net_close(dev_t dev)
+static void __attribute__ ((noreturn)) virtio_net_rx_thread(void)
 {
-    int minor = minor(dev);
+    struct virtio_net_dev *netdev = current_thread()->ith_other;
+    struct virtqueue *vq = netdev->rx_vq;
+    boolean_t full;
+    spl_t s;
     
-    if (minor < virtio_net_device_count && virtio_net_devices[minor]) {
-        printf("VIRTIO-NET: Closing device %s\n", virtio_net_devices[minor]->name);
+    for (;;) {
+        s = splimp();
+        
+        /* Without an interrupt line, look at the ring on every tick */
+        if (!netdev->vdev->irq_enabled) {
+            virtio_interrupt(netdev->vdev);
+        }
+        
+        while (netdev->rx_handoff) {
+            netdev->rx_polls++;
+            if (!virtio_net_rx_round(netdev, VIRTIO_NET_RX_BUDGET)) {
+                VIRTIO_QUEUE_LOCK(vq);
+                netdev->rx_handoff = FALSE;
+                VIRTIO_QUEUE_UNLOCK(vq);
+            } else if (csw_needed(current_thread(), current_processor())) {
+                /* Let others run, the device holds on to the frames */
+                splx(s);
+                thread_block(thread_no_continuation);
+                s = splimp();
+            }
+        }
+        
+        VIRTIO_QUEUE_LOCK(vq);
+        full = virtio_net_rx_fill(netdev);
+        assert_wait((event_t)&netdev->rx_handoff, FALSE);
+        if (!full || !netdev->vdev->irq_enabled) {
+            thread_set_timeout(VIRTIO_NET_RX_RETRY);
+        }
+        VIRTIO_QUEUE_UNLOCK(vq);
+        splx(s);
+        
+        thread_block(thread_no_continuation);
     }
 }
 
 /*
- * Network device read (receive)
+ * Look up the device of a minor number
  */
-static io_return_t virtio_net_read(dev_t dev, io_req_t ior)
+static struct virtio_net_dev *virtio_net_lookup(dev_t dev)
 {
     int minor = minor(dev);
     
-    if (minor >= virtio_net_device_count || !virtio_net_devices[minor]) {
+    if (minor < 0 || minor >= virtio_net_device_count) {
+        return NULL;
+    }
+    
+    return virtio_net_devices[minor];
+}
+
+/*
+ * Network device open.  Receiving starts with the first open.
+ */
+io_return_t virtio_net_open(dev_t dev, int flag, io_req_t ior)
+{
+    struct virtio_net_dev *netdev;
+    boolean_t start;
+    spl_t s;
+    
+    netdev = virtio_net_lookup(dev);
+    if (!netdev) {
         return D_NO_SUCH_DEVICE;
     }
     
-    return virtio_net_receive(virtio_net_devices[minor], ior);
+    s = splimp();
+    VIRTIO_QUEUE_LOCK(netdev->rx_vq);
+    start = !netdev->rx_started;
+    netdev->rx_started = TRUE;
+    VIRTIO_QUEUE_UNLOCK(netdev->rx_vq);
+    splx(s);
+    
+    if (start) {
+        (void) kernel_thread(kernel_task, "virtio-net rx",
+                             virtio_net_rx_thread, netdev);
+    }
+    
+    return D_SUCCESS;
+}
+
+/*
+ * Network device close
+ */
+void virtio_net_close(dev_t dev, int flag)
+{
 }
 
 /*
  * Network device write (transmit)
  */
-static io_return_t virtio_net_write(dev_t dev, io_req_t ior)
+io_return_t virtio_net_write(dev_t dev, io_req_t ior)
 {
-    int minor = minor(dev);
+    struct virtio_net_dev *netdev;
     
-    if (minor >= virtio_net_device_count || !virtio_net_devices[minor]) {
+    netdev = virtio_net_lookup(dev);
+    if (!netdev) {
         return D_NO_SUCH_DEVICE;
     }
     
-    return virtio_net_transmit(virtio_net_devices[minor], ior);
+    return virtio_net_transmit(netdev, ior);
 }
 
 /*
  * Network device get status
  */
-static io_return_t virtio_net_get_status(dev_t dev, dev_flavor_t flavor,
-                                        dev_status_t status, natural_t *count)
+io_return_t virtio_net_getstat(dev_t dev, dev_flavor_t flavor,
+                               dev_status_t status,
+                               mach_msg_type_number_t *count)
 {
-    int minor = minor(dev);
     struct virtio_net_dev *netdev;
     
-    if (minor >= virtio_net_device_count || !virtio_net_devices[minor]) {
+    netdev = virtio_net_lookup(dev);
+    if (!netdev) {
         return D_NO_SUCH_DEVICE;
     }
     
-    netdev = virtio_net_devices[minor];
+    return net_getstat(&netdev->ifnet, flavor, status, count);
+}
+
+/*
+ * Network device packet filter
+ */
+io_return_t virtio_net_setinput(dev_t dev, const ipc_port_t receive_port,
+                                int priority, filter_t *filter,
+                                unsigned int filter_count)
+{
+    struct virtio_net_dev *netdev;
     
-    switch (flavor) {
-        case NET_STATUS:
-            if (*count < NET_STATUS_COUNT) {
-                return D_INVALID_OPERATION;
-            }
-            
-            /* Fill net_status structure */
-            struct net_status *net_stat = (struct net_status *)status;
-            net_stat->min_packet_size = 64;
-            net_stat->max_packet_size = netdev->mtu + 14; /* MTU + Ethernet header */
-            net_stat->header_format = HDR_ETHERNET;
-            net_stat->header_size = 14; /* Ethernet header size */
-            net_stat->address_size = 6; /* MAC address size */
-            net_stat->flags = netdev->link_up ? IFF_UP | IFF_RUNNING : 0;
-            net_stat->mapped_size = 0;
-            
-            *count = NET_STATUS_COUNT;
-            break;
-            
-        default:
-            return D_INVALID_OPERATION;
+    netdev = virtio_net_lookup(dev);
+    if (!netdev) {
+        return D_NO_SUCH_DEVICE;
     }
     
-    return D_SUCCESS;
+    return net_set_filter(&netdev->ifnet, receive_port, priority,
+                          filter, filter_count);
+}
+
+/*
+ * Print the receive statistics of all devices
+ */
+void virtio_net_dump_stats(void)
+{
+    struct virtio_net_dev *netdev;
+    int d;
+    
+    for (d = 0; d < virtio_net_device_count; d++) {
+        netdev = virtio_net_devices[d];
+        if (!netdev) {
+            continue;
+        }
+        
+        printf("VIRTIO-NET: %s: %lu packets received, %lu interrupts, "
+               "%lu rounds, %lu polls\n", netdev->name, netdev->rx_packets,
+               netdev->rx_interrupts, netdev->rx_rounds, netdev->rx_polls);
+        printf("VIRTIO-NET: %s: %lu refills short of buffers, "
+               "%lu runt frames\n", netdev->name, netdev->rx_nokmsg,
+               netdev->rx_errors);
+    }
+}
+
+/*
+ * Allocate one receive buffer per ring entry
+ */
+static kern_return_t virtio_net_rx_init(struct virtio_net_dev *netdev)
+{
+    struct virtio_net_rxbuf *rxbuf;
+    unsigned int i;
+    
+    netdev->rx_nbufs = netdev->rx_vq->num;
+    if (!netdev->rx_vq->indirect) {
+        netdev->rx_nbufs /= VIRTIO_NET_RX_SEGS;
+    }
+    
+    netdev->rx_bufs = (struct virtio_net_rxbuf **)
+        kalloc(netdev->rx_nbufs * sizeof(struct virtio_net_rxbuf *));
+    if (!netdev->rx_bufs) {
+        return KERN_RESOURCE_SHORTAGE;
+    }
+    memset(netdev->rx_bufs, 0,
+           netdev->rx_nbufs * sizeof(struct virtio_net_rxbuf *));
+    
+    for (i = 0; i < netdev->rx_nbufs; i++) {
+        /* Small enough not to cross a page, as the device reads it */
+        rxbuf = (struct virtio_net_rxbuf *)
+            kalloc(sizeof(struct virtio_net_rxbuf));
+        if (!rxbuf) {
+            return KERN_RESOURCE_SHORTAGE;
+        }
+        memset(rxbuf, 0, sizeof(struct virtio_net_rxbuf));
+        rxbuf->next = netdev->rx_free;
+        netdev->rx_free = rxbuf;
+        netdev->rx_bufs[i] = rxbuf;
+    }
+    
+    netdev->rx_vq->data = netdev;
+    netdev->rx_vq->callback = virtio_net_rx_intr;
+    return KERN_SUCCESS;
+}
+
+/*
+ * Release the receive buffers, with the messages still posted
+ */
+static void virtio_net_rx_destroy(struct virtio_net_dev *netdev)
+{
+    unsigned int i;
+    
+    if (!netdev->rx_bufs) {
+        return;
+    }
+    
+    for (i = 0; i < netdev->rx_nbufs; i++) {
+        if (!netdev->rx_bufs[i]) {
+            continue;
+        }
+        if (netdev->rx_bufs[i]->kmsg != IKM_NULL) {
+            net_kmsg_put(netdev->rx_bufs[i]->kmsg);
+        }
+        kfree((vm_offset_t)netdev->rx_bufs[i], sizeof(struct virtio_net_rxbuf));
+    }
+    
+    kfree((vm_offset_t)netdev->rx_bufs,
+          netdev->rx_nbufs * sizeof(struct virtio_net_rxbuf *));
+    netdev->rx_bufs = NULL;
+    netdev->rx_free = NULL;
 }
 
 /*
@@ -294,6 +693,7 @@ static int virtio_net_probe(struct virtio_device *vdev)
 {
     struct virtio_net_dev *netdev;
     const char *vq_names[] = { "rx", "tx", "ctrl" };
+    struct ifnet *ifp;
     int nvqs = 2;  /* Start with RX and TX only */
     
     printf("VIRTIO-NET: Probing virtio network device\n");
@@ -311,8 +711,7 @@ static int virtio_net_probe(struct virtio_device *vdev)
     netdev->features = vdev->features & ((1U << VIRTIO_NET_F_MAC) |
                                         (1U << VIRTIO_NET_F_STATUS) |
                                         (1U << VIRTIO_NET_F_MTU) |
-                                        (1U << VIRTIO_NET_F_CSUM) |
-                                        (1U << VIRTIO_NET_F_GUEST_CSUM));
+                                        VIRTIO_RING_FEATURES);
     
     /* Add control virtqueue if supported */
     if (vdev->features & (1U << VIRTIO_NET_F_CTRL_VQ)) {
@@ -323,6 +722,13 @@ static int virtio_net_probe(struct virtio_device *vdev)
     vdev->features = netdev->features;
     virtio_finalize_features(vdev);
     
+    /* num_buffers is only present with mergeable receive buffers */
+    if (netdev->features & (1U << VIRTIO_NET_F_MRG_RXBUF)) {
+        netdev->hdr_len = sizeof(struct virtio_net_hdr);
+    } else {
+        netdev->hdr_len = offsetof(struct virtio_net_hdr, num_buffers);
+    }
+    
     /* Read device configuration */
     virtio_net_read_config(netdev);
     
@@ -341,8 +747,12 @@ static int virtio_net_probe(struct virtio_device *vdev)
     
     if (!netdev->rx_vq || !netdev->tx_vq) {
         printf("VIRTIO-NET: Failed to find required virtqueues\n");
-        kfree((vm_offset_t)netdev, sizeof(struct virtio_net_dev));
-        return -1;
+        goto fail;
+    }
+    
+    if (virtio_net_rx_init(netdev) != KERN_SUCCESS) {
+        printf("VIRTIO-NET: Failed to allocate receive buffers\n");
+        goto fail;
     }
     
     /* Set driver private data */
@@ -351,9 +761,19 @@ static int virtio_net_probe(struct virtio_device *vdev)
     /* Register device */
     if (virtio_net_device_count < 4) {
         virtio_net_devices[virtio_net_device_count] = netdev;
-        snprintf(netdev->name, sizeof(netdev->name), "eth%d", 
+        snprintf(netdev->name, sizeof(netdev->name), "vnet%d", 
                 virtio_net_device_count);
         
+        ifp = &netdev->ifnet;
+        ifp->if_unit = virtio_net_device_count;
+        ifp->if_flags = IFF_UP | IFF_RUNNING | IFF_BROADCAST;
+        ifp->if_header_size = sizeof(struct ether_header);
+        ifp->if_header_format = HDR_ETHERNET;
+        ifp->if_mtu = netdev->mtu;
+        ifp->if_address_size = sizeof(netdev->mac_addr);
+        ifp->if_address = (char *)netdev->mac_addr;
+        if_init_queues(ifp);
+        
         printf("VIRTIO-NET: Registered network device %s\n", netdev->name);
         virtio_net_device_count++;
     }
@@ -365,8 +785,15 @@ static int virtio_net_probe(struct virtio_device *vdev)
                         VIRTIO_STATUS_FEATURES_OK |
                         VIRTIO_STATUS_DRIVER_OK);
     
-    printf("VIRTIO-NET: Network device probe successful\n");
+    printf("VIRTIO-NET: Network device probe successful, %u receive buffers, %s\n",
+           netdev->rx_nbufs, vdev->irq_enabled ? "interrupts" : "polled");
     return 0;
+    
+fail:
+    virtio_net_rx_destroy(netdev);
+    virtio_cleanup_vqs(vdev);
+    kfree((vm_offset_t)netdev, sizeof(struct virtio_net_dev));
+    return -1;
 }
 
 /*
@@ -392,6 +819,7 @@ static void virtio_net_remove(struct virtio_device *vdev)
     }
     
     /* Clean up */
+    virtio_net_rx_destroy(netdev);
     kfree((vm_offset_t)netdev, sizeof(struct virtio_net_dev));
     vdev->priv = NULL;
 }
@@ -401,8 +829,6 @@ static uint32_t virtio_net_features[] = {
     VIRTIO_NET_F_MAC,
     VIRTIO_NET_F_STATUS,
     VIRTIO_NET_F_MTU,
-    VIRTIO_NET_F_CSUM,
-    VIRTIO_NET_F_GUEST_CSUM,
     VIRTIO_NET_F_CTRL_VQ,
     VIRTIO_NET_F_CTRL_RX,
 };
@@ -0,0 +1,43 @@
+/*
+ * GNU Mach Operating System
+ * Copyright (c) 2024 Free Software Foundation, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _DEVICE_VIRTIO_NET_H_
+#define _DEVICE_VIRTIO_NET_H_
+
+#include <sys/types.h>
+
+#include <device/device_types.h>
+#include <device/io_req.h>
+#include <device/net_status.h>
+#include <ipc/ipc_port.h>
+
+extern kern_return_t virtio_net_init(void);
+extern void virtio_net_dump_stats(void);
+
+io_return_t virtio_net_open(dev_t dev, int flag, io_req_t ior);
+void virtio_net_close(dev_t dev, int flag);
+io_return_t virtio_net_write(dev_t dev, io_req_t ior);
+io_return_t virtio_net_getstat(dev_t dev, dev_flavor_t flavor,
+			       dev_status_t status,
+			       mach_msg_type_number_t *count);
+io_return_t virtio_net_setinput(dev_t dev, const ipc_port_t receive_port,
+				int priority, filter_t *filter,
+				unsigned int filter_count);
+
+#endif /* _DEVICE_VIRTIO_NET_H_ */
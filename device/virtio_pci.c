@@ -29,12 +29,20 @@
 #include <kern/printf.h>
 #include <kern/kalloc.h>
 #include <machine/pio.h>
+#include <machine/irq.h>
+#include <machine/ipl.h>
 
 /* Virtio PCI vendor and device IDs */
 #define VIRTIO_PCI_VENDOR_ID    0x1AF4
 #define VIRTIO_PCI_DEVICE_MIN   0x1000
 #define VIRTIO_PCI_DEVICE_MAX   0x103F
 
+/* Devices whose interrupt line may be serviced by virtio_pci_intr */
+#define VIRTIO_PCI_MAX_DEVICES  16
+
+static struct virtio_device *virtio_pci_devices[VIRTIO_PCI_MAX_DEVICES];
+static int virtio_pci_device_count;
+
 /* PCI configuration space */
 struct pci_dev {
     uint16_t vendor_id;
@@ -106,6 +114,92 @@ static void pci_config_write16(uint8_t bus, uint8_t slot, uint8_t func, uint8_t
     outl(0xCFC, data);
 }
 
+/*
+ * Interrupt handler for the legacy INTx line.  The line may be shared
+ * by several virtio devices, each of which acknowledges its own
+ * interrupt by reading its ISR status.
+ */
+static void virtio_pci_intr(int irq)
+{
+    int i;
+    
+    for (i = 0; i < virtio_pci_device_count; i++) {
+        if (virtio_pci_devices[i]->irq == irq) {
+            (void) virtio_interrupt(virtio_pci_devices[i]);
+        }
+    }
+}
+
+/*
+ * Route the interrupt line of a device to virtio_pci_intr.  Devices
+ * whose line is used by another driver stay in polled mode.
+ */
+static void virtio_pci_setup_irq(struct virtio_device *vdev)
+{
+    int irq = vdev->irq;
+    
+    if (virtio_pci_device_count == VIRTIO_PCI_MAX_DEVICES) {
+        return;
+    }
+    
+    if (irq == 0 || irq == 0xFF || irq >= NINTR) {
+        printf("VIRTIO-PCI: No usable IRQ line, polling\n");
+        return;
+    }
+    
+    if (ivect[irq] != intnull && ivect[irq] != virtio_pci_intr) {
+        printf("VIRTIO-PCI: IRQ %d already in use, polling\n", irq);
+        return;
+    }
+    
+    virtio_pci_devices[virtio_pci_device_count++] = vdev;
+    vdev->irq_enabled = TRUE;
+    
+    if (ivect[irq] == intnull) {
+        iunit[irq] = irq;
+        ivect[irq] = virtio_pci_intr;
+        unmask_irq(irq);
+    }
+}
+
+/*
+ * Undo virtio_pci_setup_irq, so that the device can be freed.
+ */
+static void virtio_pci_teardown_irq(struct virtio_device *vdev)
+{
+    int i, irq = vdev->irq;
+    boolean_t shared = FALSE;
+    spl_t s;
+    
+    if (!vdev->irq_enabled) {
+        return;
+    }
+    
+    s = splhigh();
+    
+    for (i = 0; i < virtio_pci_device_count; i++) {
+        if (virtio_pci_devices[i] == vdev) {
+            virtio_pci_devices[i] =
+                virtio_pci_devices[--virtio_pci_device_count];
+            break;
+        }
+    }
+    
+    for (i = 0; i < virtio_pci_device_count; i++) {
+        if (virtio_pci_devices[i]->irq == irq) {
+            shared = TRUE;
+        }
+    }
+    
+    if (!shared) {
+        mask_irq(irq);
+        ivect[irq] = intnull;
+    }
+    
+    vdev->irq_enabled = FALSE;
+    splx(s);
+}
+
 /*
  * Initialize a virtio device from PCI configuration
  */
@@ -126,8 +220,11 @@ static kern_return_t virtio_pci_init_device(uint8_t bus, uint8_t slot, uint8_t f
         return KERN_RESOURCE_SHORTAGE;
     }
     
-    /* Set device type based on PCI device ID */
-    vdev->device_id = device_id - VIRTIO_PCI_DEVICE_MIN;  /* Convert to virtio device ID */
+    /*
+     * Legacy and transitional devices carry their virtio device type
+     * in the PCI subsystem ID.
+     */
+    vdev->device_id = pci_config_read16(bus, slot, func, 0x2E);
     vdev->vendor_id = VIRTIO_PCI_VENDOR_ID;
     
     /* Read BAR0 for I/O base address */
@@ -161,9 +258,12 @@ static kern_return_t virtio_pci_init_device(uint8_t bus, uint8_t slot, uint8_t f
     vdev->features = virtio_get_features(vdev);
     printf("VIRTIO-PCI: Host features: 0x%x\n", vdev->features);
     
+    virtio_pci_setup_irq(vdev);
+    
     /* Register the device with virtio subsystem */
     if (virtio_register_device(vdev) != KERN_SUCCESS) {
         printf("VIRTIO-PCI: Failed to register device\n");
+        virtio_pci_teardown_irq(vdev);
         virtio_free_device(vdev);
         return KERN_FAILURE;
     }
@@ -177,7 +277,7 @@ static kern_return_t virtio_pci_init_device(uint8_t bus, uint8_t slot, uint8_t f
  */
 static void virtio_pci_scan_bus(void)
 {
-    uint8_t bus, slot, func;
+    unsigned int bus, slot, func;
     uint16_t vendor_id, device_id;
     int device_count = 0;
     
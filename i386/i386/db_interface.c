@@ -470,12 +470,12 @@ db_user_to_phys_address(
 	phys_addr_t	*paddr,
 	int		flag)
 {
-	pt_entry_t *ptp;
+	phys_addr_t	pa;
 	boolean_t	faulted = FALSE;
 
 	retry:
-	ptp = pmap_pte(task->map->pmap, addr);
-	if (ptp == PT_ENTRY_NULL || (*ptp & INTEL_PTE_VALID) == 0) {
+	pa = pmap_translate(task->map->pmap, addr);
+	if (pa == 0) {
 	    if (!faulted && !db_no_vm_fault) {
 		kern_return_t	err;
 
@@ -493,7 +493,7 @@ db_user_to_phys_address(
 	    return(-1);
 	}
 
-	*paddr = pte_to_pa(*ptp) + (addr & (INTEL_PGBYTES-1));
+	*paddr = pa;
 	return(0);
 }
 
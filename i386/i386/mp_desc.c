@@ -222,6 +222,12 @@ paging_enable(void)
     set_cr0(get_cr0() & ~(CR0_CD | CR0_NW));
     if (CPU_HAS_FEATURE(CPU_FEATURE_PGE))
         set_cr4(get_cr4() | CR4_PGE);
+#ifdef PMAP_PCID
+    if (pmap_pcid_enabled) {
+        unsigned long cr4 = get_cr4();
+        set_cr4(cr4 | CR4_PCIDE);
+    }
+#endif  /* PMAP_PCID */
 #endif  /* MACH_HYP */
 }
 
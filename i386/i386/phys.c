@@ -37,12 +37,120 @@
 #include <vm/vm_page.h>
 
 #include <i386/pmap.h>
+#include <i386/locore.h>
 #include <i386/model_dep.h>
 #include <mach/machine/vm_param.h>
 
 #define INTEL_PTE_W(p) (INTEL_PTE_VALID | INTEL_PTE_WRITE | INTEL_PTE_REF | INTEL_PTE_MOD | pa_to_pte(p))
 #define INTEL_PTE_R(p) (INTEL_PTE_VALID | INTEL_PTE_REF | pa_to_pte(p))
 
+/* CPUID leaf 7 features */
+#define CPU_FEATURE_ERMS	(1 << 9)	/* ebx: enhanced rep movsb/stosb */
+
+/* rep movsb/stosb are faster than the string functions */
+static boolean_t phys_erms;
+
+/* movnti is available for copies bypassing the caches */
+static boolean_t phys_nocache;
+
+void
+pmap_page_ops_init(void)
+{
+	unsigned eax, ebx, ecx, edx;
+
+	eax = 0x0;
+	ecx = 0x0;
+	cpuid(eax, ebx, ecx, edx);
+	if (eax >= 0x7) {
+		eax = 0x7;
+		ecx = 0x0;
+		cpuid(eax, ebx, ecx, edx);
+		phys_erms = (ebx & CPU_FEATURE_ERMS) != 0;
+	}
+
+	phys_nocache = CPU_HAS_FEATURE(CPU_FEATURE_SSE2) != 0;
+}
+
+static inline void
+phys_page_zero(vm_offset_t v)
+{
+	if (phys_erms) {
+		unsigned long n = PAGE_SIZE;
+
+		asm volatile("rep stosb"
+			     : "+D" (v), "+c" (n) : "a" (0) : "memory");
+	} else
+		memset((void *) v, 0, PAGE_SIZE);
+}
+
+static inline void
+phys_page_copy(vm_offset_t dst, vm_offset_t src)
+{
+	if (phys_erms) {
+		unsigned long n = PAGE_SIZE;
+
+		asm volatile("rep movsb"
+			     : "+D" (dst), "+S" (src), "+c" (n) : : "memory");
+	} else
+		memcpy((void *) dst, (void *) src, PAGE_SIZE);
+}
+
+/*
+ *	Copy a page with non-temporal stores, so that the destination
+ *	doesn't evict useful data from the caches.
+ */
+static inline void
+phys_page_copy_nocache(vm_offset_t dst, vm_offset_t src)
+{
+	unsigned long *d = (unsigned long *) dst;
+	const unsigned long *s = (const unsigned long *) src;
+	int i;
+
+	if (!phys_nocache) {
+		phys_page_copy(dst, src);
+		return;
+	}
+
+	for (i = 0; i < PAGE_SIZE / sizeof(*d); i += 4) {
+		asm volatile("movnti %1,%0" : "=m" (d[i]) : "r" (s[i]));
+		asm volatile("movnti %1,%0" : "=m" (d[i + 1]) : "r" (s[i + 1]));
+		asm volatile("movnti %1,%0" : "=m" (d[i + 2]) : "r" (s[i + 2]));
+		asm volatile("movnti %1,%0" : "=m" (d[i + 3]) : "r" (s[i + 3]));
+	}
+
+	/* Order the stores before any later store releasing the page */
+	asm volatile("sfence" : : : "memory");
+}
+
+/*
+ *	Return a kernel address for physical address p.  Memory out of
+ *	the direct and physical memory maps gets mapped in a window,
+ *	with pte, which must be released with phys_unmap.
+ */
+static inline vm_offset_t
+phys_map(phys_addr_t p, pt_entry_t pte, pmap_mapwindow_t **map)
+{
+	*map = NULL;
+
+	if (p < VM_PAGE_DIRECTMAP_LIMIT)
+		return phystokv(p);
+
+#ifdef	VM_PHYSMAP_ADDRESS
+	if (p < physmap_end)
+		return phystophysmap(p);
+#endif	/* VM_PHYSMAP_ADDRESS */
+
+	*map = pmap_get_mapwindow(pte);
+	return (*map)->vaddr + (p & (INTEL_PGBYTES-1));
+}
+
+static inline void
+phys_unmap(pmap_mapwindow_t *map)
+{
+	if (map != NULL)
+		pmap_put_mapwindow(map);
+}
+
 /*
  *	pmap_zero_page zeros the specified (machine independent) page.
  */
@@ -52,20 +160,10 @@ pmap_zero_page(phys_addr_t p)
 	assert(p != vm_page_fictitious_addr);
 	vm_offset_t v;
 	pmap_mapwindow_t *map;
-	boolean_t mapped = p >= VM_PAGE_DIRECTMAP_LIMIT;
-
-	if (mapped)
-	{
-		map = pmap_get_mapwindow(INTEL_PTE_W(p));
-		v = map->vaddr;
-	}
-	else
-		v = phystokv(p);
-
-	memset((void*) v, 0, PAGE_SIZE);
 
-	if (mapped)
-		pmap_put_mapwindow(map);
+	v = phys_map(p, INTEL_PTE_W(p), &map);
+	phys_page_zero(v);
+	phys_unmap(map);
 }
 
 /*
@@ -77,35 +175,40 @@ pmap_copy_page(
 	phys_addr_t dst)
 {
 	vm_offset_t src_addr_v, dst_addr_v;
-	pmap_mapwindow_t *src_map = NULL;
-	pmap_mapwindow_t *dst_map;
-	boolean_t src_mapped = src >= VM_PAGE_DIRECTMAP_LIMIT;
-	boolean_t dst_mapped = dst >= VM_PAGE_DIRECTMAP_LIMIT;
+	pmap_mapwindow_t *src_map, *dst_map;
 	assert(src != vm_page_fictitious_addr);
 	assert(dst != vm_page_fictitious_addr);
 
-	if (src_mapped)
-	{
-		src_map = pmap_get_mapwindow(INTEL_PTE_R(src));
-		src_addr_v = src_map->vaddr;
-	}
-	else
-		src_addr_v = phystokv(src);
+	src_addr_v = phys_map(src, INTEL_PTE_R(src), &src_map);
+	dst_addr_v = phys_map(dst, INTEL_PTE_W(dst), &dst_map);
 
-	if (dst_mapped)
-	{
-		dst_map = pmap_get_mapwindow(INTEL_PTE_W(dst));
-		dst_addr_v = dst_map->vaddr;
-	}
-	else
-		dst_addr_v = phystokv(dst);
+	phys_page_copy(dst_addr_v, src_addr_v);
 
-	memcpy((void *) dst_addr_v, (void *) src_addr_v, PAGE_SIZE);
+	phys_unmap(src_map);
+	phys_unmap(dst_map);
+}
 
-	if (src_mapped)
-		pmap_put_mapwindow(src_map);
-	if (dst_mapped)
-		pmap_put_mapwindow(dst_map);
+/*
+ *	pmap_copy_page_nocache copies the specified (machine independent)
+ *	pages, bypassing the caches for the destination.
+ */
+void
+pmap_copy_page_nocache(
+	phys_addr_t src,
+	phys_addr_t dst)
+{
+	vm_offset_t src_addr_v, dst_addr_v;
+	pmap_mapwindow_t *src_map, *dst_map;
+	assert(src != vm_page_fictitious_addr);
+	assert(dst != vm_page_fictitious_addr);
+
+	src_addr_v = phys_map(src, INTEL_PTE_R(src), &src_map);
+	dst_addr_v = phys_map(dst, INTEL_PTE_W(dst), &dst_map);
+
+	phys_page_copy_nocache(dst_addr_v, src_addr_v);
+
+	phys_unmap(src_map);
+	phys_unmap(dst_map);
 }
 
 /*
@@ -121,22 +224,12 @@ copy_to_phys(
 {
 	vm_offset_t dst_addr_v;
 	pmap_mapwindow_t *dst_map;
-	boolean_t mapped = dst_addr_p >= VM_PAGE_DIRECTMAP_LIMIT;
 	assert(dst_addr_p != vm_page_fictitious_addr);
 	assert(pa_to_pte(dst_addr_p + count-1) == pa_to_pte(dst_addr_p));
 
-	if (mapped)
-	{
-		dst_map = pmap_get_mapwindow(INTEL_PTE_W(dst_addr_p));
-		dst_addr_v = dst_map->vaddr + (dst_addr_p & (INTEL_PGBYTES-1));
-	}
-	else
-		dst_addr_v = phystokv(dst_addr_p);
-
+	dst_addr_v = phys_map(dst_addr_p, INTEL_PTE_W(dst_addr_p), &dst_map);
 	memcpy((void *)dst_addr_v, (void *)src_addr_v, count);
-
-	if (mapped)
-		pmap_put_mapwindow(dst_map);
+	phys_unmap(dst_map);
 }
 
 /*
@@ -153,22 +246,12 @@ copy_from_phys(
 {
 	vm_offset_t src_addr_v;
 	pmap_mapwindow_t *src_map;
-	boolean_t mapped = src_addr_p >= VM_PAGE_DIRECTMAP_LIMIT;
 	assert(src_addr_p != vm_page_fictitious_addr);
 	assert(pa_to_pte(src_addr_p + count-1) == pa_to_pte(src_addr_p));
 
-	if (mapped)
-	{
-		src_map = pmap_get_mapwindow(INTEL_PTE_R(src_addr_p));
-		src_addr_v = src_map->vaddr + (src_addr_p & (INTEL_PGBYTES-1));
-	}
-	else
-		src_addr_v = phystokv(src_addr_p);
-
+	src_addr_v = phys_map(src_addr_p, INTEL_PTE_R(src_addr_p), &src_map);
 	memcpy((void *)dst_addr_v, (void *)src_addr_v, count);
-
-	if (mapped)
-		pmap_put_mapwindow(src_map);
+	phys_unmap(src_map);
 }
 
 /*
@@ -179,9 +262,5 @@ copy_from_phys(
 phys_addr_t
 kvtophys(vm_offset_t addr)
 {
-	pt_entry_t *pte;
-
-	if ((pte = pmap_pte(kernel_pmap, addr)) == PT_ENTRY_NULL)
-		return 0;
-	return pte_to_pa(*pte) | (addr & INTEL_OFFMASK);
+	return pmap_translate(kernel_pmap, addr);
 }
@@ -50,6 +50,10 @@
  */
 #define	CR3_PCD	0x0010			/* Page-level Cache Disable */
 #define	CR3_PWT	0x0008			/* Page-level Writes Transparent */
+#define	CR3_PCID_MASK	0x0fff		/* Process-Context Identifier */
+#ifdef	__x86_64__
+#define	CR3_NOFLUSH	(1UL << 63)	/* Keep the TLB entries of the PCID */
+#endif	/* __x86_64__ */
 
 /*
  * CR4
@@ -68,12 +72,16 @@
 					 * and FXRSTOR instructions */
 #define	CR4_OSXMMEXCPT	0x0400		/* Operating System Support for Unmasked
 					 * SIMD Floating-Point Exceptions */
+#define	CR4_PCIDE	0x20000		/* Process-Context Identifiers
+					 * Enable */
 #define	CR4_OSXSAVE	0x40000		/* Operating System Support for XSAVE
 					 * and XRSTOR instructions */
 
 #ifndef	__ASSEMBLER__
 #ifdef	__GNUC__
 
+#include <stdint.h>
+
 #ifndef	MACH_HYP
 #include <i386/gdt.h>
 #include <i386/ldt.h>
@@ -101,6 +109,14 @@ set_eflags(unsigned long eflags)
 #endif
 }
 
+static inline uint64_t
+get_tsc(void)
+{
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t) hi << 32) | lo;
+}
+
 #define get_esp() \
     ({ \
 	register unsigned long _temp__ asm("esp"); \
@@ -197,6 +213,23 @@ extern unsigned long cr3;
 		: "+r" (var) : "r" (end), \
 		  "q" (LINEAR_DS), "q" (KERNEL_DS), "i" (PAGE_SIZE)); \
     })
+
+#ifdef	__x86_64__
+/*
+ * INVPCID invalidation types.
+ */
+#define	INVPCID_ADDR		0	/* an address in a context */
+#define	INVPCID_CONTEXT		1	/* a context */
+#define	INVPCID_ALL		2	/* all contexts, global entries too */
+#define	INVPCID_ALL_NONGLOBAL	3	/* all contexts */
+
+#define invpcid(type, id, la) \
+    ({ \
+	struct { unsigned long pcid, addr; } _desc__ = { (id), (la) }; \
+	asm volatile("invpcid %0, %1" \
+		     : : "m" (_desc__), "r" ((unsigned long) (type)) : "memory"); \
+    })
+#endif	/* __x86_64__ */
 #endif	/* MACH_PV_PAGETABLES */
 
 #define	get_cr4() \
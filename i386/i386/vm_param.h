@@ -192,6 +192,18 @@
 #endif /* __LP64__ */
 #endif /* MACH_XEN */
 
+#if defined(__x86_64__) && !defined(MACH_XEN)
+/*
+ * All of physical memory, high memory included, is also mapped with
+ * large pages starting at VM_PHYSMAP_ADDRESS.  The mapping takes an
+ * L4 slot of its own, shared by all pmaps, so that the pmap module
+ * can reach any page without a mapping window.
+ */
+#define VM_PHYSMAP_ADDRESS	DECL_CONST(0xffff880000000000, UL)
+#define VM_PHYSMAP_LIMIT	DECL_CONST(0x8000000000, UL)	/* 512GB */
+#define phystophysmap(a)	((vm_offset_t)(a) + VM_PHYSMAP_ADDRESS)
+#endif /* __x86_64__ && !MACH_XEN */
+
 /*
  * Physical segment indexes.
  */
@@ -31,8 +31,11 @@
 #include <i386/apic.h>      /* lapic, ioapic... */
 #include <i386at/acpi_parse_apic.h>
 #include <vm/vm_kern.h>
+#include <vm/vm_page.h>
 
 static struct acpi_apic *apic_madt = NULL;
+static phys_addr_t acpi_srat_addr;
+static phys_addr_t acpi_slit_addr;
 unsigned lapic_addr;
 uint32_t *hpet_addr;
 
@@ -293,7 +296,8 @@ acpi_get_xsdt(phys_addr_t rsdp_phys, int* acpi_xsdt_n)
  * and the number of entries of RSDT table.
  *
  * Returns a reference to APIC/MADT table if success, NULL if failure.
- * Also sets hpet_addr to base address of HPET.
+ * Also sets hpet_addr to base address of HPET, and records the
+ * addresses of the SRAT and SLIT tables if present.
  */
 static struct acpi_apic*
 acpi_get_apic(struct acpi_rsdt *rsdt, int acpi_rsdt_n)
@@ -321,6 +325,15 @@ acpi_get_apic(struct acpi_rsdt *rsdt, int acpi_rsdt_n)
             hpet_addr = (uint32_t *)kmem_map_aligned_table(map_addr, 1024, VM_PROT_READ | VM_PROT_WRITE);
             printf("HPET at physical address 0x%llx\n", map_addr);
         }
+
+        /* Check if the entry is a SRAT or a SLIT */
+        check_signature = acpi_check_signature(descr_header->signature, ACPI_SRAT_SIG, 4*sizeof(uint8_t));
+        if (check_signature == ACPI_SUCCESS)
+            acpi_srat_addr = rsdt->entry[i];
+
+        check_signature = acpi_check_signature(descr_header->signature, ACPI_SLIT_SIG, 4*sizeof(uint8_t));
+        if (check_signature == ACPI_SUCCESS)
+            acpi_slit_addr = rsdt->entry[i];
     }
 
     return madt;
@@ -333,7 +346,8 @@ acpi_get_apic(struct acpi_rsdt *rsdt, int acpi_rsdt_n)
  * and the number of entries of XSDT table.
  *
  * Returns a reference to APIC/MADT table if success, NULL if failure.
- * Also sets hpet_addr to base address of HPET.
+ * Also sets hpet_addr to base address of HPET, and records the
+ * addresses of the SRAT and SLIT tables if present.
  */
 static struct acpi_apic*
 acpi_get_apic2(struct acpi_xsdt *xsdt, int acpi_xsdt_n)
@@ -361,6 +375,15 @@ acpi_get_apic2(struct acpi_xsdt *xsdt, int acpi_xsdt_n)
             hpet_addr = (uint32_t *)kmem_map_aligned_table(map_addr, 1024, VM_PROT_READ | VM_PROT_WRITE);
             printf("HPET at physical address 0x%llx\n", map_addr);
         }
+
+        /* Check if the entry is a SRAT or a SLIT. */
+        check_signature = acpi_check_signature(descr_header->signature, ACPI_SRAT_SIG, 4*sizeof(uint8_t));
+        if (check_signature == ACPI_SUCCESS)
+            acpi_srat_addr = xsdt->entry[i];
+
+        check_signature = acpi_check_signature(descr_header->signature, ACPI_SLIT_SIG, 4*sizeof(uint8_t));
+        if (check_signature == ACPI_SUCCESS)
+            acpi_slit_addr = xsdt->entry[i];
     }
 
     return madt;
@@ -564,6 +587,232 @@ acpi_apic_setup(struct acpi_apic *apic)
     return ACPI_SUCCESS;
 }
 
+/*
+ * acpi_map_table: map a whole ACPI table.
+ *
+ * Receives as input the physical address of the table.
+ * Returns a reference to the table if success, NULL if failure
+ * or if its checksum is wrong.
+ */
+static struct acpi_dhdr*
+acpi_map_table(phys_addr_t addr)
+{
+    struct acpi_dhdr *header;
+
+    header = (struct acpi_dhdr*) kmem_map_aligned_table(addr, sizeof(struct acpi_dhdr),
+                                                        VM_PROT_READ);
+    if (header == NULL)
+        return NULL;
+
+    header = (struct acpi_dhdr*) kmem_map_aligned_table(addr, header->length, VM_PROT_READ);
+    if (header == NULL)
+        return NULL;
+
+    if (acpi_checksum((void *)header, header->length) != 0)
+        return NULL;
+
+    return header;
+}
+
+/* Proximity domains, indexed by NUMA node. */
+static uint32_t acpi_numa_domains[VM_PAGE_MAX_NODES];
+static unsigned int acpi_numa_nr_domains;
+
+/*
+ * acpi_numa_find_node: get the NUMA node of a proximity domain.
+ *
+ * Returns the node if success, -1 if the domain wasn't seen in the SRAT.
+ */
+static int
+acpi_numa_find_node(uint32_t domain)
+{
+    for (unsigned int i = 0; i < acpi_numa_nr_domains; i++) {
+        if (acpi_numa_domains[i] == domain)
+            return i;
+    }
+
+    return -1;
+}
+
+/*
+ * acpi_numa_get_node: get the NUMA node of a proximity domain,
+ * numbering a new node if the domain wasn't seen before.
+ *
+ * Returns the node if success, -1 if there are too many nodes.
+ */
+static int
+acpi_numa_get_node(uint32_t domain)
+{
+    int node;
+
+    node = acpi_numa_find_node(domain);
+    if (node >= 0)
+        return node;
+
+    if (acpi_numa_nr_domains == VM_PAGE_MAX_NODES) {
+        printf("Too many NUMA nodes, ignoring proximity domain %u\n", domain);
+        return -1;
+    }
+
+    acpi_numa_domains[acpi_numa_nr_domains] = domain;
+    return acpi_numa_nr_domains++;
+}
+
+/*
+ * acpi_numa_add_cpu: assign the cpu with the given APIC ID to a proximity domain.
+ */
+static void
+acpi_numa_add_cpu(uint32_t apic_id, uint32_t domain)
+{
+    int node;
+
+    node = acpi_numa_get_node(domain);
+    if (node < 0)
+        return;
+
+    /* Cpus not listed in the MADT, or beyond NCPUS, are not started */
+    for (int i = 0; i < apic_get_numcpus() && i < NCPUS; i++) {
+        if (apic_get_cpu_apic_id(i) == apic_id) {
+            vm_page_numa_set_cpu(i, node);
+            return;
+        }
+    }
+}
+
+/*
+ * acpi_numa_parse_srat: parse the SRAT table.
+ *
+ * Read the SRAT table entry to entry, describing the NUMA node
+ * of each cpu and memory range to the vm_page module.
+ */
+static int
+acpi_numa_parse_srat(struct acpi_srat *srat)
+{
+    struct acpi_apic_dhdr *srat_entry;
+    vm_offset_t end;
+    int node;
+
+    srat_entry = srat->entry;
+    end = (vm_offset_t) srat + srat->header.length;
+
+    while ((vm_offset_t)srat_entry < end) {
+        struct acpi_srat_lapic *lapic_entry;
+        struct acpi_srat_memory *memory_entry;
+        struct acpi_srat_x2apic *x2apic_entry;
+
+        if (srat_entry->length == 0)
+            return ACPI_BAD_SIGNATURE;
+
+        switch (srat_entry->type) {
+
+        case ACPI_SRAT_ENTRY_LAPIC:
+            lapic_entry = (struct acpi_srat_lapic*) srat_entry;
+            if (lapic_entry->flags & ACPI_SRAT_FLAG_ENABLED)
+                acpi_numa_add_cpu(lapic_entry->apic_id,
+                                  lapic_entry->proximity_lo
+                                  | (lapic_entry->proximity_hi[0] << 8)
+                                  | (lapic_entry->proximity_hi[1] << 16)
+                                  | (lapic_entry->proximity_hi[2] << 24));
+            break;
+
+        case ACPI_SRAT_ENTRY_MEMORY:
+            memory_entry = (struct acpi_srat_memory*) srat_entry;
+            if (!(memory_entry->flags & ACPI_SRAT_FLAG_ENABLED)
+                || (memory_entry->length == 0))
+                break;
+
+            node = acpi_numa_get_node(memory_entry->proximity);
+            if (node >= 0) {
+                printf("NUMA node %d: memory 0x%llx-0x%llx\n", node,
+                       (unsigned long long) memory_entry->base,
+                       (unsigned long long) (memory_entry->base
+                                             + memory_entry->length));
+                vm_page_numa_add_range(node, memory_entry->base,
+                                       memory_entry->base + memory_entry->length);
+            }
+            break;
+
+        case ACPI_SRAT_ENTRY_X2APIC:
+            x2apic_entry = (struct acpi_srat_x2apic*) srat_entry;
+            if (x2apic_entry->flags & ACPI_SRAT_FLAG_ENABLED)
+                acpi_numa_add_cpu(x2apic_entry->x2apic_id,
+                                  x2apic_entry->proximity);
+            break;
+
+        default:
+            break;
+        }
+
+        srat_entry = (struct acpi_apic_dhdr*)((vm_offset_t) srat_entry
+                                              + srat_entry->length);
+    }
+
+    return ACPI_SUCCESS;
+}
+
+/*
+ * acpi_numa_parse_slit: parse the SLIT table.
+ *
+ * Reports the distances between the proximity domains found in the SRAT
+ * to the vm_page module.
+ */
+static void
+acpi_numa_parse_slit(struct acpi_slit *slit)
+{
+    uint64_t n = slit->nr_localities;
+    int from, to;
+
+    if (sizeof(*slit) + n * n > slit->header.length)
+        return;
+
+    for (uint64_t i = 0; i < n; i++) {
+        from = acpi_numa_find_node(i);
+        if (from < 0)
+            continue;
+
+        for (uint64_t j = 0; j < n; j++) {
+            to = acpi_numa_find_node(j);
+            if (to >= 0)
+                vm_page_numa_set_distance(from, to, slit->entry[i * n + j]);
+        }
+    }
+}
+
+/*
+ * acpi_numa_init: describe the NUMA topology to the vm_page module,
+ * from the SRAT and SLIT tables.
+ *
+ * Without a valid SRAT, all memory and cpus are left in a single node.
+ * Precondition: the cpus must have been enumerated from the MADT.
+ */
+static void
+acpi_numa_init(void)
+{
+    struct acpi_dhdr *srat, *slit;
+
+    if (acpi_srat_addr == 0)
+        return;
+
+    srat = acpi_map_table(acpi_srat_addr);
+    if (srat == NULL) {
+        printf("ACPI SRAT ignored: bad checksum\n");
+        return;
+    }
+
+    if (acpi_numa_parse_srat((struct acpi_srat*) srat) != ACPI_SUCCESS) {
+        printf("ACPI SRAT ignored: bad entry\n");
+        return;
+    }
+
+    if (acpi_slit_addr != 0) {
+        slit = acpi_map_table(acpi_slit_addr);
+        if (slit != NULL)
+            acpi_numa_parse_slit((struct acpi_slit*) slit);
+    }
+
+    vm_page_numa_setup();
+}
+
 /*
  * acpi_apic_init: find the MADT/APIC table in ACPI tables
  * and parses It to find Local APIC and IOAPIC structures.
@@ -646,6 +895,9 @@ acpi_apic_init(void)
     if (ret_acpi_setup != ACPI_SUCCESS)
         return ret_acpi_setup;
 
+    /* Now that cpus are known, find out which NUMA node they and memory belong to. */
+    acpi_numa_init();
+
     /* Prints a table with the list of each cpu and each IOAPIC with its APIC ID. */
     apic_print_info();
 
@@ -195,6 +195,84 @@ struct acpi_hpet {
     uint8_t	flags;
 } __attribute__((__packed__));
 
+#define ACPI_SRAT_SIG "SRAT"
+
+/* Types value for SRAT entries: Local APIC, memory and x2APIC affinity. */
+enum ACPI_SRAT_ENTRY_TYPE {
+    ACPI_SRAT_ENTRY_LAPIC = 0,
+    ACPI_SRAT_ENTRY_MEMORY = 1,
+    ACPI_SRAT_ENTRY_X2APIC = 2
+};
+
+/*
+ * System Resource Affinity Table (SRAT)
+ *
+ * Associates processors and memory ranges with proximity domains,
+ * i.e. NUMA nodes. Entries share the header of MADT entries.
+ */
+struct acpi_srat {
+    struct acpi_dhdr header;
+    uint32_t	reserved1;
+    uint64_t	reserved2;
+    struct acpi_apic_dhdr entry[0];
+} __attribute__((__packed__));
+
+/*
+ * Processor Local APIC Affinity Structure
+ */
+struct acpi_srat_lapic {
+    struct acpi_apic_dhdr header;
+    uint8_t	proximity_lo;
+    uint8_t	apic_id;
+    uint32_t	flags;
+    uint8_t	sapic_eid;
+    uint8_t	proximity_hi[3];
+    uint32_t	clock_domain;
+} __attribute__((__packed__));
+
+/*
+ * Memory Affinity Structure
+ */
+struct acpi_srat_memory {
+    struct acpi_apic_dhdr header;
+    uint32_t	proximity;
+    uint16_t	reserved1;
+    uint64_t	base;
+    uint64_t	length;
+    uint32_t	reserved2;
+    uint32_t	flags;
+    uint64_t	reserved3;
+} __attribute__((__packed__));
+
+/*
+ * Processor Local x2APIC Affinity Structure
+ */
+struct acpi_srat_x2apic {
+    struct acpi_apic_dhdr header;
+    uint16_t	reserved1;
+    uint32_t	proximity;
+    uint32_t	x2apic_id;
+    uint32_t	flags;
+    uint32_t	clock_domain;
+    uint32_t	reserved2;
+} __attribute__((__packed__));
+
+#define ACPI_SRAT_FLAG_ENABLED	(1 << 0)
+
+#define ACPI_SLIT_SIG "SLIT"
+
+/*
+ * System Locality Information Table (SLIT)
+ *
+ * Matrix of the relative distances between proximity domains,
+ * where 10 is the distance within a domain.
+ */
+struct acpi_slit {
+    struct acpi_dhdr header;
+    uint64_t	nr_localities;
+    uint8_t	entry[0];
+} __attribute__((__packed__));
+
 int acpi_apic_init(void);
 void acpi_print_info(phys_addr_t rsdp, void *rsdt, int acpi_rsdt_n);
 
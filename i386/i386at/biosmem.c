@@ -856,6 +856,23 @@ biosmem_directmap_end(void)
     return biosmem_segment_end(VM_PAGE_SEG_DMA);
 }
 
+phys_addr_t __boot
+biosmem_physmem_end(void)
+{
+    phys_addr_t end;
+    unsigned int i;
+
+    end = 0;
+
+    for (i = 0; i < ARRAY_SIZE(biosmem_segments); i++) {
+        if ((biosmem_segment_size(i) != 0) && (biosmem_segment_end(i) > end)) {
+            end = biosmem_segment_end(i);
+        }
+    }
+
+    return end;
+}
+
 static const char * __init
 biosmem_type_desc(unsigned int type)
 {
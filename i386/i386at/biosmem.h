@@ -86,6 +86,11 @@ unsigned long biosmem_bootalloc(unsigned int nr_pages);
  */
 phys_addr_t biosmem_directmap_end(void);
 
+/*
+ * Return the end of the highest segment of physical memory.
+ */
+phys_addr_t biosmem_physmem_end(void);
+
 /*
  * Set up physical memory based on the information obtained during bootstrap
  * and load it in the VM system.
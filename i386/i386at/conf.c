@@ -74,6 +74,15 @@
 #include <i386at/mbinfo.h>
 #define mbinfoname		"mbinfo"
 
+#ifndef	MACH_HYP
+#include <device/blkio.h>
+#include <device/virtio_blk.h>
+#define	virtioblkname		"vd"
+
+#include <device/virtio_net.h>
+#define	virtionetname		"vnet"
+#endif	/* MACH_HYP */
+
 /*
  * List of devices - console must be at slot 0
  */
@@ -165,6 +174,16 @@ struct dev_ops	dev_name_list[] =
           nulldev_write,nulldev_getstat,nulldev_setstat,nomap,
           nodev_async_in,	nulldev_reset,	nulldev_portdeath,0,
           nodev_info },
+
+	{ virtioblkname, virtio_blk_open, virtio_blk_close, virtio_blk_read,
+	  virtio_blk_write, virtio_blk_getstat, nulldev_setstat, block_io_mmap,
+	  nodev_async_in,	nulldev_reset,	nulldev_portdeath,	0,
+	  virtio_blk_dev_info },
+
+	{ virtionetname, virtio_net_open, virtio_net_close, nulldev_read,
+	  virtio_net_write, virtio_net_getstat, nulldev_setstat, nomap,
+	  virtio_net_setinput,	nulldev_reset,	nulldev_portdeath,	0,
+	  nodev_info },
 #endif	/* MACH_HYP */
 
 };
@@ -36,6 +36,9 @@
 #include <string.h>
 
 #include <device/cons.h>
+#include <device/virtio.h>
+#include <device/virtio_blk.h>
+#include <device/virtio_net.h>
 
 #include <mach/vm_param.h>
 #include <mach/vm_prot.h>
@@ -194,6 +197,15 @@ void machine_init(void)
 	 * Find the devices
 	 */
 	probeio();
+
+	/*
+	 * Find the virtio devices, drivers first so that they get
+	 * probed as devices are found.
+	 */
+	virtio_init();
+	virtio_blk_init();
+	virtio_net_init();
+	virtio_pci_init();
 #endif	/* MACH_HYP */
 
 	/*
@@ -469,6 +481,9 @@ i386at_init(void)
 	set_cr0(get_cr0() & ~(CR0_CD | CR0_NW));
 	if (CPU_HAS_FEATURE(CPU_FEATURE_PGE))
 		set_cr4(get_cr4() | CR4_PGE);
+#ifdef	PMAP_PCID
+	pmap_pcid_init(strstr(kernel_cmdline, "nopcid") == NULL);
+#endif	/* PMAP_PCID */
 #endif	/* MACH_HYP */
 	flush_instr_queue();
 #ifdef	MACH_PV_PAGETABLES
@@ -105,6 +105,14 @@
 #include <ddb/db_output.h>
 #include <machine/db_machdep.h>
 
+#if	MACH_DEBUG
+#include <mach_debug/tlb_info.h>
+#include <kern/host.h>
+#include <kern/kalloc.h>
+#include <kern/mach_debug.server.h>
+#include <kern/smp.h>
+#endif	/* MACH_DEBUG */
+
 #ifdef	MACH_PSEUDO_PHYS
 #define	WRITE_PTE(pte_p, pte_entry)		*(pte_p) = pte_entry?pa_to_ma(pte_entry):0;
 #else	/* MACH_PSEUDO_PHYS */
@@ -315,12 +323,15 @@ MACRO_BEGIN \
  \
 	/* Since the pmap is locked, other updates are locked */ \
 	/* out, and any pmap_activate has finished. */ \
+ \
+	PMAP_TLB_STAT(updates); \
  \
 	/* find other cpus using the pmap */ \
 	users = (pmap)->cpus_using & ~cpu_mask; \
 	if (users) { \
 	    /* signal them, and wait for them to finish */ \
 	    /* using the pmap */ \
+	    PMAP_TLB_STAT(shootdowns); \
 	    signal_cpus(users, (pmap), (s), (e)); \
 	    while ((pmap)->cpus_using & cpus_active & ~cpu_mask) \
 		cpu_pause(); \
@@ -330,6 +341,9 @@ MACRO_BEGIN \
 	if ((pmap)->cpus_using & cpu_mask) { \
 	    INVALIDATE_TLB((pmap), (s), (e)); \
 	} \
+ \
+	/* other cpus get a fresh PCID when they next use it */ \
+	PMAP_PCID_INVALIDATE((pmap), (pmap)->cpus_using & cpu_mask); \
 MACRO_END
 
 #else	/* NCPUS > 1 */
@@ -348,36 +362,130 @@ MACRO_END
 
 #define PMAP_UPDATE_TLBS(pmap, s, e) \
 MACRO_BEGIN \
+	PMAP_TLB_STAT(updates); \
+ \
 	/* invalidate our own TLB if pmap is in use */ \
 	if ((pmap)->cpus_using) { \
 	    INVALIDATE_TLB((pmap), (s), (e)); \
+	    PMAP_PCID_INVALIDATE((pmap), 1); \
 	} \
+	else \
+	    PMAP_PCID_INVALIDATE((pmap), 0); \
 MACRO_END
 
 #endif	/* NCPUS > 1 */
 
+/*
+ *	Like PMAP_UPDATE_TLBS, but only record the update in the batch
+ *	of the pmap if the current thread has one, see pmap_batch_start.
+ *	The pmap must be locked.
+ */
+#define PMAP_UPDATE_TLBS_BATCHED(pmap, s, e) \
+MACRO_BEGIN \
+	if ((pmap)->batch_thread != THREAD_NULL \
+	    && (pmap)->batch_thread == current_thread()) { \
+	    if ((pmap)->batch_start == (pmap)->batch_end) { \
+		(pmap)->batch_start = (s); \
+		(pmap)->batch_end = (e); \
+	    } else { \
+		if ((s) < (pmap)->batch_start) \
+		    (pmap)->batch_start = (s); \
+		if ((e) > (pmap)->batch_end) \
+		    (pmap)->batch_end = (e); \
+	    } \
+	    PMAP_TLB_STAT(deferred); \
+	} else \
+	    PMAP_UPDATE_TLBS((pmap), (s), (e)); \
+MACRO_END
+
+#ifdef	PMAP_PCID
+/*
+ *	Invalidate the PCIDs of a pmap on all cpus but those in keep,
+ *	whose TLB is up to date.  The pmap must be locked.
+ */
+#define PMAP_PCID_INVALIDATE(pmap, keep) \
+	((pmap)->pcid_cpus &= (keep))
+#else	/* PMAP_PCID */
+#define PMAP_PCID_INVALIDATE(pmap, keep)	((void) 0)
+#endif	/* PMAP_PCID */
+
 #ifdef	MACH_PV_PAGETABLES
 #define INVALIDATE_TLB(pmap, s, e) \
 MACRO_BEGIN \
 	if (__builtin_constant_p((e) - (s)) \
-		&& (e) - (s) == PAGE_SIZE) \
+		&& (e) - (s) == PAGE_SIZE) { \
 		hyp_invlpg((pmap) == kernel_pmap ? kvtolin(s) : (s)); \
-	else \
+		PMAP_TLB_STAT(ranged); \
+	} else { \
 		hyp_mmuext_op_void(MMUEXT_TLB_FLUSH_LOCAL); \
+		PMAP_TLB_STAT(flushes); \
+	} \
 MACRO_END
 #else	/* MACH_PV_PAGETABLES */
 /* It is hard to know when a TLB flush becomes less expensive than a bunch of
- * invlpgs.  But it surely is more expensive than just one invlpg.  */
+ * invlpgs.  But it surely is more expensive than just one invlpg, and the
+ * TLB has to be refilled after a flush.  Ranges of up to PMAP_INVLPG_MAX
+ * pages are invalidated page by page.  */
+#define PMAP_INVLPG_MAX	32
+
 #define INVALIDATE_TLB(pmap, s, e) \
 MACRO_BEGIN \
-	if (__builtin_constant_p((e) - (s)) \
-		&& (e) - (s) == PAGE_SIZE) \
-		invlpg_linear((pmap) == kernel_pmap ? kvtolin(s) : (s)); \
-	else \
+	if ((e) - (s) <= PMAP_INVLPG_MAX * PAGE_SIZE) { \
+		vm_offset_t __va = (pmap) == kernel_pmap ? kvtolin(s) : (s); \
+		vm_size_t __n = ((e) - (s)) / PAGE_SIZE; \
+		for (; __n > 0; __n--, __va += PAGE_SIZE) \
+			invlpg_linear(__va); \
+		PMAP_TLB_STAT(ranged); \
+	} else { \
 		flush_tlb(); \
+		PMAP_TLB_STAT(flushes); \
+	} \
+	INVALIDATE_TLB_PCIDS(pmap); \
 MACRO_END
 #endif	/* MACH_PV_PAGETABLES */
 
+#ifdef	PMAP_PCID
+/*
+ *	Kernel mappings are also cached in the TLB under the PCIDs of
+ *	the user pmaps, and invlpg or a cr3 reload only invalidates the
+ *	current one.
+ */
+#define INVALIDATE_TLB_PCIDS(pmap) \
+MACRO_BEGIN \
+	if ((pmap) == kernel_pmap && pmap_pcid_enabled) \
+		invpcid(INVPCID_ALL_NONGLOBAL, 0, 0); \
+MACRO_END
+#else	/* PMAP_PCID */
+#define INVALIDATE_TLB_PCIDS(pmap)
+#endif	/* PMAP_PCID */
+
+
+/*
+ *	TLB update statistics, per cpu
+ */
+struct pmap_tlb_stats {
+	unsigned long	updates;	/* TLB updates of pmaps */
+	unsigned long	deferred;	/* updates recorded in a batch */
+	unsigned long	batches;	/* batches that had updates */
+	unsigned long	shootdowns;	/* updates that signalled cpus */
+	unsigned long	ipis;		/* interrupts sent to cpus */
+	unsigned long	received;	/* update requests processed */
+	unsigned long	ranged;		/* invalidations page by page */
+	unsigned long	flushes;	/* full TLB flushes */
+};
+
+static struct pmap_tlb_stats	pmap_tlb_stats[NCPUS];
+
+#define PMAP_TLB_STAT(field)	(pmap_tlb_stats[cpu_number()].field++)
+
+/*
+ *	Queue of the pmaps which have a batch of TLB updates.
+ *	Batches are started and finished with the pmap system read-locked,
+ *	so the queue is locked to change it, and flushed with the pmap
+ *	system write-locked, which alone protects the queue.
+ */
+static queue_head_t	pmap_batch_queue;
+def_simple_lock_data(static, pmap_batch_lock)
 
 #if	NCPUS > 1
 /*
@@ -450,6 +558,19 @@ unsigned int	inuse_ptepages_count = 0;	/* debugging */
  */
 pt_entry_t *kernel_page_dir;
 
+#ifdef	VM_PHYSMAP_ADDRESS
+/*
+ *	Page directory pointer table of the physical memory map,
+ *	shared by all pmaps.
+ */
+static pt_entry_t *pdp_physmap;
+
+/*
+ *	End of the physical memory reachable through the map.
+ */
+phys_addr_t physmap_end;
+#endif	/* VM_PHYSMAP_ADDRESS */
+
 /*
  * Two slots for temporary physical page mapping, to allow for
  * physical-to-physical transfers.
@@ -541,10 +662,167 @@ pmap_pte(const pmap_t pmap, vm_offset_t addr)
 	pte = *ptp;
 	if ((pte & INTEL_PTE_VALID) == 0)
 		return(PT_ENTRY_NULL);
+	if (pte & INTEL_PTE_PS)
+		return(PT_ENTRY_NULL);	/* large page */
 	ptp = (pt_entry_t *)ptetokv(pte);
 	return(&ptp[ptenum(addr)]);
 }
 
+/*
+ *	Return the physical address a virtual address translates
+ *	to in a pmap, large pages included, or 0 if it isn't mapped.
+ *	The pmap must be locked, or not changing in that range.
+ */
+phys_addr_t
+pmap_translate(const pmap_t pmap, vm_offset_t addr)
+{
+	pt_entry_t	*pte;
+
+	pte = pmap_pte(pmap, addr);
+	if (pte != PT_ENTRY_NULL) {
+		if ((*pte & INTEL_PTE_VALID) == 0)
+			return 0;
+		return pte_to_pa(*pte) + (addr & INTEL_OFFMASK);
+	}
+
+#ifdef	PMAP_LARGE_PAGE_SIZE
+	pte = pmap_pde(pmap, addr);
+	if (pte != PT_ENTRY_NULL
+	    && (*pte & (INTEL_PTE_VALID | INTEL_PTE_PS))
+		== (INTEL_PTE_VALID | INTEL_PTE_PS))
+		return pte_to_pa(*pte) + (addr & (PMAP_LARGE_PAGE_SIZE - 1));
+#endif	/* PMAP_LARGE_PAGE_SIZE */
+
+	return 0;
+}
+
+#ifdef	PMAP_LARGE_PAGE_SIZE
+/*
+ *	Page-table pages kept in reserve to split large mappings, so
+ *	that pmap_demote never has to allocate one: there are always at
+ *	least as many as there are large mappings.  They are linked
+ *	through their first word.
+ */
+def_simple_lock_data(static, pmap_large_lock)
+static vm_offset_t	pmap_large_reserve;
+static unsigned long	pmap_large_reserve_count;
+
+/* Statistics */
+unsigned long	pmap_large_count;	/* large mappings */
+unsigned long	pmap_large_demotions;	/* large mappings split */
+
+static void pmap_large_reserve_put(vm_offset_t ptp)
+{
+	simple_lock(&pmap_large_lock);
+	*(vm_offset_t *) ptp = pmap_large_reserve;
+	pmap_large_reserve = ptp;
+	pmap_large_reserve_count++;
+	simple_unlock(&pmap_large_lock);
+}
+
+/*
+ *	Free the reserved pages that aren't needed any more.
+ *	Nothing must be locked.
+ */
+static void pmap_large_reserve_trim(void)
+{
+	vm_offset_t	ptp;
+	int		spl;
+
+	for (;;) {
+	    SPLVM(spl);
+	    simple_lock(&pmap_large_lock);
+	    if (pmap_large_reserve_count <= pmap_large_count) {
+		simple_unlock(&pmap_large_lock);
+		SPLX(spl);
+		break;
+	    }
+	    ptp = pmap_large_reserve;
+	    pmap_large_reserve = *(vm_offset_t *) ptp;
+	    pmap_large_reserve_count--;
+	    simple_unlock(&pmap_large_lock);
+	    SPLX(spl);
+
+	    kmem_cache_free(&pt_cache, ptp);
+	}
+}
+
+/*
+ *	Return the page directory entry of the large mapping of
+ *	addr in a pmap, or PT_ENTRY_NULL if there is none.
+ */
+static inline pt_entry_t *
+pmap_large_pde(const pmap_t pmap, vm_offset_t addr)
+{
+	pt_entry_t	*pde;
+
+	pde = pmap_pde(pmap, addr);
+	if (pde == PT_ENTRY_NULL
+	    || (*pde & (INTEL_PTE_VALID | INTEL_PTE_PS))
+		!= (INTEL_PTE_VALID | INTEL_PTE_PS))
+		return PT_ENTRY_NULL;
+	return pde;
+}
+
+/*
+ *	Split a large mapping into small ones, with a page table
+ *	from the reserve.  The translations don't change, so the TLB
+ *	isn't updated here; the caller does it for the part of the
+ *	range it then changes, which also drops the large TLB entry.
+ *	The pmap must be locked.
+ */
+static void pmap_demote(pt_entry_t *pde)
+{
+	pt_entry_t	*ptp, template, old;
+	int		i;
+
+	simple_lock(&pmap_large_lock);
+	ptp = (pt_entry_t *) pmap_large_reserve;
+	if (ptp == PT_ENTRY_NULL)
+		panic("pmap_demote: no reserved page table");
+	pmap_large_reserve = *(vm_offset_t *) ptp;
+	pmap_large_reserve_count--;
+	pmap_large_count--;
+	pmap_large_demotions++;
+	simple_unlock(&pmap_large_lock);
+
+	template = *pde & ~INTEL_PTE_PS;
+	for (i = 0; i < NPTES; i++) {
+	    WRITE_PTE(&ptp[i], template);
+	    pte_increment_pa(template);
+	}
+
+	/*
+	 *	Other processors may still set the referenced and
+	 *	modified bits of the large entry until it is replaced.
+	 */
+	old = __atomic_exchange_n(pde, pa_to_pte(kvtophys((vm_offset_t) ptp))
+				  | INTEL_PTE_VALID | INTEL_PTE_USER
+				  | INTEL_PTE_WRITE, __ATOMIC_SEQ_CST);
+	old &= (INTEL_PTE_REF | INTEL_PTE_MOD) & ~ptp[0];
+	if (old != 0)
+	    for (i = 0; i < NPTES; i++)
+		ptp[i] |= old;
+}
+
+/*
+ *	Like pmap_pte, but split the large mapping of addr first,
+ *	if there is one.  The pmap must be locked.
+ */
+static pt_entry_t *
+pmap_pte_demote(pmap_t pmap, vm_offset_t addr)
+{
+	pt_entry_t	*pde;
+
+	pde = pmap_large_pde(pmap, addr);
+	if (pde != PT_ENTRY_NULL)
+	    pmap_demote(pde);
+	return pmap_pte(pmap, addr);
+}
+#else	/* PMAP_LARGE_PAGE_SIZE */
+#define pmap_pte_demote(pmap, addr)	pmap_pte((pmap), (addr))
+#endif	/* PMAP_LARGE_PAGE_SIZE */
+
 #define DEBUG_PTE_PAGE	0
 
 #if	DEBUG_PTE_PAGE
@@ -637,6 +915,43 @@ vm_offset_t pmap_map_bd(
 	return(virt);
 }
 
+#ifdef	VM_PHYSMAP_ADDRESS
+/*
+ *	Map all of physical memory at VM_PHYSMAP_ADDRESS, up to
+ *	VM_PHYSMAP_LIMIT, with 2MB pages.  Holes get mapped too;
+ *	the MTRRs keep device memory uncached.
+ */
+static void pmap_bootstrap_physmap(void)
+{
+	pt_entry_t template, *pd;
+	phys_addr_t pa;
+	int i, j;
+
+	physmap_end = round_page(biosmem_physmem_end());
+	physmap_end = (physmap_end + (1ULL << PDPSHIFT) - 1)
+		      & ~((1ULL << PDPSHIFT) - 1);
+	if (physmap_end > VM_PHYSMAP_LIMIT)
+		physmap_end = VM_PHYSMAP_LIMIT;
+
+	template = INTEL_PTE_VALID | INTEL_PTE_WRITE | INTEL_PTE_PS;
+	if (CPU_HAS_FEATURE(CPU_FEATURE_PGE))
+		template |= INTEL_PTE_GLOBAL;
+
+	pdp_physmap = (pt_entry_t*)phystokv(pmap_grab_page());
+	memset(pdp_physmap, 0, INTEL_PGBYTES);
+	for (i = 0, pa = 0; pa < physmap_end; i++) {
+		pd = (pt_entry_t*)phystokv(pmap_grab_page());
+		for (j = 0; j < NPTES; j++, pa += 1ULL << PDESHIFT)
+			WRITE_PTE(&pd[j], pa_to_pte(pa) | template);
+		WRITE_PTE(&pdp_physmap[i],
+			  pa_to_pte(_kvtophys(pd)) | INTEL_PTE_VALID | INTEL_PTE_WRITE);
+	}
+
+	WRITE_PTE(&kernel_pmap->l4base[lin2l4num(VM_PHYSMAP_ADDRESS)],
+		  pa_to_pte(_kvtophys(pdp_physmap)) | INTEL_PTE_VALID | INTEL_PTE_WRITE);
+}
+#endif	/* VM_PHYSMAP_ADDRESS */
+
 #ifdef PAE
 static void pmap_bootstrap_pae(void)
 {
@@ -680,6 +995,9 @@ static void pmap_bootstrap_pae(void)
         /* only fill the kernel pdpte during bootstrap */
 	WRITE_PTE(&kernel_pmap->l4base[lin2l4num(VM_MIN_KERNEL_ADDRESS)],
                   pa_to_pte(_kvtophys(pdp_kernel)) | INTEL_PTE_VALID | INTEL_PTE_WRITE);
+#ifdef	VM_PHYSMAP_ADDRESS
+	pmap_bootstrap_physmap();
+#endif	/* VM_PHYSMAP_ADDRESS */
 #ifdef	MACH_PV_PAGETABLES
 	pmap_set_page_readonly_init(kernel_pmap->l4base);
 #endif /* MACH_PV_PAGETABLES */
@@ -775,6 +1093,10 @@ void pmap_bootstrap(void)
 #if	NCPUS > 1
 	lock_init(&pmap_system_lock, FALSE);	/* NOT a sleep lock */
 #endif	/* NCPUS > 1 */
+	queue_init(&pmap_batch_queue);
+#ifdef	PMAP_LARGE_PAGE_SIZE
+	simple_lock_init(&pmap_large_lock);
+#endif	/* PMAP_LARGE_PAGE_SIZE */
 
 	simple_lock_init(&kernel_pmap->lock);
 
@@ -839,9 +1161,32 @@ void pmap_bootstrap(void)
 		for (va = phystokv(0); va >= phystokv(0) && va < kernel_virtual_end; )
 		{
 			pt_entry_t *pde = kernel_page_dir + lin2pdenum_cont(kvtolin(va));
-			pt_entry_t *ptable = (pt_entry_t*)phystokv(pmap_grab_page());
+			pt_entry_t *ptable;
 			pt_entry_t *pte;
 
+#ifdef	PMAP_LARGE_PAGE_SIZE
+			/*
+			 * Use large pages where all of the page table would
+			 * map physical memory read-write, but in the first
+			 * one, which the BIOS data and trampolines share.
+			 */
+			extern char _start[], etext[];
+
+			if (va != phystokv(0)
+			    && va + PMAP_LARGE_PAGE_SIZE <= phystokv(biosmem_directmap_end())
+			    && (va + PMAP_LARGE_PAGE_SIZE <= (vm_offset_t) _start
+				|| va >= (vm_offset_t) etext))
+			{
+				WRITE_PTE(pde, pa_to_pte(_kvtophys(va))
+					| INTEL_PTE_VALID | INTEL_PTE_WRITE
+					| INTEL_PTE_PS | global);
+				va += PMAP_LARGE_PAGE_SIZE;
+				continue;
+			}
+#endif	/* PMAP_LARGE_PAGE_SIZE */
+
+			ptable = (pt_entry_t*)phystokv(pmap_grab_page());
+
 			/* Initialize the page directory entry.  */
 			WRITE_PTE(pde, pa_to_pte((vm_offset_t)_kvtophys(ptable))
 				| INTEL_PTE_VALID | INTEL_PTE_WRITE);
@@ -1184,6 +1529,8 @@ void pmap_init(void)
 	}
 #endif	/* NCPUS > 1 */
 
+	pmap_page_ops_init();
+
 	/*
 	 * Indicate that the PMAP module is now fully initialized.
 	 */
@@ -1444,6 +1791,10 @@ pmap_t pmap_create(vm_size_t size)
 	memset(p->l4base, 0, INTEL_PGBYTES);
 	WRITE_PTE(&p->l4base[lin2l4num(VM_MIN_KERNEL_ADDRESS)],
 		  pa_to_pte(kvtophys((vm_offset_t) pdp_kernel)) | INTEL_PTE_VALID | INTEL_PTE_WRITE);
+#ifdef	VM_PHYSMAP_ADDRESS
+	WRITE_PTE(&p->l4base[lin2l4num(VM_PHYSMAP_ADDRESS)],
+		  kernel_pmap->l4base[lin2l4num(VM_PHYSMAP_ADDRESS)]);
+#endif	/* VM_PHYSMAP_ADDRESS */
 #ifdef	MACH_PV_PAGETABLES
 	// FIXME: use kmem_cache_alloc instead
 	if (kmem_alloc_wired(kernel_map,
@@ -1489,6 +1840,12 @@ pmap_t pmap_create(vm_size_t size)
 
 	simple_lock_init(&p->lock);
 	p->cpus_using = 0;
+	p->batch_thread = THREAD_NULL;
+	p->batch_depth = 0;
+	p->batch_start = p->batch_end = 0;
+#ifdef	PMAP_PCID
+	p->pcid_cpus = 0;
+#endif	/* PMAP_PCID */
 
 	/*
 	 *	Initialize statistics.
@@ -1524,6 +1881,8 @@ void pmap_destroy(pmap_t p)
 	    return;	/* still in use */
 	}
 
+	assert(p->batch_thread == THREAD_NULL);
+
         /*
          * Free the page table tree.
          */
@@ -1533,6 +1892,10 @@ void pmap_destroy(pmap_t p)
 		pt_entry_t pdp = (pt_entry_t) p->l4base[l4i];
 		if (!(pdp & INTEL_PTE_VALID))
 			continue;
+#ifdef	VM_PHYSMAP_ADDRESS
+		if (l4i == lin2l4num(VM_PHYSMAP_ADDRESS))
+			continue;	/* shared with all pmaps */
+#endif	/* VM_PHYSMAP_ADDRESS */
 		pt_entry_t *pdpbase = (pt_entry_t*) ptetokv(pdp);
 #else /* __x86_64__ */
 		pt_entry_t *pdpbase = p->pdpbase;
@@ -1564,6 +1927,8 @@ void pmap_destroy(pmap_t p)
 				pt_entry_t pte = (pt_entry_t) pdebase[l2i];
 				if (!(pte & INTEL_PTE_VALID))
 					continue;
+				if (pte & INTEL_PTE_PS)
+					continue;	/* no page table */
 				kmem_cache_free(&pt_cache, (vm_offset_t)ptetokv(pte));
 			}
 			kmem_cache_free(&pd_cache, (vm_offset_t)pdebase);
@@ -1793,6 +2158,16 @@ void pmap_remove(
 	    if (l > e || l < s)
 		l = e;
 	    if (pde && (*pde & INTEL_PTE_VALID)) {
+#ifdef	PMAP_LARGE_PAGE_SIZE
+		/*
+		 *	Large mappings are split, even when removed
+		 *	entirely, so that their pages leave the pv lists
+		 *	the usual way.  The page table stays, as do the
+		 *	others.
+		 */
+		if (*pde & INTEL_PTE_PS)
+		    pmap_demote(pde);
+#endif	/* PMAP_LARGE_PAGE_SIZE */
 		spte = (pt_entry_t *)ptetokv(*pde);
 		spte = &spte[ptenum(s)];
 		epte = &spte[intel_btop(l-s)];
@@ -1800,11 +2175,125 @@ void pmap_remove(
 	    }
 	    s = l;
 	}
-	PMAP_UPDATE_TLBS(map, _s, e);
+	PMAP_UPDATE_TLBS_BATCHED(map, _s, e);
 
 	PMAP_READ_UNLOCK(map, spl);
 }
 
+/*
+ *	Routine:	pmap_batch_start
+ *
+ *	Function:
+ *		Start batching the TLB updates made on behalf of the
+ *		current thread in the given pmap: pmap_remove and
+ *		pmap_protect only record the range to invalidate in
+ *		the pmap, until pmap_batch_flush or pmap_batch_finish.
+ *		Batches nest.  The updates of the kernel pmap are not
+ *		batched, nor those of a pmap another thread batches.
+ */
+void pmap_batch_start(pmap_t pmap)
+{
+	int	spl;
+
+	if (pmap == PMAP_NULL || pmap == kernel_pmap ||
+	    current_thread() == THREAD_NULL)
+		return;
+
+	PMAP_READ_LOCK(pmap, spl);
+	if (pmap->batch_thread == THREAD_NULL) {
+		pmap->batch_thread = current_thread();
+		pmap->batch_depth = 1;
+		pmap->batch_start = pmap->batch_end = 0;
+		simple_lock(&pmap_batch_lock);
+		queue_enter(&pmap_batch_queue, pmap, pmap_t, batch_link);
+		simple_unlock(&pmap_batch_lock);
+	} else if (pmap->batch_thread == current_thread())
+		pmap->batch_depth++;
+	PMAP_READ_UNLOCK(pmap, spl);
+}
+
+/*
+ *	Make the TLB update pending in the batch of a pmap, if any.
+ *	The other cpus using the pmap are signalled once for the
+ *	union of the ranges recorded.  The pmap must be locked.
+ */
+static void pmap_batch_update(pmap_t pmap)
+{
+	if (pmap->batch_start == pmap->batch_end)
+		return;
+
+	PMAP_UPDATE_TLBS(pmap, pmap->batch_start, pmap->batch_end);
+	pmap->batch_start = pmap->batch_end = 0;
+	PMAP_TLB_STAT(batches);
+}
+
+/*
+ *	Routine:	pmap_batch_flush
+ *
+ *	Function:
+ *		Make the TLB update pending in the batch of the
+ *		current thread, which goes on.
+ */
+void pmap_batch_flush(pmap_t pmap)
+{
+	int	spl;
+
+	if (pmap == PMAP_NULL || pmap == kernel_pmap)
+		return;
+
+	PMAP_READ_LOCK(pmap, spl);
+	if (pmap->batch_thread == current_thread())
+		pmap_batch_update(pmap);
+	PMAP_READ_UNLOCK(pmap, spl);
+}
+
+/*
+ *	Routine:	pmap_batch_finish
+ *
+ *	Function:
+ *		Make the TLB update pending in the batch of the
+ *		current thread, and end the batch unless it is
+ *		nested in another.
+ */
+void pmap_batch_finish(pmap_t pmap)
+{
+	int	spl;
+
+	if (pmap == PMAP_NULL || pmap == kernel_pmap)
+		return;
+
+	PMAP_READ_LOCK(pmap, spl);
+	if (pmap->batch_thread == current_thread()) {
+		pmap_batch_update(pmap);
+		if (--pmap->batch_depth == 0) {
+			pmap->batch_thread = THREAD_NULL;
+			simple_lock(&pmap_batch_lock);
+			queue_remove(&pmap_batch_queue, pmap, pmap_t,
+				     batch_link);
+			simple_unlock(&pmap_batch_lock);
+		}
+	}
+	PMAP_READ_UNLOCK(pmap, spl);
+}
+
+/*
+ *	Make the TLB updates pending in all batches.  This is needed
+ *	before changing the mappings of a physical page: the page may
+ *	be about to be freed or cleaned, and the mappings removed in
+ *	a batch, which no pv list lists anymore, may still be cached
+ *	in the TLB of some cpu.  The pmap system must be write-locked.
+ */
+static void pmap_flush_batches(void)
+{
+	pmap_t	pmap;
+
+	queue_iterate(&pmap_batch_queue, pmap, pmap_t, batch_link) {
+		simple_lock(&pmap->lock);
+		pmap_batch_update(pmap);
+		simple_unlock(&pmap->lock);
+	}
+}
+
 /*
  *	Routine:	pmap_page_protect
  *
@@ -1853,6 +2342,7 @@ void pmap_page_protect(
 	 */
 
 	PMAP_WRITE_LOCK(spl);
+	pmap_flush_batches();
 
 	pai = pa_index(phys);
 	pv_h = pai_to_pvh(pai);
@@ -1875,7 +2365,7 @@ void pmap_page_protect(
 		simple_lock(&pmap->lock);
 
 		va = pv_e->va;
-		pte = pmap_pte(pmap, va);
+		pte = pmap_pte_demote(pmap, va);
 
 		/*
 		 * Consistency checks.
@@ -2028,6 +2518,16 @@ void pmap_protect(
 	    if (l > e || l < s)
 		l = e;
 	    if (pde && (*pde & INTEL_PTE_VALID)) {
+#ifdef	PMAP_LARGE_PAGE_SIZE
+		if (*pde & INTEL_PTE_PS) {
+		    if (l - s == PMAP_LARGE_PAGE_SIZE) {
+			*pde &= ~INTEL_PTE_WRITE;
+			s = l;
+			continue;
+		    }
+		    pmap_demote(pde);
+		}
+#endif	/* PMAP_LARGE_PAGE_SIZE */
 		spte = (pt_entry_t *)ptetokv(*pde);
 		spte = &spte[ptenum(s)];
 		epte = &spte[intel_btop(l-s)];
@@ -2065,7 +2565,7 @@ void pmap_protect(
 	    }
 	    s = l;
 	}
-	PMAP_UPDATE_TLBS(map, _s, e);
+	PMAP_UPDATE_TLBS_BATCHED(map, _s, e);
 
 	simple_unlock(&map->lock);
 	SPLX(spl);
@@ -2198,12 +2698,14 @@ static inline pt_entry_t* pmap_expand(pmap_t pmap, vm_offset_t v, int spl)
  *	or lose information.  That is, this routine must actually
  *	insert this page into the given map NOW.
  */
-void pmap_enter(
+static boolean_t pmap_enter_common(
 	pmap_t			pmap,
 	vm_offset_t		v,
 	phys_addr_t		pa,
 	vm_prot_t		prot,
-	boolean_t		wired)
+	boolean_t		wired,
+	const unsigned int	*seqp,
+	unsigned int		seq)
 {
 	boolean_t		is_physmem;
 	pt_entry_t		*pte;
@@ -2217,7 +2719,7 @@ void pmap_enter(
 	assert(pa != vm_page_fictitious_addr);
 	if (pmap_debug) printf("pmap(%zx, %llx)\n", v, (unsigned long long) pa);
 	if (pmap == PMAP_NULL)
-		return;
+		return TRUE;
 
 	if (pmap == kernel_pmap && (v < kernel_virtual_start || v >= kernel_virtual_end))
 		panic("pmap_enter(%lx, %llx) falls in physical memory area!\n", (unsigned long) v, (unsigned long long) pa);
@@ -2242,7 +2744,7 @@ void pmap_enter(
 		PMAP_UPDATE_TLBS(pmap, v, v + PAGE_SIZE);
 	    }
 	    PMAP_READ_UNLOCK(pmap, spl);
-	    return;
+	    return TRUE;
 	}
 #endif
 
@@ -2257,8 +2759,41 @@ void pmap_enter(
 Retry:
 	PMAP_READ_LOCK(pmap, spl);
 
+#ifdef	PMAP_LARGE_PAGE_SIZE
+	/*
+	 *	Leave a large mapping alone if it already maps the
+	 *	page as requested, and split it otherwise.
+	 */
+	pte = pmap_large_pde(pmap, v);
+	if (pte != PT_ENTRY_NULL) {
+	    template = (prot & VM_PROT_WRITE) ? INTEL_PTE_WRITE : 0;
+	    if (wired)
+		template |= INTEL_PTE_WIRED;
+	    if (pte_to_pa(*pte) + (v & (PMAP_LARGE_PAGE_SIZE - 1)) == pa
+		&& (*pte & (INTEL_PTE_WRITE | INTEL_PTE_WIRED)) == template) {
+		if (pv_e != PV_ENTRY_NULL)
+		    PV_FREE(pv_e);
+		PMAP_READ_UNLOCK(pmap, spl);
+		return TRUE;
+	    }
+	    pmap_demote(pte);
+	}
+#endif	/* PMAP_LARGE_PAGE_SIZE */
+
 	pte = pmap_expand(pmap, v, spl);
 
+	/*
+	 *	Expanding may have dropped the lock, check the
+	 *	sequence number only now.
+	 */
+	if (seqp != NULL
+	    && __atomic_load_n(seqp, __ATOMIC_RELAXED) != seq) {
+	    if (pv_e != PV_ENTRY_NULL)
+		PV_FREE(pv_e);
+	    PMAP_READ_UNLOCK(pmap, spl);
+	    return FALSE;
+	}
+
 	if (vm_page_ready())
 		is_physmem = (vm_page_lookup_pa(pa) != NULL);
 	else
@@ -2419,7 +2954,137 @@ Retry:
 	}
 
 	PMAP_READ_UNLOCK(pmap, spl);
+	return TRUE;
+}
+
+void pmap_enter(
+	pmap_t			pmap,
+	vm_offset_t		v,
+	phys_addr_t		pa,
+	vm_prot_t		prot,
+	boolean_t		wired)
+{
+	pmap_enter_common(pmap, v, pa, prot, wired, NULL, 0);
+}
+
+/*
+ *	Enter a mapping unless the sequence number changed, see
+ *	vm/pmap.h.  It is checked with the pmap locked, after which
+ *	any change to the mappings has to wait for us.
+ */
+boolean_t pmap_enter_speculative(
+	pmap_t			pmap,
+	vm_offset_t		v,
+	phys_addr_t		pa,
+	vm_prot_t		prot,
+	boolean_t		wired,
+	const unsigned int	*seqp,
+	unsigned int		seq)
+{
+	return pmap_enter_common(pmap, v, pa, prot, wired, seqp, seq);
+}
+
+#ifdef	PMAP_LARGE_PAGE_SIZE
+/*
+ *	Map a large page, see vm/pmap.h.  Only user pmaps get large
+ *	mappings, since the kernel pmap can't grow page tables to
+ *	split them.
+ */
+boolean_t pmap_enter_large(
+	pmap_t			pmap,
+	vm_offset_t		v,
+	phys_addr_t		pa,
+	vm_prot_t		prot,
+	boolean_t		wired)
+{
+	pt_entry_t		*pde, *ptp;
+	pt_entry_t		template;
+	pv_entry_t		pv_h;
+	unsigned long		pai;
+	vm_offset_t		reserve;
+	int			i, spl;
+	boolean_t		entered;
+
+	assert((v & (PMAP_LARGE_PAGE_SIZE - 1)) == 0);
+	assert((pa & (PMAP_LARGE_PAGE_SIZE - 1)) == 0);
+
+	if (pmap == PMAP_NULL || pmap == kernel_pmap || !valid_page(pa))
+	    return FALSE;
+
+	/*
+	 *	Add a page to the reserve for splitting the mapping
+	 *	later, while unlocked.
+	 */
+	reserve = kmem_cache_alloc(&pt_cache);
+	if (reserve == 0)
+	    return FALSE;
+
+	PMAP_READ_LOCK(pmap, spl);
+	pmap_large_reserve_put(reserve);
+
+	pmap_expand_level(pmap, v, spl, pmap_ptp, pmap_l4base, 1, &pdpt_cache);
+	pde = pmap_expand_level(pmap, v, spl, pmap_pde, pmap_ptp, 1, &pd_cache);
+
+	entered = FALSE;
+	ptp = PT_ENTRY_NULL;
+	if (*pde & INTEL_PTE_VALID) {
+	    /*
+	     *	An empty page table can go to the reserve instead.
+	     */
+	    if (*pde & INTEL_PTE_PS)
+		goto out;
+	    ptp = (pt_entry_t *) ptetokv(*pde);
+	    for (i = 0; i < NPTES; i++)
+		if (ptp[i] != 0)
+		    goto out;
+	}
+
+	/*
+	 *	Enter each page in its pv list, of which it is the
+	 *	only mapping.
+	 */
+	for (i = 0; i < NPTES; i++) {
+	    pai = pa_index(pa + i * PAGE_SIZE);
+	    LOCK_PVH(pai);
+	    pv_h = pai_to_pvh(pai);
+	    assert(pv_h->pmap == PMAP_NULL);
+	    pv_h->va = v + i * PAGE_SIZE;
+	    pv_h->pmap = pmap;
+	    pv_h->next = PV_ENTRY_NULL;
+	    UNLOCK_PVH(pai);
+	}
+
+	pmap->stats.resident_count += NPTES;
+	if (wired)
+	    pmap->stats.wired_count += NPTES;
+
+	template = pa_to_pte(pa) | INTEL_PTE_VALID | INTEL_PTE_USER
+		   | INTEL_PTE_PS;
+	if (prot & VM_PROT_WRITE)
+	    template |= INTEL_PTE_WRITE;
+	if (wired)
+	    template |= INTEL_PTE_WIRED;
+	WRITE_PTE(pde, template);
+
+	if (ptp != PT_ENTRY_NULL) {
+	    /*
+	     *	Drop the page table from the paging-structure caches.
+	     */
+	    PMAP_UPDATE_TLBS(pmap, v, v + PMAP_LARGE_PAGE_SIZE);
+	    pmap_large_reserve_put((vm_offset_t) ptp);
+	}
+
+	simple_lock(&pmap_large_lock);
+	pmap_large_count++;
+	simple_unlock(&pmap_large_lock);
+	entered = TRUE;
+
+out:
+	PMAP_READ_UNLOCK(pmap, spl);
+	pmap_large_reserve_trim();
+	return entered;
 }
+#endif	/* PMAP_LARGE_PAGE_SIZE */
 
 /*
  *	Routine:	pmap_change_wiring
@@ -2443,7 +3108,7 @@ void pmap_change_wiring(
 	 */
 	PMAP_READ_LOCK(map, spl);
 
-	if ((pte = pmap_pte(map, v)) == PT_ENTRY_NULL)
+	if ((pte = pmap_pte_demote(map, v)) == PT_ENTRY_NULL)
 		panic("pmap_change_wiring: pte missing");
 
 	if (wired && !(*pte & INTEL_PTE_WIRED)) {
@@ -2487,18 +3152,12 @@ phys_addr_t pmap_extract(
 	pmap_t		pmap,
 	vm_offset_t	va)
 {
-	pt_entry_t	*pte;
 	phys_addr_t	pa;
 	int		spl;
 
 	SPLVM(spl);
 	simple_lock(&pmap->lock);
-	if ((pte = pmap_pte(pmap, va)) == PT_ENTRY_NULL)
-	    pa = 0;
-	else if (!(*pte & INTEL_PTE_VALID))
-	    pa = 0;
-	else
-	    pa = pte_to_pa(*pte) + (va & INTEL_OFFMASK);
+	pa = pmap_translate(pmap, va);
 	simple_unlock(&pmap->lock);
 	SPLX(spl);
 	return(pa);
@@ -2581,6 +3240,8 @@ void pmap_collect(pmap_t p)
 				pt_entry_t pte = (pt_entry_t) pdebase[l2i];
 				if (!(pte & INTEL_PTE_VALID))
 					continue;
+				if (pte & INTEL_PTE_PS)
+					continue;	/* no page table */
 
 				pa = pte_to_pa(pte);
 				ptp = (pt_entry_t *)phystokv(pa);
@@ -2722,6 +3383,8 @@ int pmap_whatis(pmap_t p, vm_offset_t a)
 				pt_entry_t pte = (pt_entry_t) pdebase[l2i];
 				if (!(pte & INTEL_PTE_VALID))
 					continue;
+				if (pte & INTEL_PTE_PS)
+					continue;	/* no page table */
 
 				pa = pte_to_pa(pte);
 				ptp = (pt_entry_t *)phystokv(pa);
@@ -2892,6 +3555,7 @@ phys_attribute_clear(
 	 */
 
 	PMAP_WRITE_LOCK(spl);
+	pmap_flush_batches();
 
 	pai = pa_index(phys);
 	pv_h = pai_to_pvh(pai);
@@ -2915,7 +3579,7 @@ phys_attribute_clear(
 		simple_lock(&pmap->lock);
 
 		va = pv_e->va;
-		pte = pmap_pte(pmap, va);
+		pte = pmap_pte_demote(pmap, va);
 
 		/*
 		 * Consistency checks.
@@ -3007,12 +3671,21 @@ phys_attribute_test(
 
 		    va = pv_e->va;
 		    pte = pmap_pte(pmap, va);
+#ifdef	PMAP_LARGE_PAGE_SIZE
+		    /*
+		     * The bits of a large mapping are those of
+		     * all its pages.
+		     */
+		    if (pte == PT_ENTRY_NULL)
+			pte = pmap_large_pde(pmap, va);
+#endif	/* PMAP_LARGE_PAGE_SIZE */
 
 		    /*
 		     * Consistency checks.
 		     */
 		    assert(*pte & INTEL_PTE_VALID);
-		    assert(pte_to_pa(*pte) == phys);
+		    assert((*pte & INTEL_PTE_PS)
+			   || pte_to_pa(*pte) == phys);
 		}
 
 		/*
@@ -3179,8 +3852,10 @@ void    signal_cpus(
 	    simple_unlock(&update_list_p->lock);
 
 	    __sync_synchronize();
-	    if (((cpus_idle & (1 << which_cpu)) == 0))
+	    if (((cpus_idle & (1 << which_cpu)) == 0)) {
+		PMAP_TLB_STAT(ipis);
 		interrupt_processor(which_cpu);
+	    }
 	    use_list &= ~(1 << which_cpu);
 	}
 }
@@ -3200,6 +3875,7 @@ void process_pmap_updates(pmap_t my_pmap)
 	simple_lock_nocheck(&update_list_p->lock);
 
 	for (j = 0; j < update_list_p->count; j++) {
+	    PMAP_TLB_STAT(received);
 	    pmap = update_list_p->item[j].pmap;
 	    if (pmap == my_pmap ||
 		pmap == kernel_pmap) {
@@ -3283,6 +3959,88 @@ void pmap_update_interrupt(void)
 }
 #endif	/* NCPUS > 1 */
 
+#if	MACH_DEBUG
+/*
+ *	Routine:	host_tlb_info [kernel call]
+ *	Purpose:
+ *		Return the TLB update statistics of the processors.
+ *	Conditions:
+ *		Nothing locked.  The statistics are not locked either,
+ *		so the figures may be slightly inconsistent.
+ *		Obeys CountInOut protocol.
+ *	Returns:
+ *		KERN_SUCCESS		Returned information.
+ *		KERN_INVALID_HOST	The host is null.
+ *		KERN_RESOURCE_SHORTAGE	Couldn't allocate memory.
+ */
+
+kern_return_t
+host_tlb_info(
+	host_t			host,
+	tlb_info_array_t	*infop,
+	mach_msg_type_number_t	*infoCntp)
+{
+	tlb_info_t *info;
+	struct pmap_tlb_stats *stats;
+	unsigned int i, ncpus;
+	vm_size_t info_size;
+	kern_return_t kr;
+
+	if (host == HOST_NULL)
+		return KERN_INVALID_HOST;
+
+	ncpus = smp_get_numcpus();
+	info_size = ncpus * sizeof *info;
+	info = (tlb_info_t *) kalloc(info_size);
+	if (info == NULL)
+		return KERN_RESOURCE_SHORTAGE;
+
+	memset(info, 0, info_size);
+	for (i = 0; i < ncpus; i++) {
+		stats = &pmap_tlb_stats[i];
+		info[i].tlbi_cpu = i;
+		info[i].tlbi_updates = stats->updates;
+		info[i].tlbi_deferred = stats->deferred;
+		info[i].tlbi_batches = stats->batches;
+		info[i].tlbi_shootdowns = stats->shootdowns;
+		info[i].tlbi_ipis = stats->ipis;
+		info[i].tlbi_received = stats->received;
+		info[i].tlbi_ranged = stats->ranged;
+		info[i].tlbi_flushes = stats->flushes;
+	}
+
+	if (ncpus <= *infoCntp) {
+		memcpy(*infop, info, info_size);
+	} else {
+		vm_offset_t info_addr;
+		vm_size_t total_size;
+		vm_map_copy_t copy;
+
+		kr = kmem_alloc_pageable(ipc_kernel_map, &info_addr, info_size);
+		if (kr != KERN_SUCCESS)
+			goto out;
+
+		memcpy((char *) info_addr, info, info_size);
+		total_size = round_page(info_size);
+		if (info_size < total_size)
+			memset((char *) (info_addr + info_size),
+			       0, total_size - info_size);
+
+		kr = vm_map_copyin(ipc_kernel_map, info_addr, info_size,
+				   TRUE, &copy);
+		assert(kr == KERN_SUCCESS);
+		*infop = (tlb_info_t *) copy;
+	}
+
+	*infoCntp = ncpus;
+	kr = KERN_SUCCESS;
+
+out:
+	kfree((vm_offset_t) info, info_size);
+	return kr;
+}
+#endif	/* MACH_DEBUG */
+
 #if defined(__i386__) || defined (__x86_64__)
 /* Unmap page 0 to trap NULL references.  */
 void
@@ -3347,6 +4105,102 @@ pmap_make_temporary_mapping(void)
 #endif	/* MACH_PV_PAGETABLES */
 }
 
+#ifdef	PMAP_PCID
+/* CPUID leaf 7 features */
+#define CPU_FEATURE_INVPCID	(1 << 10)	/* ebx */
+
+boolean_t pmap_pcid_enabled;
+
+/* Next PCID to hand out and current generation, per cpu */
+static unsigned long pmap_pcid_next[NCPUS];
+static unsigned long pmap_pcid_gen[NCPUS];
+
+/*
+ *	Decide whether pmaps get PCIDs, which also needs INVPCID to
+ *	invalidate kernel mappings in all of them, and enable them on
+ *	the boot processor.  The others enable them in paging_enable.
+ */
+void
+pmap_pcid_init(boolean_t enable)
+{
+	unsigned eax, ebx, ecx, edx;
+	unsigned long cr4;
+
+	if (!enable || !CPU_HAS_FEATURE(CPU_FEATURE_PCID))
+		return;
+
+	eax = 0x0;
+	ecx = 0x0;
+	cpuid(eax, ebx, ecx, edx);
+	if (eax < 0x7)
+		return;
+
+	eax = 0x7;
+	ecx = 0x0;
+	cpuid(eax, ebx, ecx, edx);
+	if (!(ebx & CPU_FEATURE_INVPCID))
+		return;
+
+	cr4 = get_cr4();
+	set_cr4(cr4 | CR4_PCIDE);
+	pmap_pcid_enabled = TRUE;
+}
+
+/*
+ *	Hand out a PCID of the current generation on a cpu, starting a
+ *	new one if needed.  The fresh PCIDs of a generation have no
+ *	entries in the TLB.
+ */
+static unsigned long
+pmap_pcid_alloc(int cpu)
+{
+	if (pmap_pcid_next[cpu] == 0 || pmap_pcid_next[cpu] == PMAP_NPCIDS) {
+		pmap_pcid_gen[cpu]++;
+		pmap_pcid_next[cpu] = 1;
+		invpcid(INVPCID_ALL_NONGLOBAL, 0, 0);
+	}
+
+	return (pmap_pcid_gen[cpu] << PMAP_PCID_GEN_SHIFT)
+	       | pmap_pcid_next[cpu]++;
+}
+
+/*
+ *	Switch the current cpu to the page tables of a pmap, keeping
+ *	the TLB entries of its PCID if it still has a valid one here.
+ *	The pmap must be locked, unless it is the kernel pmap.
+ */
+void
+pmap_set_cr3(pmap_t pmap)
+{
+	unsigned long cr3 = kvtophys((vm_offset_t) pmap->l4base);
+	unsigned long pcid;
+	int cpu;
+
+	if (!pmap_pcid_enabled) {
+		set_cr3(cr3);
+		return;
+	}
+
+	if (pmap == kernel_pmap) {
+		set_cr3(cr3 | CR3_NOFLUSH);
+		return;
+	}
+
+	cpu = cpu_number();
+	pcid = pmap->pcid[cpu];
+	if ((pmap->pcid_cpus & (1 << cpu))
+	    && (pcid >> PMAP_PCID_GEN_SHIFT) == pmap_pcid_gen[cpu]) {
+		set_cr3(cr3 | (pcid & CR3_PCID_MASK) | CR3_NOFLUSH);
+		return;
+	}
+
+	pcid = pmap_pcid_alloc(cpu);
+	pmap->pcid[cpu] = pcid;
+	pmap->pcid_cpus |= 1 << cpu;
+	set_cr3(cr3 | (pcid & CR3_PCID_MASK));
+}
+#endif	/* PMAP_PCID */
+
 void
 pmap_set_page_dir(void)
 {
@@ -38,6 +38,7 @@
 #ifndef	__ASSEMBLER__
 
 #include <kern/lock.h>
+#include <kern/queue.h>
 #include <mach/machine/vm_param.h>
 #include <mach/vm_statistics.h>
 #include <mach/kern_return.h>
@@ -208,6 +209,20 @@ typedef phys_addr_t pt_entry_t;
 typedef	volatile long	cpu_set;	/* set of CPUs - must be <= 32 */
 				/* changed by other processors */
 
+#if	defined(__x86_64__) && !defined(MACH_HYP)
+/*
+ *	Process-context identifiers tag TLB entries with the address
+ *	space they belong to, so that switching pmaps doesn't flush the
+ *	TLB.  Each cpu hands out its own PCIDs to the pmaps which run on
+ *	it.  Once it runs out of them, it flushes the TLB and starts a
+ *	new generation, which invalidates all the PCIDs of the previous
+ *	one.  The kernel pmap always uses PCID 0.
+ */
+#define	PMAP_PCID	1
+#define	PMAP_NPCIDS	4096
+#define	PMAP_PCID_GEN_SHIFT	12	/* generation, above the PCID */
+#endif	/* __x86_64__ && !MACH_HYP */
+
 struct pmap {
 #ifdef __x86_64__
 	pt_entry_t	*l4base;	/* l4 table */
@@ -225,6 +240,15 @@ struct pmap {
 				/* lock on map */
 	struct pmap_statistics	stats;	/* map statistics */
 	cpu_set		cpus_using;	/* bitmap of cpus using pmap */
+	struct thread	*batch_thread;	/* thread batching TLB updates */
+	int		batch_depth;	/* nesting of its batches */
+	vm_offset_t	batch_start;	/* range whose TLB update */
+	vm_offset_t	batch_end;	/*   is pending in the batch */
+	queue_chain_t	batch_link;	/* in the queue of batched pmaps */
+#ifdef	PMAP_PCID
+	cpu_set		pcid_cpus;	/* cpus on which pcid is valid */
+	unsigned long	pcid[NCPUS];	/* PCID and generation, per cpu */
+#endif	/* PMAP_PCID */
 };
 
 typedef struct pmap	*pmap_t;
@@ -240,7 +264,6 @@ extern void pmap_clear_bootstrap_pagetable(pt_entry_t *addr);
 #endif	/* MACH_PV_PAGETABLES */
 
 #ifdef __x86_64__
-/* TODO: support PCID */
 #ifdef MACH_HYP
 #define	set_pmap(pmap)	\
 	MACRO_BEGIN					\
@@ -250,7 +273,10 @@ extern void pmap_clear_bootstrap_pagetable(pt_entry_t *addr);
 				panic("set_user_cr3"); \
 	MACRO_END
 #else	/* MACH_HYP */
-#define	set_pmap(pmap)	set_cr3(kvtophys((vm_offset_t)(pmap)->l4base))
+extern boolean_t pmap_pcid_enabled;
+extern void pmap_pcid_init(boolean_t enable);
+extern void pmap_set_cr3(pmap_t pmap);
+#define	set_pmap(pmap)	pmap_set_cr3(pmap)
 #endif	/* MACH_HYP */
 #elif PAE
 #define	set_pmap(pmap)	set_cr3(kvtophys((vm_offset_t)(pmap)->pdpbase))
@@ -300,11 +326,44 @@ extern	pmap_t	kernel_pmap;
 
 void		pmap_update_interrupt(void);
 
+/*
+ *	Batching of TLB updates, see vm/pmap.h.
+ */
+#define	PMAP_BATCH	1
+
+extern void	pmap_batch_start(pmap_t pmap);
+extern void	pmap_batch_flush(pmap_t pmap);
+extern void	pmap_batch_finish(pmap_t pmap);
+
+/*
+ *	Speculative entry, see vm/pmap.h.
+ */
+#define	PMAP_ENTER_SPECULATIVE	1
+
+extern boolean_t pmap_enter_speculative(pmap_t pmap, vm_offset_t v,
+					phys_addr_t pa, vm_prot_t prot,
+					boolean_t wired,
+					const unsigned int *seqp,
+					unsigned int seq);
+
+#if	defined(__x86_64__) && !defined(MACH_XEN)
+/*
+ *	Large pages, see vm/pmap.h.  The direct mapping of physical
+ *	memory is made of them too.
+ */
+#define	PMAP_LARGE_PAGE_SIZE	(1UL << PDESHIFT)
+
+extern boolean_t pmap_enter_large(pmap_t pmap, vm_offset_t v,
+				  phys_addr_t pa, vm_prot_t prot,
+				  boolean_t wired);
+#endif	/* __x86_64__ && !MACH_XEN */
+
 /*
  *	Machine dependent routines that are used only for i386/i486.
  */
 
 pt_entry_t *pmap_pte(const pmap_t pmap, vm_offset_t addr);
+phys_addr_t pmap_translate(const pmap_t pmap, vm_offset_t addr);
 
 /*
  *	Macros for speed.
@@ -541,6 +600,23 @@ extern void pmap_zero_page (phys_addr_t);
  */
 extern void pmap_copy_page (phys_addr_t, phys_addr_t);
 
+/*
+ *  pmap_copy_page_nocache copies a page which is not likely to be
+ *  accessed soon, without filling the caches with it if possible.
+ */
+extern void pmap_copy_page_nocache (phys_addr_t, phys_addr_t);
+
+/*
+ *  pmap_page_ops_init selects the routines used to zero and copy
+ *  pages according to the processor features.
+ */
+extern void pmap_page_ops_init (void);
+
+/*
+ *  End of the physical memory mapped at VM_PHYSMAP_ADDRESS, if any.
+ */
+extern phys_addr_t physmap_end;
+
 /*
  *	copy_to_phys(src_addr_v, dst_addr_p, count)
  *
@@ -46,6 +46,10 @@
 #define VIRTIO_F_RING_EVENT_IDX      29
 #define VIRTIO_F_VERSION_1           32
 
+/* Ring features handled by the core, to be kept by every driver */
+#define VIRTIO_RING_FEATURES \
+    ((1U << VIRTIO_F_RING_INDIRECT_DESC) | (1U << VIRTIO_F_RING_EVENT_IDX))
+
 /* Virtio PCI configuration space offsets */
 #define VIRTIO_PCI_HOST_FEATURES     0
 #define VIRTIO_PCI_GUEST_FEATURES    4
@@ -57,6 +61,14 @@
 #define VIRTIO_PCI_ISR               19
 #define VIRTIO_PCI_CONFIG            20
 
+/* Legacy ring layout: queue address in pages of this size */
+#define VIRTIO_PCI_QUEUE_ADDR_SHIFT  12
+#define VIRTIO_PCI_VRING_ALIGN       4096
+
+/* ISR status bits */
+#define VIRTIO_PCI_ISR_QUEUE         0x01
+#define VIRTIO_PCI_ISR_CONFIG        0x02
+
 /* Virtio status bits */
 #define VIRTIO_STATUS_RESET          0x00
 #define VIRTIO_STATUS_ACKNOWLEDGE    0x01
@@ -70,6 +82,13 @@
 #define VRING_DESC_F_WRITE    2
 #define VRING_DESC_F_INDIRECT 4
 
+/* Ring notification suppression flags */
+#define VRING_AVAIL_F_NO_INTERRUPT 1
+#define VRING_USED_F_NO_NOTIFY     1
+
+/* Longest chain put in a single indirect table */
+#define VIRTIO_MAX_INDIRECT   128
+
 /* Virtio ring descriptor */
 struct vring_desc {
     uint64_t addr;   /* Address (guest-physical) */
@@ -99,16 +118,53 @@ struct vring_used {
 };
 
 /* Virtio queue structure */
+struct virtio_device;
+struct vm_page;
+
 struct virtqueue {
     unsigned int num;                /* Number of descriptors */
+    unsigned int index;              /* Queue index on the device */
+    struct virtio_device *vdev;      /* Owning device */
     struct vring_desc *desc;         /* Descriptor table */
     struct vring_avail *avail;       /* Available ring */
     struct vring_used *used;         /* Used ring */
     uint16_t last_used_idx;          /* Last processed used index */
+    uint16_t free_head;              /* First free descriptor */
+    unsigned int num_free;           /* Number of free descriptors */
+    uint16_t num_added;              /* Buffers made available since kick */
+    boolean_t event_idx;             /* VIRTIO_F_RING_EVENT_IDX in use */
+    boolean_t indirect;              /* VIRTIO_F_RING_INDIRECT_DESC in use */
+    void **desc_data;                /* Caller token of each chain head */
+    struct vring_desc **desc_indirect; /* Indirect table of each chain head */
+    struct vm_page *ring_pages;      /* Pages backing the rings */
+    vm_size_t ring_size;             /* Size of the rings */
+    void (*callback)(struct virtqueue *vq); /* Used buffer notification */
     void *data;                      /* Per-queue data */
     simple_lock_data_t lock;         /* Queue lock */
+
+    /* Statistics */
+    unsigned long added;             /* Buffers made available */
+    unsigned long completed;         /* Buffers returned by the device */
+    unsigned long kicks;             /* Calls to virtio_kick */
+    unsigned long notifications;     /* Kicks that notified the device */
 };
 
+/*
+ * Event index locations, past the end of the available and used rings
+ */
+#define vring_used_event(vq)  ((vq)->avail->ring[(vq)->num])
+#define vring_avail_event(vq) \
+    (*(volatile uint16_t *)((char *)(vq)->used \
+                            + offsetof(struct vring_used, ring) \
+                            + (vq)->num * sizeof(struct vring_used_elem)))
+
+/*
+ * Whether the other side asked to be notified when the ring index moves
+ * from old to new_idx, given the event index it published.
+ */
+#define vring_need_event(event_idx, new_idx, old) \
+    ((uint16_t)((new_idx) - (event_idx) - 1) < (uint16_t)((new_idx) - (old)))
+
 /* Forward declaration */
 struct virtio_device;
 
@@ -137,6 +193,7 @@ struct virtio_device {
     /* Hardware access */
     vm_offset_t config_base;         /* Configuration space base */
     int irq;                         /* Interrupt line */
+    boolean_t irq_enabled;           /* Transport interrupt handler installed */
     
     /* Virtqueues */
     struct virtqueue **vqs;          /* Virtqueue array */
@@ -184,10 +241,20 @@ extern kern_return_t virtio_add_buf(struct virtqueue *vq,
                                    unsigned int out_num,
                                    unsigned int in_num,
                                    void *data);
+extern kern_return_t virtio_add_indirect(struct virtqueue *vq,
+                                        struct vring_desc *table,
+                                        unsigned int out_num,
+                                        unsigned int in_num,
+                                        void *data);
 extern void *virtio_get_buf(struct virtqueue *vq, uint32_t *len);
+extern unsigned int virtio_sg_init(struct vring_desc *sg, unsigned int max,
+                                   vm_offset_t addr, vm_size_t size);
 extern void virtio_kick(struct virtqueue *vq);
 extern void virtio_disable_cb(struct virtqueue *vq);
 extern boolean_t virtio_enable_cb(struct virtqueue *vq);
+extern boolean_t virtio_enable_cb_delayed(struct virtqueue *vq,
+                                          unsigned int count);
+extern boolean_t virtio_interrupt(struct virtio_device *dev);
 
 /*
  * Virtio configuration functions
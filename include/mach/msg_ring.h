@@ -0,0 +1,92 @@
+/*
+ *  Copyright (C) 2024 Free Software Foundation
+ *
+ * This program is free software ; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY ; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the program ; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Asynchronous message rings.
+ *
+ * A thread registers a ring in its address space with
+ * mach_msg_ring_register.  It then queues mach_msg operations on the
+ * submission queue, and mach_msg_ring_enter runs them all, in order,
+ * posting one completion for each on the completion queue.  Many
+ * messages thus cost a single trap.
+ *
+ * Each queue is indexed by free running counters, masked with the
+ * number of entries, which must be a power of 2.  The task advances
+ * sq_tail and cq_head, the kernel sq_head and cq_tail.  The kernel
+ * stops consuming submissions while the completion queue is full.
+ *
+ * With MACH_MSG_RING_POLL, mach_msg_ring_enter keeps polling the
+ * submission queue, so that other threads of the task can submit
+ * without entering the kernel, until it finds it empty poll_spins
+ * times in a row, or the processor is needed elsewhere.
+ */
+
+#ifndef _MACH_MSG_RING_H_
+#define _MACH_MSG_RING_H_
+
+#include <mach/message.h>
+
+#define MACH_MSG_RING_MAX	4096	/* entries per queue */
+
+/* Options of mach_msg_ring_enter */
+#define MACH_MSG_RING_POLL	0x00000001
+
+/*
+ * A mach_msg operation; the fields are the arguments of mach_msg.
+ */
+struct mach_msg_ring_sqe {
+	rpc_vm_address_t	msg;
+	mach_msg_option_t	option;
+	mach_msg_size_t		send_size;
+	mach_msg_size_t		rcv_size;
+	mach_port_name_t	rcv_name;
+	mach_msg_timeout_t	timeout;
+	mach_port_name_t	notify;
+	rpc_uintptr_t		user_data;	/* copied to the completion */
+};
+
+struct mach_msg_ring_cqe {
+	rpc_uintptr_t		user_data;
+	mach_msg_return_t	result;		/* what mach_msg returned */
+};
+
+struct mach_msg_ring {
+	/* Written by the kernel */
+	natural_t		sq_head;
+	natural_t		cq_tail;
+
+	/* Written by the task */
+	natural_t		sq_tail;
+	natural_t		cq_head;
+
+	natural_t		nentries;
+	natural_t		reserved;
+
+	/* Followed by the submission, then the completion queue */
+};
+
+#define MACH_MSG_RING_SQ(ring)						\
+	((struct mach_msg_ring_sqe *) ((struct mach_msg_ring *) (ring) + 1))
+#define MACH_MSG_RING_CQ(ring, nentries)				\
+	((struct mach_msg_ring_cqe *) (MACH_MSG_RING_SQ(ring) + (nentries)))
+#define MACH_MSG_RING_SIZE(nentries)					\
+	(sizeof(struct mach_msg_ring)					\
+	 + (nentries) * (sizeof(struct mach_msg_ring_sqe)		\
+			 + sizeof(struct mach_msg_ring_cqe)))
+
+#endif	/* _MACH_MSG_RING_H_ */
@@ -54,6 +54,9 @@ kernel_trap(mach_task_self,-28,0)
 kernel_trap(mach_host_self,-29,0)
 kernel_trap(mach_print,-30,1)
 
+kernel_trap(mach_msg_ring_register,-78,2)
+kernel_trap(mach_msg_ring_enter,-79,2)
+
 kernel_trap(swtch_pri,-59,1)
 kernel_trap(swtch,-60,0)
 kernel_trap(thread_switch,-61,3)
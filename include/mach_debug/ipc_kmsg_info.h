@@ -0,0 +1,45 @@
+/*
+ *  Copyright (C) 2024 Free Software Foundation
+ *
+ * This program is free software ; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY ; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the program ; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _MACH_DEBUG_IPC_KMSG_INFO_H_
+#define _MACH_DEBUG_IPC_KMSG_INFO_H_
+
+#include <stdint.h>
+
+/*
+ *	Remember to update the mig type definitions
+ *	in mach_debug_types.defs when adding/removing fields.
+ */
+
+/*
+ *	Statistics of a size class of the per-processor kernel
+ *	message buffer caches, summed over the processors.  Allocations
+ *	not counted as hits found the cache empty and went to kalloc.
+ */
+typedef struct ipc_kmsg_cache_info {
+	uint32_t	ikci_size;	/* buffer size, with overhead */
+	uint32_t	ikci_cached;	/* buffers in the caches */
+	uint64_t	ikci_hits;	/* allocations from a cache */
+	uint64_t	ikci_misses;	/* allocations that refilled one */
+	uint64_t	ikci_frees;	/* buffers freed to a cache */
+	uint64_t	ikci_drains;	/* times one was drained */
+} ipc_kmsg_cache_info_t;
+
+typedef ipc_kmsg_cache_info_t *ipc_kmsg_cache_info_array_t;
+
+#endif	/* _MACH_DEBUG_IPC_KMSG_INFO_H_ */
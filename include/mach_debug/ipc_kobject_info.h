@@ -0,0 +1,49 @@
+/*
+ *  Copyright (C) 2024 Free Software Foundation
+ *
+ * This program is free software ; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY ; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the program ; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _MACH_DEBUG_IPC_KOBJECT_INFO_H_
+#define _MACH_DEBUG_IPC_KOBJECT_INFO_H_
+
+#include <stdint.h>
+
+/*
+ *	Remember to update the mig type definitions
+ *	in mach_debug_types.defs when adding/removing fields.
+ */
+
+/*
+ *	Latency histogram of a kernel server routine, in processor
+ *	cycles.  Bucket 0 counts calls shorter than
+ *	2^IKRI_HIST_SHIFT cycles, bucket i calls of
+ *	[2^(IKRI_HIST_SHIFT+i-1), 2^(IKRI_HIST_SHIFT+i)) cycles,
+ *	and the last bucket everything longer.
+ */
+#define IKRI_HIST_BUCKETS	16
+#define IKRI_HIST_SHIFT		8
+
+typedef struct ipc_kobject_routine_info {
+	int32_t		ikri_id;	/* request message id */
+	uint32_t	ikri_reserved;
+	uint64_t	ikri_calls;	/* number of requests served */
+	uint64_t	ikri_cycles;	/* total cycles spent serving them */
+	uint64_t	ikri_hist[IKRI_HIST_BUCKETS];
+} ipc_kobject_routine_info_t;
+
+typedef ipc_kobject_routine_info_t *ipc_kobject_routine_info_array_t;
+
+#endif	/* _MACH_DEBUG_IPC_KOBJECT_INFO_H_ */
@@ -33,6 +33,11 @@
 #include <mach_debug/vm_info.h>
 #include <mach_debug/slab_info.h>
 #include <mach_debug/hash_info.h>
+#include <mach_debug/ipc_kmsg_info.h>
+#include <mach_debug/ipc_kobject_info.h>
+#include <mach_debug/runq_info.h>
+#include <mach_debug/tlb_info.h>
+#include <mach_debug/wait_info.h>
 
 typedef	char	symtab_name_t[32];
 typedef	const char	*const_symtab_name_t;
@@ -0,0 +1,46 @@
+/*
+ *  Copyright (C) 2024 Free Software Foundation
+ *
+ * This program is free software ; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY ; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the program ; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _MACH_DEBUG_RUNQ_INFO_H_
+#define _MACH_DEBUG_RUNQ_INFO_H_
+
+#include <stdint.h>
+
+/*
+ *	Remember to update the mig type definitions
+ *	in mach_debug_types.defs when adding/removing fields.
+ */
+
+/*
+ *	State and statistics of a run queue: the one of a processor,
+ *	or the one of the default processor set, where rqi_cpu is -1.
+ *	The counters only make sense for processors.
+ */
+typedef struct runq_info {
+	int32_t		rqi_cpu;	/* processor slot number */
+	uint32_t	rqi_count;	/* threads waiting */
+	uint64_t	rqi_switches;	/* context switches */
+	uint64_t	rqi_steals;	/* threads taken from other queues */
+	uint64_t	rqi_migrations;	/* threads which ran elsewhere last */
+	uint64_t	rqi_locks;	/* times the queue was locked */
+	uint64_t	rqi_contended;	/* times it was found locked */
+} runq_info_t;
+
+typedef runq_info_t *runq_info_array_t;
+
+#endif	/* _MACH_DEBUG_RUNQ_INFO_H_ */
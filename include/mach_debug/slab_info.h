@@ -53,4 +53,29 @@ typedef struct cache_info {
 
 typedef cache_info_t *cache_info_array_t;
 
+typedef struct cache_depot_info {
+	rpc_vm_size_t magazine_size;
+	rpc_long_natural_t nr_full_magazines;
+	rpc_long_natural_t nr_empty_magazines;
+	rpc_long_natural_t depot_hits;
+	rpc_long_natural_t depot_misses;
+	rpc_long_natural_t depot_contended;
+	rpc_long_natural_t nr_reaped_slabs;
+	char name[CACHE_NAME_MAX_LEN];
+} cache_depot_info_t;
+
+typedef cache_depot_info_t *cache_depot_info_array_t;
+
+#define SHRINKER_NAME_MAX_LEN 32
+
+typedef struct shrinker_info {
+	rpc_long_natural_t nr_objs;
+	rpc_long_natural_t nr_calls;
+	rpc_long_natural_t nr_scanned;
+	rpc_long_natural_t nr_freed;
+	char name[SHRINKER_NAME_MAX_LEN];
+} shrinker_info_t;
+
+typedef shrinker_info_t *shrinker_info_array_t;
+
 #endif	/* _MACH_DEBUG_SLAB_INFO_H_ */
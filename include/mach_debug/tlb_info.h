@@ -0,0 +1,50 @@
+/*
+ *  Copyright (C) 2024 Free Software Foundation
+ *
+ * This program is free software ; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY ; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the program ; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _MACH_DEBUG_TLB_INFO_H_
+#define _MACH_DEBUG_TLB_INFO_H_
+
+#include <stdint.h>
+
+/*
+ *	Remember to update the mig type definitions
+ *	in mach_debug_types.defs when adding/removing fields.
+ */
+
+/*
+ *	TLB update statistics of a processor.  An update invalidates
+ *	the translations of a range of a pmap; those recorded in a
+ *	batch are made at once when the batch is flushed.  Shootdowns
+ *	are the updates that had other processors to signal.
+ */
+typedef struct tlb_info {
+	int32_t		tlbi_cpu;		/* processor number */
+	uint32_t	tlbi_reserved;
+	uint64_t	tlbi_updates;		/* updates made */
+	uint64_t	tlbi_deferred;		/* updates batched */
+	uint64_t	tlbi_batches;		/* batches flushed */
+	uint64_t	tlbi_shootdowns;	/* updates that signalled */
+	uint64_t	tlbi_ipis;		/* interrupts sent */
+	uint64_t	tlbi_received;		/* requests from others */
+	uint64_t	tlbi_ranged;		/* invalidations by page */
+	uint64_t	tlbi_flushes;		/* full TLB flushes */
+} tlb_info_t;
+
+typedef tlb_info_t *tlb_info_array_t;
+
+#endif	/* _MACH_DEBUG_TLB_INFO_H_ */
@@ -140,4 +140,58 @@ typedef struct vm_page_phys_info {
 
 typedef vm_page_phys_info_t *vm_page_phys_info_array_t;
 
+/* State of the compressed pool in front of the default pager */
+typedef struct vm_compress_info {
+	uint64_t vci_stored;		/* pages currently in the pool */
+	uint64_t vci_zero;		/* of which zero-filled pages */
+	uint64_t vci_data_bytes;	/* compressed bytes held */
+	uint64_t vci_pool_pages;	/* pages backing the pool */
+	uint64_t vci_max_pool_pages;	/* limit of the above */
+	uint64_t vci_compressed;	/* pages stored so far */
+	uint64_t vci_decompressed;	/* faults served by the pool */
+	uint64_t vci_misses;		/* faults passed to the pager */
+	uint64_t vci_incompressible;	/* pages rejected as incompressible */
+	uint64_t vci_pool_full;		/* pages rejected as the pool was full */
+	uint64_t vci_discarded;		/* pages dropped with their pager */
+} vm_compress_info_t;
+
+/* Block cache of a file-backed object */
+typedef struct vm_block_cache_info {
+	uint64_t vbci_block_size;	/* size of the blocks of the object */
+	uint64_t vbci_blocks;		/* blocks of the object tracked */
+	uint64_t vbci_pages;		/* pages of the object cached */
+	uint64_t vbci_hits;		/* faults served by the cache */
+	uint64_t vbci_misses;		/* faults passed to the pager */
+	uint64_t vbci_inserted;		/* clean pages kept on eviction */
+	uint64_t vbci_evicted;		/* pages released by replacement */
+	uint64_t vbci_invalidated;	/* pages dropped for the pager */
+	uint64_t vbci_clustered;	/* dirty pages written with another */
+	uint64_t vbci_cache_pages;	/* pages cached, all objects */
+	uint64_t vbci_max_cache_pages;	/* limit of the above */
+} vm_block_cache_info_t;
+
+/* Page replacement state, summed over the physical segments */
+typedef struct vm_lru_info {
+	uint64_t vli_active;		/* active pages */
+	uint64_t vli_inactive;		/* inactive pages */
+	uint64_t vli_oldest;		/* active pages of the oldest generation */
+	uint64_t vli_youngest;		/* active pages of the youngest generation */
+	uint64_t vli_promoted;		/* pages moved up when aged */
+	uint64_t vli_deactivated;	/* pages deactivated when aged */
+	uint64_t vli_pagevec_flushes;	/* batches of deferred queue moves */
+	uint64_t vli_pagevec_pages;	/* pages in the above */
+} vm_lru_info_t;
+
+/* Physical memory and allocations of a NUMA node */
+typedef struct vm_node_info {
+	uint64_t vni_pages;		/* physical pages */
+	uint64_t vni_free;		/* free pages */
+	uint64_t vni_cpus;		/* processors */
+	uint64_t vni_hits;		/* allocations made on the node */
+	uint64_t vni_misses;		/* allocations that fell back elsewhere */
+	uint64_t vni_foreign;		/* allocations of other nodes made here */
+} vm_node_info_t;
+
+typedef vm_node_info_t *vm_node_info_array_t;
+
 #endif	/* _MACH_DEBUG_VM_INFO_H_ */
@@ -0,0 +1,48 @@
+/*
+ *  Copyright (C) 2024 Free Software Foundation
+ *
+ * This program is free software ; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY ; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the program ; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _MACH_DEBUG_WAIT_INFO_H_
+#define _MACH_DEBUG_WAIT_INFO_H_
+
+#include <stdint.h>
+
+/*
+ *	Remember to update the mig type definitions
+ *	in mach_debug_types.defs when adding/removing fields.
+ */
+
+/*
+ *	State and statistics of the wait event hash table, summed
+ *	over its buckets.  A chain is the list of the distinct events
+ *	waited on in a bucket.  Lock hold times are in TSC cycles,
+ *	and zero if the processor has no TSC.
+ */
+typedef struct wait_table_info {
+	uint32_t	wti_buckets;		/* size of the table */
+	uint32_t	wti_events;		/* events waited on */
+	uint32_t	wti_max_chain;		/* longest chain */
+	uint32_t	wti_max_chain_seen;	/* longest chain ever */
+	uint64_t	wti_locks;		/* times a bucket was locked */
+	uint64_t	wti_hold_cycles;	/* time buckets were held */
+	uint64_t	wti_max_hold_cycles;	/* longest time held */
+	uint64_t	wti_waits;		/* assert_wait calls */
+	uint64_t	wti_wakeups;		/* thread_wakeup_prim calls */
+	uint64_t	wti_woken;		/* threads they woke up */
+} wait_table_info_t;
+
+#endif	/* _MACH_DEBUG_WAIT_INFO_H_ */
@@ -51,6 +51,14 @@
 
 struct kmem_cache ipc_entry_cache;
 
+void
+ipc_entry_free_deferred(struct llsync_work *work)
+{
+	ipc_entry_t entry = structof(work, struct ipc_entry, ie_llsync_work);
+
+	kmem_cache_free(&ipc_entry_cache, (vm_offset_t) entry);
+}
+
 /*
  *	Routine:	ipc_entry_alloc
  *	Purpose:
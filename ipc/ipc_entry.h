@@ -41,6 +41,7 @@
 #include <mach/mach_types.h>
 #include <mach/port.h>
 #include <mach/kern_return.h>
+#include <kern/llsync.h>
 #include <kern/slab.h>
 #include <ipc/port.h>
 #include <ipc/ipc_table.h>
@@ -62,6 +63,7 @@ typedef struct ipc_entry {
 		struct ipc_entry *next_free;
 		/*XXX ipc_port_request_index_t request;*/
 		unsigned int request;
+		struct llsync_work llsync_work;	/* once freed */
 	} index;
 } *ipc_entry_t;
 
@@ -69,6 +71,7 @@ typedef struct ipc_entry {
 
 #define	ie_request	index.request
 #define	ie_next_free	index.next_free
+#define	ie_llsync_work	index.llsync_work
 
 #define	IE_BITS_UREFS_MASK	0x0000ffff	/* 16 bits of user-reference */
 #define	IE_BITS_UREFS(bits)	((bits) & IE_BITS_UREFS_MASK)
@@ -94,7 +97,15 @@ typedef struct ipc_entry {
 
 extern struct kmem_cache ipc_entry_cache;
 #define ie_alloc()	((ipc_entry_t) kmem_cache_alloc(&ipc_entry_cache))
-#define	ie_free(e)	kmem_cache_free(&ipc_entry_cache, (vm_offset_t) (e))
+
+/*
+ *	Entries are looked up without locking the space (see
+ *	ipc_entry_lookup_lockless), so wait for such lookups to be
+ *	done before freeing them.
+ */
+extern void ipc_entry_free_deferred(struct llsync_work *work);
+#define	ie_free(e)	\
+		llsync_defer(&(e)->ie_llsync_work, ipc_entry_free_deferred)
 
 extern kern_return_t
 ipc_entry_alloc(ipc_space_t space, mach_port_name_t *namep, ipc_entry_t *entryp);
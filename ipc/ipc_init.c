@@ -36,6 +36,7 @@
 
 #include <mach/kern_return.h>
 #include <kern/ipc_host.h>
+#include <kern/ipc_kobject.h>
 #include <kern/slab.h>
 #include <vm/vm_map.h>
 #include <vm/vm_kern.h>
@@ -97,6 +98,7 @@ ipc_bootstrap(void)
 	ipc_table_init();
 	ipc_notify_init();
 	ipc_marequest_init();
+	ipc_kmsg_cache_init();
 }
 
 /*
@@ -114,4 +116,5 @@ ipc_init(void)
 		    ipc_kernel_map_size);
 
 	ipc_host_init();
+	ipc_kobject_init();
 }
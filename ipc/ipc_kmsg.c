@@ -45,6 +45,7 @@
 #include <kern/assert.h>
 #include <kern/debug.h>
 #include <kern/kalloc.h>
+#include <kern/slab.h>
 #include <vm/vm_map.h>
 #include <vm/vm_object.h>
 #include <vm/vm_kern.h>
@@ -70,8 +71,158 @@
 #include <ipc/ipc_print.h>
 #endif
 
+#if	MACH_DEBUG
+#include <mach_debug/ipc_kmsg_info.h>
+#include <kern/host.h>
+#include <kern/mach_debug.server.h>
+#include <kern/smp.h>
+#endif	/* MACH_DEBUG */
 
-ipc_kmsg_t ipc_kmsg_cache[NCPUS];
+
+struct ipc_kmsg_cache ipc_kmsg_cache[NCPUS][IKM_CACHE_CLASSES];
+
+const vm_size_t ipc_kmsg_cache_sizes[IKM_CACHE_CLASSES] = {
+	IKM_CACHE_HEADER_KMSG_SIZE,
+	IKM_CACHE_SMALL_KMSG_SIZE,
+	IKM_CACHE_PAGE_KMSG_SIZE,
+};
+
+/*
+ *	Routine:	ipc_kmsg_cache_refill
+ *	Purpose:
+ *		Allocate a kmsg of the given class, and refill half
+ *		of the cache of the current processor for that class.
+ *	Conditions:
+ *		Nothing locked.  The cache is empty.
+ */
+
+ipc_kmsg_t
+ipc_kmsg_cache_refill(int class)
+{
+	ipc_kmsg_t kmsgs[IKM_CACHE_SLOTS / 2 + 1];
+	vm_size_t size = ipc_kmsg_cache_sizes[class];
+	ipc_kmsg_cache_t cache;
+	unsigned int i, nr_kmsgs;
+
+	assert((class >= 0) && (class < IKM_CACHE_CLASSES));
+
+	/*
+	 *	kalloc may block, and we may resume on another
+	 *	processor, so pick the cache once we are done.
+	 */
+
+	for (nr_kmsgs = 0; nr_kmsgs < IKM_CACHE_SLOTS / 2 + 1; nr_kmsgs++) {
+		kmsgs[nr_kmsgs] = (ipc_kmsg_t) kalloc(size);
+		if (kmsgs[nr_kmsgs] == IKM_NULL)
+			break;
+
+		ikm_init_special(kmsgs[nr_kmsgs], size);
+	}
+
+	if (nr_kmsgs == 0)
+		return IKM_NULL;
+
+	cache = ikm_cache(class);
+	cache->ikc_misses++;
+	for (i = 1; i < nr_kmsgs; i++) {
+		if (cache->ikc_count == IKM_CACHE_SLOTS)
+			kfree((vm_offset_t) kmsgs[i], size);
+		else
+			cache->ikc_kmsgs[cache->ikc_count++] = kmsgs[i];
+	}
+
+	return kmsgs[0];
+}
+
+/*
+ *	Routine:	ipc_kmsg_cache_drain
+ *	Purpose:
+ *		Return half of the kmsgs of a processor cache to kalloc.
+ *	Conditions:
+ *		Nothing locked.  The cache is the one of the current
+ *		processor.
+ */
+
+void
+ipc_kmsg_cache_drain(ipc_kmsg_cache_t cache)
+{
+	ipc_kmsg_t kmsg;
+	unsigned int i;
+
+	cache->ikc_drains++;
+	for (i = 0; i < IKM_CACHE_SLOTS / 2; i++) {
+		assert(cache->ikc_count > 0);
+		kmsg = cache->ikc_kmsgs[--cache->ikc_count];
+		kfree((vm_offset_t) kmsg, kmsg->ikm_size);
+	}
+}
+
+/*
+ *	Routines:	ipc_kmsg_cache_shrink_count, ipc_kmsg_cache_shrink_scan
+ *	Purpose:
+ *		Shrinker interface, through which the pageout daemon
+ *		returns cached kmsgs to kalloc on memory pressure.
+ *		Only the caches of the current processor can be
+ *		accessed; those of the others are bounded by
+ *		IKM_CACHE_SLOTS anyway.
+ *	Conditions:
+ *		Nothing locked.
+ */
+
+static unsigned long
+ipc_kmsg_cache_shrink_count(void)
+{
+	unsigned long count;
+	int class;
+
+	count = 0;
+	for (class = 0; class < IKM_CACHE_CLASSES; class++)
+		count += ikm_cache(class)->ikc_count;
+
+	return count;
+}
+
+static unsigned long
+ipc_kmsg_cache_shrink_scan(unsigned long nr_to_scan)
+{
+	ipc_kmsg_cache_t cache;
+	ipc_kmsg_t kmsg;
+	unsigned long nr_freed;
+	int class;
+
+	nr_freed = 0;
+
+	/* Largest buffers first */
+	for (class = IKM_CACHE_CLASSES - 1; class >= 0; class--) {
+		cache = ikm_cache(class);
+		while ((cache->ikc_count > 0) && (nr_freed < nr_to_scan)) {
+			kmsg = cache->ikc_kmsgs[--cache->ikc_count];
+			kfree((vm_offset_t) kmsg, kmsg->ikm_size);
+			nr_freed++;
+		}
+	}
+
+	return nr_freed;
+}
+
+static struct kmem_shrinker ipc_kmsg_cache_shrinker = {
+	.name = "ipc_kmsg_cache",
+	.count = ipc_kmsg_cache_shrink_count,
+	.scan = ipc_kmsg_cache_shrink_scan,
+};
+
+/*
+ *	Routine:	ipc_kmsg_cache_init
+ *	Purpose:
+ *		Register the kmsg caches for reclaim on memory
+ *		pressure.
+ */
+
+void
+ipc_kmsg_cache_init(void)
+{
+	kmem_shrinker_register(&ipc_kmsg_cache_shrinker);
+}
 
 /*
  *	Routine:	ipc_kmsg_enqueue
@@ -530,7 +681,7 @@ ipc_kmsg_get(
 		return MACH_SEND_MSG_TOO_SMALL;
 
 	if (ksize <= IKM_SAVED_MSG_SIZE) {
-		kmsg = ikm_cache_alloc();
+		kmsg = ikm_cache_alloc(ksize);
 		if (kmsg == IKM_NULL)
 			return MACH_SEND_NO_BUFFER;
 	} else {
@@ -2991,3 +3142,74 @@ ipc_msg_print(mach_msg_header_t *msgh)
 	}
 }
 #endif	/* MACH_KDB */
+
+#if	MACH_DEBUG
+/*
+ *	Routine:	host_ipc_kmsg_cache_info [kernel call]
+ *	Purpose:
+ *		Return the statistics of the per-processor kernel
+ *		message buffer caches, summed for each size class.
+ *	Conditions:
+ *		Nothing locked.  The caches are not locked either,
+ *		so the figures may be slightly inconsistent.
+ *		Obeys CountInOut protocol.
+ *	Returns:
+ *		KERN_SUCCESS		Returned information.
+ *		KERN_INVALID_HOST	The host is null.
+ *		KERN_RESOURCE_SHORTAGE	Couldn't allocate memory.
+ */
+
+kern_return_t
+host_ipc_kmsg_cache_info(
+	host_t				host,
+	ipc_kmsg_cache_info_array_t	*infop,
+	mach_msg_type_number_t		*infoCntp)
+{
+	ipc_kmsg_cache_info_t info[IKM_CACHE_CLASSES];
+	ipc_kmsg_cache_t cache;
+	unsigned int cpu, i;
+	kern_return_t kr;
+
+	if (host == HOST_NULL)
+		return KERN_INVALID_HOST;
+
+	memset(info, 0, sizeof info);
+	for (i = 0; i < IKM_CACHE_CLASSES; i++) {
+		info[i].ikci_size = ipc_kmsg_cache_sizes[i];
+		for (cpu = 0; cpu < smp_get_numcpus(); cpu++) {
+			cache = &ipc_kmsg_cache[cpu][i];
+			info[i].ikci_cached += cache->ikc_count;
+			info[i].ikci_hits += cache->ikc_hits;
+			info[i].ikci_misses += cache->ikc_misses;
+			info[i].ikci_frees += cache->ikc_frees;
+			info[i].ikci_drains += cache->ikc_drains;
+		}
+	}
+
+	if (IKM_CACHE_CLASSES <= *infoCntp) {
+		memcpy(*infop, info, sizeof info);
+	} else {
+		vm_offset_t info_addr;
+		vm_size_t total_size;
+		vm_map_copy_t copy;
+
+		kr = kmem_alloc_pageable(ipc_kernel_map, &info_addr,
+					 sizeof info);
+		if (kr != KERN_SUCCESS)
+			return KERN_RESOURCE_SHORTAGE;
+
+		memcpy((char *) info_addr, info, sizeof info);
+		total_size = round_page(sizeof info);
+		memset((char *) (info_addr + sizeof info), 0,
+		       total_size - sizeof info);
+
+		kr = vm_map_copyin(ipc_kernel_map, info_addr, sizeof info,
+				   TRUE, &copy);
+		assert(kr == KERN_SUCCESS);
+		*infop = (ipc_kmsg_cache_info_t *) copy;
+	}
+
+	*infoCntp = IKM_CACHE_CLASSES;
+	return KERN_SUCCESS;
+}
+#endif	/* MACH_DEBUG */
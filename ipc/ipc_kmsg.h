@@ -91,68 +91,144 @@ MACRO_END
 #endif	/* MACH_IPC_TEST */
 
 /*
- *	We keep a per-processor cache of kernel message buffers.
- *	The cache saves the overhead/locking of using kalloc/kfree.
- *	The per-processor cache seems to miss less than a per-thread cache,
- *	and it also uses less memory.  Access to the cache doesn't
- *	require locking.
+ *	The size of the kernel message buffers that will be cached.
+ *	IKM_SAVED_KMSG_SIZE includes overhead; IKM_SAVED_MSG_SIZE doesn't.
+ *
+ *	We use the page size for IKM_SAVED_KMSG_SIZE to make sure the
+ *	page is pinned to a single processor.
+ */
+
+#define	IKM_SAVED_KMSG_SIZE	PAGE_SIZE
+#define	IKM_SAVED_MSG_SIZE	ikm_less_overhead(IKM_SAVED_KMSG_SIZE)
+
+/*
+ *	We keep per-processor caches of kernel message buffers, one
+ *	for each size class: header-only messages, small inline ones,
+ *	and page-sized ones.  The caches save the overhead/locking of
+ *	using kalloc/kfree.  Each holds several buffers, so that a
+ *	processor can have a few messages in flight without going
+ *	to kalloc.  When a cache runs empty or full, half of it is
+ *	refilled from or drained to kalloc at once.  Access to the
+ *	caches doesn't require locking.
  */
 
-extern ipc_kmsg_t	ipc_kmsg_cache[NCPUS];
+#define	IKM_CACHE_CLASSES	3
+#define	IKM_CACHE_SLOTS		8	/* buffers per cache */
 
-#define ikm_cache()     ipc_kmsg_cache[cpu_number()]
+/* Sizes of the classes, including overhead */
+#define	IKM_CACHE_HEADER_KMSG_SIZE	256
+#define	IKM_CACHE_SMALL_KMSG_SIZE	1024
+#define	IKM_CACHE_PAGE_KMSG_SIZE	IKM_SAVED_KMSG_SIZE
 
-#define ikm_cache_alloc_try()						\
+typedef struct ipc_kmsg_cache {
+	unsigned int	ikc_count;		/* cached buffers */
+	ipc_kmsg_t	ikc_kmsgs[IKM_CACHE_SLOTS];
+	unsigned long	ikc_hits;		/* allocations */
+	unsigned long	ikc_misses;		/*   that refilled */
+	unsigned long	ikc_frees;		/* frees */
+	unsigned long	ikc_drains;		/*   that drained */
+} *ipc_kmsg_cache_t;
+
+extern struct ipc_kmsg_cache	ipc_kmsg_cache[NCPUS][IKM_CACHE_CLASSES];
+extern const vm_size_t		ipc_kmsg_cache_sizes[IKM_CACHE_CLASSES];
+
+extern ipc_kmsg_t ipc_kmsg_cache_refill(int);
+extern void ipc_kmsg_cache_drain(ipc_kmsg_cache_t);
+extern void ipc_kmsg_cache_init(void);
+
+#define ikm_cache(class)	(&ipc_kmsg_cache[cpu_number()][class])
+
+/*
+ *	Return the smallest class of kmsgs of at least the given
+ *	size, including overhead, or -1 if there is none.
+ */
+static inline int
+ikm_cache_class(vm_size_t size)
+{
+	if (size <= IKM_CACHE_HEADER_KMSG_SIZE)
+		return 0;
+	else if (size <= IKM_CACHE_SMALL_KMSG_SIZE)
+		return 1;
+	else if (size <= IKM_CACHE_PAGE_KMSG_SIZE)
+		return 2;
+	else
+		return -1;
+}
+
+/*
+ *	Return the class of a kmsg, or -1 if it doesn't have the
+ *	exact size of one.
+ */
+static inline int
+ikm_cache_class_of(ipc_kmsg_t kmsg)
+{
+	int class = ikm_cache_class(kmsg->ikm_size);
+
+	if ((class < 0) || (ipc_kmsg_cache_sizes[class] != kmsg->ikm_size))
+		return -1;
+
+	return class;
+}
+
+/*
+ *	The sizes given to the allocation macros don't include
+ *	overhead, and must fit in IKM_SAVED_MSG_SIZE for
+ *	ikm_cache_alloc.
+ */
+
+#define ikm_cache_alloc_try(size)					\
 MACRO_BEGIN								\
-	ipc_kmsg_t __kmsg = ikm_cache();				\
-	if (__kmsg != IKM_NULL) {					\
-		ikm_cache() = IKM_NULL;					\
-		ikm_check_initialized(__kmsg, IKM_SAVED_KMSG_SIZE);	\
+	int __class = ikm_cache_class(ikm_plus_overhead(size));		\
+	ipc_kmsg_t __kmsg = IKM_NULL;					\
+	if (__class >= 0) {						\
+		ipc_kmsg_cache_t __cache = ikm_cache(__class);		\
+		if (__cache->ikc_count > 0) {				\
+			__kmsg = __cache->ikc_kmsgs[--__cache->ikc_count]; \
+			__cache->ikc_hits++;				\
+			ikm_check_initialized(__kmsg,			\
+				ipc_kmsg_cache_sizes[__class]);		\
+		}							\
 	}								\
 	__kmsg;								\
 MACRO_END
 
-#define ikm_cache_alloc()						\
+#define ikm_cache_alloc(size)						\
 MACRO_BEGIN								\
-	ipc_kmsg_t __kmsg = ikm_cache_alloc_try(); 			\
-	if (!__kmsg) {							\
-		__kmsg = ikm_alloc(IKM_SAVED_MSG_SIZE);			\
-		if (__kmsg != IKM_NULL)					\
-			ikm_init(__kmsg, IKM_SAVED_MSG_SIZE);		\
-	}								\
+	ipc_kmsg_t __kmsg = ikm_cache_alloc_try(size);			\
+	if (__kmsg == IKM_NULL)						\
+		__kmsg = ipc_kmsg_cache_refill(				\
+			ikm_cache_class(ikm_plus_overhead(size)));	\
 	__kmsg;								\
 MACRO_END
 
 #define ikm_cache_free_try(kmsg)					\
 MACRO_BEGIN								\
+	int __class = ikm_cache_class_of(kmsg);				\
 	int __success = 0;						\
-	if (ikm_cache() == IKM_NULL) {					\
-		ikm_cache() = (kmsg);					\
-		__success = 1;						\
+	if (__class >= 0) {						\
+		ipc_kmsg_cache_t __cache = ikm_cache(__class);		\
+		if (__cache->ikc_count < IKM_CACHE_SLOTS) {		\
+			__cache->ikc_kmsgs[__cache->ikc_count++] = (kmsg); \
+			__cache->ikc_frees++;				\
+			__success = 1;					\
+		}							\
 	}								\
 	__success;							\
 MACRO_END
 
 #define ikm_cache_free(kmsg)						\
 MACRO_BEGIN								\
-	if (((kmsg)->ikm_size == IKM_SAVED_KMSG_SIZE) &&		\
-	    (ikm_cache() == IKM_NULL))					\
-		ikm_cache() = (kmsg);					\
-	else								\
+	int __class = ikm_cache_class_of(kmsg);				\
+	if (__class >= 0) {						\
+		ipc_kmsg_cache_t __cache = ikm_cache(__class);		\
+		if (__cache->ikc_count == IKM_CACHE_SLOTS)		\
+			ipc_kmsg_cache_drain(__cache);			\
+		__cache->ikc_kmsgs[__cache->ikc_count++] = (kmsg);	\
+		__cache->ikc_frees++;					\
+	} else								\
 		ikm_free(kmsg);						\
 MACRO_END
 
-/*
- *	The size of the kernel message buffers that will be cached.
- *	IKM_SAVED_KMSG_SIZE includes overhead; IKM_SAVED_MSG_SIZE doesn't.
- *
- *	We use the page size for IKM_SAVED_KMSG_SIZE to make sure the
- *	page is pinned to a single processor.
- */
-
-#define	IKM_SAVED_KMSG_SIZE	PAGE_SIZE
-#define	IKM_SAVED_MSG_SIZE	ikm_less_overhead(IKM_SAVED_KMSG_SIZE)
-
 /*
  *	Virtual copy optimization thresholds.
  *	For out-of-line data larger than this threshold, prefer virtual copy
@@ -409,33 +409,45 @@ ipc_mqueue_copyin(
 	ipc_object_t object;
 	ipc_mqueue_t mqueue;
 
-	is_read_lock(space);
-	if (!space->is_active) {
-		is_read_unlock(space);
-		return MACH_RCV_INVALID_NAME;
-	}
+	if (!ipc_entry_lookup_lockless(space, name, &bits, &object)) {
+		is_read_lock(space);
+		if (!space->is_active) {
+			is_read_unlock(space);
+			return MACH_RCV_INVALID_NAME;
+		}
 
-	entry = ipc_entry_lookup(space, name);
-	if (entry == IE_NULL) {
+		entry = ipc_entry_lookup(space, name);
+		if (entry == IE_NULL) {
+			is_read_unlock(space);
+			return MACH_RCV_INVALID_NAME;
+		}
+
+		bits = entry->ie_bits;
+		object = entry->ie_object;
+		if ((bits & (MACH_PORT_TYPE_RECEIVE |
+			     MACH_PORT_TYPE_PORT_SET)) == 0) {
+			is_read_unlock(space);
+			return MACH_RCV_INVALID_NAME;
+		}
+
+		assert(object != IO_NULL);
+		io_lock(object);
 		is_read_unlock(space);
-		return MACH_RCV_INVALID_NAME;
 	}
 
-	bits = entry->ie_bits;
-	object = entry->ie_object;
+	/*
+	 *	The object is locked, and the entry was seen to denote it
+	 *	while the space was locked or not being modified.
+	 */
 
 	if (bits & MACH_PORT_TYPE_RECEIVE) {
 		ipc_port_t port;
 		ipc_pset_t pset;
 
 		port = (ipc_port_t) object;
-		assert(port != IP_NULL);
-
-		ip_lock(port);
 		assert(ip_active(port));
 		assert(port->ip_receiver_name == name);
 		assert(port->ip_receiver == space);
-		is_read_unlock(space);
 
 		pset = port->ip_pset;
 		if (pset != IPS_NULL) {
@@ -456,16 +468,12 @@ ipc_mqueue_copyin(
 		ipc_pset_t pset;
 
 		pset = (ipc_pset_t) object;
-		assert(pset != IPS_NULL);
-
-		ips_lock(pset);
 		assert(ips_active(pset));
 		assert(pset->ips_local_name == name);
-		is_read_unlock(space);
 
 		mqueue = &pset->ips_messages;
 	} else {
-		is_read_unlock(space);
+		io_unlock(object);
 		return MACH_RCV_INVALID_NAME;
 	}
 
@@ -55,6 +55,15 @@
 
 struct kmem_cache ipc_object_caches[IOT_NUMBER];
 
+void
+ipc_object_free_deferred(struct llsync_work *work)
+{
+	ipc_object_t object = structof(work, struct ipc_object,
+				       io_llsync_work);
+
+	io_free(io_otype(object), object);
+}
+
 
 
 /*
@@ -37,6 +37,7 @@
 #include <mach/kern_return.h>
 #include <mach/message.h>
 #include <ipc/ipc_types.h>
+#include <kern/llsync.h>
 #include <kern/lock.h>
 #include <kern/macros.h>
 #include <kern/slab.h>
@@ -49,6 +50,7 @@ typedef struct ipc_object {
 	decl_simple_lock_data(,io_lock_data)
 	ipc_object_refs_t io_references;
 	ipc_object_bits_t io_bits;
+	struct llsync_work io_llsync_work;	/* once freed */
 } *ipc_object_t;
 
 #define	IO_NULL			((ipc_object_t) 0)
@@ -85,6 +87,15 @@ extern struct kmem_cache ipc_object_caches[IOT_NUMBER];
 #define	io_free(otype, io)	\
 		kmem_cache_free(&ipc_object_caches[(otype)], (vm_offset_t) (io))
 
+/*
+ *	Objects are locked by lockless entry lookups (see
+ *	ipc_entry_lookup_lockless), so once they have been entered
+ *	in a space, wait for such lookups to be done before freeing them.
+ */
+extern void ipc_object_free_deferred(struct llsync_work *work);
+#define	io_free_deferred(io)	\
+		llsync_defer(&(io)->io_llsync_work, ipc_object_free_deferred)
+
 #define	io_lock_init(io)	simple_lock_init(&(io)->io_lock_data)
 #define	io_lock(io)		simple_lock(&(io)->io_lock_data)
 #define	io_lock_try(io)		simple_lock_try(&(io)->io_lock_data)
@@ -96,7 +107,7 @@ MACRO_BEGIN								\
 									\
 	io_unlock(io);							\
 	if (_refs == 0)							\
-		io_free(io_otype(io), io);				\
+		io_free_deferred(io);					\
 MACRO_END
 
 #define	io_reference(io)						\
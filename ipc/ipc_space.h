@@ -44,6 +44,7 @@
 #include <mach/mach_types.h>
 #include <machine/vm_param.h>
 #include <kern/macros.h>
+#include <kern/llsync.h>
 #include <kern/lock.h>
 #include <kern/rdxtree.h>
 #include <kern/slab.h>
@@ -65,6 +66,7 @@ struct ipc_space {
 	ipc_space_refs_t is_references;
 
 	struct lock is_lock_data;
+	unsigned int is_seqno;		/* odd while write-locked */
 	boolean_t is_active;		/* is the space alive? */
 	struct rdxtree is_map;		/* a map of entries */
 	size_t is_size;			/* number of entries */
@@ -109,16 +111,52 @@ MACRO_BEGIN								\
 		is_free(is);						\
 MACRO_END
 
-#define	is_lock_init(is)	lock_init(&(is)->is_lock_data, TRUE)
+#define	is_lock_init(is)						\
+MACRO_BEGIN								\
+	lock_init(&(is)->is_lock_data, TRUE);				\
+	(is)->is_seqno = 0;						\
+MACRO_END
 
 #define	is_read_lock(is)	lock_read(&(is)->is_lock_data)
 #define is_read_unlock(is)	lock_done(&(is)->is_lock_data)
 
-#define	is_write_lock(is)	lock_write(&(is)->is_lock_data)
-#define	is_write_lock_try(is)	lock_try_write(&(is)->is_lock_data)
-#define is_write_unlock(is)	lock_done(&(is)->is_lock_data)
+/*
+ *	Writers bump the sequence number of the space when they take
+ *	and release the write lock, so that lockless lookups can tell
+ *	whether the space was modified while they looked.
+ */
+#define	is_write_begin(is)						\
+MACRO_BEGIN								\
+	__atomic_store_n(&(is)->is_seqno, (is)->is_seqno + 1,		\
+			 __ATOMIC_RELAXED);				\
+	__atomic_thread_fence(__ATOMIC_RELEASE);			\
+MACRO_END
+
+#define	is_write_end(is)						\
+	__atomic_store_n(&(is)->is_seqno, (is)->is_seqno + 1,		\
+			 __ATOMIC_RELEASE)
+
+#define	is_write_lock(is)						\
+MACRO_BEGIN								\
+	lock_write(&(is)->is_lock_data);				\
+	is_write_begin(is);						\
+MACRO_END
 
-#define	is_write_to_read_lock(is) lock_write_to_read(&(is)->is_lock_data)
+#define	is_write_lock_try(is)						\
+	(lock_try_write(&(is)->is_lock_data) ?				\
+	 ({ is_write_begin(is); TRUE; }) : FALSE)
+
+#define is_write_unlock(is)						\
+MACRO_BEGIN								\
+	is_write_end(is);						\
+	lock_done(&(is)->is_lock_data);					\
+MACRO_END
+
+#define	is_write_to_read_lock(is)					\
+MACRO_BEGIN								\
+	is_write_end(is);						\
+	lock_write_to_read(&(is)->is_lock_data);			\
+MACRO_END
 
 extern void ipc_space_reference(struct ipc_space *space);
 extern void ipc_space_release(struct ipc_space *space);
@@ -157,6 +195,72 @@ ipc_entry_lookup(
 	return entry;
 }
 
+/*
+ *	Routine:	ipc_entry_lookup_lockless
+ *	Purpose:
+ *		Searches for an entry, given its name, without locking
+ *		the space, and locks its object.  Returns FALSE if the
+ *		name doesn't denote an object, or the space was modified
+ *		meanwhile: the caller should then look the entry up
+ *		with the space locked.
+ *	Conditions:
+ *		Nothing locked.  If successful, the object is locked,
+ *		and the bits and object returned are those of the entry
+ *		while the space was not being modified.
+ */
+
+static inline boolean_t
+ipc_entry_lookup_lockless(
+	ipc_space_t	space,
+	mach_port_name_t	name,
+	ipc_entry_bits_t	*bitsp,
+	ipc_object_t	*objectp)
+{
+	ipc_entry_t entry;
+	ipc_entry_bits_t bits;
+	ipc_object_t object;
+	unsigned int seqno;
+
+	llsync_read_enter();
+	seqno = __atomic_load_n(&space->is_seqno, __ATOMIC_ACQUIRE);
+	if ((seqno & 1) || !space->is_active)
+		goto fail;
+
+	entry = rdxtree_lookup(&space->is_map, (rdxtree_key_t) name);
+	if (entry == IE_NULL)
+		goto fail;
+
+	bits = entry->ie_bits;
+	object = entry->ie_object;
+	if (IE_BITS_TYPE(bits) == MACH_PORT_TYPE_NONE || !IO_VALID(object))
+		goto fail;
+
+	/*
+	 *	Only lock an object the space was seen to hold:
+	 *	a new one may not be initialized yet.  Check again
+	 *	once it is locked.
+	 */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&space->is_seqno, __ATOMIC_RELAXED) != seqno)
+		goto fail;
+
+	io_lock(object);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&space->is_seqno, __ATOMIC_RELAXED) != seqno) {
+		io_unlock(object);
+		goto fail;
+	}
+	llsync_read_exit();
+
+	*bitsp = bits;
+	*objectp = object;
+	return TRUE;
+
+fail:
+	llsync_read_exit();
+	return FALSE;
+}
+
 extern volatile boolean_t mach_port_deallocate_debug;
 
 #define ipc_entry_lookup_failed(msg, port_name)				\
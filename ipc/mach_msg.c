@@ -39,11 +39,15 @@
 #include <mach/kern_return.h>
 #include <mach/port.h>
 #include <mach/message.h>
+#include <mach/msg_ring.h>
 #include <kern/assert.h>
+#include <kern/ast.h>
 #include <kern/counters.h>
+#include <kern/cpu_number.h>
 #include <kern/debug.h>
 #include <kern/lock.h>
 #include <kern/printf.h>
+#include <kern/sched.h>
 #include <kern/sched_prim.h>
 #include <kern/ipc_sched.h>
 #include <kern/dtrace.h>
@@ -63,6 +67,7 @@
 #include <ipc/mach_msg.h>
 #include <machine/locore.h>
 #include <machine/pcb.h>
+#include <machine/smp.h>
 //<<<<<<< copilot/fix-116
 #include <kern/perf_analysis.h>
 //=======
@@ -162,34 +167,22 @@ mach_msg_send(
 }
 
 /*
- *	Routine:	mach_msg_receive
+ *	Routine:	mach_msg_receive_prim
  *	Purpose:
- *		Receive a message.
- *	Conditions:
- *		Nothing locked.
- *	Returns:
- *		MACH_MSG_SUCCESS	Received a message.
- *		MACH_RCV_INVALID_NAME	The name doesn't denote a right,
- *			or the denoted right is not receive or port set.
- *		MACH_RCV_IN_SET		Receive right is a member of a set.
- *		MACH_RCV_TOO_LARGE	Message wouldn't fit into buffer.
- *		MACH_RCV_TIMED_OUT	Timeout expired without a message.
- *		MACH_RCV_INTERRUPTED	Reception interrupted.
- *		MACH_RCV_PORT_DIED	Port/set died while receiving.
- *		MACH_RCV_PORT_CHANGED	Port moved into set while receiving.
- *		MACH_RCV_INVALID_DATA	Couldn't copy to user buffer.
- *		MACH_RCV_INVALID_NOTIFY	Bad notify port.
- *		MACH_RCV_HEADER_ERROR
+ *		Receive a message, like mach_msg_receive.  If we
+ *		block, our kernel stack is discarded and we continue
+ *		with continuation, unless it is null.
  */
 
-mach_msg_return_t
-mach_msg_receive(
+static mach_msg_return_t
+mach_msg_receive_prim(
 	mach_msg_user_header_t 	*msg,
 	mach_msg_option_t 	option,
 	mach_msg_size_t 	rcv_size,
 	mach_port_name_t 	rcv_name,
 	mach_msg_timeout_t 	time_out,
-	mach_port_name_t 	notify)
+	mach_port_name_t 	notify,
+	continuation_t		continuation)
 {
 	ipc_thread_t self = current_thread();
 	ipc_space_t space = current_space();
@@ -226,7 +219,7 @@ mach_msg_receive(
 	if (option & MACH_RCV_LARGE) {
 		mr = ipc_mqueue_receive(mqueue, option & MACH_RCV_TIMEOUT,
 					rcv_size, time_out,
-					FALSE, mach_msg_receive_continue,
+					FALSE, continuation,
 					&kmsg, &seqno);
 		/* mqueue is unlocked */
 		ipc_object_release(object);
@@ -250,7 +243,7 @@ mach_msg_receive(
 	} else {
 		mr = ipc_mqueue_receive(mqueue, option & MACH_RCV_TIMEOUT,
 					MACH_MSG_SIZE_MAX, time_out,
-					FALSE, mach_msg_receive_continue,
+					FALSE, continuation,
 					&kmsg, &seqno);
 		/* mqueue is unlocked */
 		ipc_object_release(object);
@@ -287,6 +280,41 @@ mach_msg_receive(
 	return ipc_kmsg_put(msg, kmsg, kmsg->ikm_header.msgh_size);
 }
 
+/*
+ *	Routine:	mach_msg_receive
+ *	Purpose:
+ *		Receive a message.
+ *	Conditions:
+ *		Nothing locked.
+ *	Returns:
+ *		MACH_MSG_SUCCESS	Received a message.
+ *		MACH_RCV_INVALID_NAME	The name doesn't denote a right,
+ *			or the denoted right is not receive or port set.
+ *		MACH_RCV_IN_SET		Receive right is a member of a set.
+ *		MACH_RCV_TOO_LARGE	Message wouldn't fit into buffer.
+ *		MACH_RCV_TIMED_OUT	Timeout expired without a message.
+ *		MACH_RCV_INTERRUPTED	Reception interrupted.
+ *		MACH_RCV_PORT_DIED	Port/set died while receiving.
+ *		MACH_RCV_PORT_CHANGED	Port moved into set while receiving.
+ *		MACH_RCV_INVALID_DATA	Couldn't copy to user buffer.
+ *		MACH_RCV_INVALID_NOTIFY	Bad notify port.
+ *		MACH_RCV_HEADER_ERROR
+ */
+
+mach_msg_return_t
+mach_msg_receive(
+	mach_msg_user_header_t 	*msg,
+	mach_msg_option_t 	option,
+	mach_msg_size_t 	rcv_size,
+	mach_port_name_t 	rcv_name,
+	mach_msg_timeout_t 	time_out,
+	mach_port_name_t 	notify)
+{
+	return mach_msg_receive_prim(msg, option, rcv_size, rcv_name,
+				     time_out, notify,
+				     mach_msg_receive_continue);
+}
+
 /*
  *	Routine:	mach_msg_receive_continue
  *	Purpose:
@@ -486,7 +514,7 @@ mach_msg_trap(
 		    (send_size & 3))
 			goto slow_get;
 
-		kmsg = ikm_cache_alloc_try();
+		kmsg = ikm_cache_alloc_try(send_size * IKM_EXPAND_FACTOR);
 		if (kmsg == IKM_NULL)
 			goto slow_get;
 
@@ -1217,7 +1245,7 @@ mach_msg_trap(
 
 		ikm_check_initialized(kmsg, kmsg->ikm_size);
 
-		if ((kmsg->ikm_size != IKM_SAVED_KMSG_SIZE) ||
+		if ((ikm_cache_class_of(kmsg) < 0) ||
 		    copyoutmsg(&kmsg->ikm_header, msg,
 			       reply_size))
 			goto slow_put;
@@ -1743,3 +1771,177 @@ mach_msg_interrupt(thread_t thread)
 	thread->swap_func = thread_exception_return;
 	return TRUE;
 }
+
+/*
+ *	Routine:	mach_msg_ring_register [mach trap]
+ *	Purpose:
+ *		Register the asynchronous message ring of the current
+ *		thread, replacing the previous one, if any.  A ring
+ *		address of zero unregisters it.
+ *	Conditions:
+ *		Nothing locked.
+ *	Returns:
+ *		KERN_SUCCESS		The ring is registered.
+ *		KERN_INVALID_ARGUMENT	Bad number of entries.
+ *		KERN_INVALID_ADDRESS	Couldn't access the ring.
+ */
+
+kern_return_t
+mach_msg_ring_register(
+	rpc_vm_address_t	ring_addr,
+	natural_t		nentries)
+{
+	thread_t self = current_thread();
+	struct mach_msg_ring *ring;
+	struct mach_msg_ring header;
+
+	self->ith_ring = 0;
+	if (ring_addr == 0)
+		return KERN_SUCCESS;
+
+	if ((nentries == 0) || (nentries > MACH_MSG_RING_MAX) ||
+	    ((nentries & (nentries - 1)) != 0))
+		return KERN_INVALID_ARGUMENT;
+
+	ring = (struct mach_msg_ring *) convert_vm_from_user(ring_addr);
+	if (copyin(ring, &header, sizeof header))
+		return KERN_INVALID_ADDRESS;
+
+	if (header.nentries != nentries)
+		return KERN_INVALID_ARGUMENT;
+
+	/*
+	 *	The kernel keeps its own indexes, so that the task can't
+	 *	make it run a submission twice.  The queues start where
+	 *	the task left them.
+	 */
+
+	self->ith_ring_size = nentries;
+	self->ith_ring_sq_head = header.sq_head;
+	self->ith_ring_cq_tail = header.cq_tail;
+	self->ith_ring = (vm_offset_t) ring;
+	return KERN_SUCCESS;
+}
+
+/*
+ *	Routine:	mach_msg_ring_drain
+ *	Purpose:
+ *		Run the submissions queued up to sq_tail, as long as
+ *		there is room for their completions.  The kernel
+ *		indexes are published after each one, because the
+ *		next one may block.
+ *	Conditions:
+ *		Nothing locked.
+ */
+
+static kern_return_t
+mach_msg_ring_drain(
+	thread_t	self,
+	natural_t	sq_tail,
+	natural_t	cq_head)
+{
+	struct mach_msg_ring *ring = (struct mach_msg_ring *) self->ith_ring;
+	natural_t mask = self->ith_ring_size - 1;
+	struct mach_msg_ring_sqe sqe;
+	struct mach_msg_ring_cqe cqe;
+	mach_msg_user_header_t *msg;
+	mach_msg_return_t mr;
+
+	while ((self->ith_ring_sq_head != sq_tail) &&
+	       (self->ith_ring_cq_tail - cq_head < self->ith_ring_size)) {
+		if (copyin(&MACH_MSG_RING_SQ(ring)[self->ith_ring_sq_head & mask],
+			   &sqe, sizeof sqe))
+			return KERN_INVALID_ADDRESS;
+
+		self->ith_ring_sq_head++;
+		msg = (mach_msg_user_header_t *) convert_vm_from_user(sqe.msg);
+		mr = MACH_MSG_SUCCESS;
+
+		if (sqe.option & MACH_SEND_MSG)
+			mr = mach_msg_send(msg, sqe.option, sqe.send_size,
+					   sqe.timeout, sqe.notify);
+
+		/*
+		 *	We have more submissions to run, so keep our
+		 *	kernel stack if we block.
+		 */
+
+		if ((mr == MACH_MSG_SUCCESS) && (sqe.option & MACH_RCV_MSG))
+			mr = mach_msg_receive_prim(msg, sqe.option,
+						   sqe.rcv_size, sqe.rcv_name,
+						   sqe.timeout, sqe.notify,
+						   thread_no_continuation);
+
+		cqe.user_data = sqe.user_data;
+		cqe.result = mr;
+		if (copyout(&cqe, &MACH_MSG_RING_CQ(ring, self->ith_ring_size)
+					[self->ith_ring_cq_tail & mask],
+			    sizeof cqe))
+			return KERN_INVALID_ADDRESS;
+
+		self->ith_ring_cq_tail++;
+		if (copyout(&self->ith_ring_sq_head, &ring->sq_head,
+			    2 * sizeof(natural_t)))
+			return KERN_INVALID_ADDRESS;
+	}
+
+	return KERN_SUCCESS;
+}
+
+/*
+ *	Routine:	mach_msg_ring_enter [mach trap]
+ *	Purpose:
+ *		Run the operations submitted on the message ring of
+ *		the current thread.  With MACH_MSG_RING_POLL, keep
+ *		polling for submissions until none came poll_spins
+ *		times in a row, or something else needs the processor.
+ *	Conditions:
+ *		Nothing locked.
+ *	Returns:
+ *		KERN_SUCCESS		Completions were posted.
+ *		KERN_FAILURE		The thread has no ring.
+ *		KERN_INVALID_ARGUMENT	Unknown option.
+ *		KERN_INVALID_ADDRESS	Couldn't access the ring.
+ */
+
+kern_return_t
+mach_msg_ring_enter(
+	natural_t	option,
+	natural_t	poll_spins)
+{
+	thread_t self = current_thread();
+	struct mach_msg_ring *ring = (struct mach_msg_ring *) self->ith_ring;
+	natural_t indexes[2];		/* sq_tail, cq_head */
+	natural_t sq_head, spins;
+	kern_return_t kr;
+
+	if (ring == NULL)
+		return KERN_FAILURE;
+
+	if (option & ~MACH_MSG_RING_POLL)
+		return KERN_INVALID_ARGUMENT;
+
+	spins = 0;
+	for (;;) {
+		if (copyin(&ring->sq_tail, indexes, sizeof indexes))
+			return KERN_INVALID_ADDRESS;
+
+		sq_head = self->ith_ring_sq_head;
+		if (indexes[0] != sq_head) {
+			kr = mach_msg_ring_drain(self, indexes[0], indexes[1]);
+			if (kr != KERN_SUCCESS)
+				return kr;
+
+			if (self->ith_ring_sq_head != sq_head)
+				spins = 0;
+		}
+
+		if (!(option & MACH_MSG_RING_POLL) || (spins >= poll_spins) ||
+		    ast_needed(cpu_number()) ||
+		    csw_needed(self, current_processor()))
+			return KERN_SUCCESS;
+
+		spins++;
+		cpu_pause();
+	}
+}
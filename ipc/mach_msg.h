@@ -57,4 +57,10 @@ mach_msg_continue(void);
 extern boolean_t
 mach_msg_interrupt(thread_t);
 
+extern kern_return_t
+mach_msg_ring_register(rpc_vm_address_t, natural_t);
+
+extern kern_return_t
+mach_msg_ring_enter(natural_t, natural_t);
+
 #endif	/* _IPC_MACH_MSG_H_ */
@@ -119,7 +119,6 @@ ast_check(void)
 	int			mycpu = cpu_number();
 	processor_t		myprocessor;
 	thread_t		thread = current_thread();
-	run_queue_t		rq;
 	spl_t			s = splsched();
 
 	/*
@@ -158,70 +157,19 @@ ast_check(void)
 			break;
 
 		/*
-		 *	Context switch check.  The csw_needed macro isn't
-		 *	used here because the rq->low hint may be wrong,
-		 *	and fixing it here avoids an extra ast.
-		 *	First check the easy cases.
+		 *	Context switch check.
 		 */
-		if (thread->state & TH_SUSP || myprocessor->runq.count > 0) {
+		if (csw_needed(thread, myprocessor)) {
 			ast_on(mycpu, AST_BLOCK);
 			break;
 		}
-
+#if	MACH_FIXPRI
 		/*
-		 *	Update lazy evaluated runq->low if only timesharing.
+		 *	For fixed priority threads, set first_quantum
+		 *	so entire new quantum is used.
 		 */
-#if	MACH_FIXPRI
-		if (myprocessor->processor_set->policies & POLICY_FIXEDPRI) {
-		    if (csw_needed(thread,myprocessor)) {
-			ast_on(mycpu, AST_BLOCK);
-			break;
-		    }
-		    else {
-			/*
-			 *	For fixed priority threads, set first_quantum
-			 *	so entire new quantum is used.
-			 */
-			if (thread->policy == POLICY_FIXEDPRI)
-			    myprocessor->first_quantum = TRUE;
-		    }
-		}
-		else {
-#endif	/* MACH_FIXPRI			 */
-		rq = &(myprocessor->processor_set->runq);
-		if (!(myprocessor->first_quantum) && (rq->count > 0)) {
-		    queue_t 		q;
-		    /*
-		     *	This is not the first quantum, and there may
-		     *	be something in the processor_set runq.
-		     *	Check whether low hint is accurate.
-		     */
-		    q = rq->runq + *(volatile int *)&rq->low;
-		    if (queue_empty(q)) {
-			/*
-			 *	Need to recheck and possibly update hint.
-			 */
-			runq_lock(rq);
-			q = rq->runq + rq->low;
-			if (rq->count > 0) {
-			    int i;
-			    for (i = rq->low; i < NRQS; i++) {
-				if(!(queue_empty(q)))
-				    break;
-				q++;
-			    }
-			    rq->low = i;
-			}
-			runq_unlock(rq);
-		    }
-
-		    if (rq->low <= thread->sched_pri) {
-			ast_on(mycpu, AST_BLOCK);
-			break;
-		    }
-		}
-#if	MACH_FIXPRI
-		}
+		if (thread->policy == POLICY_FIXEDPRI)
+			myprocessor->first_quantum = TRUE;
 #endif	/* MACH_FIXPRI */
 		break;
 
@@ -54,7 +54,7 @@
 #define PERF_DEFAULT_PROFILE_INTERVAL_MS 100     /* Default profiling interval in milliseconds */
 
 /* Scheduler constants */
-#define SCHED_WAIT_HASH_SIZE        1031         /* Size of wait event hash table (prime number) */
+#define SCHED_WAIT_HASH_SIZE        1024         /* Minimum size of wait event hash table (power of 2) */
 #define SCHED_CPU_USAGE_RESET_TICKS 30           /* Ticks after which to reset CPU usage stats */
 
 /* Console output constants */
@@ -32,15 +32,27 @@
 #if MACH_DTRACE
 
 #include <mach/time_value.h>
+#include <mach/vm_param.h>
+#include <machine/locore.h>
+#include <machine/proc_reg.h>
+#include <machine/spl.h>
 #include <kern/thread.h>
 #include <kern/task.h>
 #include <kern/cpu_number.h>
+#include <kern/host.h>
 #include <kern/kalloc.h>
 #include <kern/sched_prim.h>
 #include <kern/printf.h>
 #include <kern/mach_clock.h>
+#include <kern/mach_debug.server.h>
+#include <kern/smp.h>
+#include <vm/vm_kern.h>
+#include <vm/vm_map.h>
+#include <util/atoi.h>
 #include <string.h>
 
+extern char *kernel_cmdline;
+
 /*
  * Global DTrace state
  */
@@ -51,6 +63,163 @@ static dtrace_state_t dtrace_state;
  */
 #define DTRACE_MAX_PROBES 512
 
+/*
+ * The TSC is calibrated against the clock interrupt, from the start
+ * of tracing on.  The estimate gets better as the system stays up;
+ * after DTRACE_CALIBRATE_MAX nanoseconds it is left alone, which
+ * also keeps the computation from overflowing.
+ */
+#define DTRACE_CALIBRATE_MIN_TICKS  10
+#define DTRACE_CALIBRATE_MAX        (1ULL << (64 - DTRACE_TSC_SHIFT - 1))
+
+/*
+ * Where the kernel reader stands in a ring
+ */
+struct dtrace_reader {
+    uint32_t        pos;            /* Next event to read */
+    boolean_t       valid;          /* Next holds that event */
+    dtrace_event_t  next;           /* Copy of that event */
+};
+
+static inline dtrace_ring_t *
+dtrace_ring(uint32_t cpu)
+{
+    dtrace_ring_header_t *hdr = dtrace_state.rings;
+
+    return (dtrace_ring_t *)((vm_offset_t)hdr + hdr->ring_offset
+                             + cpu * hdr->ring_stride);
+}
+
+/*
+ * Current timestamp, in the unit of the rings
+ */
+static inline uint64_t
+dtrace_timestamp(void)
+{
+    if (dtrace_state.have_tsc) {
+        return get_tsc();
+    }
+    
+    return (uint64_t)elapsed_ticks * tick * 1000;
+}
+
+/*
+ * Convert a ring timestamp to nanoseconds since boot
+ */
+static uint64_t
+dtrace_timestamp_to_ns(uint64_t ts)
+{
+    dtrace_ring_header_t *hdr = dtrace_state.rings;
+    uint64_t delta = ts - hdr->tsc_base;
+    
+    /* Split the product so that it fits in 64 bits */
+    return hdr->ns_base
+           + (((delta >> 32) * hdr->tsc_mult) << (32 - DTRACE_TSC_SHIFT))
+           + (((delta & 0xffffffff) * hdr->tsc_mult) >> DTRACE_TSC_SHIFT);
+}
+
+/*
+ * Refine the TSC rate from the ticks elapsed since tracing started
+ */
+static void
+dtrace_tsc_calibrate(void)
+{
+    dtrace_ring_header_t *hdr = dtrace_state.rings;
+    unsigned long ticks;
+    uint64_t ns, tsc;
+    
+    if (!dtrace_state.have_tsc) {
+        return;
+    }
+    
+    ticks = elapsed_ticks - dtrace_state.ticks_base;
+    ns = (uint64_t)ticks * tick * 1000;
+    if (ticks < DTRACE_CALIBRATE_MIN_TICKS
+        || (ns >= DTRACE_CALIBRATE_MAX && hdr->tsc_mult != 0)) {
+        return;
+    }
+    
+    tsc = get_tsc() - hdr->tsc_base;
+    if (tsc != 0) {
+        hdr->tsc_mult = (ns << DTRACE_TSC_SHIFT) / tsc;
+    }
+}
+
+/*
+ * Allocate the event rings, one per processor.  The size of the rings
+ * can be set with dtrace_events=N on the kernel command line.
+ */
+static void
+dtrace_rings_init(void)
+{
+    dtrace_ring_header_t *hdr;
+    vm_offset_t addr;
+    vm_size_t stride, size;
+    uint32_t events, nrings, i;
+    const char *arg;
+    int n;
+    
+    events = DTRACE_RING_EVENTS;
+    arg = strstr(kernel_cmdline, "dtrace_events=");
+    if (arg != NULL) {
+        n = MACH_ATOI_DEFAULT;
+        mach_atoi((const u_char *)arg + strlen("dtrace_events="), &n);
+        if (n > 0) {
+            events = n;
+        }
+    }
+    
+    /* Round up to a power of two, so that positions wrap cleanly */
+    while (events & (events - 1)) {
+        events = (events | (events - 1)) + 1;
+    }
+    
+    nrings = smp_get_numcpus();
+    stride = round_page(sizeof(dtrace_ring_t)
+                        + events * sizeof(dtrace_event_t));
+    size = round_page(sizeof(dtrace_ring_header_t)) + nrings * stride;
+    
+    if (kmem_alloc_wired(kernel_map, &addr, size) != KERN_SUCCESS) {
+        printf("dtrace_init: failed to allocate event rings\n");
+        return;
+    }
+    memset((void *)addr, 0, size);
+    
+    dtrace_state.readers = (struct dtrace_reader *)
+        kalloc(nrings * sizeof(struct dtrace_reader));
+    if (dtrace_state.readers == NULL) {
+        printf("dtrace_init: failed to allocate event rings\n");
+        kmem_free(kernel_map, addr, size);
+        return;
+    }
+    memset(dtrace_state.readers, 0, nrings * sizeof(struct dtrace_reader));
+    
+    hdr = (dtrace_ring_header_t *)addr;
+    hdr->magic = DTRACE_RING_MAGIC;
+    hdr->version = DTRACE_RING_VERSION;
+    hdr->nrings = nrings;
+    hdr->ring_events = events;
+    hdr->ring_offset = round_page(sizeof(dtrace_ring_header_t));
+    hdr->ring_stride = stride;
+    
+    dtrace_state.have_tsc = CPU_HAS_FEATURE(CPU_FEATURE_TSC);
+    dtrace_state.ticks_base = elapsed_ticks;
+    hdr->ns_base = (uint64_t)elapsed_ticks * tick * 1000;
+    if (dtrace_state.have_tsc) {
+        hdr->tsc_base = get_tsc();
+    } else {
+        /* Timestamps are nanoseconds already */
+        hdr->tsc_base = hdr->ns_base;
+        hdr->tsc_mult = 1ULL << DTRACE_TSC_SHIFT;
+    }
+    
+    dtrace_state.rings = hdr;
+    dtrace_state.rings_size = size;
+    for (i = 0; i < nrings; i++) {
+        dtrace_ring(i)->cpu = i;
+    }
+}
+
 /*
  * Initialize the DTrace subsystem
  */
@@ -75,13 +244,10 @@ dtrace_init(void)
     
     /* Initialize locks */
     simple_lock_init_irq(&dtrace_state.probe_lock);
-    simple_lock_init_irq(&dtrace_state.buffer.lock);
+    simple_lock_init_irq(&dtrace_state.read_lock);
     
-    /* Initialize buffer */
-    dtrace_state.buffer.head = 0;
-    dtrace_state.buffer.tail = 0;
-    dtrace_state.buffer.count = 0;
-    dtrace_state.buffer.overruns = 0;
+    /* Allocate the event rings */
+    dtrace_rings_init();
     
     /* Initialize metrics */
     dtrace_state.metrics.max_probes = DTRACE_MAX_PROBES;
@@ -104,6 +270,11 @@ dtrace_init(void)
     
     printf("DTrace instrumentation framework initialized (%d probes max)\n",
            DTRACE_MAX_PROBES);
+    if (dtrace_state.rings != NULL) {
+        printf("DTrace event rings: %u x %u events, %s timestamps\n",
+               dtrace_state.rings->nrings, dtrace_state.rings->ring_events,
+               dtrace_state.have_tsc ? "TSC" : "clock tick");
+    }
     printf("Default probes registered: thread_switch, ipc_send, vm_fault\n");
 }
 
@@ -268,6 +439,10 @@ dtrace_probe_remove(uint32_t probe_id)
 
 /*
  * Fire a probe (core instrumentation function)
+ *
+ * The event goes to the ring of the current processor.  Only this
+ * processor writes to it, and interrupts are off meanwhile, so no
+ * lock is needed; head is advanced once the event is complete.
  */
 void
 dtrace_probe_fire(dtrace_probe_type_t type, const char *name,
@@ -275,19 +450,20 @@ dtrace_probe_fire(dtrace_probe_type_t type, const char *name,
                  uint64_t arg3, uint64_t arg4, uint64_t arg5)
 {
     spl_t s;
+    dtrace_ring_t *ring;
     dtrace_event_t *event;
     dtrace_probe_t *probe = NULL;
     uint64_t start_time, end_time;
+    uint32_t head, cpu;
     thread_t thread;
     task_t task;
     
     /* Quick check if DTrace is enabled globally */
-    if (!dtrace_state.enabled || !dtrace_state.probes) {
+    if (!dtrace_state.enabled || !dtrace_state.probes
+        || !dtrace_state.rings) {
         return;
     }
     
-    start_time = dtrace_gethrtime();
-    
     /* Find the probe by type and name */
     for (uint32_t i = 1; i < dtrace_state.max_probes; i++) {
         if (dtrace_state.probes[i].id == i &&
@@ -304,42 +480,39 @@ dtrace_probe_fire(dtrace_probe_type_t type, const char *name,
         return; /* No matching enabled probe */
     }
     
-    /* Update probe statistics */
-    probe->fire_count++;
-    dtrace_state.metrics.total_probes_fired++;
-    
     /* Get current context */
     thread = current_thread();
     task = (thread != THREAD_NULL) ? thread->task : TASK_NULL;
     
-    /* Add event to buffer */
-    s = simple_lock_irq(&dtrace_state.buffer.lock);
+    s = splhigh();
     
-    if (dtrace_state.buffer.count < DTRACE_BUFFER_SIZE) {
-        event = &dtrace_state.buffer.events[dtrace_state.buffer.head];
-        
-        event->probe_id = probe->id;
-        event->timestamp = start_time;
-        event->cpu_id = cpu_number();
-        event->thread_id = (thread != THREAD_NULL) ? (uint32_t)(uintptr_t)thread : 0;
-        event->task_id = (task != TASK_NULL) ? (uint32_t)(uintptr_t)task : 0;
-        event->args[0] = arg0;
-        event->args[1] = arg1;
-        event->args[2] = arg2;
-        event->args[3] = arg3;
-        event->args[4] = arg4;
-        event->args[5] = arg5;
-        
-        dtrace_state.buffer.head = (dtrace_state.buffer.head + 1) % DTRACE_BUFFER_SIZE;
-        dtrace_state.buffer.count++;
-        dtrace_state.metrics.total_events_captured++;
-    } else {
-        /* Buffer is full, record overrun */
-        dtrace_state.buffer.overruns++;
-        dtrace_state.metrics.buffer_overruns++;
+    cpu = cpu_number();
+    if (cpu >= dtrace_state.rings->nrings) {
+        splx(s);
+        return;
     }
-    
-    simple_unlock_irq(s, &dtrace_state.buffer.lock);
+    ring = dtrace_ring(cpu);
+    start_time = dtrace_timestamp();
+    
+    head = ring->head;
+    event = &ring->events[head & (dtrace_state.rings->ring_events - 1)];
+    event->probe_id = probe->id;
+    event->timestamp = start_time;
+    event->cpu_id = cpu;
+    event->thread_id = (thread != THREAD_NULL) ? (uint32_t)(uintptr_t)thread : 0;
+    event->task_id = (task != TASK_NULL) ? (uint32_t)(uintptr_t)task : 0;
+    event->args[0] = arg0;
+    event->args[1] = arg1;
+    event->args[2] = arg2;
+    event->args[3] = arg3;
+    event->args[4] = arg4;
+    event->args[5] = arg5;
+    
+    /* Publish the event */
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    ring->fired++;
+    
+    splx(s);
     
     /* Call probe handler if present */
     if (probe->handler) {
@@ -347,52 +520,164 @@ dtrace_probe_fire(dtrace_probe_type_t type, const char *name,
         handler(probe, arg0, arg1, arg2, arg3, arg4, arg5);
     }
     
-    /* Update timing statistics */
-    end_time = dtrace_gethrtime();
-    probe->total_time += (end_time - start_time);
-    dtrace_state.metrics.probe_overhead_ns += (end_time - start_time);
+    /* Update timing statistics, in ring time units until reported */
+    s = splhigh();
+    end_time = dtrace_timestamp();
+    cpu = cpu_number();
+    if (cpu < dtrace_state.rings->nrings) {
+        dtrace_ring(cpu)->overhead += end_time - start_time;
+    }
+    splx(s);
+    probe->total_time += end_time - start_time;
+    probe->fire_count++;
+}
+
+/*
+ * Copy the next event of a ring for the reader, unless the writer
+ * overwrote it meanwhile.  Events the ring lost are skipped and
+ * counted.  The reader lock must be held.
+ */
+static void
+dtrace_ring_peek(uint32_t cpu)
+{
+    dtrace_ring_t *ring = dtrace_ring(cpu);
+    struct dtrace_reader *reader = &dtrace_state.readers[cpu];
+    uint32_t size = dtrace_state.rings->ring_events;
+    uint32_t head;
+    
+    for (;;) {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head == reader->pos) {
+            reader->valid = FALSE;
+            return;
+        }
+        
+        /* The slot written next holds the oldest event, it is gone */
+        if (head - reader->pos >= size) {
+            dtrace_state.read_lost += head - reader->pos - (size - 1);
+            reader->pos = head - (size - 1);
+        }
+        
+        reader->next = ring->events[reader->pos & (size - 1)];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        
+        /* Keep the copy only if the writer did not reach the slot */
+        head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        if (head - reader->pos < size) {
+            reader->valid = TRUE;
+            return;
+        }
+    }
 }
 
 /*
- * Read events from the buffer
+ * Read events from the rings
+ *
+ * The rings are merged on the fly: each event returned is the oldest
+ * unread one of all processors.  Timestamps are converted to
+ * nanoseconds since boot.
  */
 uint32_t
 dtrace_buffer_read(dtrace_event_t *events, uint32_t max_events)
 {
     spl_t s;
+    struct dtrace_reader *reader, *best;
     uint32_t count = 0;
+    uint32_t nrings, i;
     
-    if (!events || max_events == 0) {
+    if (!events || max_events == 0 || !dtrace_state.rings) {
         return 0;
     }
     
-    s = simple_lock_irq(&dtrace_state.buffer.lock);
+    s = simple_lock_irq(&dtrace_state.read_lock);
+    
+    dtrace_tsc_calibrate();
+    nrings = dtrace_state.rings->nrings;
+    for (i = 0; i < nrings; i++) {
+        dtrace_ring_peek(i);
+    }
     
-    while (count < max_events && dtrace_state.buffer.count > 0) {
-        events[count] = dtrace_state.buffer.events[dtrace_state.buffer.tail];
-        dtrace_state.buffer.tail = (dtrace_state.buffer.tail + 1) % DTRACE_BUFFER_SIZE;
-        dtrace_state.buffer.count--;
+    while (count < max_events) {
+        best = NULL;
+        for (i = 0; i < nrings; i++) {
+            reader = &dtrace_state.readers[i];
+            if (reader->valid && (best == NULL
+                || reader->next.timestamp < best->next.timestamp)) {
+                best = reader;
+            }
+        }
+        if (best == NULL) {
+            break;
+        }
+        
+        events[count] = best->next;
+        events[count].timestamp = dtrace_timestamp_to_ns(best->next.timestamp);
         count++;
+        
+        best->pos++;
+        dtrace_ring_peek(best - dtrace_state.readers);
     }
     
-    simple_unlock_irq(s, &dtrace_state.buffer.lock);
+    simple_unlock_irq(s, &dtrace_state.read_lock);
     
     return count;
 }
 
 /*
- * Clear the event buffer
+ * Clear the event buffer, i.e. skip all events not read yet
  */
 void
 dtrace_buffer_clear(void)
 {
     spl_t s;
+    uint32_t i;
+    
+    if (!dtrace_state.rings) {
+        return;
+    }
+    
+    s = simple_lock_irq(&dtrace_state.read_lock);
+    for (i = 0; i < dtrace_state.rings->nrings; i++) {
+        dtrace_state.readers[i].pos =
+            __atomic_load_n(&dtrace_ring(i)->head, __ATOMIC_ACQUIRE);
+        dtrace_state.readers[i].valid = FALSE;
+    }
+    simple_unlock_irq(s, &dtrace_state.read_lock);
+}
+
+/*
+ * Map the event rings read-only into a task
+ */
+kern_return_t
+host_dtrace_map(host_t host, vm_map_t map,
+                vm_offset_t *addr, vm_size_t *size)
+{
+    kern_return_t kr;
+    spl_t s;
+    
+    if (host == HOST_NULL) {
+        return KERN_INVALID_HOST;
+    }
+    if (map == VM_MAP_NULL) {
+        return KERN_INVALID_TASK;
+    }
+    if (!dtrace_state.rings) {
+        return KERN_RESOURCE_SHORTAGE;
+    }
+    
+    /* Give the reader a rate to start with */
+    s = simple_lock_irq(&dtrace_state.read_lock);
+    dtrace_tsc_calibrate();
+    simple_unlock_irq(s, &dtrace_state.read_lock);
+    
+    kr = projected_buffer_map(map, (vm_offset_t)dtrace_state.rings,
+                              dtrace_state.rings_size, addr,
+                              VM_PROT_READ, VM_INHERIT_NONE);
+    if (kr == KERN_SUCCESS) {
+        *size = dtrace_state.rings_size;
+    }
     
-    s = simple_lock_irq(&dtrace_state.buffer.lock);
-    dtrace_state.buffer.head = 0;
-    dtrace_state.buffer.tail = 0;
-    dtrace_state.buffer.count = 0;
-    simple_unlock_irq(s, &dtrace_state.buffer.lock);
+    return kr;
 }
 
 /*
@@ -401,9 +686,34 @@ dtrace_buffer_clear(void)
 void
 dtrace_get_metrics(dtrace_metrics_t *metrics)
 {
-    if (metrics) {
-        *metrics = dtrace_state.metrics;
+    dtrace_ring_t *ring;
+    uint64_t overhead = 0;
+    spl_t s;
+    uint32_t i;
+    
+    if (!metrics) {
+        return;
     }
+    
+    *metrics = dtrace_state.metrics;
+    if (!dtrace_state.rings) {
+        return;
+    }
+    
+    /* Rings never refuse events, they lose them to readers lagging */
+    s = simple_lock_irq(&dtrace_state.read_lock);
+    dtrace_tsc_calibrate();
+    metrics->total_probes_fired = 0;
+    for (i = 0; i < dtrace_state.rings->nrings; i++) {
+        ring = dtrace_ring(i);
+        metrics->total_probes_fired += ring->fired;
+        overhead += ring->overhead;
+    }
+    metrics->total_events_captured = metrics->total_probes_fired;
+    metrics->buffer_overruns = dtrace_state.read_lost;
+    metrics->probe_overhead_ns = dtrace_timestamp_to_ns(
+        dtrace_state.rings->tsc_base + overhead) - dtrace_state.rings->ns_base;
+    simple_unlock_irq(s, &dtrace_state.read_lock);
 }
 
 /*
@@ -434,6 +744,11 @@ dtrace_get_probe_info(uint32_t index, dtrace_probe_t *probe_info)
         *probe_info = dtrace_state.probes[index];
         /* Don't copy the handler pointer for security */
         probe_info->handler = NULL;
+        if (dtrace_state.rings) {
+            probe_info->total_time = dtrace_timestamp_to_ns(
+                dtrace_state.rings->tsc_base + probe_info->total_time)
+                - dtrace_state.rings->ns_base;
+        }
         result = TRUE;
     }
     
@@ -469,4 +784,17 @@ dtrace_is_enabled(void)
     return dtrace_state.enabled;
 }
 
+#else /* !MACH_DTRACE */
+
+#include <kern/host.h>
+#include <kern/mach_debug.server.h>
+#include <vm/vm_map.h>
+
+kern_return_t
+host_dtrace_map(host_t host, vm_map_t map,
+                vm_offset_t *addr, vm_size_t *size)
+{
+    return KERN_FAILURE;
+}
+
 #endif /* MACH_DTRACE */
\ No newline at end of file
@@ -82,7 +82,7 @@ typedef struct dtrace_probe {
  */
 typedef struct dtrace_event {
     uint32_t    probe_id;       /* Which probe fired */
-    uint64_t    timestamp;      /* When it fired (nanoseconds) */
+    uint64_t    timestamp;      /* When it fired (TSC in rings, ns once read) */
     uint32_t    cpu_id;         /* Which CPU */
     uint32_t    thread_id;      /* Which thread */
     uint32_t    task_id;        /* Which task */
@@ -90,17 +90,49 @@ typedef struct dtrace_event {
 } dtrace_event_t;
 
 /*
- * Circular buffer for storing events
+ * Per-processor event rings
+ *
+ * Each processor logs its events into a ring of its own without
+ * taking any lock: the processor is the only writer, and it writes
+ * with interrupts off.  Writers never wait for readers.  A full ring
+ * overwrites its oldest events, and a reader tells from head how far
+ * it fell behind.  Readers keep their own positions, so that the
+ * rings can be mapped read-only into user tasks by host_dtrace_map().
+ *
+ * The mapping starts with a dtrace_ring_header, followed by nrings
+ * rings of ring_events events each.  Ring I is at ring_offset +
+ * I * ring_stride from the header.  Event timestamps are raw TSC
+ * values; they convert to nanoseconds since boot as
+ *
+ *	ns_base + ((timestamp - tsc_base) * tsc_mult >> DTRACE_TSC_SHIFT)
+ *
+ * tsc_mult is zero until the kernel has calibrated the TSC.
  */
-#define DTRACE_BUFFER_SIZE 1024
-typedef struct dtrace_buffer {
-    dtrace_event_t   events[DTRACE_BUFFER_SIZE];
-    uint32_t         head;          /* Next write position */
-    uint32_t         tail;          /* Next read position */
-    uint32_t         count;         /* Number of events */
-    uint32_t         overruns;      /* Number of buffer overruns */
-    simple_lock_irq_data_t lock;    /* Buffer lock */
-} dtrace_buffer_t;
+#define DTRACE_RING_EVENTS   4096        /* Default events per ring */
+#define DTRACE_RING_MAGIC    0x44545243  /* "DTRC" */
+#define DTRACE_RING_VERSION  1
+#define DTRACE_TSC_SHIFT     24
+
+typedef struct dtrace_ring_header {
+    uint32_t    magic;          /* DTRACE_RING_MAGIC */
+    uint32_t    version;        /* DTRACE_RING_VERSION */
+    uint32_t    nrings;         /* Number of rings, one per processor */
+    uint32_t    ring_events;    /* Events per ring, a power of two */
+    uint32_t    ring_offset;    /* Offset of the first ring */
+    uint32_t    ring_stride;    /* Distance between two rings */
+    uint64_t    tsc_base;       /* TSC when tracing started */
+    uint64_t    tsc_mult;       /* Nanoseconds per TSC tick, fixed point */
+    uint64_t    ns_base;        /* Uptime when tracing started (ns) */
+} dtrace_ring_header_t;
+
+typedef struct dtrace_ring {
+    volatile uint32_t head;     /* Number of events ever written */
+    uint32_t    cpu;            /* Processor writing this ring */
+    uint64_t    fired;          /* Probes fired on this processor */
+    uint64_t    overhead;       /* TSC ticks spent firing probes */
+    uint64_t    reserved[5];    /* Keep events cache line aligned */
+    dtrace_event_t events[0];   /* Ring entries */
+} dtrace_ring_t;
 
 /*
  * Performance metrics
@@ -121,7 +153,13 @@ typedef struct dtrace_state {
     dtrace_probe_t     *probes;         /* Array of probes */
     uint32_t            probe_count;    /* Number of registered probes */
     uint32_t            max_probes;     /* Maximum number of probes */
-    dtrace_buffer_t     buffer;         /* Event buffer */
+    dtrace_ring_header_t *rings;        /* Per-processor event rings */
+    vm_size_t           rings_size;     /* Size of the ring area */
+    boolean_t           have_tsc;       /* Timestamps come from the TSC */
+    unsigned long       ticks_base;     /* Clock ticks at tsc_base */
+    struct dtrace_reader *readers;      /* Kernel reader state per ring */
+    uint64_t            read_lost;      /* Events overwritten before read */
+    simple_lock_irq_data_t read_lock;   /* Kernel reader lock */
     dtrace_metrics_t    metrics;        /* Performance metrics */
     boolean_t           enabled;        /* Global enable/disable */
     simple_lock_irq_data_t probe_lock;  /* Probe table lock */
@@ -319,7 +319,6 @@ simpler_thread_setrun(
 	boolean_t	may_preempt)
 {
 	struct run_queue	*rq;
-	int			whichq;
 
 	/*
 	 *	XXX should replace queue with a boolean in this case.
@@ -338,19 +337,7 @@ simpler_thread_setrun(
 	rq = &(master_processor->runq);
 	ast_on(cpu_number(), AST_BLOCK);
 
-	whichq = (th)->sched_pri;
-	runq_lock(rq);	/* lock the run queue */
-	enqueue_head(&(rq)->runq[whichq], &((th)->links));
-
-	if (whichq < (rq)->low || (rq)->count == 0)
-		 (rq)->low = whichq;	/* minimize */
-	(rq)->count++;
-#ifdef MIGRATING_THREADS
-	(th)->shuttle.runq = (rq);
-#else
-	(th)->runq = (rq);
-#endif
-	runq_unlock(rq);
+	run_queue_enqueue_head(rq, th);
 
 	/*
 	 *	Turn off first_quantum to allow context switch.
@@ -367,7 +367,7 @@ exception_raise(
 	 *	and it will give the buffer back with its reply.
 	 */
 
-	kmsg = ikm_cache_alloc();
+	kmsg = ikm_cache_alloc(IKM_SAVED_MSG_SIZE);
 	if (kmsg == IKM_NULL)
 		panic("exception_raise");
 
@@ -33,7 +33,9 @@
  *	Functions for letting a port represent a kernel object.
  */
 
+#include <string.h>
 #include <kern/debug.h>
+#include <kern/kalloc.h>
 #include <kern/printf.h>
 #include <mach/port.h>
 #include <mach/kern_return.h>
@@ -49,6 +51,8 @@
 #include <vm/memory_object_proxy.h>
 #include <device/ds_routines.h>
 #include <kern/constants.h>
+#include <machine/locore.h>
+#include <machine/proc_reg.h>
 
 #include <kern/mach.server.h>
 #include <ipc/mach_port.server.h>
@@ -68,6 +72,198 @@
 #include MACHINE_SERVER_HEADER
 #endif
 
+#if	MACH_DEBUG
+#include <mach/host_info.h>
+#include <mach_debug/ipc_kobject_info.h>
+#include <kern/host.h>
+#include <vm/vm_kern.h>
+#include <vm/vm_map.h>
+#include <ipc/ipc_space.h>
+#endif
+
+/*
+ *	Kernel server subsystems, in lookup order.  The base is the
+ *	message id given in the subsystem statement of the .defs file.
+ */
+struct ipc_kobject_subsystem {
+	mig_routine_t	(*server_routine)(const mach_msg_header_t *);
+	mach_msg_id_t	base;
+};
+
+static const struct ipc_kobject_subsystem ipc_kobject_subsystems[] = {
+	{ mach_server_routine,		2000 },
+	{ mach_port_server_routine,	3200 },
+	{ mach_host_server_routine,	2600 },
+	{ device_server_routine,	2800 },
+	{ device_pager_server_routine,	2200 },
+#if	MACH_DEBUG
+	{ mach_debug_server_routine,	3000 },
+#endif	/* MACH_DEBUG */
+	{ mach4_server_routine,		4000 },
+	{ gnumach_server_routine,	4200 },
+	{ experimental_server_routine,	424242 },
+#if	MACH_MACHINE_ROUTINES
+	{ MACHINE_SERVER_ROUTINE,	3800 },
+#endif	/* MACH_MACHINE_ROUTINES */
+};
+
+#define IPC_KOBJECT_NSUBSYSTEMS \
+	(sizeof ipc_kobject_subsystems / sizeof ipc_kobject_subsystems[0])
+
+/* Number of message ids probed from the base of each subsystem.  */
+#define IPC_KOBJECT_SUBSYSTEM_SPAN	200
+
+/*
+ *	Dispatch table, directly indexed by message id for the
+ *	range covering the standard subsystems.  Routines with an
+ *	id outside of it (the experimental interface) are kept in
+ *	a short list searched linearly.
+ */
+#define IPC_KOBJECT_ID_MIN	2000
+#define IPC_KOBJECT_ID_MAX	4400
+
+struct ipc_kobject_routine {
+	mig_routine_t	routine;
+	mach_msg_id_t	id;
+	uint64_t	calls;
+	uint64_t	cycles;
+	uint64_t	hist[IKRI_HIST_BUCKETS];
+};
+
+static struct ipc_kobject_routine
+	*ipc_kobject_table[IPC_KOBJECT_ID_MAX - IPC_KOBJECT_ID_MIN];
+static struct ipc_kobject_routine *ipc_kobject_routines;
+static unsigned int ipc_kobject_nroutines;
+static unsigned int ipc_kobject_nextra;	/* at the end of the array */
+static boolean_t ipc_kobject_have_tsc;
+
+static mig_routine_t
+ipc_kobject_probe(mach_msg_id_t id)
+{
+	mach_msg_header_t header;
+	mig_routine_t routine;
+	unsigned int i;
+
+	memset(&header, 0, sizeof header);
+	header.msgh_id = id;
+
+	for (i = 0; i < IPC_KOBJECT_NSUBSYSTEMS; i++) {
+		routine = ipc_kobject_subsystems[i].server_routine(&header);
+		if (routine != 0)
+			return routine;
+	}
+
+	return 0;
+}
+
+/*
+ *	Record the routines handling ids in [start, end) into R,
+ *	if not null, and return how many were found.
+ */
+static unsigned int
+ipc_kobject_scan(struct ipc_kobject_routine *r,
+		 mach_msg_id_t start, mach_msg_id_t end)
+{
+	mig_routine_t routine;
+	mach_msg_id_t id;
+	unsigned int n;
+
+	for (n = 0, id = start; id < end; id++) {
+		routine = ipc_kobject_probe(id);
+		if (routine == 0)
+			continue;
+		if (r != NULL) {
+			r[n].routine = routine;
+			r[n].id = id;
+		}
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ *	Routine:	ipc_kobject_init
+ *	Purpose:
+ *		Build the kernel server dispatch table, by asking
+ *		the subsystems which message ids they handle.
+ *		Until then, requests are dispatched by asking
+ *		the subsystems in turn.
+ */
+
+void
+ipc_kobject_init(void)
+{
+	struct ipc_kobject_routine *r;
+	mach_msg_id_t base;
+	unsigned int i, n, pass;
+
+	ipc_kobject_have_tsc = CPU_HAS_FEATURE(CPU_FEATURE_TSC);
+
+	/* First count the routines, then record them. */
+	r = NULL;
+	for (pass = 0; pass < 2; pass++) {
+		n = ipc_kobject_scan(r, IPC_KOBJECT_ID_MIN, IPC_KOBJECT_ID_MAX);
+		for (i = 0; i < IPC_KOBJECT_NSUBSYSTEMS; i++) {
+			base = ipc_kobject_subsystems[i].base;
+			if ((base >= IPC_KOBJECT_ID_MIN)
+			    && (base < IPC_KOBJECT_ID_MAX))
+				continue;
+			n += ipc_kobject_scan(r == NULL ? NULL : &r[n], base,
+					      base + IPC_KOBJECT_SUBSYSTEM_SPAN);
+		}
+
+		if (r == NULL) {
+			r = (struct ipc_kobject_routine *) kalloc(n * sizeof *r);
+			if (r == NULL)
+				panic("ipc_kobject_init");
+			memset(r, 0, n * sizeof *r);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if ((r[i].id >= IPC_KOBJECT_ID_MIN)
+		    && (r[i].id < IPC_KOBJECT_ID_MAX))
+			ipc_kobject_table[r[i].id - IPC_KOBJECT_ID_MIN] = &r[i];
+		else
+			ipc_kobject_nextra++;
+	}
+
+	ipc_kobject_routines = r;
+	ipc_kobject_nroutines = n;
+}
+
+static struct ipc_kobject_routine *
+ipc_kobject_lookup(mach_msg_id_t id)
+{
+	struct ipc_kobject_routine *r;
+	unsigned int i;
+
+	if ((id >= IPC_KOBJECT_ID_MIN) && (id < IPC_KOBJECT_ID_MAX))
+		return ipc_kobject_table[id - IPC_KOBJECT_ID_MIN];
+
+	r = &ipc_kobject_routines[ipc_kobject_nroutines - ipc_kobject_nextra];
+	for (i = 0; i < ipc_kobject_nextra; i++)
+		if (r[i].id == id)
+			return &r[i];
+
+	return NULL;
+}
+
+static void
+ipc_kobject_account(struct ipc_kobject_routine *r, uint64_t cycles)
+{
+	unsigned int bucket;
+
+	for (bucket = 0; bucket < IKRI_HIST_BUCKETS - 1; bucket++)
+		if (cycles < (1ULL << (IKRI_HIST_SHIFT + bucket)))
+			break;
+
+	__atomic_add_fetch(&r->calls, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&r->cycles, cycles, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&r->hist[bucket], 1, __ATOMIC_RELAXED);
+}
+
 
 /*
  *	Routine:	ipc_kobject_server
@@ -84,6 +280,7 @@ ipc_kobject_server(ipc_kmsg_t request)
 	mach_msg_size_t reply_size = ikm_less_overhead(IPC_REPLY_SIZE_DEFAULT);
 	ipc_kmsg_t reply;
 	kern_return_t kr;
+	struct ipc_kobject_routine *entry;
 	mig_routine_t routine;
 	ipc_port_t *destp;
 
@@ -162,21 +359,17 @@ ipc_kobject_server(ipc_kmsg_t request)
 	 */
     {
 	check_simple_locks();
-	if ((routine = mach_server_routine(&request->ikm_header)) != 0
-	 || (routine = mach_port_server_routine(&request->ikm_header)) != 0
-	 || (routine = mach_host_server_routine(&request->ikm_header)) != 0
-	 || (routine = device_server_routine(&request->ikm_header)) != 0
-	 || (routine = device_pager_server_routine(&request->ikm_header)) != 0
-#if	MACH_DEBUG
-	 || (routine = mach_debug_server_routine(&request->ikm_header)) != 0
-#endif	/* MACH_DEBUG */
-	 || (routine = mach4_server_routine(&request->ikm_header)) != 0
-	 || (routine = gnumach_server_routine(&request->ikm_header)) != 0
-	 || (routine = experimental_server_routine(&request->ikm_header)) != 0
-#if	MACH_MACHINE_ROUTINES
-	 || (routine = MACHINE_SERVER_ROUTINE(&request->ikm_header)) != 0
-#endif	/* MACH_MACHINE_ROUTINES */
-	) {
+	entry = ipc_kobject_lookup(request->ikm_header.msgh_id);
+	if (entry != NULL) {
+	    uint64_t start = ipc_kobject_have_tsc ? get_tsc() : 0;
+
+	    (*entry->routine)(&request->ikm_header, &reply->ikm_header);
+	    ipc_kobject_account(entry,
+				ipc_kobject_have_tsc ? get_tsc() - start : 0);
+	    kernel_task->messages_received++;
+	} else if ((ipc_kobject_routines == NULL)
+		   && ((routine = ipc_kobject_probe(
+				request->ikm_header.msgh_id)) != 0)) {
 	    (*routine)(&request->ikm_header, &reply->ikm_header);
 	    kernel_task->messages_received++;
 	} else {
@@ -364,3 +557,83 @@ ipc_kobject_notify(mach_msg_header_t *request_header,
 		return FALSE;
 	}
 }
+
+#if	MACH_DEBUG
+/*
+ *	Routine:	host_ipc_kobject_info [kernel call]
+ *	Purpose:
+ *		Return the statistics of the kernel server routines.
+ *	Conditions:
+ *		Nothing locked.  Obeys CountInOut protocol.
+ *	Returns:
+ *		KERN_SUCCESS		Returned information.
+ *		KERN_INVALID_HOST	The host is null.
+ *		KERN_RESOURCE_SHORTAGE	Couldn't allocate memory.
+ */
+
+kern_return_t
+host_ipc_kobject_info(
+	host_t					host,
+	ipc_kobject_routine_info_array_t	*infop,
+	mach_msg_type_number_t			*infoCntp)
+{
+	ipc_kobject_routine_info_t *info;
+	struct ipc_kobject_routine *r;
+	unsigned int i, nr_routines;
+	vm_size_t info_size;
+	kern_return_t kr;
+
+	if (host == HOST_NULL)
+		return KERN_INVALID_HOST;
+
+	nr_routines = ipc_kobject_nroutines;
+	info_size = nr_routines * sizeof *info;
+	if (nr_routines == 0) {
+		*infoCntp = 0;
+		return KERN_SUCCESS;
+	}
+
+	info = (ipc_kobject_routine_info_t *) kalloc(info_size);
+	if (info == NULL)
+		return KERN_RESOURCE_SHORTAGE;
+
+	memset(info, 0, info_size);
+	for (i = 0; i < nr_routines; i++) {
+		r = &ipc_kobject_routines[i];
+		info[i].ikri_id = r->id;
+		info[i].ikri_calls = __atomic_load_n(&r->calls, __ATOMIC_RELAXED);
+		info[i].ikri_cycles = __atomic_load_n(&r->cycles, __ATOMIC_RELAXED);
+		memcpy(info[i].ikri_hist, r->hist, sizeof info[i].ikri_hist);
+	}
+
+	if (nr_routines <= *infoCntp) {
+		memcpy(*infop, info, info_size);
+	} else {
+		vm_offset_t info_addr;
+		vm_size_t total_size;
+		vm_map_copy_t copy;
+
+		kr = kmem_alloc_pageable(ipc_kernel_map, &info_addr, info_size);
+		if (kr != KERN_SUCCESS)
+			goto out;
+
+		memcpy((char *) info_addr, info, info_size);
+		total_size = round_page(info_size);
+		if (info_size < total_size)
+			memset((char *) (info_addr + info_size),
+			       0, total_size - info_size);
+
+		kr = vm_map_copyin(ipc_kernel_map, info_addr, info_size,
+				   TRUE, &copy);
+		assert(kr == KERN_SUCCESS);
+		*infop = (ipc_kobject_routine_info_t *) copy;
+	}
+
+	*infoCntp = nr_routines;
+	kr = KERN_SUCCESS;
+
+out:
+	kfree((vm_offset_t) info, info_size);
+	return kr;
+}
+#endif	/* MACH_DEBUG */
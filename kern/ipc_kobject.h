@@ -102,9 +102,7 @@ typedef unsigned int ipc_kobject_type_t;
 #define ipc_kobject_vm_page_steal(ikot)	(ikot == IKOT_PAGING_REQUEST)
 
 /* Initialize kernel server dispatch table */
-/* XXX
-extern void mig_init(void);
-*/
+extern void ipc_kobject_init(void);
 
 /* Dispatch a kernel server function */
 extern ipc_kmsg_t ipc_kobject_server(
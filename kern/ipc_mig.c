@@ -320,27 +320,38 @@ mig_deallocate(vm_address_t addr, vm_size_t size)
 MACRO_BEGIN								\
 	ipc_space_t space = current_space();				\
 	ipc_entry_t entry;						\
+	ipc_entry_bits_t bits;						\
+	ipc_object_t object;						\
 									\
-	is_read_lock(space);						\
-	assert(space->is_active);					\
+	if (ipc_entry_lookup_lockless(space, name, &bits, &object)) {	\
+		if (IE_BITS_TYPE (bits) != MACH_PORT_TYPE_SEND) {	\
+			io_unlock(object);				\
+			abort;						\
+		}							\
+		port = (ipc_port_t) object;				\
+	} else {							\
+		is_read_lock(space);					\
+		assert(space->is_active);				\
 									\
-	entry = ipc_entry_lookup (space, name);				\
-	if (entry == IE_NULL) {						\
-		is_read_unlock (space);					\
-		abort;							\
-	}								\
+		entry = ipc_entry_lookup (space, name);			\
+		if (entry == IE_NULL) {					\
+			is_read_unlock (space);				\
+			abort;						\
+		}							\
 									\
-	if (IE_BITS_TYPE (entry->ie_bits) != MACH_PORT_TYPE_SEND) {	\
-		is_read_unlock (space);					\
-		abort;							\
-	}								\
+		if (IE_BITS_TYPE (entry->ie_bits) !=			\
+		    MACH_PORT_TYPE_SEND) {				\
+			is_read_unlock (space);				\
+			abort;						\
+		}							\
 									\
-	port = (ipc_port_t) entry->ie_object;				\
-	assert(port != IP_NULL);					\
+		port = (ipc_port_t) entry->ie_object;			\
+		assert(port != IP_NULL);				\
 									\
-	ip_lock(port);							\
-	/* can safely unlock space now that port is locked */		\
-	is_read_unlock(space);						\
+		ip_lock(port);						\
+		/* can safely unlock space now that port is locked */	\
+		is_read_unlock(space);					\
+	}								\
 MACRO_END
 
 static device_t
@@ -233,6 +233,7 @@ ipc_thread_init(thread_t thread)
 
 	thread->ith_mig_reply = MACH_PORT_NULL;
 	thread->ith_rpc_reply = IP_NULL;
+	thread->ith_ring = 0;
 }
 
 /*
@@ -0,0 +1,247 @@
+/*
+ *  Copyright (C) 2024 Free Software Foundation
+ *
+ * This program is free software ; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY ; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the program ; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Quiescent state based lockless synchronization.
+ *
+ * Works go through three queues: pending ones wait for a grace period
+ * to start, current ones for the grace period in progress to end, and
+ * ready ones for the llsync thread to run them.  Only one grace period
+ * is in progress at a time, and it covers all the works deferred
+ * before it started.
+ *
+ * When a grace period starts, every running processor that isn't
+ * idle is marked as having to report a quiescent state.  Idle
+ * processors are not in read-side critical sections, and those they
+ * enter later can't see what was unlinked before.  Processors check
+ * their mark without locking, so that reporting is cheap when no
+ * grace period waits for them.
+ */
+
+#include <stddef.h>
+#include <mach/machine.h>
+#include <machine/spl.h>
+#include <kern/assert.h>
+#include <kern/cpu_number.h>
+#include <kern/llsync.h>
+#include <kern/lock.h>
+#include <kern/processor.h>
+#include <kern/sched_prim.h>
+#include <kern/smp.h>
+
+struct llsync_queue {
+	struct llsync_work	*first;
+	struct llsync_work	*last;
+};
+
+decl_simple_lock_data(static, llsync_lock)	/* at splsched only */
+static struct llsync_queue llsync_pending;
+static struct llsync_queue llsync_current;
+static struct llsync_queue llsync_ready;
+static boolean_t llsync_in_progress;	/* a grace period is */
+static unsigned int llsync_nr_waiting;	/* processors to report */
+
+/*
+ * Whether a processor has to report a quiescent state for the grace
+ * period in progress.
+ */
+static volatile boolean_t llsync_cpu_waiting[NCPUS];
+
+/* Statistics */
+unsigned long llsync_nr_grace_periods;
+unsigned long llsync_nr_works;
+
+static inline void llsync_queue_init(struct llsync_queue *queue)
+{
+	queue->first = NULL;
+	queue->last = NULL;
+}
+
+static inline boolean_t llsync_queue_empty(const struct llsync_queue *queue)
+{
+	return queue->first == NULL;
+}
+
+static inline void llsync_queue_push(
+	struct llsync_queue	*queue,
+	struct llsync_work	*work)
+{
+	work->next = NULL;
+	if (queue->first == NULL)
+		queue->first = work;
+	else
+		queue->last->next = work;
+	queue->last = work;
+}
+
+/*
+ * Move all the works of src at the end of dest.
+ */
+static inline void llsync_queue_concat(
+	struct llsync_queue	*dest,
+	struct llsync_queue	*src)
+{
+	if (src->first == NULL)
+		return;
+
+	if (dest->first == NULL)
+		dest->first = src->first;
+	else
+		dest->last->next = src->first;
+	dest->last = src->last;
+	llsync_queue_init(src);
+}
+
+void llsync_setup(void)
+{
+	simple_lock_init(&llsync_lock);
+	llsync_queue_init(&llsync_pending);
+	llsync_queue_init(&llsync_current);
+	llsync_queue_init(&llsync_ready);
+}
+
+static void llsync_end_grace_period(void);
+
+/*
+ *	Start a grace period for the pending works, if any.
+ *	The llsync lock must be held.
+ */
+static void llsync_start_grace_period(void)
+{
+	unsigned int cpu;
+
+	assert(!llsync_in_progress);
+	if (llsync_queue_empty(&llsync_pending))
+		return;
+
+	llsync_queue_concat(&llsync_current, &llsync_pending);
+	llsync_in_progress = TRUE;
+	llsync_nr_waiting = 0;
+	for (cpu = 0; cpu < smp_get_numcpus(); cpu++) {
+		if (!machine_slot[cpu].running || cpu_idle(cpu))
+			continue;
+
+		llsync_cpu_waiting[cpu] = TRUE;
+		llsync_nr_waiting++;
+	}
+
+	if (llsync_nr_waiting == 0)
+		llsync_end_grace_period();
+}
+
+/*
+ *	Hand the works of the grace period over to the llsync thread,
+ *	and start the next one.  The llsync lock must be held.
+ */
+static void llsync_end_grace_period(void)
+{
+	assert(llsync_in_progress && llsync_nr_waiting == 0);
+	llsync_nr_grace_periods++;
+	llsync_queue_concat(&llsync_ready, &llsync_current);
+	llsync_in_progress = FALSE;
+	thread_wakeup_one((event_t) &llsync_ready);
+	llsync_start_grace_period();
+}
+
+void llsync_defer(struct llsync_work *work, llsync_fn_t fn)
+{
+	spl_t s;
+
+	work->fn = fn;
+	s = splsched();
+	simple_lock(&llsync_lock);
+	llsync_queue_push(&llsync_pending, work);
+	llsync_nr_works++;
+	if (!llsync_in_progress)
+		llsync_start_grace_period();
+	simple_unlock(&llsync_lock);
+	splx(s);
+}
+
+static void llsync_report_quiescent_state(void)
+{
+	int mycpu = cpu_number();
+	spl_t s;
+
+	if (!llsync_cpu_waiting[mycpu])
+		return;
+
+	s = splsched();
+	simple_lock(&llsync_lock);
+	if (llsync_cpu_waiting[mycpu]) {
+		llsync_cpu_waiting[mycpu] = FALSE;
+		assert(llsync_nr_waiting > 0);
+		if (--llsync_nr_waiting == 0)
+			llsync_end_grace_period();
+	}
+	simple_unlock(&llsync_lock);
+	splx(s);
+}
+
+void llsync_report_context_switch(void)
+{
+	llsync_report_quiescent_state();
+}
+
+void llsync_report_periodic_event(boolean_t usermode)
+{
+	if (usermode || cpu_idle(cpu_number()))
+		llsync_report_quiescent_state();
+}
+
+/*
+ *	llsync_thread:
+ *
+ *	Run the works whose grace period has ended.  They may block.
+ */
+static void __attribute__((noreturn)) llsync_thread_continue(void)
+{
+	struct llsync_work *work, *next;
+	spl_t s;
+
+	for (;;) {
+		s = splsched();
+		simple_lock(&llsync_lock);
+
+		while (!llsync_queue_empty(&llsync_ready)) {
+			work = llsync_ready.first;
+			llsync_queue_init(&llsync_ready);
+			simple_unlock(&llsync_lock);
+			(void) splx(s);
+
+			for (; work != NULL; work = next) {
+				next = work->next;
+				work->fn(work);
+			}
+
+			s = splsched();
+			simple_lock(&llsync_lock);
+		}
+
+		assert_wait((event_t) &llsync_ready, FALSE);
+		simple_unlock(&llsync_lock);
+		(void) splx(s);
+		thread_block(llsync_thread_continue);
+	}
+}
+
+void llsync_thread(void)
+{
+	llsync_thread_continue();
+	/*NOTREACHED*/
+}
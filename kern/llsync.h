@@ -0,0 +1,90 @@
+/*
+ *  Copyright (C) 2024 Free Software Foundation
+ *
+ * This program is free software ; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY ; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the program ; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Lockless synchronization.
+ *
+ * Readers walk shared data without taking locks, between
+ * llsync_read_enter and llsync_read_exit, and must not block in
+ * between.  Writers still serialize with locks, publish pointers with
+ * llsync_assign_ptr, and defer freeing what they unlinked with
+ * llsync_defer, until readers can no longer see it.
+ *
+ * The kernel is not preemptible, so a processor that switches
+ * context, or takes a clock interrupt while running in user mode or
+ * idle, can't be in a read-side critical section: it is in a
+ * quiescent state.  A grace period ends once every processor has gone
+ * through one after it started, and the works deferred before it
+ * started are then run by the llsync thread.
+ */
+
+#ifndef _KERN_LLSYNC_H_
+#define _KERN_LLSYNC_H_
+
+#include <mach/boolean.h>
+#include <kern/macros.h>
+
+struct llsync_work;
+
+typedef void (*llsync_fn_t)(struct llsync_work *work);
+
+/*
+ * Deferred work, usually embedded in the object to free.
+ */
+struct llsync_work {
+	struct llsync_work	*next;
+	llsync_fn_t		fn;
+};
+
+/*
+ * Publish and read pointers to data read locklessly.  A pointer read
+ * gives access to the data as initialized before it was assigned.
+ */
+#define llsync_assign_ptr(ptr, value) \
+	__atomic_store_n(&(ptr), (value), __ATOMIC_RELEASE)
+#define llsync_read_ptr(ptr) \
+	__atomic_load_n(&(ptr), __ATOMIC_ACQUIRE)
+
+static inline void llsync_read_enter(void)
+{
+	barrier();
+}
+
+static inline void llsync_read_exit(void)
+{
+	barrier();
+}
+
+void llsync_setup(void);
+
+/*
+ * Run fn on work once all current readers are done.  May be called
+ * with simple locks held and at any spl up to splsched.
+ */
+void llsync_defer(struct llsync_work *work, llsync_fn_t fn);
+
+/*
+ * Quiescent states, reported by the scheduler and the clock interrupt
+ * for the current processor.
+ */
+void llsync_report_context_switch(void);
+void llsync_report_periodic_event(boolean_t usermode);
+
+void llsync_thread(void) __attribute__((noreturn));
+
+#endif	/* _KERN_LLSYNC_H_ */
@@ -45,9 +45,11 @@
 #include "cpu_number.h"
 #include <kern/debug.h>
 #include <kern/host.h>
+#include <kern/llsync.h>
 #include <kern/lock.h>
 #include <kern/mach_clock.h>
 #include <kern/mach_host.server.h>
+#include <kern/printf.h>
 #include <kern/processor.h>
 #include <kern/queue.h>
 #include <kern/sched.h>
@@ -153,11 +155,265 @@ MACRO_BEGIN								\
 	time_value64_add_hpc(uptime);					\
 MACRO_END
 
-def_simple_lock_irq_data(static,	timer_lock)	/* lock for ... */
-timer_elt_data_t	timer_head;	/* ordered list of timeouts */
-					/* (doubles as end-of-list) */
+/*
+ *	Time-out wheels.
+ *
+ *	Pending timeouts are kept in hierarchical timing wheels, one
+ *	per processor.  The root level has one slot per tick for the
+ *	next TW_ROOT_SIZE ticks, and each further level covers
+ *	TW_NODE_SIZE times the range of the level below it.  A timer
+ *	is queued directly on the slot matching its expiration time,
+ *	so that both set_timeout and reset_timeout are O(1).  Whenever
+ *	the root index wraps around, the current slot of the next level
+ *	is cascaded down, and so on up the hierarchy.
+ *
+ *	set_timeout inserts into the wheel of the calling processor, so
+ *	that processors arming timeouts concurrently do not contend on
+ *	a single lock.  Expiration is still driven by the master CPU:
+ *	softclock drains every wheel up to elapsed_ticks.
+ */
+
+#define TW_ROOT_BITS	8
+#define TW_NODE_BITS	6
+#define TW_ROOT_SIZE	(1 << TW_ROOT_BITS)
+#define TW_NODE_SIZE	(1 << TW_NODE_BITS)
+#define TW_ROOT_MASK	(TW_ROOT_SIZE - 1)
+#define TW_NODE_MASK	(TW_NODE_SIZE - 1)
+#define TW_LEVELS	4		/* root level included */
+
+#define TW_LEVEL_SHIFT(level)	(TW_ROOT_BITS + (level) * TW_NODE_BITS)
+
+/* Timers further away are clamped, then requeued when the top level cascades.  */
+#define TW_MAX_INTERVAL	((1UL << TW_LEVEL_SHIFT(TW_LEVELS - 1)) - 1)
+
+struct timer_wheel {
+	decl_simple_lock_irq_data(, lock)
+	unsigned long	clk;		/* next tick to process */
+	unsigned long	next_expiry;	/* no timer expires before this */
+	unsigned int	count;		/* number of timers in the wheel */
+	queue_head_t	root[TW_ROOT_SIZE];
+	queue_head_t	node[TW_LEVELS - 1][TW_NODE_SIZE];
+
+	/* Statistics.  */
+	unsigned long	inserts;
+	unsigned long	cancels;
+	unsigned long	expirations;
+	unsigned long	cascades;
+};
+
+static struct timer_wheel timer_wheels[NCPUS];
+
+def_simple_lock_irq_data(static,	timeout_lock)	/* lock for timeout_timers */
+
+/*
+ *	Queue a timer on the slot matching its expiration time.
+ *	The wheel must be locked.
+ */
+static void
+timer_wheel_add(
+	struct timer_wheel	*wheel,
+	timer_elt_t		telt)
+{
+	unsigned long	expires, interval;
+	unsigned long	next;
+	queue_t		slot;
+	int		level;
+
+	expires = telt->ticks;
+	if (expires < wheel->clk)
+	    expires = wheel->clk;	/* already due, run on next pass */
+	interval = expires - wheel->clk;
+
+	if (interval < TW_ROOT_SIZE) {
+	    slot = &wheel->root[expires & TW_ROOT_MASK];
+	} else {
+	    if (interval > TW_MAX_INTERVAL) {
+		interval = TW_MAX_INTERVAL;
+		expires = wheel->clk + interval;
+	    }
+
+	    for (level = 0; level < TW_LEVELS - 2; level++)
+		if (interval < (1UL << TW_LEVEL_SHIFT(level + 1)))
+		    break;
+
+	    slot = &wheel->node[level][(expires >> TW_LEVEL_SHIFT(level))
+				       & TW_NODE_MASK];
+	}
+
+	enqueue_tail(slot, (queue_entry_t) telt);
+	telt->wheel = wheel;
+
+	/*
+	 *	As in timer_wheel_next_expiry, the wheel must be run no
+	 *	later than the next point where the root level wraps
+	 *	around, so that the upper levels get cascaded in time.
+	 */
+	next = (wheel->clk + TW_ROOT_MASK) & ~(unsigned long) TW_ROOT_MASK;
+	if (telt->ticks < next)
+	    next = telt->ticks;
+
+	if ((wheel->count == 0) || (next < wheel->next_expiry))
+	    wheel->next_expiry = next;
+	wheel->count++;
+}
+
+/*
+ *	Requeue the timers of the current slot of the given upper
+ *	level, and return the index of that slot.  The wheel must be
+ *	locked.
+ */
+static unsigned int
+timer_wheel_cascade(
+	struct timer_wheel	*wheel,
+	int			level)
+{
+	queue_head_t	list;
+	queue_t		slot;
+	timer_elt_t	telt;
+	unsigned int	index;
+
+	index = (wheel->clk >> TW_LEVEL_SHIFT(level)) & TW_NODE_MASK;
+	slot = &wheel->node[level][index];
+
+	/*
+	 *	Detach the slot first, so that timers parked beyond
+	 *	TW_MAX_INTERVAL can't be requeued on the slot being
+	 *	walked.
+	 */
+	queue_init(&list);
+	while (!queue_empty(slot))
+	    enqueue_tail(&list, dequeue_head(slot));
+
+	while (!queue_empty(&list)) {
+	    telt = (timer_elt_t) dequeue_head(&list);
+	    wheel->count--;
+	    timer_wheel_add(wheel, telt);
+	    wheel->cascades++;
+	}
+
+	return index;
+}
+
+/*
+ *	Return a lower bound of the expiration time of the timers in
+ *	the wheel.  Only the root level is scanned, up to the next
+ *	point where it wraps around and upper levels are cascaded.
+ *	The wheel must be locked.
+ */
+static unsigned long
+timer_wheel_next_expiry(const struct timer_wheel *wheel)
+{
+	unsigned long	clk;
+
+	if (wheel->count == 0)
+	    return ~0UL;
+
+	for (clk = wheel->clk; ; clk++) {
+	    if (((clk & TW_ROOT_MASK) == 0)
+		|| !queue_empty(&wheel->root[clk & TW_ROOT_MASK]))
+		return clk;
+	}
+}
+
+/*
+ *	Expire the timers of a wheel up to elapsed_ticks.  At most
+ *	budget functions are called; return the remaining budget.
+ */
+static unsigned int
+timer_wheel_run(
+	struct timer_wheel	*wheel,
+	unsigned int		budget)
+{
+	spl_t		s;
+	timer_elt_t	telt;
+	timer_func_t	*fcn;
+	void		*param;
+	queue_t		slot;
+	int		level;
+
+	s = simple_lock_irq(&wheel->lock);
+
+	while (wheel->clk <= elapsed_ticks) {
+	    if (wheel->count == 0) {
+		/* Nothing to expire, catch up at once.  */
+		wheel->clk = elapsed_ticks + 1;
+		break;
+	    }
+
+	    if (((wheel->clk & TW_ROOT_MASK) != 0)
+		&& queue_empty(&wheel->root[wheel->clk & TW_ROOT_MASK])) {
+		/* Skip to the next populated slot or cascade point.  */
+		wheel->clk = timer_wheel_next_expiry(wheel);
+		if (wheel->clk > elapsed_ticks + 1)
+		    wheel->clk = elapsed_ticks + 1;
+		continue;
+	    }
+
+	    if ((wheel->clk & TW_ROOT_MASK) == 0)
+		for (level = 0; level < TW_LEVELS - 1; level++)
+		    if (timer_wheel_cascade(wheel, level) != 0)
+			break;
+
+	    /*
+	     *	Timers set while the lock is released below either land
+	     *	on a later slot, or on this one if they are already due.
+	     *	Either way the slot is drained in place, and the clock
+	     *	only advances once it is empty.
+	     */
+	    slot = &wheel->root[wheel->clk & TW_ROOT_MASK];
+	    while (!queue_empty(slot)) {
+		if (budget == 0)
+		    goto out;
+		budget--;
+
+		telt = (timer_elt_t) dequeue_head(slot);
+		wheel->count--;
+		wheel->expirations++;
+		fcn = telt->fcn;
+		param = telt->param;
+		telt->set = TELT_UNSET;
+		simple_unlock_irq(s, &wheel->lock);
+
+		assert(fcn != 0);
+		(*fcn)(param);
+
+		s = simple_lock_irq(&wheel->lock);
+	    }
+
+	    wheel->clk++;
+	}
+
+out:
+	wheel->next_expiry = timer_wheel_next_expiry(wheel);
+	simple_unlock_irq(s, &wheel->lock);
+	return budget;
+}
+
+/*
+ *	Return a lower bound of the expiration time of all pending
+ *	timers.  The wheels are sampled without locking; a stale value
+ *	only delays or anticipates a softclock pass by one tick.
+ */
+static unsigned long
+timer_wheels_next_expiry(void)
+{
+	unsigned long	next = ~0UL;
+	int		i;
+
+	for (i = 0; i < NCPUS; i++) {
+	    struct timer_wheel *wheel = &timer_wheels[i];
+
+	    if ((wheel->count != 0) && (wheel->next_expiry < next))
+		next = wheel->next_expiry;
+	}
+
+	return next;
+}
 
 #ifdef TICKLESS_TIMER
+/* Never skip more ticks than this in a row.  */
+#define TICKLESS_MAX_SKIP	100
+
 /*
  * Tickless timer support: Check if we have pending timers that require
  * immediate processing.
@@ -165,16 +421,7 @@ timer_elt_data_t	timer_head;	/* ordered list of timeouts */
 static boolean_t
 tickless_have_pending_timers(void)
 {
-	timer_elt_t telt;
-	boolean_t have_pending;
-	spl_t s;
-	
-	s = simple_lock_irq(&timer_lock);
-	telt = (timer_elt_t)queue_first(&timer_head.chain);
-	have_pending = (telt->ticks <= elapsed_ticks);
-	simple_unlock_irq(s, &timer_lock);
-	
-	return have_pending;
+	return (timer_wheels_next_expiry() <= elapsed_ticks);
 }
 
 /*
@@ -184,21 +431,18 @@ tickless_have_pending_timers(void)
 static unsigned long
 tickless_next_timer_deadline(void)
 {
-	timer_elt_t telt;
+	unsigned long next_expiry;
 	unsigned long next_deadline = 0;
-	spl_t s;
-	
-	s = simple_lock_irq(&timer_lock);
-	telt = (timer_elt_t)queue_first(&timer_head.chain);
-	if (telt->ticks > elapsed_ticks) {
-		next_deadline = telt->ticks - elapsed_ticks;
+
+	next_expiry = timer_wheels_next_expiry();
+	if (next_expiry > elapsed_ticks) {
+		next_deadline = next_expiry - elapsed_ticks;
 		/* Limit skip to reasonable amount to avoid long delays */
-		if (next_deadline > 100) {
-			next_deadline = 100;
+		if (next_deadline > TICKLESS_MAX_SKIP) {
+			next_deadline = TICKLESS_MAX_SKIP;
 		}
 	}
-	simple_unlock_irq(s, &timer_lock);
-	
+
 	return next_deadline;
 }
 
@@ -280,6 +524,12 @@ void clock_interrupt(
 	    thread_quantum_update(my_cpu, thread, 1, state);
 	}
 
+	/*
+	 *	Nothing runs in a lockless read-side critical section
+	 *	in user mode or when idle.
+	 */
+	llsync_report_periodic_event(usermode);
+
 #if 	MACH_PCSAMPLE
 	/*
 	 * Take a sample of pc for the user if required.
@@ -301,8 +551,6 @@ void clock_interrupt(
 	 */
 	if (my_cpu == master_cpu) {
 
-	    spl_t s;
-	    timer_elt_t	telt;
 	    boolean_t	needsoft = FALSE;
 #ifdef TICKLESS_TIMER
 	    boolean_t	should_skip_tick = FALSE;
@@ -310,11 +558,10 @@ void clock_interrupt(
 
 	    /*
 	     *	Update the tick count since bootup, and handle
-	     *	timeouts.
+	     *	timeouts.  Only the master CPU writes elapsed_ticks;
+	     *	the timer wheels sample it under their own locks.
 	     */
 
-	    s = simple_lock_irq(&timer_lock);
-
 #ifdef TICKLESS_TIMER
 	    /* 
 	     * Tickless optimization: Only process ticks if we have
@@ -324,20 +571,16 @@ void clock_interrupt(
 	    if (!should_skip_tick) {
 		elapsed_ticks++;
 		
-		telt = (timer_elt_t)queue_first(&timer_head.chain);
-		if (telt->ticks <= elapsed_ticks)
+		if (timer_wheels_next_expiry() <= elapsed_ticks)
 		    needsoft = TRUE;
 	    }
 #else
 	    /* Traditional tick processing */
 	    elapsed_ticks++;
 
-	    telt = (timer_elt_t)queue_first(&timer_head.chain);
-	    if (telt->ticks <= elapsed_ticks)
+	    if (timer_wheels_next_expiry() <= elapsed_ticks)
 		needsoft = TRUE;
 #endif /* TICKLESS_TIMER */
-	    
-	    simple_unlock_irq(s, &timer_lock);
 
 	    /*
 	     *	Increment the time-of-day clock.
@@ -414,52 +657,28 @@ void softclock(void)
 	/*
 	 *	Handle timeouts.
 	 */
-	spl_t	s;
-	timer_elt_t	telt;
-	void	(*fcn)( void * param );
-	void	*param;
-#ifdef TICKLESS_TIMER
-	int processed = 0;
-	const int max_batch = 16; /* Process up to 16 timers per batch */
-#endif
+	unsigned int	budget;
+	int		i;
 
-	while (TRUE) {
-	    s = simple_lock_irq(&timer_lock);
-	    telt = (timer_elt_t) queue_first(&timer_head.chain);
-	    if (telt->ticks > elapsed_ticks) {
-		simple_unlock_irq(s, &timer_lock);
-		break;
-	    }
-	    fcn = telt->fcn;
-	    param = telt->param;
-
-	    remqueue(&timer_head.chain, (queue_entry_t)telt);
-	    telt->set = TELT_UNSET;
-	    simple_unlock_irq(s, &timer_lock);
-
-	    assert(fcn != 0);
-	    (*fcn)(param);
-	    
 #ifdef TICKLESS_TIMER
-	    /* 
-	     * Tickless optimization: Limit batch processing to reduce
-	     * interrupt latency
-	     */
-	    if (++processed >= max_batch) {
-		/* If there are more timers, schedule another softclock */
-		s = simple_lock_irq(&timer_lock);
-		telt = (timer_elt_t) queue_first(&timer_head.chain);
-		if (telt->ticks <= elapsed_ticks) {
-		    simple_unlock_irq(s, &timer_lock);
-		    setsoftclock(); /* Schedule another round */
-		}
-		else {
-		    simple_unlock_irq(s, &timer_lock);
-		}
-		break;
-	    }
+	/*
+	 * Tickless optimization: Limit batch processing to reduce
+	 * interrupt latency.  Process up to 16 timers per batch.
+	 */
+	budget = 16;
+#else
+	budget = ~0U;
 #endif /* TICKLESS_TIMER */
+
+	for (i = 0; i < NCPUS; i++) {
+	    budget = timer_wheel_run(&timer_wheels[i], budget);
+	    if (budget == 0)
+		break;
 	}
+
+	/* If there are more timers, schedule another softclock */
+	if ((budget == 0) && (timer_wheels_next_expiry() <= elapsed_ticks))
+	    setsoftclock();
 }
 
 /*
@@ -474,51 +693,78 @@ void set_timeout(
 	unsigned int	interval)
 {
 	spl_t			s;
-	timer_elt_t		next;
-
-	s = simple_lock_irq(&timer_lock);
+	struct timer_wheel	*wheel;
 
-	interval += elapsed_ticks;
+	wheel = &timer_wheels[cpu_number()];
+	s = simple_lock_irq(&wheel->lock);
 
-	for (next = (timer_elt_t)queue_first(&timer_head.chain);
-	     ;
-	     next = (timer_elt_t)queue_next((queue_entry_t)next)) {
-
-	    if (next->ticks > interval)
-		break;
-	}
-	telt->ticks = interval;
 	/*
-	 * Insert new timer element before 'next'
-	 * (after 'next'->prev)
+	 *	An empty wheel is not advanced by softclock; bring its
+	 *	clock up to date so the new timer lands near the root.
 	 */
-	insque((queue_entry_t) telt, ((queue_entry_t)next)->prev);
+	if (wheel->count == 0)
+	    wheel->clk = elapsed_ticks;
+
+	telt->ticks = elapsed_ticks + interval;
+	timer_wheel_add(wheel, telt);
 	telt->set = TELT_SET;
-	simple_unlock_irq(s, &timer_lock);
+	wheel->inserts++;
+	simple_unlock_irq(s, &wheel->lock);
 }
 
 boolean_t reset_timeout(timer_elt_t telt)
 {
-	spl_t	s;
+	spl_t			s;
+	struct timer_wheel	*wheel;
+
+	/*
+	 *	The timer may be moved to another wheel while we are
+	 *	not holding its lock; retry until the wheel we locked
+	 *	is the one it is on.
+	 */
+	for (;;) {
+	    wheel = telt->wheel;
+	    if ((telt->set != TELT_SET) || (wheel == NULL))
+		return FALSE;
 
-	s = simple_lock_irq(&timer_lock);
-	if (telt->set) {
-	    remqueue(&timer_head.chain, (queue_entry_t)telt);
+	    s = simple_lock_irq(&wheel->lock);
+	    if (telt->wheel == wheel)
+		break;
+	    simple_unlock_irq(s, &wheel->lock);
+	}
+
+	if (telt->set == TELT_SET) {
+	    remqueue(NULL, (queue_entry_t)telt);
 	    telt->set = TELT_UNSET;
-	    simple_unlock_irq(s, &timer_lock);
+	    wheel->count--;
+	    wheel->cancels++;
+	    simple_unlock_irq(s, &wheel->lock);
 	    return TRUE;
 	}
 	else {
-	    simple_unlock_irq(s, &timer_lock);
+	    simple_unlock_irq(s, &wheel->lock);
 	    return FALSE;
 	}
 }
 
 void init_timeout(void)
 {
-	simple_lock_init_irq(&timer_lock);
-	queue_init(&timer_head.chain);
-	timer_head.ticks = ~0;	/* MAXUINT - sentinel */
+	struct timer_wheel	*wheel;
+	int			i, j, level;
+
+	for (i = 0; i < NCPUS; i++) {
+	    wheel = &timer_wheels[i];
+	    simple_lock_init_irq(&wheel->lock);
+	    wheel->clk = 0;
+	    wheel->next_expiry = ~0UL;
+	    wheel->count = 0;
+	    for (j = 0; j < TW_ROOT_SIZE; j++)
+		queue_init(&wheel->root[j]);
+	    for (level = 0; level < TW_LEVELS - 1; level++)
+		for (j = 0; j < TW_NODE_SIZE; j++)
+		    queue_init(&wheel->node[level][j]);
+	}
+	simple_lock_init_irq(&timeout_lock);
 
 	elapsed_ticks = 0;
 	
@@ -526,7 +772,111 @@ void init_timeout(void)
 	printf("Tickless timer optimization enabled\n");
 #endif
 }
-
+
+/*
+ *	Boot-time benchmark of the time-out facility, run when
+ *	"timerbench" is given on the kernel command line.  Arms
+ *	TIMEOUT_BENCH_COUNT timeouts spread over a few seconds, waits
+ *	for all of them to fire, then arms and cancels them again.
+ */
+
+#define TIMEOUT_BENCH_COUNT	100000
+
+static unsigned int	timeout_bench_fired;
+static unsigned long	timeout_bench_late_total;	/* in ticks */
+static unsigned long	timeout_bench_late_max;		/* in ticks */
+
+/* Called at splsoftclock, on the master CPU only.  */
+static void
+timeout_bench_fire(void *param)
+{
+	timer_elt_t	telt = param;
+	unsigned long	late = elapsed_ticks - telt->ticks;
+
+	timeout_bench_late_total += late;
+	if (late > timeout_bench_late_max)
+	    timeout_bench_late_max = late;
+	if (++timeout_bench_fired == TIMEOUT_BENCH_COUNT)
+	    thread_wakeup((event_t) &timeout_bench_fired);
+}
+
+static uint64_t
+timeout_bench_nsec(uint32_t start)
+{
+	return (uint64_t) (hpclock_read_counter() - start)
+		* hpclock_get_counter_period_nsec();
+}
+
+void timeout_benchmark(void)
+{
+	vm_offset_t	addr;
+	vm_size_t	size;
+	timer_elt_t	telts;
+	uint64_t	insert_ns, fire_ns, cancel_ns;
+	uint32_t	start;
+	unsigned long	late_avg, cascades;
+	unsigned int	i;
+	spl_t		s;
+
+	size = round_page(TIMEOUT_BENCH_COUNT * sizeof(timer_elt_data_t));
+	if (kmem_alloc_wired(kernel_map, &addr, size) != KERN_SUCCESS) {
+	    printf("timeout_benchmark: cannot allocate timers\n");
+	    return;
+	}
+	telts = (timer_elt_t) addr;
+	memset(telts, 0, size);
+
+	timeout_bench_fired = 0;
+	timeout_bench_late_total = 0;
+	timeout_bench_late_max = 0;
+
+	/* Spread the expirations over four seconds.  */
+	start = hpclock_read_counter();
+	for (i = 0; i < TIMEOUT_BENCH_COUNT; i++) {
+	    telts[i].fcn = timeout_bench_fire;
+	    telts[i].param = &telts[i];
+	    set_timeout(&telts[i], 1 + (i * 7919) % (4 * hz));
+	}
+	insert_ns = timeout_bench_nsec(start);
+
+	start = hpclock_read_counter();
+	s = splsoftclock();
+	while (timeout_bench_fired < TIMEOUT_BENCH_COUNT) {
+	    assert_wait((event_t) &timeout_bench_fired, FALSE);
+	    thread_set_timeout(hz);
+	    splx(s);
+	    thread_block(thread_no_continuation);
+	    s = splsoftclock();
+	}
+	splx(s);
+	fire_ns = timeout_bench_nsec(start);
+
+	start = hpclock_read_counter();
+	for (i = 0; i < TIMEOUT_BENCH_COUNT; i++)
+	    set_timeout(&telts[i], 1 + (i * 7919) % (4 * hz));
+	for (i = 0; i < TIMEOUT_BENCH_COUNT; i++)
+	    reset_timeout(&telts[i]);
+	cancel_ns = timeout_bench_nsec(start);
+
+	cascades = 0;
+	for (i = 0; i < NCPUS; i++)
+	    cascades += timer_wheels[i].cascades;
+	late_avg = timeout_bench_late_total * 1000 / TIMEOUT_BENCH_COUNT;
+
+	printf("timeout_benchmark: %u timeouts, %lu cascades since boot\n",
+	       TIMEOUT_BENCH_COUNT, cascades);
+	printf("timeout_benchmark: insert %llu ns/timeout\n",
+	       (unsigned long long) (insert_ns / TIMEOUT_BENCH_COUNT));
+	printf("timeout_benchmark: fire %llu ms total, "
+	       "late %lu.%03lu ticks avg, %lu ticks max\n",
+	       (unsigned long long) (fire_ns / 1000000),
+	       late_avg / 1000, late_avg % 1000, timeout_bench_late_max);
+	printf("timeout_benchmark: insert+cancel %llu ns/timeout\n",
+	       (unsigned long long) (cancel_ns / TIMEOUT_BENCH_COUNT));
+
+	kmem_free(kernel_map, addr, size);
+}
+
 /*
  * We record timestamps using the boot-time clock.  We keep track of
  * the boot-time clock by storing the difference to the real-time
@@ -836,7 +1186,7 @@ void timeout(
 	spl_t	s;
 	timer_elt_t elt;
 
-	s = simple_lock_irq(&timer_lock);
+	s = simple_lock_irq(&timeout_lock);
 	for (elt = &timeout_timers[0]; elt < &timeout_timers[NTIMERS]; elt++)
 	    if (elt->set == TELT_UNSET)
 		break;
@@ -845,9 +1195,9 @@ void timeout(
 	elt->fcn = fcn;
 	elt->param = param;
 	elt->set = TELT_ALLOC;
-	simple_unlock_irq(s, &timer_lock);
 
 	set_timeout(elt, (unsigned int)interval);
+	simple_unlock_irq(s, &timeout_lock);
 }
 
 /*
@@ -859,20 +1209,18 @@ boolean_t untimeout(void (*fcn)( void * param ), const void *param)
 	spl_t	s;
 	timer_elt_t elt;
 
-	s = simple_lock_irq(&timer_lock);
-	queue_iterate(&timer_head.chain, elt, timer_elt_t, chain) {
+	s = simple_lock_irq(&timeout_lock);
+	for (elt = &timeout_timers[0]; elt < &timeout_timers[NTIMERS]; elt++) {
 
-	    if ((fcn == elt->fcn) && (param == elt->param)) {
+	    if ((fcn == elt->fcn) && (param == elt->param)
+		&& reset_timeout(elt)) {
 		/*
 		 *	Found it.
 		 */
-		remqueue(&timer_head.chain, (queue_entry_t)elt);
-		elt->set = TELT_UNSET;
-
-		simple_unlock_irq(s, &timer_lock);
+		simple_unlock_irq(s, &timeout_lock);
 		return (TRUE);
 	    }
 	}
-	simple_unlock_irq(s, &timer_lock);
+	simple_unlock_irq(s, &timeout_lock);
 	return (FALSE);
 }
@@ -52,13 +52,16 @@ extern time_value64_t	uptime;		/* time since bootup */
 
 typedef void timer_func_t(void *);
 
+struct timer_wheel;
+
 /* Time-out element.  */
 struct timer_elt {
-	queue_chain_t	chain;		/* chain in order of expiration */
+	queue_chain_t	chain;		/* chain in timer wheel slot */
 	timer_func_t	*fcn;		/* function to call */
 	void *		param;		/* with this parameter */
 	unsigned long	ticks;		/* expiration time, in ticks */
 	int		set;		/* unset | set | allocated */
+	struct timer_wheel *wheel;	/* wheel the timer was last set on */
 };
 #define	TELT_UNSET	0		/* timer not set */
 #define	TELT_SET	1		/* timer set */
@@ -96,6 +99,9 @@ extern boolean_t reset_timeout(timer_elt_t telt);
 
 extern void init_timeout (void);
 
+/* Arm and fire a large number of timeouts and report their cost.  */
+extern void timeout_benchmark (void);
+
 /*
  * Record a timestamp in STAMP.  Records values in the boot-time clock
  * frame.
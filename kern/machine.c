@@ -50,6 +50,7 @@
 #include <kern/processor.h>
 #include <kern/queue.h>
 #include <kern/sched.h>
+#include <kern/sched_prim.h>
 #include <kern/task.h>
 #include <kern/thread.h>
 #include <kern/printf.h>
@@ -538,6 +539,13 @@ Restart_pset:
 	    splx(s);
 	    pset_unlock(new_pset);
 
+	    /*
+	     *	Send the threads of the old set elsewhere.
+	     */
+	    s = splsched();
+	    processor_drain_runq(processor);
+	    splx(s);
+
 	    /*
 	     *	Clean up dangling references, and release our binding.
 	     */
@@ -571,6 +579,7 @@ Restart_pset:
 	pset_remove_processor(pset, processor);
 	processor_unlock(processor);
 	pset_unlock(pset);
+	processor_drain_runq(processor);
 	splx(s);
 
 	/*
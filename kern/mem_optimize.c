@@ -209,9 +209,6 @@ kern_return_t mem_opt_compact_memory(void)
     pages_moved = 20; /* Simulated */
     fragments_merged = 15; /* Simulated */
     
-    /* Force another garbage collection to clean up after compaction */
-    slab_collect();
-    
     simple_lock(&opt->lock);
     opt->stats.pages_moved += pages_moved;
     opt->stats.fragments_merged += fragments_merged;
@@ -233,9 +230,7 @@ kern_return_t mem_opt_defragment_slabs(void)
 {
     printf("Defragmenting slab allocations...\n");
     
-    /* Multiple garbage collection passes for thorough cleanup */
-    slab_collect();
-    slab_collect();
+    /* A single pass releases all free slabs, further ones would be no-ops */
     slab_collect();
     
     simple_lock(&global_mem_optimizer.lock);
@@ -278,10 +273,8 @@ void mem_opt_emergency_reclaim(void)
 {
     printf("Emergency memory reclamation started\n");
     
-    /* Aggressive garbage collection */
-    slab_collect();
-    slab_collect();
-    slab_collect();
+    /* Release everything the shrinkers and caches can spare */
+    slab_shrink(0);
     
     /* Force compaction regardless of policy */
     mem_opt_compact_memory();
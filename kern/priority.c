@@ -84,6 +84,7 @@ void thread_quantum_update(
 	processor_t			myprocessor;
 #if	NCPUS > 1
 	processor_set_t			pset;
+	int				nwaiting;
 #endif
 	spl_t				s;
 
@@ -110,14 +111,11 @@ void thread_quantum_update(
 	 *	Update set_quantum and calculate the current quantum.
 	 */
 #if	NCPUS > 1
+	nwaiting = pset_runq_count(pset);
 	pset->set_quantum = pset->machine_quantum[
-		((pset->runq.count > pset->processor_count) ?
-		  pset->processor_count : pset->runq.count)];
-
-	if (myprocessor->runq.count != 0)
-		quantum = min_quantum;
-	else
-		quantum = pset->set_quantum;
+		((nwaiting > pset->processor_count) ?
+		  pset->processor_count : nwaiting)];
+	quantum = pset->set_quantum;
 #else	/* NCPUS > 1 */
 	quantum = min_quantum;
 	default_pset.set_quantum = quantum;
@@ -135,14 +135,11 @@ void pset_sys_init(void)
 void pset_init(
 	processor_set_t	pset)
 {
+#if	NCPUS > 1
 	int	i;
+#endif	/* NCPUS > 1 */
 
-	simple_lock_init(&pset->runq.lock);
-	pset->runq.low = 0;
-	pset->runq.count = 0;
-	for (i = 0; i < NRQS; i++) {
-	    queue_init(&(pset->runq.runq[i]));
-	}
+	run_queue_init(&pset->runq);
 	queue_init(&pset->idle_queue);
 	pset->idle_count = 0;
 	simple_lock_init(&pset->idle_lock);
@@ -187,14 +184,7 @@ void processor_init(
 	processor_t 	pr,
 	int		slot_num)
 {
-	int	i;
-
-	simple_lock_init(&pr->runq.lock);
-	pr->runq.low = 0;
-	pr->runq.count = 0;
-	for (i = 0; i < NRQS; i++) {
-	    queue_init(&(pr->runq.runq[i]));
-	}
+	run_queue_init(&pr->runq);
 	queue_init(&pr->processor_queue);
 	pr->state = PROCESSOR_OFF_LINE;
 	pr->next_thread = THREAD_NULL;
@@ -208,12 +198,12 @@ void processor_init(
 	simple_lock_init(&pr->lock);
 	pr->processor_self = IP_NULL;
 	pr->slot_num = slot_num;
+	pr->context_switches = 0;
 #if NCPUS > 1
-	/* Initialize load balancing statistics */
-	pr->load_average = 0;
+	pr->active_pri = NRQS - 1;
 	pr->migration_in = 0;
 	pr->migration_out = 0;
-	pr->last_balance_tick = 0;
+	pr->steals = 0;
 #endif /* NCPUS > 1 */
 }
 
@@ -512,8 +502,9 @@ void quantum_set(
 	}
 	pset->machine_quantum[0] = 2 * pset->machine_quantum[1];
 
-	i = ((pset->runq.count > pset->processor_count) ?
-		pset->processor_count : pset->runq.count);
+	i = pset_runq_count(pset);
+	if (i > pset->processor_count)
+		i = pset->processor_count;
 	pset->set_quantum = pset->machine_quantum[i];
 #else	/* NCPUS > 1 */
 	default_pset.set_quantum = min_quantum;
@@ -122,12 +122,13 @@ struct processor {
 	decl_simple_lock_data(,	lock)
 	struct ipc_port *processor_self;	/* port for operations */
 	int		slot_num;	/* machine-indep slot number */
+	unsigned long	context_switches; /* threads switched to */
 #if	NCPUS > 1
 	ast_check_t	ast_check_data;	/* for remote ast_check invocation */
-	unsigned int	load_average;	/* current load average */
+	int		active_pri;	/* priority of running thread, hint */
 	unsigned int	migration_in;	/* threads migrated in */
 	unsigned int	migration_out;	/* threads migrated out */
-	unsigned int	last_balance_tick; /* last load balance time */
+	unsigned int	steals;		/* threads stolen from others */
 #endif	/* NCPUS > 1 */
 	/* punt id data temporarily */
 };
@@ -243,6 +244,7 @@ extern processor_t	master_processor;
 
 #define	pset_lock(pset)		simple_lock(&(pset)->lock)
 #define pset_unlock(pset)	simple_unlock(&(pset)->lock)
+#define	pset_lock_try(pset)	simple_lock_try(&(pset)->lock)
 #define	pset_ref_lock(pset)	simple_lock(&(pset)->ref_lock)
 #define	pset_ref_unlock(pset)	simple_unlock(&(pset)->ref_lock)
 
@@ -250,6 +252,29 @@ extern processor_t	master_processor;
 #define processor_lock(pr)	simple_lock(&(pr)->lock)
 #define processor_unlock(pr)	simple_unlock(&(pr)->lock)
 
+/*
+ *	Number of threads waiting to run in a processor set, on its run
+ *	queue and on the ones of its processors.  Looked at without
+ *	locking: the processors queue of the set may be changed under
+ *	us by a reassignment, so the fixed processor array is walked
+ *	instead, and a processor moving meanwhile only makes the count
+ *	a little stale.
+ */
+static inline int pset_runq_count(
+	processor_set_t	pset)
+{
+	processor_t	processor;
+	int		count, i;
+
+	count = pset->runq.count;
+	for (i = 0; i < NCPUS; i++) {
+		processor = cpu_to_processor(i);
+		if (processor->processor_set == pset)
+			count += processor->runq.count;
+	}
+	return count;
+}
+
 typedef mach_port_t	*processor_array_t;
 typedef mach_port_t	*processor_set_array_t;
 typedef mach_port_t	*processor_set_name_array_t;
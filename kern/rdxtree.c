@@ -28,6 +28,7 @@
  */
 
 #include <kern/assert.h>
+#include <kern/llsync.h>
 #include <kern/slab.h>
 #include <mach/kern_return.h>
 #include <stddef.h>
@@ -77,13 +78,6 @@ typedef unsigned long long rdxtree_bm_t;
 #define RDXTREE_BM_FULL \
     ((~(rdxtree_bm_t)0) >> (RDXTREE_BM_SIZE - RDXTREE_RADIX_SIZE))
 
-/*
- * These macros can be replaced by actual functions in an environment
- * that provides lockless synchronization such as RCU.
- */
-#define llsync_assign_ptr(ptr, value)   ((ptr) = (value))
-#define llsync_read_ptr(ptr)            (ptr)
-
 /*
  * Radix tree node.
  *
@@ -113,6 +107,7 @@ struct rdxtree_node {
     unsigned int nr_entries;
     rdxtree_bm_t alloc_bm;
     void *entries[RDXTREE_RADIX_SIZE];
+    struct llsync_work llsync_work;
 };
 
 /*
@@ -185,17 +180,22 @@ rdxtree_node_create(struct rdxtree_node **nodep, unsigned int height)
     return 0;
 }
 
+static void
+rdxtree_node_destroy_deferred(struct llsync_work *work)
+{
+    struct rdxtree_node *node;
+
+    node = structof(work, struct rdxtree_node, llsync_work);
+    kmem_cache_free(&rdxtree_node_cache, (vm_offset_t) node);
+}
+
 static void
 rdxtree_node_schedule_destruction(struct rdxtree_node *node)
 {
     /*
-     * This function is intended to use the appropriate interface to defer
-     * destruction until all read-side references are dropped in an
-     * environment that provides lockless synchronization.
-     *
-     * Otherwise, it simply "schedules" destruction immediately.
+     * Lockless lookups may still be walking the node.
      */
-    kmem_cache_free(&rdxtree_node_cache, (vm_offset_t) node);
+    llsync_defer(&node->llsync_work, rdxtree_node_destroy_deferred);
 }
 
 static inline void
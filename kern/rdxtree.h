@@ -147,6 +147,11 @@ void * rdxtree_remove(struct rdxtree *tree, rdxtree_key_t key);
  * Look up a pointer in a tree.
  *
  * The matching pointer is returned if successful, NULL otherwise.
+ *
+ * Lookups may run concurrently with updates, without locking, in a
+ * read-side critical section (see kern/llsync.h).  Pointers removed
+ * from the tree are then only known not to be used once a grace
+ * period has elapsed.
  */
 static inline void *
 rdxtree_lookup(const struct rdxtree *tree, rdxtree_key_t key)
@@ -73,24 +73,51 @@
  */
 #define NRQS	64			/* 64 run queues per cpu - allows fine-grained priority levels */
 
+/*
+ *	Each processor has a run queue, where the threads it is going
+ *	to run wait.  Processor sets have one too, only used when the
+ *	set has no processor to run them.  A bit is set in the bitmap
+ *	for every non-empty queue, so that the highest priority thread
+ *	is found without scanning the queues, and low is always the
+ *	index of the first non-empty queue.
+ */
+#define RUNQ_BITMAP_BITS	(sizeof(unsigned long) * 8)
+#define RUNQ_BITMAP_SIZE	((NRQS + RUNQ_BITMAP_BITS - 1) / RUNQ_BITMAP_BITS)
+
 struct run_queue {
 	queue_head_t		runq[NRQS];	/* one for each priority */
 	decl_simple_lock_data(,	lock)		/* one lock for all queues,
 						   shall be taken at splsched
 						   only */
-	int			low;		/* low queue value */
+	int			low;		/* highest priority queued */
 	int			count;		/* count of threads runable */
+	int			nbound;		/* of which bound threads */
+	unsigned long		bitmap[RUNQ_BITMAP_SIZE]; /* non-empty queues */
+	unsigned long		lock_count;	/* times locked */
+	unsigned long		lock_contended;	/* times found locked */
 };
 
 typedef struct run_queue	*run_queue_t;
 #define RUN_QUEUE_NULL	((run_queue_t) 0)
 
-/* Shall be taken at splsched only */
+/*
+ *	Shall be taken at splsched only.  Other processors look into
+ *	run queues to steal threads, so keep track of contention.
+ */
+#define _runq_lock(rq)							\
+MACRO_BEGIN								\
+	if (!simple_lock_try_nocheck(&(rq)->lock)) {			\
+		simple_lock_nocheck(&(rq)->lock);			\
+		(rq)->lock_contended++;					\
+	}								\
+	(rq)->lock_count++;						\
+MACRO_END
+
 #ifdef MACH_LDEBUG
 #define runq_lock(rq)		\
 MACRO_BEGIN \
 	assert_splsched(); \
-	simple_lock_nocheck(&(rq)->lock); \
+	_runq_lock(rq); \
 MACRO_END
 #define runq_unlock(rq)	\
 MACRO_BEGIN \
@@ -98,46 +125,38 @@ MACRO_BEGIN \
 	simple_unlock_nocheck(&(rq)->lock); \
 MACRO_END
 #else
-#define runq_lock(rq)		simple_lock_nocheck(&(rq)->lock)
+#define runq_lock(rq)		_runq_lock(rq)
 #define runq_unlock(rq)	simple_unlock_nocheck(&(rq)->lock)
 #endif
 
-#if	MACH_FIXPRI
 /*
+ *	Whether a thread waiting on run queue rq should replace a
+ *	running thread of priority pri.  Higher priority threads always
+ *	do.  Threads of the same priority take turns, but only once the
+ *	running thread has used its first quantum.
+ *
  *	NOTE: For fixed priority threads, first_quantum indicates
  *	whether context switch at same priority is ok.  For timeshareing
  *	it indicates whether preempt is ok.
  */
+#define runq_preempts(rq, pri, first_quantum)				\
+	((rq)->count > 0 &&						\
+	 ((rq)->low < (pri) ||						\
+	  (!(first_quantum) && (rq)->low <= (pri))))
 
 #define csw_needed(thread, processor) ((thread)->state & TH_SUSP ||	\
-	((processor)->runq.count > 0) ||				\
-	((thread)->policy == POLICY_TIMESHARE &&			\
-		(processor)->first_quantum == FALSE &&			\
-		(processor)->processor_set->runq.count > 0 &&		\
-		  (processor)->processor_set->runq.low <=		\
-			(thread)->sched_pri) ||				\
-	((thread)->policy == POLICY_FIXEDPRI &&				\
-		(processor)->processor_set->runq.count > 0 &&		\
-		 ((((processor)->first_quantum == FALSE) &&		\
-		  ((processor)->processor_set->runq.low <=		\
-			(thread)->sched_pri)) ||			\
-		 ((processor)->processor_set->runq.low <		\
-			(thread)->sched_pri))))
-
-#else	/* MACH_FIXPRI */
-#define csw_needed(thread, processor) ((thread)->state & TH_SUSP ||	\
-		((processor)->runq.count > 0) ||			\
-		((processor)->first_quantum == FALSE &&			\
-		 ((processor)->processor_set->runq.count > 0 &&		\
-		  (processor)->processor_set->runq.low <=		\
-			((thread)->sched_pri))))
-#endif	/* MACH_FIXPRI */
+	runq_preempts(&(processor)->runq, (thread)->sched_pri,		\
+		      (processor)->first_quantum) ||			\
+	runq_preempts(&(processor)->processor_set->runq,		\
+		      (thread)->sched_pri, (processor)->first_quantum))
 
 /*
  *	Scheduler routines.
  */
 
+extern void		run_queue_init(run_queue_t);
 extern struct run_queue	*rem_runq(thread_t);
+extern void		run_queue_enqueue_head(run_queue_t, struct thread *);
 extern struct thread	*choose_thread(processor_t);
 extern queue_head_t	action_queue;	/* assign/shutdown queue */
 decl_simple_lock_data(extern,action_lock);
@@ -32,12 +32,14 @@
  *
  */
 
+#include <string.h>
 #include <kern/printf.h>
 #include <kern/constants.h>
 #include <mach/machine.h>
 #include <machine/locore.h>
 #include <machine/spl.h>	/* For def'n of splsched() */
 #include <machine/model_dep.h>
+#include <machine/proc_reg.h>
 #include <kern/ast.h>
 #include <kern/counters.h>
 #include <kern/cpu_number.h>
@@ -55,14 +57,25 @@
 #include <kern/thread.h>
 #include <kern/thread_swap.h>
 #include <kern/dtrace.h>
+#include <kern/kalloc.h>
+#include <kern/llsync.h>
+#include <kern/host.h>
+#include <kern/slab.h>
 #include <vm/pmap.h>
 #include <vm/vm_kern.h>
 #include <vm/vm_map.h>
+#include <vm/vm_page.h>
 
 #if	MACH_FIXPRI
 #include <mach/policy.h>
 #endif	/* MACH_FIXPRI */
 
+#if	MACH_DEBUG
+#include <mach_debug/runq_info.h>
+#include <mach_debug/wait_info.h>
+#include <kern/mach_debug.server.h>
+#endif	/* MACH_DEBUG */
+
 int		min_quantum;	/* defines max context switch rate */
 
 unsigned	sched_tick;
@@ -111,15 +124,23 @@ timer_elt_data_t recompute_priorities_timer;
  *	or by directly waking that thread up with clear_wait().
  *
  *	The implementation of wait events uses a hash table.  Each
- *	bucket is queue of threads having the same hash function
- *	value; the chain for the queue (linked list) is the run queue
- *	field.  [It is not possible to be waiting and runnable at the
- *	same time.]
+ *	bucket is a queue of wait lists, one for every event falling
+ *	in the bucket that threads are waiting on.  A wait list is a
+ *	queue of the threads waiting on its event; the chain for the
+ *	queue (linked list) is the run queue field.  [It is not possible
+ *	to be waiting and runnable at the same time.]  This way, wakeups
+ *	only look at the threads waiting on their event.
+ *
+ *	Wait lists are not allocated when waiting: each thread has
+ *	one.  The list of the first thread to wait on an event becomes
+ *	the list of the event, and the next ones leave theirs on it
+ *	as spares.  A thread leaving a list takes a spare back, or the
+ *	list itself if it is the last one.
  *
  *	Locks on both the thread and on the hash buckets govern the
- *	wait event field and the queue chain field.  Because wakeup
- *	operations only have the event as an argument, the event hash
- *	bucket must be locked before any thread.
+ *	wait event field, the wait list field and the queue chain field.
+ *	Because wakeup operations only have the event as an argument,
+ *	the event hash bucket must be locked before any thread.
  *
  *	Scheduling operations may also occur at interrupt level; therefore,
  *	interrupts below splsched() must be prevented when holding
@@ -128,11 +149,49 @@ timer_elt_data_t recompute_priorities_timer;
  *	The wait event hash table declarations are as follows:
  */
 
-#define NUMQUEUES	SCHED_WAIT_HASH_SIZE
+struct wait_list {
+	queue_chain_t	link;		/* in its bucket, or in spares */
+	event_t		event;		/* event waited on */
+	queue_head_t	threads;	/* threads waiting on it */
+	queue_head_t	spares;		/* lists they brought along */
+};
+
+static struct kmem_cache wait_list_cache;
+
+struct wait_bucket {
+	decl_simple_lock_data(,	lock)	/* shall be taken at splsched only */
+	queue_head_t	lists;		/* wait lists of the bucket */
+	unsigned int	nr_lists;	/* length of the chain */
+	unsigned int	max_lists;	/* longest it has been */
+	uint64_t	hold_start;	/* TSC when locked */
+	uint64_t	lock_count;	/* times locked */
+	uint64_t	hold_cycles;	/* total time held */
+	uint64_t	max_hold;	/* longest time held */
+	uint64_t	waits;		/* threads which waited here */
+	uint64_t	wakeups;	/* wakeups of events of the bucket */
+	uint64_t	woken;		/* threads they woke up */
+};
+
+/*
+ *	Until wait_table_init sizes it for the machine, the table
+ *	is a small static one.  Its size is always a power of 2.
+ */
+#define WAIT_TABLE_BOOT_SIZE	16
+#define WAIT_TABLE_MAX_SIZE	16384
+
+/*
+ *	Buckets for each processor, and memory for each bucket:
+ *	the number of threads which may wait at the same time
+ *	grows with both.
+ */
+#define WAIT_TABLE_CPU_BUCKETS	256
+#define WAIT_TABLE_BUCKET_MEM	(64 * KERNEL_STACK_SIZE)
 
-/* Shall be taken at splsched only */
-decl_simple_lock_data(static,	wait_lock[NUMQUEUES])	 /* Lock for... */
-queue_head_t		wait_queue[NUMQUEUES];
+static struct wait_bucket wait_table_boot[WAIT_TABLE_BOOT_SIZE];
+static struct wait_bucket *wait_table = wait_table_boot;
+static unsigned int wait_table_size = WAIT_TABLE_BOOT_SIZE;
+static unsigned int wait_table_shift = 4;	/* log2(wait_table_size) */
+static boolean_t wait_table_have_tsc;
 
 #ifdef MACH_LDEBUG
 #define waitq_lock(wl)		\
@@ -150,19 +209,196 @@ MACRO_END
 #define waitq_unlock(wl)	simple_unlock_nocheck(wl)
 #endif
 
+static inline void wait_bucket_lock(struct wait_bucket *bucket)
+{
+	waitq_lock(&bucket->lock);
+	bucket->lock_count++;
+	if (wait_table_have_tsc)
+		bucket->hold_start = get_tsc();
+}
+
+static inline void wait_bucket_unlock(struct wait_bucket *bucket)
+{
+	uint64_t held;
+
+	if (wait_table_have_tsc) {
+		held = get_tsc() - bucket->hold_start;
+		bucket->hold_cycles += held;
+		if (held > bucket->max_hold)
+			bucket->max_hold = held;
+	}
+	waitq_unlock(&bucket->lock);
+}
+
+/*
+ *	Fibonacci hashing: multiply by 2^N / phi and keep the high
+ *	order bits, which depend on all the bits of the event.  Events
+ *	are addresses, so their low order bits are mostly the same.
+ */
+#ifdef __LP64__
+#define WAIT_HASH_MULTIPLIER	0x9e3779b97f4a7c15UL
+#else
+#define WAIT_HASH_MULTIPLIER	0x9e3779b9UL
+#endif
+
+static inline unsigned long wait_hash(event_t event, unsigned int shift)
+{
+	return ((unsigned long) event * WAIT_HASH_MULTIPLIER) >>
+	       (sizeof(unsigned long) * 8 - shift);
+}
+
+static inline struct wait_bucket *wait_bucket(event_t event)
+{
+	return &wait_table[wait_hash(event, wait_table_shift)];
+}
+
+static void wait_bucket_init(struct wait_bucket *bucket)
+{
+	memset(bucket, 0, sizeof *bucket);
+	simple_lock_init(&bucket->lock);
+	queue_init(&bucket->lists);
+}
+
+static void wait_bucket_add(
+	struct wait_bucket	*bucket,
+	struct wait_list	*wl)
+{
+	enqueue_tail(&bucket->lists, &wl->link);
+	if (++bucket->nr_lists > bucket->max_lists)
+		bucket->max_lists = bucket->nr_lists;
+}
+
+/*
+ *	Find the wait list of event in its bucket, which must be locked.
+ */
+static struct wait_list *wait_bucket_lookup(
+	struct wait_bucket	*bucket,
+	event_t			event)
+{
+	struct wait_list *wl;
+
+	queue_iterate(&bucket->lists, wl, struct wait_list *, link) {
+		if (wl->event == event)
+			return wl;
+	}
+	return NULL;
+}
+
+/*
+ *	Remove thread from the wait list it waits on.  The bucket of
+ *	the list and the thread must be locked.  Returns whether
+ *	the list was emptied, and so given back to thread.
+ */
+static boolean_t wait_list_remove(
+	struct wait_bucket	*bucket,
+	struct wait_list	*wl,
+	thread_t		thread)
+{
+	remqueue(&wl->threads, (queue_entry_t) thread);
+	thread->wait_event = 0;
+
+	if (queue_empty(&wl->threads)) {
+		assert(queue_empty(&wl->spares));
+		remqueue(&bucket->lists, &wl->link);
+		bucket->nr_lists--;
+		thread->wait_list = wl;
+		return TRUE;
+	}
+
+	thread->wait_list = (struct wait_list *) dequeue_head(&wl->spares);
+	return FALSE;
+}
+
+static void wait_list_init(struct wait_list *wl)
+{
+	wl->event = 0;
+	queue_init(&wl->threads);
+	queue_init(&wl->spares);
+}
+
+/*
+ *	Wait lists of new and destroyed threads.
+ */
+struct wait_list *wait_list_alloc(void)
+{
+	struct wait_list *wl;
+
+	wl = (struct wait_list *) kmem_cache_alloc(&wait_list_cache);
+	if (wl != NULL)
+		wait_list_init(wl);
+	return wl;
+}
 
-/* NOTE: we want a small positive integer out of this */
-#define wait_hash(event) \
-	((((long)(event) < 0) ? ~(long)(event) : (long)(event)) % NUMQUEUES)
+void wait_list_free(struct wait_list *wl)
+{
+	assert(queue_empty(&wl->threads) && queue_empty(&wl->spares));
+	kmem_cache_free(&wait_list_cache, (vm_offset_t) wl);
+}
 
 static void wait_queue_init(void)
 {
 	int i;
 
-	for (i = 0; i < NUMQUEUES; i++) {
-		queue_init(&wait_queue[i]);
-		simple_lock_init(&wait_lock[i]);
+	for (i = 0; i < WAIT_TABLE_BOOT_SIZE; i++)
+		wait_bucket_init(&wait_table_boot[i]);
+}
+
+/*
+ *	Size the wait event hash table for the machine, now that the
+ *	number of processors and the amount of memory are known.
+ *	Called during startup, before any thread is created.
+ */
+void wait_table_init(void)
+{
+	struct wait_bucket *table, *bucket;
+	struct wait_list *wl;
+	unsigned int size, shift, min_size, i;
+	vm_offset_t addr;
+	spl_t s;
+
+	kmem_cache_init(&wait_list_cache, "wait_list",
+			sizeof(struct wait_list), 0, NULL, 0);
+
+	min_size = SCHED_WAIT_HASH_SIZE;
+	if (smp_get_numcpus() * WAIT_TABLE_CPU_BUCKETS > min_size)
+		min_size = smp_get_numcpus() * WAIT_TABLE_CPU_BUCKETS;
+	if (vm_page_mem_size() / WAIT_TABLE_BUCKET_MEM > min_size)
+		min_size = vm_page_mem_size() / WAIT_TABLE_BUCKET_MEM;
+	if (min_size > WAIT_TABLE_MAX_SIZE)
+		min_size = WAIT_TABLE_MAX_SIZE;
+
+	for (size = 1, shift = 0; size < min_size; size <<= 1)
+		shift++;
+
+	if (kmem_alloc_wired(kernel_map, &addr,
+			     round_page(size * sizeof *table)) != KERN_SUCCESS) {
+		printf("wait_table_init: keeping %u buckets\n",
+		       wait_table_size);
+		return;
+	}
+	table = (struct wait_bucket *) addr;
+	for (i = 0; i < size; i++)
+		wait_bucket_init(&table[i]);
+
+	/*
+	 *	Move whatever waits on the boot table to the new one.
+	 */
+	s = splsched();
+	for (i = 0; i < WAIT_TABLE_BOOT_SIZE; i++) {
+		bucket = &wait_table_boot[i];
+		waitq_lock(&bucket->lock);
+		while (!queue_empty(&bucket->lists)) {
+			wl = (struct wait_list *) dequeue_head(&bucket->lists);
+			wait_bucket_add(&table[wait_hash(wl->event, shift)],
+					wl);
+		}
+		waitq_unlock(&bucket->lock);
 	}
+	wait_table = table;
+	wait_table_size = size;
+	wait_table_shift = shift;
+	wait_table_have_tsc = CPU_HAS_FEATURE(CPU_FEATURE_TSC);
+	splx(s);
 }
 
 void sched_init(void)
@@ -237,10 +473,9 @@ void assert_wait(
 	event_t		event,
 	boolean_t	interruptible)
 {
-	queue_t			q;
-	int			index;
+	struct wait_bucket	*bucket;
+	struct wait_list	*wl;
 	thread_t		thread;
-	decl_simple_lock_data( , *lock);
 	spl_t			s;
 
 	thread = current_thread();
@@ -250,19 +485,26 @@ void assert_wait(
 	}
  	s = splsched();
 	if (event != 0) {
-		index = wait_hash(event);
-		q = &wait_queue[index];
-		lock = &wait_lock[index];
-		waitq_lock(lock);
+		bucket = wait_bucket(event);
+		wait_bucket_lock(bucket);
 		thread_lock(thread);
-		enqueue_tail(q, &(thread->links));
+		wl = wait_bucket_lookup(bucket, event);
+		if (wl == NULL) {
+			wl = thread->wait_list;
+			wl->event = event;
+			wait_bucket_add(bucket, wl);
+		} else
+			enqueue_tail(&wl->spares, &thread->wait_list->link);
+		enqueue_tail(&wl->threads, &(thread->links));
+		thread->wait_list = wl;
 		thread->wait_event = event;
+		bucket->waits++;
 		if (interruptible)
 			thread->state |= TH_WAIT;
 		else
 			thread->state |= TH_WAIT | TH_UNINT;
 		thread_unlock(thread);
-		waitq_unlock(lock);
+		wait_bucket_unlock(bucket);
 	}
 	else {
 		thread_lock(thread);
@@ -292,9 +534,7 @@ void clear_wait(
 	int			result,
 	boolean_t		interrupt_only)
 {
-	int			index;
-	queue_t			q;
-	decl_simple_lock_data( , *lock);
+	struct wait_bucket	*bucket;
 	event_t			event;
 	spl_t			s;
 
@@ -312,10 +552,8 @@ void clear_wait(
 	event = thread->wait_event;
 	if (event != 0) {
 		thread_unlock(thread);
-		index = wait_hash(event);
-		q = &wait_queue[index];
-		lock = &wait_lock[index];
-		waitq_lock(lock);
+		bucket = wait_bucket(event);
+		wait_bucket_lock(bucket);
 		/*
 		 *	If the thread is still waiting on that event,
 		 *	then remove it from the list.  If it is waiting
@@ -324,11 +562,10 @@ void clear_wait(
 		 */
 		thread_lock(thread);
 		if (thread->wait_event == event) {
-			remqueue(q, (queue_entry_t)thread);
-			thread->wait_event = 0;
+			wait_list_remove(bucket, thread->wait_list, thread);
 			event = 0;		/* cause to run below */
 		}
-		waitq_unlock(lock);
+		wait_bucket_unlock(bucket);
 	}
 	if (event == 0) {
 		int	state = thread->state;
@@ -395,68 +632,72 @@ boolean_t thread_wakeup_prim(
 	boolean_t	one_thread,
 	int		result)
 {
-	queue_t			q;
-	int			index;
-	boolean_t woke = FALSE;
-	thread_t		thread, next_th;
-	decl_simple_lock_data( , *lock);
+	struct wait_bucket	*bucket;
+	struct wait_list	*wl;
+	boolean_t		woke = FALSE, emptied;
+	thread_t		thread;
 	spl_t			s;
 	int			state;
 
-	index = wait_hash(event);
-	q = &wait_queue[index];
+	bucket = wait_bucket(event);
 	s = splsched();
-	lock = &wait_lock[index];
-	waitq_lock(lock);
-	thread = (thread_t) queue_first(q);
-	while (!queue_end(q, (queue_entry_t)thread)) {
-		next_th = (thread_t) queue_next((queue_t) thread);
+	wait_bucket_lock(bucket);
+	bucket->wakeups++;
+	wl = wait_bucket_lookup(bucket, event);
+	if (wl == NULL) {
+		wait_bucket_unlock(bucket);
+		splx(s);
+		return FALSE;
+	}
 
-		if (thread->wait_event == event) {
-			thread_lock(thread);
-			remqueue(q, (queue_entry_t) thread);
-			thread->wait_event = 0;
-			reset_timeout_check(&thread->timer);
+	/*
+	 *	Only threads waiting on the event are on the list, so
+	 *	wake them up from its head.  Once the last one is gone,
+	 *	the list belongs to it: don't look at it again.
+	 */
+	do {
+		thread = (thread_t) queue_first(&wl->threads);
+		thread_lock(thread);
+		emptied = wait_list_remove(bucket, wl, thread);
+		reset_timeout_check(&thread->timer);
 
-			state = thread->state;
-			switch (state & TH_SCHED_STATE) {
+		state = thread->state;
+		switch (state & TH_SCHED_STATE) {
 
-			    case	  TH_WAIT | TH_SUSP | TH_UNINT:
-			    case	  TH_WAIT	    | TH_UNINT:
-			    case	  TH_WAIT:
-				/*
-				 *	Sleeping and not suspendable - put
-				 *	on run queue.
-				 */
-				thread->state = (state &~ TH_WAIT) | TH_RUN;
-				thread->wait_result = result;
-				thread_setrun(thread, TRUE);
-				break;
+		    case	  TH_WAIT | TH_SUSP | TH_UNINT:
+		    case	  TH_WAIT	    | TH_UNINT:
+		    case	  TH_WAIT:
+			/*
+			 *	Sleeping and not suspendable - put
+			 *	on run queue.
+			 */
+			thread->state = (state &~ TH_WAIT) | TH_RUN;
+			thread->wait_result = result;
+			thread_setrun(thread, TRUE);
+			break;
 
-			    case	  TH_WAIT | TH_SUSP:
-			    case TH_RUN | TH_WAIT:
-			    case TH_RUN | TH_WAIT | TH_SUSP:
-			    case TH_RUN | TH_WAIT	    | TH_UNINT:
-			    case TH_RUN | TH_WAIT | TH_SUSP | TH_UNINT:
-				/*
-				 *	Either already running, or suspended.
-				 */
-				thread->state = state &~ TH_WAIT;
-				thread->wait_result = result;
-				break;
+		    case	  TH_WAIT | TH_SUSP:
+		    case TH_RUN | TH_WAIT:
+		    case TH_RUN | TH_WAIT | TH_SUSP:
+		    case TH_RUN | TH_WAIT	    | TH_UNINT:
+		    case TH_RUN | TH_WAIT | TH_SUSP | TH_UNINT:
+			/*
+			 *	Either already running, or suspended.
+			 */
+			thread->state = state &~ TH_WAIT;
+			thread->wait_result = result;
+			break;
 
-			    default:
-				state_panic(thread);
-				break;
-			}
-			thread_unlock(thread);
-			woke = TRUE;
-			if (one_thread)
-				break;
+		    default:
+			state_panic(thread);
+			break;
 		}
-		thread = next_th;
-	}
-	waitq_unlock(lock);
+		thread_unlock(thread);
+		bucket->woken++;
+		woke = TRUE;
+	} while (!one_thread && !emptied);
+
+	wait_bucket_unlock(bucket);
 	splx(s);
 	return (woke);
 }
@@ -515,107 +756,80 @@ static thread_t thread_select(
 	processor_t myprocessor)
 {
 	thread_t thread;
+	processor_set_t pset;
 
 	myprocessor->first_quantum = TRUE;
-	/*
-	 *	Check for obvious simple case; local runq is
-	 *	empty and global runq has entry at hint.
-	 */
-	if (myprocessor->runq.count > 0) {
-		thread = choose_thread(myprocessor);
-		myprocessor->quantum = min_quantum;
-	}
-	else {
-		processor_set_t pset;
 
 #if	MACH_HOST
-		pset = myprocessor->processor_set;
+	pset = myprocessor->processor_set;
 #else	/* MACH_HOST */
-		pset = &default_pset;
+	pset = &default_pset;
 #endif	/* MACH_HOST */
-		simple_lock(&pset->runq.lock);
-#if	DEBUG
-		checkrq(&pset->runq, "thread_select");
-#endif	/* DEBUG */
-		if (pset->runq.count == 0) {
-			/*
-			 *	Nothing else runnable.  Return if this
-			 *	thread is still runnable on this processor.
-			 *	Check for priority update if required.
-			 */
-			thread = current_thread();
-			if ((thread->state == TH_RUN) &&
+
+	/*
+	 *	Check for obvious simple case; both run queues are
+	 *	empty and the current thread can go on running.
+	 */
+	thread = current_thread();
+	if (myprocessor->runq.count == 0 && pset->runq.count == 0 &&
+	    (thread->state == TH_RUN) &&
 #if	MACH_HOST
-			    (thread->processor_set == pset) &&
+	    (thread->processor_set == pset) &&
 #endif	/* MACH_HOST */
-			    ((thread->bound_processor == PROCESSOR_NULL) ||
-			     (thread->bound_processor == myprocessor))) {
-
-				simple_unlock(&pset->runq.lock);
-				thread_lock(thread);
-				if (thread->sched_stamp != sched_tick)
-				    update_priority(thread);
-				thread_unlock(thread);
-			}
-			else {
-				thread = choose_pset_thread(myprocessor, pset);
-			}
-		}
-		else {
-			queue_t	q;
-
-			/*
-			 *	If there is a thread at hint, grab it,
-			 *	else call choose_pset_thread.
-			 */
-			q = pset->runq.runq + pset->runq.low;
-
-			if (queue_empty(q)) {
-				pset->runq.low++;
-				thread = choose_pset_thread(myprocessor, pset);
-			}
-			else {
-				thread = (thread_t) dequeue_head(q);
-				thread->runq = RUN_QUEUE_NULL;
-				pset->runq.count--;
-#if	MACH_FIXPRI
-				/*
-				 *	Cannot lazy evaluate pset->runq.low for
-				 *	fixed priority policy
-				 */
-				if ((pset->runq.count > 0) &&
-				    (pset->policies & POLICY_FIXEDPRI)) {
-					    while (queue_empty(q)) {
-						pset->runq.low++;
-						q++;
-					    }
-				}
-#endif	/* MACH_FIXPRI */
-#if	DEBUG
-				checkrq(&pset->runq, "thread_select: after");
-#endif	/* DEBUG */
-				simple_unlock(&pset->runq.lock);
-			}
-		}
+	    ((thread->bound_processor == PROCESSOR_NULL) ||
+	     (thread->bound_processor == myprocessor))) {
+		thread_lock(thread);
+		if (thread->sched_stamp != sched_tick)
+		    update_priority(thread);
+		thread_unlock(thread);
+	}
+	else {
+		thread = choose_thread(myprocessor);
+	}
 
 #if	MACH_FIXPRI
-		if (thread->policy == POLICY_TIMESHARE) {
+	if (thread->policy == POLICY_TIMESHARE) {
 #endif	/* MACH_FIXPRI */
-			myprocessor->quantum = pset->set_quantum;
+		myprocessor->quantum = pset->set_quantum;
 #if	MACH_FIXPRI
-		}
-		else {
-			/*
-			 *	POLICY_FIXEDPRI
-			 */
-			myprocessor->quantum = thread->sched_data;
-		}
-#endif	/* MACH_FIXPRI */
 	}
+	else {
+		/*
+		 *	POLICY_FIXEDPRI
+		 */
+		myprocessor->quantum = thread->sched_data;
+	}
+#endif	/* MACH_FIXPRI */
 
 	return thread;
 }
 
+/*
+ *	Account for a processor switching to a thread, and keep track
+ *	of how warm the caches of the processor are for the thread.
+ */
+static inline void processor_note_switch(
+	processor_t	myprocessor,
+	thread_t	new_thread)
+{
+	myprocessor->context_switches++;
+#if	NCPUS > 1
+	myprocessor->active_pri = new_thread->sched_pri;
+	if (new_thread->last_processor == myprocessor) {
+		thread_update_cache_warmth(new_thread);
+		return;
+	}
+
+	if (new_thread->last_processor != PROCESSOR_NULL) {
+		new_thread->migration_count++;
+		new_thread->last_processor->migration_out++;
+		myprocessor->migration_in++;
+	}
+	new_thread->cache_warmth = 0;
+	new_thread->last_processor = myprocessor;
+#endif	/* NCPUS > 1 */
+}
+
 /*
  *	Stop running the current thread and start running the new thread.
  *	If continuation is non-zero, and the current thread is blocked,
@@ -630,7 +844,13 @@ boolean_t thread_invoke(
 	thread_t 	new_thread)
 {
 	DTRACE_THREAD_SWITCH(old_thread, new_thread);
-	
+
+	/*
+	 *	The old thread is done running, and so is done
+	 *	with the data it read locklessly.
+	 */
+	llsync_report_context_switch();
+
 	/*
 	 *	Check for invoking the same thread.
 	 */
@@ -666,9 +886,7 @@ boolean_t thread_invoke(
 		    thread_unlock(new_thread);
 		    thread_wakeup(TH_EV_STATE(new_thread));
 
-#if	NCPUS > 1
-		    new_thread->last_processor = current_processor();
-#endif	/* NCPUS > 1 */
+		    processor_note_switch(current_processor(), new_thread);
 
 		    /*
 		     *	Set up ast context of new thread and
@@ -799,9 +1017,7 @@ boolean_t thread_invoke(
 	/*
 	 *	Thread is now interruptible.
 	 */
-#if	NCPUS > 1
-	new_thread->last_processor = current_processor();
-#endif	/* NCPUS > 1 */
+	processor_note_switch(current_processor(), new_thread);
 
 	/*
 	 *	Set up ast context of new thread and switch to its timer.
@@ -1107,12 +1323,6 @@ void recompute_priorities(void *param)
 {
 	sched_tick++;		/* age usage one more time */
 	set_timeout(&recompute_priorities_timer, hz);
-#if NCPUS > 1
-	/* Perform load balancing every few ticks */
-	if ((sched_tick % 4) == 0) {
-		thread_balance_load();
-	}
-#endif /* NCPUS > 1 */
 	/*
 	 *	Wakeup scheduler thread.
 	 */
@@ -1189,198 +1399,338 @@ void update_priority(
 }
 
 /*
- *	run_queue_enqueue macro for thread_setrun().
+ *	run_queue_init:
+ *
+ *	Initialize an empty run queue.
  */
-#if	DEBUG
-#define run_queue_enqueue(rq, th)					\
-	MACRO_BEGIN							\
-	    unsigned int	whichq;					\
-									\
-	    whichq = (th)->sched_pri;					\
-	    if (whichq >= NRQS) {					\
-	printf("thread_setrun: pri too high (%d)\n", (th)->sched_pri);  \
-		whichq = NRQS - 1;					\
-	    }								\
-									\
-	    runq_lock(rq);	/* lock the run queue */	\
-	    checkrq((rq), "thread_setrun: before adding thread");	\
-	    enqueue_tail(&(rq)->runq[whichq], &((th)->links));		\
-									\
-	    if (whichq < (rq)->low || (rq)->count == 0) 		\
-		 (rq)->low = whichq;	/* minimize */			\
-									\
-	    (rq)->count++;						\
-	    (th)->runq = (rq);						\
-	    thread_check((th), (rq));					\
-	    checkrq((rq), "thread_setrun: after adding thread");	\
-	    runq_unlock(rq);						\
-	MACRO_END
-#else	/* DEBUG */
-#define run_queue_enqueue(rq, th)					\
-	MACRO_BEGIN							\
-	    unsigned int	whichq;					\
-									\
-	    whichq = (th)->sched_pri;					\
-	    if (whichq >= NRQS) {					\
-	printf("thread_setrun: pri too high (%d)\n", (th)->sched_pri);  \
-		whichq = NRQS - 1;					\
-	    }								\
-									\
-	    runq_lock(rq);	/* lock the run queue */	\
-	    enqueue_tail(&(rq)->runq[whichq], &((th)->links));		\
-									\
-	    if (whichq < (rq)->low || (rq)->count == 0) 		\
-		 (rq)->low = whichq;	/* minimize */			\
-									\
-	    (rq)->count++;						\
-	    (th)->runq = (rq);						\
-	    runq_unlock(rq);						\
-	MACRO_END
-#endif	/* DEBUG */
+void run_queue_init(
+	run_queue_t	rq)
+{
+	int	i;
+
+	simple_lock_init(&rq->lock);
+	for (i = 0; i < NRQS; i++)
+		queue_init(&rq->runq[i]);
+	rq->low = 0;
+	rq->count = 0;
+	rq->nbound = 0;
+	for (i = 0; i < RUNQ_BITMAP_SIZE; i++)
+		rq->bitmap[i] = 0;
+	rq->lock_count = 0;
+	rq->lock_contended = 0;
+}
+
 /*
- *	thread_setrun:
- *
- *	Make thread runnable; dispatch directly onto an idle processor
- *	if possible.  Else put on appropriate run queue (processor
- *	if bound, else processor set.  Caller must have lock on thread.
- *	This is always called at splsched.
+ *	Run queue primitives.  The run queue must be locked.
  */
 
-void thread_setrun(
-	thread_t		th,
-	boolean_t		may_preempt)
+static inline int runq_index(
+	const thread_t	th)
 {
-	processor_t	processor;
-	run_queue_t	rq;
-#if	NCPUS > 1
-	processor_set_t	pset;
-#endif	/* NCPUS > 1 */
+	int	whichq;
 
-	/*
-	 *	Update priority if needed.
-	 */
-	if (th->sched_stamp != sched_tick) {
-		update_priority(th);
+	whichq = th->sched_pri;
+	if (whichq >= NRQS) {
+		printf("thread_setrun: pri too high (%d)\n", th->sched_pri);
+		whichq = NRQS - 1;
 	}
+	return whichq;
+}
 
-	assert(th->runq == RUN_QUEUE_NULL);
+/*
+ *	Return the index of the highest priority non-empty queue,
+ *	NRQS if there is none.
+ */
+static inline int runq_first(
+	const run_queue_t	rq)
+{
+	unsigned int	i;
 
-#if	NCPUS > 1
-	/*
-	 *	Try to dispatch the thread directly onto an idle processor.
-	 */
-	if ((processor = th->bound_processor) == PROCESSOR_NULL) {
-	    /*
-	     *	Not bound, use load balancing to select best processor.
-	     */
-	    pset = th->processor_set;
-	    processor = thread_select_best_processor(th);
-	    
-#if	HW_FOOTPRINT
-	    /*
-	     *	Check if selected processor is idle and can take the thread immediately.
-	     */
-	    if (processor != PROCESSOR_NULL && processor->state == PROCESSOR_IDLE) {
-		    processor_lock(processor);
-		    pset_idle_lock();
-		    if ((processor->state == PROCESSOR_IDLE)
-#if	MACH_HOST
-			&& (processor->processor_set == pset)
-#endif	/* MACH_HOST */
-			) {
-			    queue_remove(&pset->idle_queue, processor,
-			        processor_t, processor_queue);
-			    pset->idle_count--;
-			    processor->next_thread = th;
-			    processor->state = PROCESSOR_DISPATCHING;
-			    /* Update cache warmth if same processor */
-			    if (processor == th->last_processor) {
-				    thread_update_cache_warmth(th);
-			    } else {
-				    th->cache_warmth = 0;
-				    th->last_processor = processor;
-			    }
-			    pset_idle_unlock();
-			    processor_unlock(processor);
-			    if (processor != current_processor())
-				cause_ast_check(processor);
-		            return;
-		    }
-		    pset_idle_unlock();
-		    processor_unlock(processor);
-	    }
-#endif	/* HW_FOOTPRINT */
+	for (i = 0; i < RUNQ_BITMAP_SIZE; i++)
+		if (rq->bitmap[i] != 0)
+			return i * RUNQ_BITMAP_BITS +
+			       __builtin_ctzl(rq->bitmap[i]);
+	return NRQS;
+}
 
-	    if (pset->idle_count > 0) {
-		pset_idle_lock();
-		if (pset->idle_count > 0) {
-		    processor = (processor_t) queue_first(&pset->idle_queue);
-		    queue_remove(&(pset->idle_queue), processor, processor_t,
-				processor_queue);
-		    pset->idle_count--;
-		    processor->next_thread = th;
-		    processor->state = PROCESSOR_DISPATCHING;
-		    pset_idle_unlock();
-		    if (processor != current_processor())
-			cause_ast_check(processor);
-		    return;
-		}
-		pset_idle_unlock();
-	    }
-	    rq = &(pset->runq);
-	    run_queue_enqueue(rq,th);
-	    /*
-	     * Preempt check
-	     */
-	    if (may_preempt &&
+static inline void runq_bitmap_set(
+	run_queue_t	rq,
+	int		whichq)
+{
+	rq->bitmap[whichq / RUNQ_BITMAP_BITS] |=
+		1UL << (whichq % RUNQ_BITMAP_BITS);
+}
+
+static inline void runq_bitmap_clear(
+	run_queue_t	rq,
+	int		whichq)
+{
+	rq->bitmap[whichq / RUNQ_BITMAP_BITS] &=
+		~(1UL << (whichq % RUNQ_BITMAP_BITS));
+}
+
+static inline void runq_insert(
+	run_queue_t	rq,
+	thread_t	th,
+	boolean_t	head)
+{
+	int	whichq;
+
+	whichq = runq_index(th);
+	if (head)
+		enqueue_head(&rq->runq[whichq], &th->links);
+	else
+		enqueue_tail(&rq->runq[whichq], &th->links);
+	runq_bitmap_set(rq, whichq);
+	if (whichq < rq->low || rq->count == 0)
+		rq->low = whichq;
+	rq->count++;
+	if (th->bound_processor != PROCESSOR_NULL)
+		rq->nbound++;
+	th->runq = rq;
+}
+
+/*
+ *	Remove a thread from queue whichq of the run queue.  The bit of
+ *	the queue is cleared only once it is really empty, so that it
+ *	stays right even if a thread is found on another queue than its
+ *	priority says.
+ */
+static inline void runq_unlink(
+	run_queue_t	rq,
+	thread_t	th,
+	int		whichq)
+{
+	remqueue(&rq->runq[whichq], (queue_entry_t) th);
+	if (queue_empty(&rq->runq[whichq]))
+		runq_bitmap_clear(rq, whichq);
+	rq->count--;
+	if (th->bound_processor != PROCESSOR_NULL && rq->nbound > 0)
+		rq->nbound--;
+	th->runq = RUN_QUEUE_NULL;
+	rq->low = runq_first(rq);
+}
+
+/*
+ *	Return the index of the highest priority queue with a thread,
+ *	the run queue must not be empty.
+ */
+static inline int runq_first_busy(
+	run_queue_t	rq)
+{
+	int	whichq;
+
+	for (;;) {
+		whichq = runq_first(rq);
+		if (whichq == NRQS)
+			panic("runq_first_busy: count %d but no thread",
+			      rq->count);
+		if (!queue_empty(&rq->runq[whichq]))
+			return whichq;
+		runq_bitmap_clear(rq, whichq);
+	}
+}
+
+/*
+ *	Remove and return the highest priority thread of a non-empty
+ *	run queue.
+ */
+static thread_t runq_dequeue(
+	run_queue_t	rq)
+{
+	thread_t	th;
+	int		whichq;
+
+	whichq = runq_first_busy(rq);
+	th = (thread_t) queue_first(&rq->runq[whichq]);
+	runq_unlink(rq, th, whichq);
+#if	DEBUG
+	checkrq(rq, "runq_dequeue");
+#endif	/* DEBUG */
+	return th;
+}
+
+/*
+ *	run_queue_enqueue:
+ *
+ *	Lock a run queue and put a thread at the end of the queue of
+ *	its priority.
+ */
+static void run_queue_enqueue(
+	run_queue_t	rq,
+	thread_t	th)
+{
+	runq_lock(rq);
+#if	DEBUG
+	checkrq(rq, "thread_setrun: before adding thread");
+#endif	/* DEBUG */
+	runq_insert(rq, th, FALSE);
+#if	DEBUG
+	thread_check(th, rq);
+	checkrq(rq, "thread_setrun: after adding thread");
+#endif	/* DEBUG */
+	runq_unlock(rq);
+}
+
+/*
+ *	run_queue_enqueue_head:
+ *
+ *	Same, but put the thread first of the threads of its priority.
+ */
+void run_queue_enqueue_head(
+	run_queue_t	rq,
+	thread_t	th)
+{
+	runq_lock(rq);
+	runq_insert(rq, th, TRUE);
+	runq_unlock(rq);
+}
+
+#if	NCPUS > 1
+/*
+ *	Try to hand a thread directly to an idle processor, which must
+ *	belong to pset.  Returns whether the thread was dispatched.
+ */
+static boolean_t thread_dispatch_idle(
+	thread_t	th,
+	processor_t	processor,
+	processor_set_t	pset)
+{
+	processor_lock(processor);
+	pset_idle_lock();
+	if (processor->state == PROCESSOR_IDLE
 #if	MACH_HOST
-		(pset == current_processor()->processor_set) &&
+	    && processor->processor_set == pset
 #endif	/* MACH_HOST */
-		(current_thread()->sched_pri > th->sched_pri)) {
-			/*
-			 *	Turn off first_quantum to allow csw.
-			 */
-			current_processor()->first_quantum = FALSE;
-			ast_on(cpu_number(), AST_BLOCK);
-	    }
+	    ) {
+		queue_remove(&pset->idle_queue, processor,
+			     processor_t, processor_queue);
+		pset->idle_count--;
+		processor->next_thread = th;
+		processor->state = PROCESSOR_DISPATCHING;
+		pset_idle_unlock();
+		processor_unlock(processor);
+		if (processor != current_processor())
+			cause_ast_check(processor);
+		return TRUE;
 	}
-	else {
+	pset_idle_unlock();
+	processor_unlock(processor);
+	return FALSE;
+}
+#endif	/* NCPUS > 1 */
+
+/*
+ *	thread_setrun:
+ *
+ *	Make thread runnable; dispatch directly onto an idle processor
+ *	if possible.  Else put on the run queue of the processor it
+ *	should run on: the one it is bound to, or the one chosen by
+ *	thread_select_best_processor.  Caller must have lock on thread.
+ *	This is always called at splsched.
+ */
+
+void thread_setrun(
+	thread_t		th,
+	boolean_t		may_preempt)
+{
+	processor_t	processor;
+	run_queue_t	rq;
+#if	NCPUS > 1
+	processor_set_t	pset;
+#endif	/* NCPUS > 1 */
+
+	/*
+	 *	Update priority if needed.
+	 */
+	if (th->sched_stamp != sched_tick) {
+		update_priority(th);
+	}
+
+	assert(th->runq == RUN_QUEUE_NULL);
+
+#if	NCPUS > 1
+    Retry:
+	if ((processor = th->bound_processor) == PROCESSOR_NULL) {
+	    pset = th->processor_set;
+	    processor = thread_select_best_processor(th);
+	    if (processor == PROCESSOR_NULL) {
+		/*
+		 *	The set has no processor at the moment.  Its
+		 *	threads wait on its run queue for one to come.
+		 */
+		run_queue_enqueue(&pset->runq, th);
+		return;
+	    }
+
+	    if (processor->state == PROCESSOR_IDLE &&
+		thread_dispatch_idle(th, processor, pset))
+		return;
+
 	    /*
-	     *	Bound, can only run on bound processor.  Have to lock
-	     *  processor here because it may not be the current one.
+	     *	The processor chosen got busy in the meantime, but
+	     *	another one may be idle.
 	     */
-	    if (processor->state == PROCESSOR_IDLE) {
-		processor_lock(processor);
-		pset = processor->processor_set;
+	    if (pset->idle_count > 0) {
 		pset_idle_lock();
-		if (processor->state == PROCESSOR_IDLE) {
-		    queue_remove(&pset->idle_queue, processor,
-			processor_t, processor_queue);
+		if (pset->idle_count > 0) {
+		    processor = (processor_t) queue_first(&pset->idle_queue);
+		    queue_remove(&(pset->idle_queue), processor, processor_t,
+				processor_queue);
 		    pset->idle_count--;
 		    processor->next_thread = th;
 		    processor->state = PROCESSOR_DISPATCHING;
 		    pset_idle_unlock();
-		    processor_unlock(processor);
 		    if (processor != current_processor())
 			cause_ast_check(processor);
 		    return;
 		}
 		pset_idle_unlock();
-		processor_unlock(processor);
 	    }
-	    rq = &(processor->runq);
-	    run_queue_enqueue(rq,th);
+
+	    rq = &processor->runq;
+	    run_queue_enqueue(rq, th);
 
 	    /*
-	     *	Cause ast on processor if processor is on line.
+	     *	The processor may have left the set while the thread
+	     *	was being queued, and drained its run queue before it
+	     *	got there.  Queue it again then.
 	     */
-	    if (processor == current_processor()) {
-		ast_on(cpu_number(), AST_BLOCK);
+	    if (processor->processor_set != pset) {
+		if (rem_runq(th) != RUN_QUEUE_NULL)
+		    goto Retry;
+		return;
 	    }
-	    else if ((processor->state != PROCESSOR_OFF_LINE)) {
-		cause_ast_check(processor);
+	}
+	else {
+	    /*
+	     *	Bound, can only run on bound processor.
+	     */
+	    if (processor->state == PROCESSOR_IDLE &&
+		thread_dispatch_idle(th, processor, processor->processor_set))
+		return;
+
+	    rq = &processor->runq;
+	    run_queue_enqueue(rq, th);
+	}
+
+	/*
+	 *	Preempt the thread running on the processor if the new
+	 *	one has a higher priority.
+	 */
+	if (processor == current_processor()) {
+	    if (may_preempt && current_thread()->sched_pri > th->sched_pri) {
+		/*
+		 *	Turn off first_quantum to allow csw.
+		 */
+		processor->first_quantum = FALSE;
+		ast_on(cpu_number(), AST_BLOCK);
 	    }
 	}
+	else if (may_preempt && processor->state != PROCESSOR_OFF_LINE &&
+		 processor->active_pri > th->sched_pri) {
+	    cause_ast_check(processor);
+	}
 #else	/* NCPUS > 1 */
 	/*
 	 *	XXX should replace queue with a boolean in this case.
@@ -1394,13 +1744,7 @@ void thread_setrun(
 	    processor->state = PROCESSOR_DISPATCHING;
 	    return;
 	}
-	if (th->bound_processor == PROCESSOR_NULL) {
-	    	rq = &(default_pset.runq);
-	}
-	else {
-		rq = &(master_processor->runq);
-		ast_on(cpu_number(), AST_BLOCK);
-	}
+	rq = &(master_processor->runq);
 	run_queue_enqueue(rq,th);
 
 	/*
@@ -1477,12 +1821,10 @@ struct run_queue *rem_runq(
 			checkrq(rq, "rem_runq: before removing thread");
 			thread_check(th, rq);
 #endif	/* DEBUG */
-			remqueue(&rq->runq[0], (queue_entry_t) th);
-			rq->count--;
+			runq_unlink(rq, th, runq_index(th));
 #if	DEBUG
 			checkrq(rq, "rem_runq: after removing thread");
 #endif	/* DEBUG */
-			th->runq = RUN_QUEUE_NULL;
 			runq_unlock(rq);
 		}
 		else {
@@ -1500,6 +1842,79 @@ struct run_queue *rem_runq(
 	return rq;
 }
 
+#if	NCPUS > 1
+/*
+ *	runq_steal:
+ *
+ *	Take a thread from the run queue of the busiest other processor
+ *	of the set, for myprocessor to run it.  Run queues are looked at
+ *	without locking, and only the one of the victim is locked, so
+ *	that idle processors don't get in each other's way.  Threads
+ *	bound to the victim are left alone.  Of the threads of the best
+ *	priority, the one with the coldest cache is taken, as it loses
+ *	the least by moving.
+ *
+ *	The set is locked so that its processors can't be reassigned
+ *	while they are walked.  Stealing is only opportunistic, so if
+ *	the lock is busy, nothing is taken.
+ *
+ *	Called at splsched without any run queue locked.
+ */
+static thread_t runq_steal(
+	processor_t	myprocessor,
+	processor_set_t	pset)
+{
+	processor_t	processor, victim;
+	run_queue_t	rq;
+	thread_t	th, best;
+	queue_t		q;
+	int		whichq, nr, max;
+
+	if (!pset_lock_try(pset))
+		return THREAD_NULL;
+
+	victim = PROCESSOR_NULL;
+	max = 0;
+	queue_iterate(&pset->processors, processor, processor_t, processors) {
+		if (processor == myprocessor)
+			continue;
+		nr = processor->runq.count - processor->runq.nbound;
+		if (nr > max) {
+			max = nr;
+			victim = processor;
+		}
+	}
+
+	if (victim == PROCESSOR_NULL) {
+		pset_unlock(pset);
+		return THREAD_NULL;
+	}
+
+	rq = &victim->runq;
+	runq_lock(rq);
+	best = THREAD_NULL;
+	for (whichq = rq->low; whichq < NRQS && rq->count > 0; whichq++) {
+		q = &rq->runq[whichq];
+		queue_iterate(q, th, thread_t, links) {
+			if (th->bound_processor != PROCESSOR_NULL)
+				continue;
+			if (best == THREAD_NULL ||
+			    th->cache_warmth < best->cache_warmth)
+				best = th;
+		}
+		if (best != THREAD_NULL) {
+			runq_unlink(rq, best, whichq);
+			break;
+		}
+	}
+	runq_unlock(rq);
+	pset_unlock(pset);
+
+	if (best != THREAD_NULL)
+		myprocessor->steals++;
+	return best;
+}
+#endif	/* NCPUS > 1 */
 
 /*
  *	choose_thread:
@@ -1510,51 +1925,39 @@ struct run_queue *rem_runq(
  *
  *	Strategy:
  *		Check processor runq first; if anything found, run it.
- *		Else check pset runq; if nothing found, return idle thread.
+ *		Else check pset runq, then steal from another processor;
+ *		if nothing found, return idle thread.
  *
  *	Second line of strategy is implemented by choose_pset_thread.
- *	This is only called on processor startup and when thread_block
- *	thinks there's something in the processor runq.
  */
 
 thread_t choose_thread(
 	processor_t myprocessor)
 {
 	thread_t th;
-	queue_t q;
 	run_queue_t runq;
-	int i;
 	processor_set_t pset;
 
 	runq = &myprocessor->runq;
 
-	simple_lock(&runq->lock);
+	runq_lock(runq);
 	if (runq->count > 0) {
-	    q = runq->runq + runq->low;
-	    for (i = runq->low; i < NRQS ; i++, q++) {
-		if (!queue_empty(q)) {
-		    th = (thread_t) dequeue_head(q);
-		    th->runq = RUN_QUEUE_NULL;
-		    runq->count--;
-		    runq->low = i;
-		    simple_unlock(&runq->lock);
-		    return th;
-		}
-	    }
-	    panic("choose_thread");
-	    /*NOTREACHED*/
+	    th = runq_dequeue(runq);
+	    runq_unlock(runq);
+	    return th;
 	}
-	simple_unlock(&runq->lock);
+	runq_unlock(runq);
 
 	pset = myprocessor->processor_set;
 
-	simple_lock(&pset->runq.lock);
+	runq_lock(&pset->runq);
 	return choose_pset_thread(myprocessor,pset);
 }
 
 /*
- *	choose_pset_thread:  choose a thread from processor_set runq or
- *		set processor idle and choose its idle thread.
+ *	choose_pset_thread:  choose a thread from processor_set runq,
+ *		steal one from another processor, or set processor idle
+ *		and choose its idle thread.
  *
  *	Caller must be at splsched and have a lock on the runq.  This
  *	lock is released by this routine.  myprocessor is always the current
@@ -1570,43 +1973,23 @@ thread_t choose_pset_thread(
 {
 	run_queue_t runq;
 	thread_t th;
-	queue_t q;
-	int i;
 
 	runq = &pset->runq;
 
 	if (runq->count > 0) {
-	    q = runq->runq + runq->low;
-	    for (i = runq->low; i < NRQS ; i++, q++) {
-		if (!queue_empty(q)) {
-		    th = (thread_t) dequeue_head(q);
-		    th->runq = RUN_QUEUE_NULL;
-		    runq->count--;
-		    /*
-		     *	For POLICY_FIXEDPRI, runq->low must be
-		     *	accurate!
-		     */
-#if	MACH_FIXPRI
-		    if ((runq->count > 0) &&
-			(pset->policies & POLICY_FIXEDPRI)) {
-			    while (queue_empty(q)) {
-				q++;
-				i++;
-			    }
-		    }
-#endif	/* MACH_FIXPRI */
-		    runq->low = i;
-#if	DEBUG
-		    checkrq(runq, "choose_pset_thread");
-#endif	/* DEBUG */
-		    simple_unlock(&runq->lock);
-		    return th;
-		}
-	    }
-	    panic("choose_pset_thread");
-	    /*NOTREACHED*/
+	    th = runq_dequeue(runq);
+	    runq_unlock(runq);
+	    return th;
 	}
-	simple_unlock(&runq->lock);
+	runq_unlock(runq);
+
+#if	NCPUS > 1
+	if (myprocessor->state == PROCESSOR_RUNNING) {
+	    th = runq_steal(myprocessor, pset);
+	    if (th != THREAD_NULL)
+		return th;
+	}
+#endif	/* NCPUS > 1 */
 
 	/*
 	 *	Nothing is runnable, so set this processor idle if it
@@ -1636,6 +2019,83 @@ thread_t choose_pset_thread(
 	return myprocessor->idle_thread;
 }
 
+#if	NCPUS > 1
+/*
+ *	processor_drain_runq:
+ *
+ *	Requeue the threads waiting on the run queue of a processor
+ *	which left its set, except those bound to it.  Called at
+ *	splsched with nothing locked.
+ */
+void processor_drain_runq(
+	processor_t	processor)
+{
+	run_queue_t	rq;
+	queue_head_t	drained;
+	thread_t	th, next;
+	int		whichq;
+
+	queue_init(&drained);
+	rq = &processor->runq;
+	runq_lock(rq);
+	for (whichq = 0; whichq < NRQS && rq->count > rq->nbound; whichq++) {
+		th = (thread_t) queue_first(&rq->runq[whichq]);
+		while (!queue_end(&rq->runq[whichq], (queue_entry_t) th)) {
+			next = (thread_t) queue_next(&th->links);
+			if (th->bound_processor == PROCESSOR_NULL) {
+				runq_unlink(rq, th, whichq);
+				enqueue_tail(&drained, &th->links);
+			}
+			th = next;
+		}
+	}
+	runq_unlock(rq);
+
+	/*
+	 *	The threads are on no run queue now, like threads
+	 *	chosen to run.
+	 */
+	while (!queue_empty(&drained)) {
+		th = (thread_t) dequeue_head(&drained);
+		thread_lock(th);
+		thread_setrun(th, FALSE);
+		thread_unlock(th);
+	}
+}
+#endif	/* NCPUS > 1 */
+
+#if	NCPUS > 1
+/*
+ *	Whether another processor of the set of myprocessor has threads
+ *	waiting which myprocessor could take.  Called by idle processors,
+ *	without any lock.  The processors queue of the set may be changed
+ *	under us, so the fixed processor array is walked instead; the
+ *	answer is only a hint, which runq_steal checks under the lock.
+ */
+static boolean_t runq_stealable(
+	processor_t	myprocessor)
+{
+	processor_set_t	pset;
+	processor_t	processor;
+	int		i;
+
+	pset = myprocessor->processor_set;
+	if (pset == PROCESSOR_SET_NULL)
+		return FALSE;
+
+	for (i = 0; i < NCPUS; i++) {
+		processor = cpu_to_processor(i);
+		if (processor != myprocessor &&
+		    *(volatile processor_set_t *) &processor->processor_set
+		    == pset &&
+		    *(volatile int *) &processor->runq.count >
+		    *(volatile int *) &processor->runq.nbound)
+			return TRUE;
+	}
+	return FALSE;
+}
+#endif	/* NCPUS > 1 */
+
 /*
  *	no_dispatch_count counts number of times processors go non-idle
  *	without being dispatched.  This should be very rare.
@@ -1677,10 +2137,15 @@ static void __attribute__((noreturn)) idle_thread_continue(void)
 
 /*
  *	This cpu will be dispatched (by thread_setrun) by setting next_thread
- *	to the value of the thread to run next.  Also check runq counts.
+ *	to the value of the thread to run next.  Also check runq counts,
+ *	and whether threads wait for another processor.
  */
 		while ((*threadp == (volatile thread_t)THREAD_NULL) &&
-		       (*gcount == 0) && (*lcount == 0)) {
+		       (*gcount == 0) && (*lcount == 0)
+#if	NCPUS > 1
+		       && !runq_stealable(myprocessor)
+#endif	/* NCPUS > 1 */
+		       ) {
 
 			/* check for ASTs while we wait */
 
@@ -1915,7 +2380,7 @@ do_runq_scan(
 	int		count;
 
 	s = splsched();
-	simple_lock(&runq->lock);
+	runq_lock(runq);
 	if ((count = runq->count) > 0) {
 	    q = runq->runq + runq->low;
 	    while (count > 0) {
@@ -1936,7 +2401,7 @@ do_runq_scan(
 				/*
 				 *	!@#$% No more room.
 				 */
-				simple_unlock(&runq->lock);
+				runq_unlock(runq);
 				splx(s);
 				return TRUE;
 			    }
@@ -1951,9 +2416,7 @@ do_runq_scan(
 			     *	see it.  So we remove the thread
 			     *	from the runq to make it safe.
 			     */
-			    remqueue(q, (queue_entry_t) thread);
-			    runq->count--;
-			    thread->runq = RUN_QUEUE_NULL;
+			    runq_unlink(runq, thread, q - runq->runq);
 
 			    stuck_threads[stuck_count++] = thread;
 if (do_thread_scan_debug)
@@ -1965,7 +2428,7 @@ if (do_thread_scan_debug)
 		q++;
 	    }
 	}
-	simple_unlock(&runq->lock);
+	runq_unlock(runq);
 	splx(s);
 
 	return FALSE;
@@ -2023,6 +2486,141 @@ void do_thread_scan(void)
 	} while (restart_needed);
 }
 
+#if	MACH_DEBUG
+static void runq_get_info(
+	run_queue_t	rq,
+	runq_info_t	*info)
+{
+	info->rqi_count = rq->count;
+	info->rqi_locks = rq->lock_count;
+	info->rqi_contended = rq->lock_contended;
+}
+
+/*
+ *	Routine:	host_runq_info [kernel call]
+ *	Purpose:
+ *		Return the state and statistics of the run queues.
+ *	Conditions:
+ *		Nothing locked.  Obeys CountInOut protocol.
+ *	Returns:
+ *		KERN_SUCCESS		Returned information.
+ *		KERN_INVALID_HOST	The host is null.
+ *		KERN_RESOURCE_SHORTAGE	Couldn't allocate memory.
+ */
+
+kern_return_t
+host_runq_info(
+	host_t			host,
+	runq_info_array_t	*infop,
+	mach_msg_type_number_t	*infoCntp)
+{
+	runq_info_t *info;
+	processor_t processor;
+	unsigned int i, ncpus, nr_infos;
+	vm_size_t info_size;
+	kern_return_t kr;
+
+	if (host == HOST_NULL)
+		return KERN_INVALID_HOST;
+
+	ncpus = smp_get_numcpus();
+	nr_infos = ncpus + 1;
+	info_size = nr_infos * sizeof *info;
+	info = (runq_info_t *) kalloc(info_size);
+	if (info == NULL)
+		return KERN_RESOURCE_SHORTAGE;
+
+	memset(info, 0, info_size);
+	for (i = 0; i < ncpus; i++) {
+		processor = cpu_to_processor(i);
+		info[i].rqi_cpu = processor->slot_num;
+		runq_get_info(&processor->runq, &info[i]);
+		info[i].rqi_switches = processor->context_switches;
+#if	NCPUS > 1
+		info[i].rqi_steals = processor->steals;
+		info[i].rqi_migrations = processor->migration_in;
+#endif	/* NCPUS > 1 */
+	}
+	info[ncpus].rqi_cpu = -1;
+	runq_get_info(&default_pset.runq, &info[ncpus]);
+
+	if (nr_infos <= *infoCntp) {
+		memcpy(*infop, info, info_size);
+	} else {
+		vm_offset_t info_addr;
+		vm_size_t total_size;
+		vm_map_copy_t copy;
+
+		kr = kmem_alloc_pageable(ipc_kernel_map, &info_addr, info_size);
+		if (kr != KERN_SUCCESS)
+			goto out;
+
+		memcpy((char *) info_addr, info, info_size);
+		total_size = round_page(info_size);
+		if (info_size < total_size)
+			memset((char *) (info_addr + info_size),
+			       0, total_size - info_size);
+
+		kr = vm_map_copyin(ipc_kernel_map, info_addr, info_size,
+				   TRUE, &copy);
+		assert(kr == KERN_SUCCESS);
+		*infop = (runq_info_t *) copy;
+	}
+
+	*infoCntp = nr_infos;
+	kr = KERN_SUCCESS;
+
+out:
+	kfree((vm_offset_t) info, info_size);
+	return kr;
+}
+
+/*
+ *	Routine:	host_wait_table_info [kernel call]
+ *	Purpose:
+ *		Return the state and statistics of the wait event
+ *		hash table.
+ *	Conditions:
+ *		Nothing locked.  The buckets are not locked either,
+ *		so the figures may be slightly inconsistent.
+ *	Returns:
+ *		KERN_SUCCESS		Returned information.
+ *		KERN_INVALID_HOST	The host is null.
+ */
+
+kern_return_t
+host_wait_table_info(
+	host_t			host,
+	wait_table_info_t	*info)
+{
+	struct wait_bucket *bucket;
+	unsigned int i;
+
+	if (host == HOST_NULL)
+		return KERN_INVALID_HOST;
+
+	memset(info, 0, sizeof *info);
+	info->wti_buckets = wait_table_size;
+	for (i = 0; i < wait_table_size; i++) {
+		bucket = &wait_table[i];
+		info->wti_events += bucket->nr_lists;
+		if (bucket->nr_lists > info->wti_max_chain)
+			info->wti_max_chain = bucket->nr_lists;
+		if (bucket->max_lists > info->wti_max_chain_seen)
+			info->wti_max_chain_seen = bucket->max_lists;
+		info->wti_locks += bucket->lock_count;
+		info->wti_hold_cycles += bucket->hold_cycles;
+		if (bucket->max_hold > info->wti_max_hold_cycles)
+			info->wti_max_hold_cycles = bucket->max_hold;
+		info->wti_waits += bucket->waits;
+		info->wti_wakeups += bucket->wakeups;
+		info->wti_woken += bucket->woken;
+	}
+
+	return KERN_SUCCESS;
+}
+#endif	/* MACH_DEBUG */
+
 #if	DEBUG
 void checkrq(
 	run_queue_t	rq,
@@ -2081,131 +2679,87 @@ void thread_check(
 #if NCPUS > 1
 
 /*
- * Thread Migration Support
+ *	Cache affinity.
  *
- * This section implements thread migration between CPUs for load balancing
- * and cache locality optimization.
+ *	A thread keeps being put on the run queue of the processor it
+ *	last ran on, where its working set may still be cached, unless
+ *	another processor of the set is less loaded by more than the
+ *	cost of moving it there.  The cost grows with the cache warmth
+ *	of the thread, i.e. the number of times in a row it ran on the
+ *	processor.
  */
+#define SCHED_MIGRATION_COST		1	/* in queued threads */
+#define SCHED_WARM_MIGRATION_COST	2
+#define SCHED_WARM_THRESHOLD		8	/* runs in a row */
+
+static inline int thread_migration_cost(
+	thread_t	thread)
+{
+	return (thread->cache_warmth >= SCHED_WARM_THRESHOLD)
+		? SCHED_WARM_MIGRATION_COST : SCHED_MIGRATION_COST;
+}
 
 /*
- *	thread_migrate:
- *
- *	Move a thread to a different processor. The thread must be runnable
- *	but not currently running. Used for load balancing.
+ *	Load of a processor: the threads queued on it, plus the one
+ *	it is running.
  */
-kern_return_t thread_migrate(
-	thread_t	thread,
-	processor_t	target_processor)
+static inline int processor_load(
+	processor_t	processor)
 {
-	processor_t current_processor;
-	run_queue_t old_rq, new_rq;
-	spl_t s;
-
-	if (thread == THREAD_NULL || target_processor == PROCESSOR_NULL)
-		return KERN_INVALID_ARGUMENT;
-
-	s = splsched();
-	thread_lock(thread);
-
-	/* Only migrate runnable threads that are not currently running */
-	if ((thread->state & TH_RUN) == 0 || thread->state & TH_IDLE) {
-		thread_unlock(thread);
-		splx(s);
-		return KERN_FAILURE;
-	}
-
-	/* Don't migrate if already on target processor */
-	current_processor = thread->last_processor;
-	if (current_processor == target_processor) {
-		thread_unlock(thread);
-		splx(s);
-		return KERN_SUCCESS;
-	}
-
-	/* Remove from current run queue */
-	old_rq = rem_runq(thread);
-	if (old_rq == RUN_QUEUE_NULL) {
-		thread_unlock(thread);
-		splx(s);
-		return KERN_FAILURE;
-	}
-
-	/* Update migration statistics */
-	thread->migration_count++;
-	thread->cache_warmth = 0; /* Cache will be cold on new processor */
-	
-	if (current_processor != PROCESSOR_NULL) {
-		current_processor->migration_out++;
-	}
-	target_processor->migration_in++;
-
-	/* Set new processor affinity */
-	thread->last_processor = target_processor;
-
-	/* Add to target processor's run queue */
-	new_rq = &target_processor->runq;
-	run_queue_enqueue(new_rq, thread);
-
-	thread_unlock(thread);
-
-	/* Signal target processor if needed */
-	if (target_processor->state == PROCESSOR_IDLE) {
-		cause_ast_check(target_processor);
-	}
-
-	splx(s);
-	return KERN_SUCCESS;
+	return processor->runq.count +
+	       (processor->state == PROCESSOR_IDLE ? 0 : 1);
 }
 
 /*
  *	thread_select_best_processor:
  *
- *	Select the best processor for a thread based on load balancing
- *	and cache locality considerations.
+ *	Select the processor to put a runnable thread on, trading
+ *	load for cache affinity.  Processor loads are looked at without
+ *	locking.  Returns PROCESSOR_NULL if the set of the thread has no
+ *	processor.
  */
 processor_t thread_select_best_processor(
 	thread_t	thread)
 {
 	processor_set_t pset;
 	processor_t best_processor, processor;
-	unsigned int min_load, current_load;
-	unsigned int cache_bonus;
+	int min_load, load;
 
 	if (thread->bound_processor != PROCESSOR_NULL)
 		return thread->bound_processor;
 
 	pset = thread->processor_set;
 	best_processor = PROCESSOR_NULL;
-	min_load = ~0U;
-
-	/* Check last processor first for cache locality */
-	if (thread->last_processor != PROCESSOR_NULL &&
-	    thread->last_processor->processor_set == pset) {
-		processor = thread->last_processor;
-		current_load = processor->runq.count;
-		
-		/* Give cache locality bonus */
-		cache_bonus = thread->cache_warmth > 10 ? 2 : 1;
-		if (current_load <= min_load + cache_bonus) {
-			best_processor = processor;
-			min_load = current_load;
-		}
+	min_load = 0;
+
+	processor = thread->last_processor;
+	if (processor != PROCESSOR_NULL &&
+	    processor->processor_set == pset &&
+	    processor->state != PROCESSOR_SHUTDOWN &&
+	    processor->state != PROCESSOR_ASSIGN) {
+		best_processor = processor;
+		min_load = processor_load(processor);
+		if (min_load == 0)
+			return best_processor;
+		min_load -= thread_migration_cost(thread);
 	}
 
-	/* Check all other processors in the set */
 	queue_iterate(&pset->processors, processor, processor_t, processors) {
-		if (processor == thread->last_processor)
+		if (processor == thread->last_processor ||
+		    processor->state == PROCESSOR_SHUTDOWN ||
+		    processor->state == PROCESSOR_ASSIGN)
 			continue;
 
-		current_load = processor->runq.count;
-		if (current_load < min_load) {
+		load = processor_load(processor);
+		if (best_processor == PROCESSOR_NULL || load < min_load) {
 			best_processor = processor;
-			min_load = current_load;
+			min_load = load;
+			if (load == 0)
+				break;
 		}
 	}
 
-	return best_processor ? best_processor : 
-		(processor_t)queue_first(&pset->processors);
+	return best_processor;
 }
 
 /*
@@ -2221,80 +2775,4 @@ void thread_update_cache_warmth(
 		thread->cache_warmth++;
 }
 
-/*
- *	thread_balance_load:
- *
- *	Periodic load balancing across processors.
- *	Migrates threads from heavily loaded processors to idle ones.
- */
-void thread_balance_load(void)
-{
-	processor_set_t pset;
-	processor_t src_processor, dst_processor;
-	processor_t busiest, idlest;
-	thread_t thread;
-	unsigned int max_load, min_load;
-	unsigned int load_diff;
-	spl_t s;
-
-	s = splsched();
-
-	/* Balance within each processor set */
-	queue_iterate(&all_psets, pset, processor_set_t, all_psets) {
-		if (pset->processor_count < 2)
-			continue;
-
-		busiest = idlest = PROCESSOR_NULL;
-		max_load = 0;
-		min_load = ~0U;
-
-		/* Find busiest and idlest processors */
-		queue_iterate(&pset->processors, src_processor, processor_t, processors) {
-			unsigned int load = src_processor->runq.count;
-			
-			if (load > max_load) {
-				max_load = load;
-				busiest = src_processor;
-			}
-			if (load < min_load) {
-				min_load = load;
-				idlest = src_processor;
-			}
-		}
-
-		/* Only balance if load difference is significant */
-		if (busiest == PROCESSOR_NULL || idlest == PROCESSOR_NULL)
-			continue;
-
-		load_diff = max_load - min_load;
-		if (load_diff < 2)
-			continue;
-
-		/* Try to migrate one thread from busiest to idlest */
-		runq_lock(&busiest->runq);
-		if (busiest->runq.count > 0) {
-			/* Find a suitable thread to migrate */
-			int i;
-			for (i = busiest->runq.low; i < NRQS; i++) {
-				queue_t q = &busiest->runq.runq[i];
-				if (!queue_empty(q)) {
-					thread = (thread_t)queue_first(q);
-					/* Don't migrate bound threads */
-					if (thread->bound_processor == PROCESSOR_NULL) {
-						runq_unlock(&busiest->runq);
-						thread_migrate(thread, idlest);
-						goto next_pset;
-					}
-				}
-			}
-		}
-		runq_unlock(&busiest->runq);
-
-	next_pset:
-		continue;
-	}
-
-	splx(s);
-}
-
 #endif /* NCPUS > 1 */
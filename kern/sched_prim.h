@@ -59,6 +59,10 @@ typedef	void	(*continuation_t)(void);	/* continuation */
  */
 
 extern void	sched_init(void);
+extern void	wait_table_init(void);
+extern struct wait_list *wait_list_alloc(void);
+extern void	wait_list_free(
+	struct wait_list *wl);
 
 extern void	assert_wait(
 	event_t		event,
@@ -120,14 +124,12 @@ extern void thread_timeout_setup(
     thread_t   thread);
 
 #if NCPUS > 1
-extern kern_return_t thread_migrate(
-	thread_t	thread,
-	processor_t	target_processor);
-extern void thread_balance_load(void);
 extern processor_t thread_select_best_processor(
 	thread_t	thread);
 extern void thread_update_cache_warmth(
 	thread_t	thread);
+extern void processor_drain_runq(
+	processor_t	processor);
 #endif /* NCPUS > 1 */
 
 /*
@@ -66,9 +66,14 @@
  * This implementation uses per-cpu pools of objects, which service most
  * allocation requests. These pools act as caches (but are named differently
  * to avoid confusion with CPU caches) that reduce contention on multiprocessor
- * systems. When a pool is empty and cannot provide an object, it is filled by
- * transferring multiple objects from the slab layer. The symmetric case is
- * handled likewise.
+ * systems. As described in "Magazines and Vmem: Extending the Slab Allocator
+ * to Many CPUs and Arbitrary Resources" by Jeff Bonwick and Jonathan Adams,
+ * pools hold objects in magazines, which they exchange whole with a depot of
+ * full and empty magazines per cache. When neither a pool nor the depot can
+ * provide an object, it is allocated from the slab layer. The symmetric case
+ * is handled likewise. The size of new magazines grows while the depot lock
+ * is contended, and the depot is drained to the slab layer when memory is
+ * reclaimed.
  */
 
 #include <string.h>
@@ -122,10 +127,18 @@
 #define KMEM_GC_INTERVAL (5 * hz)
 
 /*
- * The transfer size of a CPU pool is computed by dividing the pool size by
- * this value.
+ * Minimum number of objects asked from a shrinker, and of free slabs and
+ * magazines released from a cache, at each reclaim at a priority other
+ * than 0, unless fewer are available.
  */
-#define KMEM_CPU_POOL_TRANSFER_RATIO 2
+#define KMEM_SHRINK_BATCH 16
+
+/*
+ * Number of contended acquisitions of the depot lock of a cache, within
+ * KMEM_DEPOT_UPDATE_INTERVAL ticks, beyond which its magazines grow.
+ */
+#define KMEM_DEPOT_CONTENTION_THRESHOLD 16
+#define KMEM_DEPOT_UPDATE_INTERVAL      hz
 
 /*
  * Redzone guard word.
@@ -210,6 +223,7 @@
                                            and KMEM_CF_PHYSMEM) */
 #define KMEM_CF_VERIFY          0x20    /* Debugging facilities enabled
                                            (implies KMEM_CF_USE_TREE) */
+#define KMEM_CF_NO_CPU_POOL     0x40    /* CPU pool layer disabled */
 
 /*
  * Options for kmem_cache_alloc_verify().
@@ -227,25 +241,38 @@
 #define KMEM_ERR_REDZONE    4   /* Redzone violation */
 
 #if SLAB_USE_CPU_POOLS
+/*
+ * Caches where magazines are allocated from, one per magazine size.
+ */
+static struct kmem_cache kmem_magazine_caches[7];
+
+/*
+ * Available magazine sizes, in increasing order.
+ */
+static struct kmem_magazine_type kmem_magazine_types[] = {
+    {   1, &kmem_magazine_caches[0] },
+    {   3, &kmem_magazine_caches[1] },
+    {   7, &kmem_magazine_caches[2] },
+    {  15, &kmem_magazine_caches[3] },
+    {  31, &kmem_magazine_caches[4] },
+    {  63, &kmem_magazine_caches[5] },
+    { 127, &kmem_magazine_caches[6] }
+};
+
 /*
  * Available CPU pool types.
  *
- * For each entry, the CPU pool size applies from the entry buf_size
+ * For each entry, the magazine sizes apply from the entry buf_size
  * (excluded) up to (and including) the buf_size of the preceding entry.
  *
  * See struct kmem_cpu_pool_type for a description of the values.
  */
 static struct kmem_cpu_pool_type kmem_cpu_pool_types[] = {
-    {  32768,   1, 0,           NULL },
-    {   4096,   8, CPU_L1_SIZE, NULL },
-    {    256,  64, CPU_L1_SIZE, NULL },
-    {      0, 128, CPU_L1_SIZE, NULL }
+    {  32768, &kmem_magazine_types[0], &kmem_magazine_types[0] },
+    {   4096, &kmem_magazine_types[1], &kmem_magazine_types[3] },
+    {    256, &kmem_magazine_types[3], &kmem_magazine_types[5] },
+    {      0, &kmem_magazine_types[4], &kmem_magazine_types[6] }
 };
-
-/*
- * Caches where CPU pool arrays are allocated from.
- */
-static struct kmem_cache kmem_cpu_array_caches[ARRAY_SIZE(kmem_cpu_pool_types)];
 #endif /* SLAB_USE_CPU_POOLS */
 
 /*
@@ -270,6 +297,14 @@ static simple_lock_data_t __attribute__((used)) kmem_cache_list_lock;
  */
 static unsigned long kmem_gc_last_tick;
 
+/*
+ * Registered shrinkers. They are never removed from the list, which
+ * allows walking it without holding the lock while they run.
+ */
+static struct list kmem_shrinker_list;
+static unsigned int kmem_nr_shrinkers;
+static simple_lock_data_t kmem_shrinker_list_lock;
+
 #define kmem_error(format, ...)                         \
     panic("mem: error: %s(): " format "\n", __func__,   \
           ## __VA_ARGS__)
@@ -614,10 +649,8 @@ static void kmem_cpu_pool_init(struct kmem_cpu_pool *cpu_pool,
 {
     simple_lock_init(&cpu_pool->lock);
     cpu_pool->flags = cache->flags;
-    cpu_pool->size = 0;
-    cpu_pool->transfer_size = 0;
-    cpu_pool->nr_objs = 0;
-    cpu_pool->array = NULL;
+    cpu_pool->loaded = NULL;
+    cpu_pool->previous = NULL;
 }
 
 /*
@@ -635,70 +668,219 @@ static inline struct kmem_cpu_pool * kmem_cpu_pool_get(struct kmem_cache *cache)
     return &cache->cpu_pools[cpu_number()];
 }
 
-static inline void kmem_cpu_pool_build(struct kmem_cpu_pool *cpu_pool,
-                                       struct kmem_cache *cache, void **array)
+static inline void kmem_cpu_pool_swap(struct kmem_cpu_pool *cpu_pool)
 {
-    cpu_pool->size = cache->cpu_pool_type->array_size;
-    cpu_pool->transfer_size = (cpu_pool->size
-                               + KMEM_CPU_POOL_TRANSFER_RATIO - 1)
-                              / KMEM_CPU_POOL_TRANSFER_RATIO;
-    cpu_pool->array = array;
+    struct kmem_magazine *magazine;
+
+    magazine = cpu_pool->loaded;
+    cpu_pool->loaded = cpu_pool->previous;
+    cpu_pool->previous = magazine;
 }
 
-static inline void * kmem_cpu_pool_pop(struct kmem_cpu_pool *cpu_pool)
+static inline int kmem_magazine_empty(const struct kmem_magazine *magazine)
 {
-    cpu_pool->nr_objs--;
-    return cpu_pool->array[cpu_pool->nr_objs];
+    return (magazine == NULL) || (magazine->nr_objs == 0);
 }
 
-static inline void kmem_cpu_pool_push(struct kmem_cpu_pool *cpu_pool, void *obj)
+static inline int kmem_magazine_full(const struct kmem_magazine *magazine)
 {
-    cpu_pool->array[cpu_pool->nr_objs] = obj;
-    cpu_pool->nr_objs++;
+    return (magazine == NULL) || (magazine->nr_objs == magazine->size);
 }
 
-static int kmem_cpu_pool_fill(struct kmem_cpu_pool *cpu_pool,
-                              struct kmem_cache *cache)
+static inline void * kmem_magazine_pop(struct kmem_magazine *magazine)
 {
-    kmem_cache_ctor_t ctor;
-    void *buf;
-    int i;
+    magazine->nr_objs--;
+    return magazine->objs[magazine->nr_objs];
+}
 
-    ctor = (cpu_pool->flags & KMEM_CF_VERIFY) ? NULL : cache->ctor;
+static inline void kmem_magazine_push(struct kmem_magazine *magazine, void *obj)
+{
+    magazine->objs[magazine->nr_objs] = obj;
+    magazine->nr_objs++;
+}
 
-    simple_lock(&cache->lock);
+/*
+ * Allocate an empty magazine of the current size of the given cache.
+ *
+ * No lock may be held, since magazines may be allocated from the cache
+ * itself.
+ */
+static struct kmem_magazine * kmem_magazine_create(struct kmem_cache *cache)
+{
+    struct kmem_magazine_type *magazine_type;
+    struct kmem_magazine *magazine;
+
+    /* Harmless unsynchronized access, the size only grows */
+    magazine_type = cache->magazine_type;
+    magazine = (void *)kmem_cache_alloc(magazine_type->cache);
 
-    for (i = 0; i < cpu_pool->transfer_size; i++) {
-        buf = kmem_cache_alloc_from_slab(cache);
+    if (magazine == NULL)
+        return NULL;
+
+    magazine->size = magazine_type->size;
+    magazine->nr_objs = 0;
+    return magazine;
+}
 
-        if (buf == NULL)
+static void kmem_magazine_destroy(struct kmem_magazine *magazine)
+{
+    size_t i;
+
+    assert(magazine->nr_objs == 0);
+
+    for (i = 0; i < ARRAY_SIZE(kmem_magazine_types); i++)
+        if (kmem_magazine_types[i].size == magazine->size)
             break;
 
-        if (ctor != NULL)
-            ctor(buf);
+    assert(i < ARRAY_SIZE(kmem_magazine_types));
+    kmem_cache_free(kmem_magazine_types[i].cache, (vm_offset_t)magazine);
+}
+
+/*
+ * Lock the depot of a cache, accounting for contention.
+ *
+ * When the lock is repeatedly found contended, larger magazines are used
+ * from then on, so that the depot is reached less often. Magazines
+ * already in use keep their size until the depot is drained.
+ */
+static void kmem_depot_lock(struct kmem_cache *cache)
+{
+    if (likely(simple_lock_try(&cache->depot_lock)))
+        return;
+
+    simple_lock(&cache->depot_lock);
+    cache->depot_contended++;
 
-        kmem_cpu_pool_push(cpu_pool, buf);
+    if ((elapsed_ticks - cache->depot_update_tick)
+        > KMEM_DEPOT_UPDATE_INTERVAL) {
+        cache->depot_update_tick = elapsed_ticks;
+        cache->depot_recent_contended = 0;
     }
 
-    simple_unlock(&cache->lock);
+    cache->depot_recent_contended++;
 
-    return i;
+    if ((cache->depot_recent_contended >= KMEM_DEPOT_CONTENTION_THRESHOLD)
+        && (cache->magazine_type < cache->max_magazine_type)) {
+        cache->magazine_type++;
+        cache->depot_recent_contended = 0;
+    }
 }
 
-static void kmem_cpu_pool_drain(struct kmem_cpu_pool *cpu_pool,
-                                struct kmem_cache *cache)
+/*
+ * Get a magazine from one of the depot lists, or NULL if it's empty.
+ */
+static struct kmem_magazine * kmem_depot_get(struct kmem_cache *cache,
+                                             struct list *list,
+                                             long_natural_t *nr_magazines)
 {
-    void *obj;
-    int i;
+    struct kmem_magazine *magazine;
 
-    simple_lock(&cache->lock);
+    kmem_depot_lock(cache);
 
-    for (i = cpu_pool->transfer_size; i > 0; i--) {
-        obj = kmem_cpu_pool_pop(cpu_pool);
-        kmem_cache_free_to_slab(cache, obj);
+    if (list_empty(list)) {
+        cache->depot_misses++;
+        magazine = NULL;
+    } else {
+        cache->depot_hits++;
+        magazine = list_first_entry(list, struct kmem_magazine, node);
+        list_remove(&magazine->node);
+        (*nr_magazines)--;
     }
 
+    simple_unlock(&cache->depot_lock);
+
+    return magazine;
+}
+
+static void kmem_depot_put(struct kmem_cache *cache, struct list *list,
+                           long_natural_t *nr_magazines,
+                           struct kmem_magazine *magazine)
+{
+    kmem_depot_lock(cache);
+    list_insert_head(list, &magazine->node);
+    (*nr_magazines)++;
+    simple_unlock(&cache->depot_lock);
+}
+
+static inline struct kmem_magazine *
+kmem_depot_get_full(struct kmem_cache *cache)
+{
+    return kmem_depot_get(cache, &cache->full_magazines,
+                          &cache->nr_full_magazines);
+}
+
+static inline struct kmem_magazine *
+kmem_depot_get_empty(struct kmem_cache *cache)
+{
+    return kmem_depot_get(cache, &cache->empty_magazines,
+                          &cache->nr_empty_magazines);
+}
+
+static inline void kmem_depot_put_full(struct kmem_cache *cache,
+                                       struct kmem_magazine *magazine)
+{
+    assert(magazine->nr_objs != 0);
+    kmem_depot_put(cache, &cache->full_magazines, &cache->nr_full_magazines,
+                   magazine);
+}
+
+static inline void kmem_depot_put_empty(struct kmem_cache *cache,
+                                        struct kmem_magazine *magazine)
+{
+    assert(magazine->nr_objs == 0);
+    kmem_depot_put(cache, &cache->empty_magazines, &cache->nr_empty_magazines,
+                   magazine);
+}
+
+/*
+ * Remove up to nr_magazines of each kind from the depot of a cache, least
+ * recently used first, returning the objects of full magazines to the
+ * slab layer.
+ *
+ * The magazines are added to the given list, to be destroyed once no
+ * lock is held.
+ */
+static void kmem_depot_drain(struct kmem_cache *cache,
+                             unsigned long nr_magazines,
+                             struct list *dead_magazines)
+{
+    struct kmem_magazine *magazine;
+    struct list full_magazines;
+    unsigned long i;
+
+    list_init(&full_magazines);
+
+    simple_lock(&cache->depot_lock);
+
+    for (i = 0; (i < nr_magazines) && !list_empty(&cache->full_magazines);
+         i++) {
+        magazine = list_last_entry(&cache->full_magazines,
+                                   struct kmem_magazine, node);
+        list_remove(&magazine->node);
+        list_insert_tail(&full_magazines, &magazine->node);
+        cache->nr_full_magazines--;
+    }
+
+    for (i = 0; (i < nr_magazines) && !list_empty(&cache->empty_magazines);
+         i++) {
+        magazine = list_last_entry(&cache->empty_magazines,
+                                   struct kmem_magazine, node);
+        list_remove(&magazine->node);
+        list_insert_tail(dead_magazines, &magazine->node);
+        cache->nr_empty_magazines--;
+    }
+
+    simple_unlock(&cache->depot_lock);
+
+    simple_lock(&cache->lock);
+
+    list_for_each_entry(&full_magazines, magazine, node)
+        while (magazine->nr_objs > 0)
+            kmem_cache_free_to_slab(cache, kmem_magazine_pop(magazine));
+
     simple_unlock(&cache->lock);
+
+    list_concat(dead_magazines, &full_magazines);
 }
 #endif /* SLAB_USE_CPU_POOLS */
 
@@ -858,6 +1040,7 @@ void kmem_cache_init(struct kmem_cache *cache, const char *name,
     cache->nr_bufs = 0;
     cache->nr_slabs = 0;
     cache->nr_free_slabs = 0;
+    cache->nr_reaped_slabs = 0;
     cache->ctor = ctor;
     strncpy(cache->name, name, sizeof(cache->name));
     cache->name[sizeof(cache->name) - 1] = '\0';
@@ -876,14 +1059,29 @@ void kmem_cache_init(struct kmem_cache *cache, const char *name,
     kmem_cache_compute_properties(cache, flags);
 
 #if SLAB_USE_CPU_POOLS
+    if (flags & KMEM_CACHE_NOCPUPOOL)
+        cache->flags |= KMEM_CF_NO_CPU_POOL;
+
     for (cpu_pool_type = kmem_cpu_pool_types;
          buf_size <= cpu_pool_type->buf_size;
          cpu_pool_type++);
 
-    cache->cpu_pool_type = cpu_pool_type;
+    cache->magazine_type = cpu_pool_type->magazine_type;
+    cache->max_magazine_type = cpu_pool_type->max_magazine_type;
 
     for (i = 0; i < ARRAY_SIZE(cache->cpu_pools); i++)
         kmem_cpu_pool_init(&cache->cpu_pools[i], cache);
+
+    simple_lock_init(&cache->depot_lock);
+    list_init(&cache->full_magazines);
+    list_init(&cache->empty_magazines);
+    cache->nr_full_magazines = 0;
+    cache->nr_empty_magazines = 0;
+    cache->depot_hits = 0;
+    cache->depot_misses = 0;
+    cache->depot_contended = 0;
+    cache->depot_recent_contended = 0;
+    cache->depot_update_tick = 0;
 #endif /* SLAB_USE_CPU_POOLS */
 
     simple_lock(&kmem_cache_list_lock);
@@ -940,15 +1138,29 @@ static int kmem_cache_grow(struct kmem_cache *cache)
     return !empty;
 }
 
-static void kmem_cache_reap(struct kmem_cache *cache, struct list *dead_slabs)
+/*
+ * Remove up to nr_slabs free slabs from a cache, least recently used
+ * first, and add them to the given list.
+ */
+static void kmem_cache_reap(struct kmem_cache *cache, unsigned long nr_slabs,
+                            struct list *dead_slabs)
 {
+    struct kmem_slab *slab;
+    unsigned long i;
+
     simple_lock(&cache->lock);
 
-    list_concat(dead_slabs, &cache->free_slabs);
-    list_init(&cache->free_slabs);
-    cache->nr_bufs -= cache->bufs_per_slab * cache->nr_free_slabs;
-    cache->nr_slabs -= cache->nr_free_slabs;
-    cache->nr_free_slabs = 0;
+    for (i = 0; (i < nr_slabs) && !list_empty(&cache->free_slabs); i++) {
+        slab = list_last_entry(&cache->free_slabs, struct kmem_slab,
+                               list_node);
+        list_remove(&slab->list_node);
+        list_insert_tail(dead_slabs, &slab->list_node);
+    }
+
+    cache->nr_bufs -= cache->bufs_per_slab * i;
+    cache->nr_slabs -= i;
+    cache->nr_free_slabs -= i;
+    cache->nr_reaped_slabs += i;
 
     simple_unlock(&cache->lock);
 }
@@ -1096,6 +1308,7 @@ vm_offset_t kmem_cache_alloc(struct kmem_cache *cache)
 
 #if SLAB_USE_CPU_POOLS
     struct kmem_cpu_pool *cpu_pool;
+    struct kmem_magazine *magazine;
 
     cpu_pool = kmem_cpu_pool_get(cache);
 
@@ -1105,8 +1318,8 @@ vm_offset_t kmem_cache_alloc(struct kmem_cache *cache)
     simple_lock(&cpu_pool->lock);
 
 fast_alloc:
-    if (likely(cpu_pool->nr_objs > 0)) {
-        buf = kmem_cpu_pool_pop(cpu_pool);
+    if (likely(!kmem_magazine_empty(cpu_pool->loaded))) {
+        buf = kmem_magazine_pop(cpu_pool->loaded);
         simple_unlock(&cpu_pool->lock);
 
         if (cpu_pool->flags & KMEM_CF_VERIFY)
@@ -1117,23 +1330,22 @@ fast_alloc:
         return (vm_offset_t)buf;
     }
 
+    if (!kmem_magazine_empty(cpu_pool->previous)) {
+        kmem_cpu_pool_swap(cpu_pool);
+        goto fast_alloc;
+    }
+
     /* Track cache miss since we need to go to slow path */
     mem_track_update_cache_stats(0, 1);
 
-    if (cpu_pool->array != NULL) {
-        filled = kmem_cpu_pool_fill(cpu_pool, cache);
-
-        if (!filled) {
-            simple_unlock(&cpu_pool->lock);
-
-            filled = kmem_cache_grow(cache);
+    magazine = kmem_depot_get_full(cache);
 
-            if (!filled)
-                return 0;
-
-            simple_lock(&cpu_pool->lock);
-        }
+    if (magazine != NULL) {
+        if (cpu_pool->previous != NULL)
+            kmem_depot_put_empty(cache, cpu_pool->previous);
 
+        cpu_pool->previous = cpu_pool->loaded;
+        cpu_pool->loaded = magazine;
         goto fast_alloc;
     }
 
@@ -1231,7 +1443,7 @@ void kmem_cache_free(struct kmem_cache *cache, vm_offset_t obj)
 {
 #if SLAB_USE_CPU_POOLS
     struct kmem_cpu_pool *cpu_pool;
-    void **array;
+    struct kmem_magazine *magazine;
 
     cpu_pool = kmem_cpu_pool_get(cache);
 
@@ -1249,40 +1461,46 @@ void kmem_cache_free(struct kmem_cache *cache, vm_offset_t obj)
     simple_lock(&cpu_pool->lock);
 
 fast_free:
-    if (likely(cpu_pool->nr_objs < cpu_pool->size)) {
-        kmem_cpu_pool_push(cpu_pool, (void *)obj);
+    if (likely(!kmem_magazine_full(cpu_pool->loaded))) {
+        kmem_magazine_push(cpu_pool->loaded, (void *)obj);
         simple_unlock(&cpu_pool->lock);
         return;
     }
 
-    if (cpu_pool->array != NULL) {
-        kmem_cpu_pool_drain(cpu_pool, cache);
+    if (!kmem_magazine_full(cpu_pool->previous)) {
+        kmem_cpu_pool_swap(cpu_pool);
         goto fast_free;
     }
 
-    simple_unlock(&cpu_pool->lock);
+    magazine = kmem_depot_get_empty(cache);
+
+    if (magazine == NULL) {
+        simple_unlock(&cpu_pool->lock);
+        magazine = kmem_magazine_create(cache);
 
-    array = (void *)kmem_cache_alloc(cache->cpu_pool_type->array_cache);
+        if (magazine == NULL)
+            goto slab_free;
 
-    if (array != NULL) {
         simple_lock(&cpu_pool->lock);
 
         /*
-         * Another thread may have built the CPU pool while the lock was
-         * dropped.
+         * Another thread may have made room in the CPU pool while the
+         * lock was dropped.
          */
-        if (cpu_pool->array != NULL) {
-            simple_unlock(&cpu_pool->lock);
-            kmem_cache_free(cache->cpu_pool_type->array_cache,
-                            (vm_offset_t)array);
-            simple_lock(&cpu_pool->lock);
+        if (!kmem_magazine_full(cpu_pool->loaded)
+            || !kmem_magazine_full(cpu_pool->previous)) {
+            kmem_depot_put_empty(cache, magazine);
             goto fast_free;
         }
-
-        kmem_cpu_pool_build(cpu_pool, cache, array);
-        goto fast_free;
     }
 
+    if (cpu_pool->previous != NULL)
+        kmem_depot_put_full(cache, cpu_pool->previous);
+
+    cpu_pool->previous = cpu_pool->loaded;
+    cpu_pool->loaded = magazine;
+    goto fast_free;
+
 slab_free:
 #endif /* SLAB_USE_CPU_POOLS */
 
@@ -1291,26 +1509,72 @@ slab_free:
     simple_unlock(&cache->lock);
 }
 
-void slab_collect(void)
+/*
+ * Return how many of count objects to reclaim at the given priority.
+ */
+static unsigned long kmem_shrink_target(unsigned long count,
+                                        unsigned int priority)
+{
+    unsigned long target;
+
+    target = count >> priority;
+
+    if (target < KMEM_SHRINK_BATCH)
+        target = (count < KMEM_SHRINK_BATCH) ? count : KMEM_SHRINK_BATCH;
+
+    return target;
+}
+
+/*
+ * Release a share, depending on the priority, of the free slabs and
+ * depot magazines of all caches.
+ */
+static void kmem_reclaim(unsigned int priority)
 {
     struct kmem_cache *cache;
     struct kmem_slab *slab;
     struct list dead_slabs;
-
-    if (elapsed_ticks <= (kmem_gc_last_tick + KMEM_GC_INTERVAL))
-        return;
-
-    kmem_gc_last_tick = elapsed_ticks;
+#if SLAB_USE_CPU_POOLS
+    struct kmem_magazine *magazine;
+    struct list dead_magazines;
+#endif /* SLAB_USE_CPU_POOLS */
 
     list_init(&dead_slabs);
+#if SLAB_USE_CPU_POOLS
+    list_init(&dead_magazines);
+#endif /* SLAB_USE_CPU_POOLS */
 
     simple_lock(&kmem_cache_list_lock);
 
-    list_for_each_entry(&kmem_cache_list, cache, node)
-        kmem_cache_reap(cache, &dead_slabs);
+    /* Harmless unsynchronized accesses, the counts are only hints */
+    list_for_each_entry(&kmem_cache_list, cache, node) {
+#if SLAB_USE_CPU_POOLS
+        kmem_depot_drain(cache,
+                         kmem_shrink_target(cache->nr_full_magazines
+                                            + cache->nr_empty_magazines,
+                                            priority),
+                         &dead_magazines);
+#endif /* SLAB_USE_CPU_POOLS */
+        kmem_cache_reap(cache,
+                        kmem_shrink_target(cache->nr_free_slabs, priority),
+                        &dead_slabs);
+    }
 
     simple_unlock(&kmem_cache_list_lock);
 
+#if SLAB_USE_CPU_POOLS
+    /*
+     * Magazines return to their own caches, which may already have been
+     * reaped, their slabs are released on the next collection.
+     */
+    while (!list_empty(&dead_magazines)) {
+        magazine = list_first_entry(&dead_magazines, struct kmem_magazine,
+                                    node);
+        list_remove(&magazine->node);
+        kmem_magazine_destroy(magazine);
+    }
+#endif /* SLAB_USE_CPU_POOLS */
+
     while (!list_empty(&dead_slabs)) {
         slab = list_first_entry(&dead_slabs, struct kmem_slab, list_node);
         list_remove(&slab->list_node);
@@ -1318,6 +1582,63 @@ void slab_collect(void)
     }
 }
 
+void slab_collect(void)
+{
+    if (elapsed_ticks <= (kmem_gc_last_tick + KMEM_GC_INTERVAL))
+        return;
+
+    kmem_gc_last_tick = elapsed_ticks;
+    kmem_reclaim(0);
+}
+
+void kmem_shrinker_register(struct kmem_shrinker *shrinker)
+{
+    assert(shrinker->count != NULL);
+    assert(shrinker->scan != NULL);
+
+    shrinker->nr_calls = 0;
+    shrinker->nr_scanned = 0;
+    shrinker->nr_freed = 0;
+
+    simple_lock(&kmem_shrinker_list_lock);
+    list_insert_tail(&kmem_shrinker_list, &shrinker->node);
+    kmem_nr_shrinkers++;
+    simple_unlock(&kmem_shrinker_list_lock);
+}
+
+void slab_shrink(unsigned int priority)
+{
+    struct kmem_shrinker *shrinker;
+    unsigned long nr_to_scan, nr_freed;
+    struct list *node;
+
+    assert(priority <= KMEM_SHRINK_PRIORITY_MAX);
+
+    /*
+     * Shrinkers release objects to caches, run them first.
+     */
+    simple_lock(&kmem_shrinker_list_lock);
+    node = list_first(&kmem_shrinker_list);
+
+    while (!list_end(&kmem_shrinker_list, node)) {
+        shrinker = list_entry(node, struct kmem_shrinker, node);
+        simple_unlock(&kmem_shrinker_list_lock);
+
+        nr_to_scan = kmem_shrink_target(shrinker->count(), priority);
+        nr_freed = (nr_to_scan == 0) ? 0 : shrinker->scan(nr_to_scan);
+
+        simple_lock(&kmem_shrinker_list_lock);
+        shrinker->nr_calls++;
+        shrinker->nr_scanned += nr_to_scan;
+        shrinker->nr_freed += nr_freed;
+        node = list_next(node);
+    }
+
+    simple_unlock(&kmem_shrinker_list_lock);
+
+    kmem_reclaim(priority);
+}
+
 void slab_bootstrap(void)
 {
     /* Make sure a bufctl can always be stored in a buffer */
@@ -1325,24 +1646,30 @@ void slab_bootstrap(void)
 
     list_init(&kmem_cache_list);
     simple_lock_init(&kmem_cache_list_lock);
+    list_init(&kmem_shrinker_list);
+    simple_lock_init(&kmem_shrinker_list_lock);
 }
 
 void slab_init(void)
 {
 #if SLAB_USE_CPU_POOLS
-    struct kmem_cpu_pool_type *cpu_pool_type;
+    struct kmem_magazine_type *magazine_type;
     char name[KMEM_CACHE_NAME_SIZE];
     size_t i, size;
 #endif /* SLAB_USE_CPU_POOLS */
 
 #if SLAB_USE_CPU_POOLS
-    for (i = 0; i < ARRAY_SIZE(kmem_cpu_pool_types); i++) {
-        cpu_pool_type = &kmem_cpu_pool_types[i];
-        cpu_pool_type->array_cache = &kmem_cpu_array_caches[i];
-        sprintf(name, "kmem_cpu_array_%d", cpu_pool_type->array_size);
-        size = sizeof(void *) * cpu_pool_type->array_size;
-        kmem_cache_init(cpu_pool_type->array_cache, name, size,
-                        cpu_pool_type->array_align, NULL, 0);
+    /*
+     * Magazines are allocated without CPU pools, as these would need
+     * magazines themselves.
+     */
+    for (i = 0; i < ARRAY_SIZE(kmem_magazine_types); i++) {
+        magazine_type = &kmem_magazine_types[i];
+        sprintf(name, "kmem_magazine_%d", magazine_type->size);
+        size = sizeof(struct kmem_magazine)
+               + sizeof(void *) * magazine_type->size;
+        kmem_cache_init(magazine_type->cache, name, size, CPU_L1_SIZE, NULL,
+                        KMEM_CACHE_NOCPUPOOL);
     }
 #endif /* SLAB_USE_CPU_POOLS */
 
@@ -1697,7 +2024,10 @@ retry:
         simple_lock(&cache->lock);
         info[i].flags = cache->flags;
 #if SLAB_USE_CPU_POOLS
-        info[i].cpu_pool_size = cache->cpu_pool_type->array_size;
+        if (cache->flags & KMEM_CF_NO_CPU_POOL)
+            info[i].cpu_pool_size = 0;
+        else
+            info[i].cpu_pool_size = cache->magazine_type->size;
 #else /* SLAB_USE_CPU_POOLS */
         info[i].cpu_pool_size = 0;
 #endif /* SLAB_USE_CPU_POOLS */
@@ -1746,6 +2076,204 @@ retry:
     *infoCntp = nr_caches;
     kr = KERN_SUCCESS;
 
+out:
+    kfree((vm_offset_t)info, info_size);
+
+    return kr;
+}
+
+kern_return_t host_slab_depot_info(host_t host,
+                                   cache_depot_info_array_t *infop,
+                                   unsigned int *infoCntp)
+{
+    struct kmem_cache *cache;
+    cache_depot_info_t *info;
+    unsigned int i, nr_caches;
+    vm_size_t info_size;
+    kern_return_t kr;
+
+    if (host == HOST_NULL)
+        return KERN_INVALID_HOST;
+
+retry:
+    /* Harmless unsynchronized access, real value checked later */
+    nr_caches = kmem_nr_caches;
+    info_size = nr_caches * sizeof(*info);
+    info = (cache_depot_info_t *)kalloc(info_size);
+
+    if (info == NULL)
+        return KERN_RESOURCE_SHORTAGE;
+
+    i = 0;
+
+    simple_lock(&kmem_cache_list_lock);
+
+    if (nr_caches != kmem_nr_caches) {
+        simple_unlock(&kmem_cache_list_lock);
+        kfree((vm_offset_t)info, info_size);
+        goto retry;
+    }
+
+    list_for_each_entry(&kmem_cache_list, cache, node) {
+#if SLAB_USE_CPU_POOLS
+        simple_lock(&cache->depot_lock);
+        info[i].nr_full_magazines = cache->nr_full_magazines;
+        info[i].nr_empty_magazines = cache->nr_empty_magazines;
+        info[i].depot_hits = cache->depot_hits;
+        info[i].depot_misses = cache->depot_misses;
+        info[i].depot_contended = cache->depot_contended;
+        simple_unlock(&cache->depot_lock);
+#else /* SLAB_USE_CPU_POOLS */
+        info[i].nr_full_magazines = 0;
+        info[i].nr_empty_magazines = 0;
+        info[i].depot_hits = 0;
+        info[i].depot_misses = 0;
+        info[i].depot_contended = 0;
+#endif /* SLAB_USE_CPU_POOLS */
+
+        simple_lock(&cache->lock);
+#if SLAB_USE_CPU_POOLS
+        if (cache->flags & KMEM_CF_NO_CPU_POOL)
+            info[i].magazine_size = 0;
+        else
+            info[i].magazine_size = cache->magazine_type->size;
+#else /* SLAB_USE_CPU_POOLS */
+        info[i].magazine_size = 0;
+#endif /* SLAB_USE_CPU_POOLS */
+        info[i].nr_reaped_slabs = cache->nr_reaped_slabs;
+        strncpy(info[i].name, cache->name, sizeof(info[i].name));
+        info[i].name[sizeof(info[i].name) - 1] = '\0';
+        simple_unlock(&cache->lock);
+
+        i++;
+    }
+
+    simple_unlock(&kmem_cache_list_lock);
+
+    if (nr_caches <= *infoCntp) {
+        memcpy(*infop, info, info_size);
+    } else {
+        vm_offset_t info_addr;
+        vm_size_t total_size;
+        vm_map_copy_t copy;
+
+        kr = kmem_alloc_pageable(ipc_kernel_map, &info_addr, info_size);
+
+        if (kr != KERN_SUCCESS)
+            goto out;
+
+        memcpy((char *)info_addr, info, info_size);
+        total_size = round_page(info_size);
+
+        if (info_size < total_size)
+            memset((char *)(info_addr + info_size),
+                   0, total_size - info_size);
+
+        kr = vm_map_copyin(ipc_kernel_map, info_addr, info_size, TRUE, &copy);
+        assert(kr == KERN_SUCCESS);
+        *infop = (cache_depot_info_t *)copy;
+    }
+
+    *infoCntp = nr_caches;
+    kr = KERN_SUCCESS;
+
+out:
+    kfree((vm_offset_t)info, info_size);
+
+    return kr;
+}
+
+kern_return_t host_slab_shrinker_info(host_t host,
+                                      shrinker_info_array_t *infop,
+                                      unsigned int *infoCntp)
+{
+    struct kmem_shrinker *shrinker;
+    shrinker_info_t *info;
+    unsigned int i, nr_shrinkers;
+    vm_size_t info_size;
+    kern_return_t kr;
+
+    if (host == HOST_NULL)
+        return KERN_INVALID_HOST;
+
+retry:
+    /* Harmless unsynchronized access, real value checked later */
+    nr_shrinkers = kmem_nr_shrinkers;
+
+    if (nr_shrinkers == 0) {
+        *infoCntp = 0;
+        return KERN_SUCCESS;
+    }
+
+    info_size = nr_shrinkers * sizeof(*info);
+    info = (shrinker_info_t *)kalloc(info_size);
+
+    if (info == NULL)
+        return KERN_RESOURCE_SHORTAGE;
+
+    i = 0;
+
+    simple_lock(&kmem_shrinker_list_lock);
+
+    if (nr_shrinkers != kmem_nr_shrinkers) {
+        simple_unlock(&kmem_shrinker_list_lock);
+        kfree((vm_offset_t)info, info_size);
+        goto retry;
+    }
+
+    list_for_each_entry(&kmem_shrinker_list, shrinker, node) {
+        info[i].nr_calls = shrinker->nr_calls;
+        info[i].nr_scanned = shrinker->nr_scanned;
+        info[i].nr_freed = shrinker->nr_freed;
+        strncpy(info[i].name, shrinker->name, sizeof(info[i].name));
+        info[i].name[sizeof(info[i].name) - 1] = '\0';
+        i++;
+    }
+
+    simple_unlock(&kmem_shrinker_list_lock);
+
+    /*
+     * Count the objects without the lock held, as count may take other
+     * locks. Shrinkers are only ever appended, so the first ones are
+     * those already reported.
+     */
+    i = 0;
+
+    list_for_each_entry(&kmem_shrinker_list, shrinker, node) {
+        if (i == nr_shrinkers)
+            break;
+
+        info[i].nr_objs = shrinker->count();
+        i++;
+    }
+
+    if (nr_shrinkers <= *infoCntp) {
+        memcpy(*infop, info, info_size);
+    } else {
+        vm_offset_t info_addr;
+        vm_size_t total_size;
+        vm_map_copy_t copy;
+
+        kr = kmem_alloc_pageable(ipc_kernel_map, &info_addr, info_size);
+
+        if (kr != KERN_SUCCESS)
+            goto out;
+
+        memcpy((char *)info_addr, info, info_size);
+        total_size = round_page(info_size);
+
+        if (info_size < total_size)
+            memset((char *)(info_addr + info_size),
+                   0, total_size - info_size);
+
+        kr = vm_map_copyin(ipc_kernel_map, info_addr, info_size, TRUE, &copy);
+        assert(kr == KERN_SUCCESS);
+        *infop = (shrinker_info_t *)copy;
+    }
+
+    *infoCntp = nr_shrinkers;
+    kr = KERN_SUCCESS;
+
 out:
     kfree((vm_offset_t)info, info_size);
 
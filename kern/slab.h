@@ -60,31 +60,56 @@ struct kmem_cache;
 
 #if SLAB_USE_CPU_POOLS
 
+/*
+ * Magazine, i.e. a fixed-size stack of pre-constructed objects.
+ *
+ * CPU pools exchange whole magazines with the depot of their cache, so
+ * that the depot lock is only taken once per magazine worth of
+ * allocations or releases.
+ */
+struct kmem_magazine {
+    struct list node;
+    int size;
+    int nr_objs;
+    void *objs[0];
+};
+
 /*
  * Per-processor cache of pre-constructed objects.
  *
+ * Objects are allocated from and released to the loaded magazine. The
+ * previously loaded magazine is kept, so that alternating allocations
+ * and releases at a magazine boundary don't reach the depot.
+ *
  * The flags member is a read-only CPU-local copy of the parent cache flags.
  */
 struct kmem_cpu_pool {
     simple_lock_data_t lock;
     int flags;
-    int size;
-    int transfer_size;
-    int nr_objs;
-    void **array;
+    struct kmem_magazine *loaded;
+    struct kmem_magazine *previous;
 } __attribute__((aligned(CPU_L1_SIZE)));
 
+/*
+ * Magazine size, along with the cache magazines of that size are
+ * allocated from.
+ */
+struct kmem_magazine_type {
+    int size;
+    struct kmem_cache *cache;
+};
+
 /*
  * When a cache is created, its CPU pool type is determined from the buffer
  * size. For small buffer sizes, many objects can be cached in a CPU pool.
  * Conversely, for large buffer sizes, this would incur much overhead, so only
- * a few objects are stored in a CPU pool.
+ * a few objects are stored in a CPU pool. Magazines start at the smaller
+ * size, and grow up to the larger one while the depot lock is contended.
  */
 struct kmem_cpu_pool_type {
     size_t buf_size;
-    int array_size;
-    size_t array_align;
-    struct kmem_cache *array_cache;
+    struct kmem_magazine_type *magazine_type;
+    struct kmem_magazine_type *max_magazine_type;
 };
 #endif /* SLAB_USE_CPU_POOLS */
 
@@ -149,17 +174,31 @@ typedef void (*kmem_cache_ctor_t)(void *obj);
 /*
  * Cache of objects.
  *
- * Locking order : cpu_pool -> cache. CPU pools locking is ordered by CPU ID.
+ * Locking order : cpu_pool -> depot -> cache. CPU pools locking is ordered
+ * by CPU ID.
  *
- * Currently, SLAB_USE_CPU_POOLS is not defined.  KMEM_CACHE_NAME_SIZE
- * is chosen so that the struct fits into two cache lines.  The first
- * cache line contains all hot fields.
+ * SLAB_USE_CPU_POOLS is only defined on multiprocessor configurations.
+ * Without it, KMEM_CACHE_NAME_SIZE is chosen so that the struct fits into
+ * two cache lines.  The first cache line contains all hot fields.
  */
 struct kmem_cache {
 #if SLAB_USE_CPU_POOLS
     /* CPU pool layer */
     struct kmem_cpu_pool cpu_pools[NCPUS];
-    struct kmem_cpu_pool_type *cpu_pool_type;
+    struct kmem_magazine_type *magazine_type;
+    struct kmem_magazine_type *max_magazine_type;
+
+    /* Depot layer */
+    simple_lock_data_t depot_lock;
+    struct list full_magazines;
+    struct list empty_magazines;
+    long_natural_t nr_full_magazines;
+    long_natural_t nr_empty_magazines;
+    long_natural_t depot_hits;      /* Magazines found in the depot */
+    long_natural_t depot_misses;    /* Magazines not found in the depot */
+    long_natural_t depot_contended; /* Contended depot lock acquisitions */
+    unsigned long depot_recent_contended;
+    unsigned long depot_update_tick;
 #endif /* SLAB_USE_CPU_POOLS */
 
     /* Slab layer */
@@ -187,6 +226,7 @@ struct kmem_cache {
     char name[KMEM_CACHE_NAME_SIZE];
     size_t buftag_dist; /* Distance from buffer to buftag */
     size_t redzone_pad; /* Bytes from end of object to redzone word */
+    long_natural_t nr_reaped_slabs; /* Free slabs released on reclaim */
 } __cacheline_aligned;
 
 /*
@@ -201,6 +241,7 @@ typedef struct kmem_cache *kmem_cache_t;
 #define KMEM_CACHE_NOOFFSLAB    0x1 /* Don't allocate external slab data */
 #define KMEM_CACHE_PHYSMEM      0x2 /* Allocate from physical memory */
 #define KMEM_CACHE_VERIFY       0x4 /* Use debugging facilities */
+#define KMEM_CACHE_NOCPUPOOL    0x8 /* Don't use the CPU pool layer */
 
 /*
  * Initialize a cache.
@@ -226,10 +267,52 @@ void slab_bootstrap(void);
 void slab_init(void);
 
 /*
- * Release free slabs to the VM system.
+ * Release free slabs to the VM system, after returning the objects held
+ * in the magazine depots of the caches to their slabs.
+ *
+ * Calls made less than a few seconds after the previous one do nothing.
  */
 void slab_collect(void);
 
+/*
+ * Shrinker, i.e. a cache of objects or pages, outside the slab allocator,
+ * that can be partially released on memory pressure.
+ *
+ * count returns how many objects could be released, and scan releases
+ * up to the given number of them, returning how many it did. Both are
+ * called with nothing locked. A shrinker stays registered for the
+ * lifetime of the kernel.
+ */
+struct kmem_shrinker {
+    struct list node;
+    const char *name;
+    unsigned long (*count)(void);
+    unsigned long (*scan)(unsigned long nr_to_scan);
+    unsigned long nr_calls;
+    unsigned long nr_scanned;
+    unsigned long nr_freed;
+};
+
+void kmem_shrinker_register(struct kmem_shrinker *shrinker);
+
+/*
+ * Priorities of memory reclaim.
+ *
+ * At priority p, each shrinker is asked to release 1/2^p of its objects,
+ * and each cache 1/2^p of its free slabs, but always a small batch at
+ * least. Priority 0 releases everything possible.
+ */
+#define KMEM_SHRINK_PRIORITY_MAX 8
+
+/*
+ * Release memory from the registered shrinkers, then from the caches,
+ * in proportion to the priority.
+ *
+ * This function is meant to be called by the pageout daemon, with a
+ * priority decreasing as memory pressure persists.
+ */
+void slab_shrink(unsigned int priority);
+
 /*
  * Display a summary of all kernel caches.
  */
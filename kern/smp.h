@@ -106,15 +106,6 @@ void smp_update_cpu_load(unsigned char cpu);
 void smp_synchronize_cpus(void);
 void smp_cpu_barrier(void);
 
-/* Enhanced SMP scheduler functions */
-void smp_sched_init(void);
-processor_t smp_choose_processor(thread_t thread, processor_set_t pset);
-boolean_t smp_should_migrate_thread(thread_t thread, processor_t from_proc, processor_t to_proc);
-void smp_balance_pset_load(processor_set_t pset);
-boolean_t smp_steal_work(processor_t idle_proc);
-void smp_enhanced_thread_setrun(thread_t th, boolean_t may_preempt);
-int processor_to_cpu_id(processor_t processor);
-
 /* Work queue management - SMP threading enhancement */
 void smp_work_queue_init(void);
 kern_return_t smp_queue_work(int cpu, void (*func)(void *), void *arg);
@@ -37,6 +37,7 @@
 #include <kern/cpu_number.h>
 #include <kern/debug.h>
 #include <kern/gsync.h>
+#include <kern/llsync.h>
 #include <kern/machine.h>
 #include <kern/mach_factor.h>
 #include <kern/mach_clock.h>
@@ -154,6 +155,7 @@ void setup_main(void)
 	vm_mem_bootstrap();
 	unified_debug_vm_init();
 	
+	llsync_setup();
 	rdxtree_cache_init();
 	
 	ipc_bootstrap();
@@ -178,14 +180,18 @@ void setup_main(void)
 	xprbootstrap();
 #endif	/* XPR_DEBUG */
 
-#if	MACH_DTRACE
-	dtrace_init();
-#endif	/* MACH_DTRACE */
-
 	machine_init();
 
+	/* Size the wait event hash table for this machine */
+	wait_table_init();
+
 	mapable_time_init();
 
+#if	MACH_DTRACE
+	/* One event ring per processor, they are all known by now */
+	dtrace_init();
+#endif	/* MACH_DTRACE */
+
 	/* Initialize console timestamps after time system is ready */
 	console_timestamp_init();
 
@@ -317,6 +323,7 @@ void start_kernel_threads(void)
 	(void) kernel_thread(kernel_task, "reaper", reaper_thread, (char *) 0);
 	(void) kernel_thread(kernel_task, "swapin", swapin_thread, (char *) 0);
 	(void) kernel_thread(kernel_task, "sched", sched_thread, (char *) 0);
+	(void) kernel_thread(kernel_task, "llsync", llsync_thread, (char *) 0);
 #ifndef MACH_XEN
 	(void) kernel_thread(kernel_task, "intr", intr_thread, (char *)0);
 #endif	/* MACH_XEN */
@@ -360,6 +367,10 @@ void start_kernel_threads(void)
 	 *	Become the pageout daemon.
 	 */
 	(void) spl0();
+
+	if (strstr(kernel_cmdline, "timerbench"))
+	    timeout_benchmark();
+
 	thread_set_name(current_thread(), "pageout");
 	vm_pageout();
 	/*NOTREACHED*/
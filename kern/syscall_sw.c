@@ -38,6 +38,7 @@
 #include <kern/syscall_subr.h>
 #include <kern/ipc_mig.h>
 #include <kern/eventcount.h>
+#include <ipc/mach_msg.h>
 #include <ipc/mach_port.server.h>
 
 
@@ -161,8 +162,8 @@ mach_trap_t	mach_trap_table[] = {
 	MACH_TRAP(syscall_mach_port_allocate_name, 3),	/* 75 */
 	MACH_TRAP(syscall_thread_depress_abort, 1),	/* 76 */
 	MACH_TRAP(thread_set_self_state, 3),		/* 77 */
-	MACH_TRAP(kern_invalid, 0),		/* 78 */
-	MACH_TRAP(kern_invalid, 0),		/* 79 */
+	MACH_TRAP(mach_msg_ring_register, 2),		/* 78 */
+	MACH_TRAP(mach_msg_ring_enter, 2),		/* 79 */
 
 	MACH_TRAP(kern_invalid, 0),                   /* 80 */
 	MACH_TRAP(kern_invalid, 0),                   /* 81 */
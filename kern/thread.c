@@ -329,6 +329,7 @@ void thread_init(void)
 	thread_template.stack_privilege = (vm_offset_t) 0;
 
 	thread_template.wait_event = 0;
+	/* thread_template.wait_list (later) */
 	/* thread_template.suspend_count (later) */
 	thread_template.wait_result = KERN_SUCCESS;
 	thread_template.wake_active = FALSE;
@@ -452,6 +453,12 @@ kern_return_t thread_create(
 
 	*new_thread = thread_template;
 
+	new_thread->wait_list = wait_list_alloc();
+	if (new_thread->wait_list == NULL) {
+		kmem_cache_free(&thread_cache, (vm_offset_t) new_thread);
+		return KERN_RESOURCE_SHORTAGE;
+	}
+
 	record_time_stamp (&new_thread->creation_time);
 
 	/*
@@ -768,6 +775,7 @@ void thread_deallocate(
 	evc_notify_abort(thread);
 
 	pcb_terminate(thread);
+	wait_list_free(thread->wait_list);
 	kmem_cache_free(&thread_cache, (vm_offset_t) thread);
 }
 
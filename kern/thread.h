@@ -112,6 +112,7 @@ struct thread {
 
 	/* Blocking information */
 	event_t		wait_event;	/* event we are waiting on */
+	struct wait_list *wait_list;	/* list we wait on, or our own */
 	int		suspend_count;	/* internal use only */
 	kern_return_t	wait_result;	/* outcome of wait -
 					   may be examined by this thread
@@ -184,6 +185,12 @@ struct thread {
 	mach_port_name_t ith_mig_reply;	/* reply port for mig */
 	struct ipc_port *ith_rpc_reply;	/* reply port for kernel RPCs */
 
+	/* Asynchronous message ring, see mach_msg_ring_enter */
+	vm_offset_t ith_ring;		/* user address, 0 if none */
+	natural_t ith_ring_size;	/* entries per queue */
+	natural_t ith_ring_sq_head;	/* next submission to run */
+	natural_t ith_ring_cq_tail;	/* next completion to post */
+
 	/* State saved when thread's stack is discarded */
 	union {
 		struct {
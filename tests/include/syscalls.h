@@ -34,6 +34,7 @@
 
 #include <device/device_types.h>
 #include <mach/message.h>
+#include <mach/msg_ring.h>
 
 // TODO: there is probably a better way to define these
 
@@ -71,9 +72,12 @@ MACH_SYSCALL3(66, kern_return_t, syscall_vm_deallocate, mach_port_t, vm_offset_t
 MACH_SYSCALL3(72, kern_return_t, syscall_mach_port_allocate, mach_port_t, mach_port_right_t, mach_port_t*)
 MACH_SYSCALL2(73, kern_return_t, syscall_mach_port_deallocate, mach_port_t, mach_port_t)
 MACH_SYSCALL3(77, kern_return_t, thread_set_self_state, int, natural_t *, natural_t)
+MACH_SYSCALL2(78, kern_return_t, mach_msg_ring_register, struct mach_msg_ring *, natural_t)
+MACH_SYSCALL2(79, kern_return_t, mach_msg_ring_enter, natural_t, natural_t)
+MACH_SYSCALL0(60, boolean_t, swtch)
 
 /*
-  todo: swtch_pri swtch ...
+  todo: swtch_pri ...
   these seem obsolete: evc_wait
     evc_wait_clear syscall_device_writev_request
     syscall_device_write_request ...
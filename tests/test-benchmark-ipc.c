@@ -18,6 +18,7 @@
 
 #include <mach/message.h>
 #include <mach/mach_types.h>
+#include <mach/msg_ring.h>
 #include <mach/vm_param.h>
 
 #include <syscalls.h>
@@ -98,6 +99,200 @@ void benchmark_message_operations(void)
     printf("Message operations benchmark completed\n");
 }
 
+/* Round trips through a port, one mach_msg per message or one
+   mach_msg_ring_enter per batch of messages */
+
+#define RING_ENTRIES	8
+#define RING_ROUNDS	1000
+
+static char ring_buf[MACH_MSG_RING_SIZE(RING_ENTRIES)]
+    __attribute__((aligned(64)));
+static mach_msg_header_t ring_msgs[RING_ENTRIES];
+
+static void prepare_msg(mach_msg_header_t *msg, mach_port_t port)
+{
+    msg->msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_MAKE_SEND, 0);
+    msg->msgh_size = sizeof(*msg);
+    msg->msgh_remote_port = port;
+    msg->msgh_local_port = MACH_PORT_NULL;
+    msg->msgh_id = 1001;
+}
+
+void benchmark_ring_operations(void)
+{
+    struct mach_msg_ring *ring = (struct mach_msg_ring *)ring_buf;
+    struct mach_msg_ring_sqe *sq = MACH_MSG_RING_SQ(ring);
+    struct mach_msg_ring_cqe *cq = MACH_MSG_RING_CQ(ring, RING_ENTRIES);
+    mach_msg_option_t option = MACH_SEND_MSG | MACH_RCV_MSG;
+    benchmark_t bench;
+    mach_port_t port;
+    natural_t head, tail;
+    kern_return_t kr;
+    int i, j;
+
+    printf("=== IPC Message Ring Benchmark ===\n");
+
+    kr = mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, &port);
+    ASSERT_RET(kr, "failed to create ring test port");
+
+    benchmark_start(&bench, "mach_msg Round Trips");
+    for (i = 0; i < RING_ROUNDS * RING_ENTRIES; i++) {
+        prepare_msg(&ring_msgs[0], port);
+        kr = mach_msg(&ring_msgs[0], option, sizeof(ring_msgs[0]),
+                      sizeof(ring_msgs[0]), port, MACH_MSG_TIMEOUT_NONE,
+                      MACH_PORT_NULL);
+        ASSERT_RET(kr, "mach_msg round trip");
+    }
+    bench.iterations = RING_ROUNDS * RING_ENTRIES;
+    benchmark_end(&bench);
+    benchmark_report(&bench, "round trips/sec");
+
+    ring->nentries = RING_ENTRIES;
+    kr = mach_msg_ring_register(ring, RING_ENTRIES);
+    ASSERT_RET(kr, "mach_msg_ring_register");
+
+    benchmark_start(&bench, "Message Ring Round Trips");
+    for (i = 0; i < RING_ROUNDS; i++) {
+        tail = ring->sq_tail;
+        for (j = 0; j < RING_ENTRIES; j++, tail++) {
+            struct mach_msg_ring_sqe *sqe = &sq[tail % RING_ENTRIES];
+
+            prepare_msg(&ring_msgs[j], port);
+            sqe->msg = (rpc_vm_address_t)&ring_msgs[j];
+            sqe->option = option;
+            sqe->send_size = sizeof(ring_msgs[j]);
+            sqe->rcv_size = sizeof(ring_msgs[j]);
+            sqe->rcv_name = port;
+            sqe->timeout = MACH_MSG_TIMEOUT_NONE;
+            sqe->notify = MACH_PORT_NULL;
+            sqe->user_data = j;
+        }
+        __atomic_store_n(&ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+        kr = mach_msg_ring_enter(0, 0);
+        ASSERT_RET(kr, "mach_msg_ring_enter");
+
+        head = ring->cq_head;
+        ASSERT(__atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE)
+               == head + RING_ENTRIES, "missing completions");
+        for (j = 0; j < RING_ENTRIES; j++, head++) {
+            ASSERT_RET(cq[head % RING_ENTRIES].result, "ring round trip");
+            ASSERT(cq[head % RING_ENTRIES].user_data == j,
+                   "completions out of order");
+        }
+        __atomic_store_n(&ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    bench.iterations = RING_ROUNDS * RING_ENTRIES;
+    benchmark_end(&bench);
+    benchmark_report(&bench, "round trips/sec");
+
+    kr = mach_msg_ring_register(NULL, 0);
+    ASSERT_RET(kr, "mach_msg_ring_register");
+    kr = mach_msg_ring_enter(0, 0);
+    ASSERT(kr == KERN_FAILURE, "ring still registered");
+
+    mach_port_destroy(mach_task_self(), port);
+
+    printf("Message ring benchmark completed\n");
+}
+
+/* RPC round trips between a client thread and the main thread, with
+   the client in the same task or in another one, so that each message
+   switches address spaces.  Boot with nopcid to compare with TLB
+   flushes on every switch. */
+
+#define RPC_ROUNDS	5000
+
+static void rpc_client(void *arg)
+{
+    mach_port_t server = (mach_port_t)(long)arg;
+    mach_port_t reply = mach_reply_port();
+    mach_msg_header_t msg;
+    kern_return_t kr;
+    int i;
+
+    for (i = 0; i < RPC_ROUNDS; i++) {
+        msg.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_COPY_SEND,
+                                       MACH_MSG_TYPE_MAKE_SEND_ONCE);
+        msg.msgh_size = sizeof(msg);
+        msg.msgh_remote_port = server;
+        msg.msgh_local_port = reply;
+        msg.msgh_id = 1002;
+        kr = mach_msg(&msg, MACH_SEND_MSG | MACH_RCV_MSG, sizeof(msg),
+                      sizeof(msg), reply, MACH_MSG_TIMEOUT_NONE,
+                      MACH_PORT_NULL);
+        ASSERT_RET(kr, "rpc");
+    }
+
+    thread_terminate(mach_thread_self());
+    FAILURE("thread_terminate");
+}
+
+static void rpc_serve(mach_port_t server, const char *name)
+{
+    mach_msg_header_t msg;
+    benchmark_t bench;
+    kern_return_t kr;
+    int i;
+
+    kr = mach_msg(&msg, MACH_RCV_MSG, 0, sizeof(msg), server,
+                  MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+    ASSERT_RET(kr, "receive first request");
+
+    benchmark_start(&bench, name);
+    for (i = 0; i < RPC_ROUNDS; i++) {
+        msg.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_MOVE_SEND_ONCE, 0);
+        msg.msgh_size = sizeof(msg);
+        msg.msgh_local_port = MACH_PORT_NULL;
+        if (i == RPC_ROUNDS - 1)
+            kr = mach_msg(&msg, MACH_SEND_MSG, sizeof(msg), 0,
+                          MACH_PORT_NULL, MACH_MSG_TIMEOUT_NONE,
+                          MACH_PORT_NULL);
+        else
+            kr = mach_msg(&msg, MACH_SEND_MSG | MACH_RCV_MSG, sizeof(msg),
+                          sizeof(msg), server, MACH_MSG_TIMEOUT_NONE,
+                          MACH_PORT_NULL);
+        ASSERT_RET(kr, "reply");
+    }
+    bench.iterations = RPC_ROUNDS;
+    benchmark_end(&bench);
+    benchmark_report(&bench, "round trips/sec");
+}
+
+void benchmark_rpc_operations(void)
+{
+    mach_port_t server;
+    task_t child;
+    kern_return_t kr;
+
+    printf("=== Cross-Task RPC Benchmark ===\n");
+
+    kr = mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE,
+                            &server);
+    ASSERT_RET(kr, "failed to create rpc server port");
+    kr = mach_port_insert_right(mach_task_self(), server, server,
+                                MACH_MSG_TYPE_MAKE_SEND);
+    ASSERT_RET(kr, "mach_port_insert_right");
+
+    test_thread_start(mach_task_self(), rpc_client, (void *)(long)server);
+    rpc_serve(server, "Same-Task RPC Round Trips");
+
+    kr = task_create(mach_task_self(), 1, &child);
+    ASSERT_RET(kr, "task_create");
+    kr = mach_port_insert_right(child, server, server,
+                                MACH_MSG_TYPE_MAKE_SEND);
+    ASSERT_RET(kr, "mach_port_insert_right in child");
+
+    test_thread_start(child, rpc_client, (void *)(long)server);
+    rpc_serve(server, "Cross-Task RPC Round Trips");
+
+    kr = task_terminate(child);
+    ASSERT_RET(kr, "task_terminate");
+    mach_port_destroy(mach_task_self(), server);
+
+    printf("Cross-task RPC benchmark completed\n");
+}
+
 void benchmark_task_info_operations(void)
 {
     benchmark_t bench;
@@ -130,6 +325,8 @@ int main(int argc, char *argv[], int envc, char *envp[])
     
     benchmark_port_operations();
     benchmark_message_operations();
+    benchmark_ring_operations();
+    benchmark_rpc_operations();
     benchmark_task_info_operations();
     
     printf("All IPC benchmarks completed successfully\n");
@@ -0,0 +1,168 @@
+/*
+ *  Copyright (C) 2024 Free Software Foundation
+ *
+ * This program is free software ; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY ; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the program ; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Map the per-processor DTrace event rings, check that the mapping
+ * is read-only, and drain the events caused by some page faults.
+ */
+
+#include <syscalls.h>
+#include <testlib.h>
+
+#include <mach/machine/vm_param.h>
+#include <mach/std_types.h>
+#include <mach/mach_types.h>
+#include <mach/vm_prot.h>
+
+#include <mach.user.h>
+#include <mach_debug.user.h>
+
+/* Keep in sync with kern/dtrace.h */
+#define DTRACE_RING_MAGIC	0x44545243
+#define DTRACE_RING_VERSION	1
+
+struct dtrace_event {
+  uint32_t probe_id;
+  uint64_t timestamp;
+  uint32_t cpu_id;
+  uint32_t thread_id;
+  uint32_t task_id;
+  uint64_t args[6];
+};
+
+struct dtrace_ring_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nrings;
+  uint32_t ring_events;
+  uint32_t ring_offset;
+  uint32_t ring_stride;
+  uint64_t tsc_base;
+  uint64_t tsc_mult;
+  uint64_t ns_base;
+};
+
+struct dtrace_ring {
+  volatile uint32_t head;
+  uint32_t cpu;
+  uint64_t fired;
+  uint64_t overhead;
+  uint64_t reserved[5];
+  struct dtrace_event events[];
+};
+
+#define FAULT_PAGES	64
+
+static const struct dtrace_ring_header *rings;
+static vm_size_t rings_size;
+
+static const struct dtrace_ring *get_ring(uint32_t i)
+{
+  return (const struct dtrace_ring *)((const char *)rings + rings->ring_offset
+                                      + i * rings->ring_stride);
+}
+
+static void test_map(void)
+{
+  vm_address_t addr, region;
+  vm_size_t size;
+  vm_prot_t prot, max_prot;
+  vm_inherit_t inherit;
+  boolean_t shared;
+  mach_port_t object;
+  vm_offset_t offset;
+  int err;
+
+  err = host_dtrace_map(host_priv(), mach_task_self(), &addr, &rings_size);
+  ASSERT_RET(err, "host_dtrace_map");
+  rings = (const struct dtrace_ring_header *)addr;
+
+  ASSERT(rings->magic == DTRACE_RING_MAGIC, "bad ring magic");
+  ASSERT(rings->version == DTRACE_RING_VERSION, "bad ring version");
+  ASSERT(rings->nrings > 0, "no rings");
+  ASSERT(rings->ring_events > 0
+         && (rings->ring_events & (rings->ring_events - 1)) == 0,
+         "ring size is not a power of two");
+  ASSERT(rings->ring_offset + rings->nrings * rings->ring_stride
+         <= rings_size, "rings beyond the mapping");
+  printf("%u rings of %u events, %u bytes mapped\n",
+         rings->nrings, rings->ring_events, (unsigned int)rings_size);
+
+  region = addr;
+  err = vm_region(mach_task_self(), &region, &size, &prot, &max_prot,
+                  &inherit, &shared, &object, &offset);
+  ASSERT_RET(err, "vm_region");
+  ASSERT(region == addr, "mapping not found");
+  ASSERT(prot == VM_PROT_READ && max_prot == VM_PROT_READ,
+         "mapping is not read-only");
+
+  err = vm_protect(mach_task_self(), addr, rings_size, FALSE,
+                   VM_PROT_READ | VM_PROT_WRITE);
+  ASSERT(err != KERN_SUCCESS, "rings could be made writable");
+}
+
+static void test_drain(void)
+{
+  uint32_t start[rings->nrings];
+  const struct dtrace_ring *ring;
+  const struct dtrace_event *event;
+  vm_address_t mem;
+  uint32_t i, pos, faults = 0;
+  uint64_t last;
+  int err;
+
+  for (i = 0; i < rings->nrings; i++)
+    start[i] = get_ring(i)->head;
+
+  err = vm_allocate(mach_task_self(), &mem, FAULT_PAGES * PAGE_SIZE, TRUE);
+  ASSERT_RET(err, "vm_allocate");
+  for (i = 0; i < FAULT_PAGES; i++)
+    *(volatile char *)(mem + i * PAGE_SIZE) = 1;
+
+  for (i = 0; i < rings->nrings; i++)
+    {
+      ring = get_ring(i);
+      ASSERT(ring->cpu == i, "ring of the wrong processor");
+      pos = ring->head - start[i] > rings->ring_events - 1
+            ? ring->head - (rings->ring_events - 1) : start[i];
+      last = 0;
+      for (; pos != ring->head; pos++)
+        {
+          event = &ring->events[pos & (rings->ring_events - 1)];
+          ASSERT(event->cpu_id == i, "event in the wrong ring");
+          ASSERT(event->timestamp >= last, "timestamps going backwards");
+          last = event->timestamp;
+          if (event->args[0] >= mem
+              && event->args[0] < mem + FAULT_PAGES * PAGE_SIZE)
+            faults++;
+        }
+    }
+
+  printf("%u of %u page faults traced\n", faults, FAULT_PAGES);
+  ASSERT(faults >= FAULT_PAGES, "page faults missing from the rings");
+
+  err = vm_deallocate(mach_task_self(), mem, FAULT_PAGES * PAGE_SIZE);
+  ASSERT_RET(err, "vm_deallocate");
+}
+
+int main(int argc, char *argv[], int envc, char *envp[])
+{
+  test_map();
+  test_drain();
+  return 0;
+}
@@ -0,0 +1,101 @@
+/*
+ *  Copyright (C) 2024 Free Software Foundation
+ *
+ * This program is free software ; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY ; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the program ; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Keep a few small messages in flight on a port, and check that
+ * their buffers mostly come from the per-processor kmsg caches.
+ */
+
+#include <syscalls.h>
+#include <testlib.h>
+
+#include <mach/std_types.h>
+#include <mach/mach_types.h>
+#include <mach_debug/mach_debug_types.h>
+
+#include <mach.user.h>
+#include <mach_debug.user.h>
+
+#define NINFLIGHT	4
+#define NROUNDS		500
+
+static void get_info(ipc_kmsg_cache_info_t *info)
+{
+  ipc_kmsg_cache_info_t *infos = info;
+  mach_msg_type_number_t count = 8;
+  int err;
+
+  err = host_ipc_kmsg_cache_info(mach_host_self(), &infos, &count);
+  ASSERT_RET(err, "host_ipc_kmsg_cache_info");
+  ASSERT(count >= 1, "no size class");
+  if (infos != info)
+    {
+      memcpy(info, infos, count * sizeof *info);
+      vm_deallocate(mach_task_self(), (vm_offset_t)infos,
+                    count * sizeof *info);
+    }
+}
+
+int main(int argc, char *argv[], int envc, char *envp[])
+{
+  ipc_kmsg_cache_info_t before[8], after[8];
+  mach_msg_header_t msg;
+  mach_port_t port;
+  uint64_t hits, misses;
+  int i, j, err;
+
+  err = mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, &port);
+  ASSERT_RET(err, "mach_port_allocate");
+
+  get_info(before);
+
+  for (j = 0; j < NROUNDS; j++)
+    {
+      for (i = 0; i < NINFLIGHT; i++)
+        {
+          msg.msgh_bits = MACH_MSGH_BITS(MACH_MSG_TYPE_MAKE_SEND, 0);
+          msg.msgh_size = sizeof(msg);
+          msg.msgh_remote_port = port;
+          msg.msgh_local_port = MACH_PORT_NULL;
+          msg.msgh_id = i;
+          err = mach_msg(&msg, MACH_SEND_MSG, sizeof(msg), 0,
+                         MACH_PORT_NULL, MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+          ASSERT_RET(err, "mach_msg send");
+        }
+      for (i = 0; i < NINFLIGHT; i++)
+        {
+          err = mach_msg(&msg, MACH_RCV_MSG, 0, sizeof(msg), port,
+                         MACH_MSG_TIMEOUT_NONE, MACH_PORT_NULL);
+          ASSERT_RET(err, "mach_msg receive");
+          ASSERT(msg.msgh_id == i, "messages out of order");
+        }
+    }
+
+  get_info(after);
+
+  /* Header-only messages use the first size class */
+  hits = after[0].ikci_hits - before[0].ikci_hits;
+  misses = after[0].ikci_misses - before[0].ikci_misses;
+  printf("%u-byte buffers: %llu hits, %llu misses, %u cached\n",
+         after[0].ikci_size, hits, misses, after[0].ikci_cached);
+  ASSERT(hits >= NROUNDS * NINFLIGHT / 2, "too few cache hits");
+  ASSERT(misses < hits, "cache misses more than it hits");
+
+  mach_port_destroy(mach_task_self(), port);
+  return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ *  Copyright (C) 2024 Free Software Foundation
+ *
+ * This program is free software ; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY ; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the program ; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Check that the kernel server dispatch table accounts for the
+ * requests it serves, and print the latency histogram of vm_allocate.
+ */
+
+#include <syscalls.h>
+#include <testlib.h>
+
+#include <mach/machine/vm_param.h>
+#include <mach/std_types.h>
+#include <mach/mach_types.h>
+#include <mach_debug/mach_debug_types.h>
+
+#include <mach.user.h>
+#include <mach_debug.user.h>
+
+/* From the subsystem and routine order in mach.defs */
+#define VM_ALLOCATE_ID	2021
+#define VM_DEALLOCATE_ID	2023
+
+#define NCALLS		1000
+
+static const ipc_kobject_routine_info_t *
+find_routine(const ipc_kobject_routine_info_t *info,
+             mach_msg_type_number_t count, int id)
+{
+  mach_msg_type_number_t i;
+
+  for (i = 0; i < count; i++)
+    if (info[i].ikri_id == id)
+      return &info[i];
+
+  FAILURE("routine missing from the dispatch table");
+  return NULL;
+}
+
+static void get_info(ipc_kobject_routine_info_array_t *info,
+                     mach_msg_type_number_t *count)
+{
+  int err;
+
+  *info = NULL;
+  *count = 0;
+  err = host_ipc_kobject_info(mach_host_self(), info, count);
+  ASSERT_RET(err, "host_ipc_kobject_info");
+  ASSERT(*count > 0, "empty dispatch table");
+}
+
+int main(int argc, char *argv[], int envc, char *envp[])
+{
+  ipc_kobject_routine_info_array_t before, after;
+  mach_msg_type_number_t before_count, after_count;
+  const ipc_kobject_routine_info_t *alloc0, *alloc1, *dealloc0, *dealloc1;
+  uint64_t hist_calls;
+  vm_address_t mem;
+  int i, err;
+
+  get_info(&before, &before_count);
+
+  for (i = 0; i < NCALLS; i++)
+    {
+      err = vm_allocate(mach_task_self(), &mem, PAGE_SIZE, TRUE);
+      ASSERT_RET(err, "vm_allocate");
+      err = vm_deallocate(mach_task_self(), mem, PAGE_SIZE);
+      ASSERT_RET(err, "vm_deallocate");
+    }
+
+  get_info(&after, &after_count);
+  ASSERT(after_count == before_count, "dispatch table changed size");
+
+  alloc0 = find_routine(before, before_count, VM_ALLOCATE_ID);
+  alloc1 = find_routine(after, after_count, VM_ALLOCATE_ID);
+  dealloc0 = find_routine(before, before_count, VM_DEALLOCATE_ID);
+  dealloc1 = find_routine(after, after_count, VM_DEALLOCATE_ID);
+
+  ASSERT(alloc1->ikri_calls - alloc0->ikri_calls >= NCALLS,
+         "vm_allocate calls not accounted");
+  ASSERT(dealloc1->ikri_calls - dealloc0->ikri_calls >= NCALLS,
+         "vm_deallocate calls not accounted");
+
+  hist_calls = 0;
+  for (i = 0; i < IKRI_HIST_BUCKETS; i++)
+    {
+      hist_calls += alloc1->ikri_hist[i];
+      printf("vm_allocate < 2^%d cycles: %u\n", IKRI_HIST_SHIFT + i,
+             (unsigned int)alloc1->ikri_hist[i]);
+    }
+  ASSERT(hist_calls == alloc1->ikri_calls, "histogram does not add up");
+  printf("%u routines, vm_allocate: %u calls, %u cycles on average\n",
+         after_count, (unsigned int)alloc1->ikri_calls,
+         (unsigned int)(alloc1->ikri_cycles / alloc1->ikri_calls));
+
+  return 0;
+}
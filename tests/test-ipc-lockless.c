@@ -0,0 +1,113 @@
+/*
+ *  Copyright (C) 2024 Free Software Foundation
+ *
+ * This program is free software ; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY ; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the program ; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Look names up locklessly while other threads allocate and destroy
+ * ports in the same space, so that entries and tree nodes get freed
+ * under the readers.  The vm traps look the task port up, and
+ * receives with a zero timeout look their own receive right up.
+ */
+
+#include <syscalls.h>
+#include <testlib.h>
+
+#include <mach/std_types.h>
+#include <mach/mach_types.h>
+
+#include <mach.user.h>
+
+#define NCHURNERS	4
+#define NREADERS	4
+#define NROUNDS		2000
+
+static volatile int done;
+
+static void churner(void *arg)
+{
+  mach_port_t names[16];
+  int i, j, err;
+
+  for (j = 0; j < NROUNDS; j++)
+    {
+      for (i = 0; i < 16; i++)
+        {
+          err = syscall_mach_port_allocate(mach_task_self(),
+                                           MACH_PORT_RIGHT_RECEIVE,
+                                           &names[i]);
+          ASSERT_RET(err, "mach_port_allocate");
+        }
+      for (i = 0; i < 16; i++)
+        {
+          err = mach_port_destroy(mach_task_self(), names[i]);
+          ASSERT_RET(err, "mach_port_destroy");
+        }
+    }
+
+  __atomic_add_fetch(&done, 1, __ATOMIC_RELAXED);
+  thread_terminate(mach_thread_self());
+  FAILURE("thread_terminate");
+}
+
+static void reader(void *arg)
+{
+  mach_msg_header_t msg;
+  mach_port_t port;
+  vm_offset_t addr;
+  int err;
+
+  err = syscall_mach_port_allocate(mach_task_self(),
+                                   MACH_PORT_RIGHT_RECEIVE, &port);
+  ASSERT_RET(err, "mach_port_allocate");
+
+  while (__atomic_load_n(&done, __ATOMIC_RELAXED) < NCHURNERS)
+    {
+      err = syscall_vm_allocate(mach_task_self(), &addr, vm_page_size, TRUE);
+      ASSERT_RET(err, "vm_allocate");
+      err = syscall_vm_deallocate(mach_task_self(), addr, vm_page_size);
+      ASSERT_RET(err, "vm_deallocate");
+
+      err = mach_msg(&msg, MACH_RCV_MSG | MACH_RCV_TIMEOUT, 0, sizeof(msg),
+                     port, 0, MACH_PORT_NULL);
+      ASSERT(err == MACH_RCV_TIMED_OUT, "receive did not time out");
+    }
+
+  err = mach_port_destroy(mach_task_self(), port);
+  ASSERT_RET(err, "mach_port_destroy");
+  err = mach_msg(&msg, MACH_RCV_MSG | MACH_RCV_TIMEOUT, 0, sizeof(msg),
+                 port, 0, MACH_PORT_NULL);
+  ASSERT(err == MACH_RCV_INVALID_NAME, "receive on a dead name");
+
+  __atomic_add_fetch(&done, 1, __ATOMIC_RELAXED);
+  thread_terminate(mach_thread_self());
+  FAILURE("thread_terminate");
+}
+
+int main(int argc, char *argv[], int envc, char *envp[])
+{
+  int i;
+
+  for (i = 0; i < NREADERS; i++)
+    test_thread_start(mach_task_self(), reader, NULL);
+  for (i = 0; i < NCHURNERS; i++)
+    test_thread_start(mach_task_self(), churner, NULL);
+
+  while (__atomic_load_n(&done, __ATOMIC_RELAXED) < NCHURNERS + NREADERS)
+    msleep(10);
+
+  return 0;
+}
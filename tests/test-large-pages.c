@@ -0,0 +1,111 @@
+/*
+ *  Copyright (C) 2024 Free Software Foundation
+ *
+ * This program is free software ; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY ; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the program ; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Fill a region big enough for the kernel to map it with large pages,
+ * then protect, deallocate and copy parts of it, so that the large
+ * mappings get split, and check that no page loses its contents.
+ * Print how long touching the region took.
+ */
+
+#include <syscalls.h>
+#include <testlib.h>
+
+#include <mach/std_types.h>
+#include <mach/mach_types.h>
+
+#include <mach.user.h>
+
+#define LARGE_SIZE	(2 * 1024 * 1024)
+#define REGION_SIZE	(4 * LARGE_SIZE)
+
+static uint64_t uptime_usec(void)
+{
+  time_value64_t uptime;
+  int err;
+
+  err = host_get_uptime64(mach_host_self(), &uptime);
+  ASSERT_RET(err, "host_get_uptime64");
+  return uptime.seconds * 1000000ULL + uptime.nanoseconds / 1000;
+}
+
+static void check(vm_offset_t addr, vm_offset_t start, vm_offset_t end,
+                  vm_offset_t hole)
+{
+  vm_offset_t va;
+
+  for (va = start; va < end; va += vm_page_size)
+    if (va != hole)
+      ASSERT(*(volatile vm_offset_t *)va == va - addr,
+             "page lost its contents");
+}
+
+int main(int argc, char *argv[], int envc, char *envp[])
+{
+  vm_offset_t addr, large, copy, va;
+  uint64_t start;
+  int err;
+
+  err = vm_allocate(mach_task_self(), &addr, REGION_SIZE, TRUE);
+  ASSERT_RET(err, "vm_allocate");
+
+  start = uptime_usec();
+  for (va = addr; va < addr + REGION_SIZE; va += vm_page_size)
+    *(volatile vm_offset_t *)va = va - addr;
+  printf("touched %u MB in %llu us\n", REGION_SIZE >> 20,
+         (unsigned long long) (uptime_usec() - start));
+  check(addr, addr, addr + REGION_SIZE, 0);
+
+  /* The first aligned large page of the region, and the next ones */
+  large = (addr + LARGE_SIZE - 1) & ~(vm_offset_t)(LARGE_SIZE - 1);
+
+  /* Protect a whole large page, then a single page of the next one */
+  err = vm_protect(mach_task_self(), large, LARGE_SIZE, FALSE, VM_PROT_READ);
+  ASSERT_RET(err, "vm_protect large page");
+  err = vm_protect(mach_task_self(), large + LARGE_SIZE + 5 * vm_page_size,
+                   vm_page_size, FALSE, VM_PROT_READ);
+  ASSERT_RET(err, "vm_protect page");
+  check(addr, addr, addr + REGION_SIZE, 0);
+
+  /* Writes to the pages left writable still go to the same memory */
+  va = large + LARGE_SIZE + 6 * vm_page_size;
+  *(volatile vm_offset_t *)va = 0;
+  *(volatile vm_offset_t *)va = va - addr;
+
+  /* Copy across the boundary of two large pages */
+  copy = 0;
+  err = vm_allocate(mach_task_self(), &copy, LARGE_SIZE, TRUE);
+  ASSERT_RET(err, "vm_allocate copy");
+  err = vm_copy(mach_task_self(), large + LARGE_SIZE / 2, LARGE_SIZE, copy);
+  ASSERT_RET(err, "vm_copy");
+  for (va = 0; va < LARGE_SIZE; va += vm_page_size)
+    ASSERT(*(volatile vm_offset_t *)(copy + va)
+           == large + LARGE_SIZE / 2 + va - addr, "copy differs");
+  err = vm_deallocate(mach_task_self(), copy, LARGE_SIZE);
+  ASSERT_RET(err, "vm_deallocate copy");
+
+  /* Punch a hole in the last large page */
+  va = large + 2 * LARGE_SIZE + 17 * vm_page_size;
+  err = vm_deallocate(mach_task_self(), va, vm_page_size);
+  ASSERT_RET(err, "vm_deallocate page");
+  check(addr, addr, addr + REGION_SIZE, va);
+
+  err = vm_deallocate(mach_task_self(), addr, REGION_SIZE);
+  ASSERT_RET(err, "vm_deallocate");
+  return 0;
+}
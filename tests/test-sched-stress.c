@@ -0,0 +1,124 @@
+/*
+ *  Copyright (C) 2024 Free Software Foundation
+ *
+ * This program is free software ; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY ; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the program ; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Keep hundreds of threads runnable, yielding to each other, and
+ * report the context switch rate and the contention on the run
+ * queue locks.  Every thread must get to run.
+ */
+
+#include <syscalls.h>
+#include <testlib.h>
+
+#include <mach/std_types.h>
+#include <mach/mach_types.h>
+#include <mach_debug/mach_debug_types.h>
+
+#include <mach.user.h>
+#include <mach_debug.user.h>
+
+#define NTHREADS	256
+#define RUN_MS		2000
+
+static volatile int stop;
+static volatile int nr_exited;
+static volatile unsigned long rounds[NTHREADS];
+
+static void worker(void *arg)
+{
+  long id = (long)arg;
+  volatile unsigned long sum = 0;
+  int i;
+
+  while (!stop)
+    {
+      for (i = 0; i < 1000; i++)
+        sum += i;
+      rounds[id]++;
+      swtch();
+    }
+
+  __atomic_add_fetch(&nr_exited, 1, __ATOMIC_RELAXED);
+  thread_terminate(mach_thread_self());
+  FAILURE("thread_terminate");
+}
+
+static void get_info(runq_info_array_t *info, mach_msg_type_number_t *count)
+{
+  int err;
+
+  *info = NULL;
+  *count = 0;
+  err = host_runq_info(mach_host_self(), info, count);
+  ASSERT_RET(err, "host_runq_info");
+  ASSERT(*count > 1, "no run queue");
+}
+
+int main(int argc, char *argv[], int envc, char *envp[])
+{
+  runq_info_array_t before, after;
+  mach_msg_type_number_t before_count, after_count, i;
+  uint64_t start, elapsed, switches, locks, contended, steals;
+  long id;
+
+  for (id = 0; id < NTHREADS; id++)
+    test_thread_start(mach_task_self(), worker, (void *)id);
+
+  get_info(&before, &before_count);
+  start = get_time_microseconds();
+  msleep(RUN_MS);
+  elapsed = get_time_microseconds() - start;
+  get_info(&after, &after_count);
+  ASSERT(after_count == before_count, "run queues changed");
+
+  stop = 1;
+  while (nr_exited < NTHREADS)
+    msleep(10);
+
+  for (id = 0; id < NTHREADS; id++)
+    ASSERT(rounds[id] > 0, "thread starved");
+
+  switches = locks = contended = steals = 0;
+  for (i = 0; i < after_count; i++)
+    {
+      ASSERT(after[i].rqi_cpu == before[i].rqi_cpu, "run queues reordered");
+      printf("runq %d: %u switches, %u steals, %u migrations, "
+             "%u/%u locks contended\n", after[i].rqi_cpu,
+             (unsigned int)(after[i].rqi_switches - before[i].rqi_switches),
+             (unsigned int)(after[i].rqi_steals - before[i].rqi_steals),
+             (unsigned int)(after[i].rqi_migrations
+                            - before[i].rqi_migrations),
+             (unsigned int)(after[i].rqi_contended - before[i].rqi_contended),
+             (unsigned int)(after[i].rqi_locks - before[i].rqi_locks));
+      switches += after[i].rqi_switches - before[i].rqi_switches;
+      steals += after[i].rqi_steals - before[i].rqi_steals;
+      locks += after[i].rqi_locks - before[i].rqi_locks;
+      contended += after[i].rqi_contended - before[i].rqi_contended;
+    }
+
+  ASSERT(switches >= NTHREADS, "too few context switches");
+  ASSERT(locks > 0, "run queues never locked");
+  printf("%d threads: %u context switches/s, %u steals, "
+         "run queue locks %u.%02u%% contended\n", NTHREADS,
+         (unsigned int)(switches * 1000000 / elapsed),
+         (unsigned int)steals,
+         (unsigned int)(contended * 100 / locks),
+         (unsigned int)(contended * 10000 / locks % 100));
+
+  return 0;
+}
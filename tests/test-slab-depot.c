@@ -0,0 +1,133 @@
+/*
+ *  Copyright (C) 2024 Free Software Foundation
+ *
+ * This program is free software ; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY ; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the program ; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Have several threads allocate and destroy ports at the same time, so
+ * that the kernel port cache goes through its magazine depot, and check
+ * that the depot statistics stay consistent.  Print the magazine size
+ * and the depot activity of the port cache.
+ */
+
+#include <syscalls.h>
+#include <testlib.h>
+
+#include <mach/std_types.h>
+#include <mach/mach_types.h>
+#include <mach_debug/mach_debug_types.h>
+
+#include <mach.user.h>
+#include <mach_debug.user.h>
+
+#define NTHREADS	4
+#define NPORTS		256
+#define NROUNDS		64
+
+static volatile int done;
+
+/* Copy the depot statistics of the named cache to info */
+static void get_info(const char *name, cache_depot_info_t *info)
+{
+  cache_depot_info_t *infos = NULL;
+  mach_msg_type_number_t count = 0;
+  int i, found, err;
+
+  err = host_slab_depot_info(mach_host_self(), &infos, &count);
+  ASSERT_RET(err, "host_slab_depot_info");
+  ASSERT(count > 0, "no cache");
+
+  found = 0;
+  for (i = 0; i < count; i++)
+    {
+      if (infos[i].magazine_size == 0)
+        ASSERT(infos[i].nr_full_magazines == 0
+               && infos[i].nr_empty_magazines == 0,
+               "magazines in a cache without CPU pool");
+      if (strcmp(infos[i].name, name) == 0)
+        {
+          memcpy(info, &infos[i], sizeof *info);
+          found = 1;
+        }
+    }
+
+  vm_deallocate(mach_task_self(), (vm_offset_t)infos, count * sizeof *infos);
+  ASSERT(found, "cache not found");
+}
+
+static void churner(void *arg)
+{
+  mach_port_t ports[NPORTS];
+  int i, j, err;
+
+  for (j = 0; j < NROUNDS; j++)
+    {
+      for (i = 0; i < NPORTS; i++)
+        {
+          err = mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE,
+                                   &ports[i]);
+          ASSERT_RET(err, "mach_port_allocate");
+        }
+
+      for (i = 0; i < NPORTS; i++)
+        {
+          err = mach_port_destroy(mach_task_self(), ports[i]);
+          ASSERT_RET(err, "mach_port_destroy");
+        }
+    }
+
+  __atomic_add_fetch(&done, 1, __ATOMIC_RELEASE);
+  thread_terminate(mach_thread_self());
+  FAILURE("thread_terminate");
+}
+
+int main(int argc, char *argv[], int envc, char *envp[])
+{
+  cache_depot_info_t before, after;
+  int i;
+
+  get_info("ipc_port", &before);
+
+  for (i = 0; i < NTHREADS; i++)
+    test_thread_start(mach_task_self(), churner, NULL);
+  while (__atomic_load_n(&done, __ATOMIC_ACQUIRE) < NTHREADS)
+    msleep(10);
+
+  get_info("ipc_port", &after);
+
+  /* Without CPU pools, the depot is unused */
+  if (after.magazine_size == 0)
+    ASSERT(after.depot_hits == 0 && after.depot_misses == 0,
+           "depot used without CPU pools");
+  else
+    ASSERT(after.depot_hits + after.depot_misses
+           > before.depot_hits + before.depot_misses,
+           "depot unused");
+
+  ASSERT(after.magazine_size >= before.magazine_size,
+         "magazine size shrank");
+
+  printf("magazine size %u -> %u, full %u empty %u\n",
+         (unsigned) before.magazine_size, (unsigned) after.magazine_size,
+         (unsigned) after.nr_full_magazines,
+         (unsigned) after.nr_empty_magazines);
+  printf("depot hits %llu misses %llu contended %llu\n",
+         (unsigned long long) (after.depot_hits - before.depot_hits),
+         (unsigned long long) (after.depot_misses - before.depot_misses),
+         (unsigned long long) (after.depot_contended
+                               - before.depot_contended));
+  return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ *  Copyright (C) 2024 Free Software Foundation
+ *
+ * This program is free software ; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY ; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the program ; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Check that the subsystems which release memory on pressure are
+ * registered, and that their statistics and those of the caches are
+ * consistent.  Print them, along with the slabs the caches released.
+ */
+
+#include <syscalls.h>
+#include <testlib.h>
+
+#include <mach/std_types.h>
+#include <mach/mach_types.h>
+#include <mach_debug/mach_debug_types.h>
+
+#include <mach.user.h>
+#include <mach_debug.user.h>
+
+static const char *expected[] = { "ipc_kmsg_cache", "net_kmsg" };
+
+int main(int argc, char *argv[], int envc, char *envp[])
+{
+  shrinker_info_t *shrinkers = NULL;
+  cache_info_t *caches = NULL;
+  cache_depot_info_t *depots = NULL;
+  mach_msg_type_number_t nr_shrinkers = 0, nr_caches = 0, nr_depots = 0;
+  unsigned long long reaped;
+  int i, j, found, err;
+
+  err = host_slab_shrinker_info(mach_host_self(), &shrinkers, &nr_shrinkers);
+  ASSERT_RET(err, "host_slab_shrinker_info");
+
+  for (j = 0; j < sizeof(expected) / sizeof(expected[0]); j++)
+    {
+      found = 0;
+      for (i = 0; i < nr_shrinkers; i++)
+        if (strcmp(shrinkers[i].name, expected[j]) == 0)
+          found = 1;
+      ASSERT(found, "shrinker not registered");
+    }
+
+  for (i = 0; i < nr_shrinkers; i++)
+    {
+      ASSERT(shrinkers[i].nr_freed <= shrinkers[i].nr_scanned,
+             "shrinker freed more than asked");
+      printf("%s: objs %llu calls %llu scanned %llu freed %llu\n",
+             shrinkers[i].name,
+             (unsigned long long) shrinkers[i].nr_objs,
+             (unsigned long long) shrinkers[i].nr_calls,
+             (unsigned long long) shrinkers[i].nr_scanned,
+             (unsigned long long) shrinkers[i].nr_freed);
+    }
+
+  if (nr_shrinkers > 0)
+    vm_deallocate(mach_task_self(), (vm_offset_t)shrinkers,
+                  nr_shrinkers * sizeof *shrinkers);
+
+  err = host_slab_info(mach_host_self(), &caches, &nr_caches);
+  ASSERT_RET(err, "host_slab_info");
+  ASSERT(nr_caches > 0, "no cache");
+
+  for (i = 0; i < nr_caches; i++)
+    ASSERT(caches[i].nr_free_slabs <= caches[i].nr_slabs,
+           "more free slabs than slabs");
+
+  vm_deallocate(mach_task_self(), (vm_offset_t)caches,
+                nr_caches * sizeof *caches);
+
+  err = host_slab_depot_info(mach_host_self(), &depots, &nr_depots);
+  ASSERT_RET(err, "host_slab_depot_info");
+  ASSERT(nr_depots > 0, "no cache");
+
+  reaped = 0;
+  for (i = 0; i < nr_depots; i++)
+    reaped += depots[i].nr_reaped_slabs;
+  printf("%u caches released %llu slabs\n", (unsigned) nr_depots, reaped);
+
+  vm_deallocate(mach_task_self(), (vm_offset_t)depots,
+                nr_depots * sizeof *depots);
+  return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ *  Copyright (C) 2024 Free Software Foundation
+ *
+ * This program is free software ; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY ; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the program ; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Protect and deallocate regions made of several map entries while
+ * other threads of the task keep its pmap in use on the other
+ * processors, and check that the TLB updates of each call are
+ * batched.  Print the shootdowns and interrupts sent per second.
+ */
+
+#include <syscalls.h>
+#include <testlib.h>
+
+#include <mach/std_types.h>
+#include <mach/mach_types.h>
+#include <mach_debug/mach_debug_types.h>
+
+#include <mach.user.h>
+#include <mach_debug.user.h>
+
+#define NTHREADS	3
+#define NPAGES		8
+#define NROUNDS		1000
+#define NCPUS_MAX	64
+
+static volatile int stop;
+static volatile int stopped;
+
+static void spinner(void *arg)
+{
+  while (!stop)
+    ;
+
+  __atomic_add_fetch(&stopped, 1, __ATOMIC_RELAXED);
+  thread_terminate(mach_thread_self());
+  FAILURE("thread_terminate");
+}
+
+/* Sum the statistics of the processors in info[0] */
+static void get_info(tlb_info_t *info)
+{
+  tlb_info_t *infos = info;
+  mach_msg_type_number_t count = NCPUS_MAX;
+  int i, err;
+
+  err = host_tlb_info(mach_host_self(), &infos, &count);
+  ASSERT_RET(err, "host_tlb_info");
+  ASSERT(count >= 1, "no processor");
+  for (i = 1; i < count; i++)
+    {
+      infos[0].tlbi_updates += infos[i].tlbi_updates;
+      infos[0].tlbi_deferred += infos[i].tlbi_deferred;
+      infos[0].tlbi_batches += infos[i].tlbi_batches;
+      infos[0].tlbi_shootdowns += infos[i].tlbi_shootdowns;
+      infos[0].tlbi_ipis += infos[i].tlbi_ipis;
+    }
+  if (infos != info)
+    {
+      info[0] = infos[0];
+      vm_deallocate(mach_task_self(), (vm_offset_t)infos,
+                    count * sizeof *info);
+    }
+}
+
+static uint64_t uptime_usec(void)
+{
+  time_value64_t uptime;
+  int err;
+
+  err = host_get_uptime64(mach_host_self(), &uptime);
+  ASSERT_RET(err, "host_get_uptime64");
+  return uptime.seconds * 1000000ULL + uptime.nanoseconds / 1000;
+}
+
+int main(int argc, char *argv[], int envc, char *envp[])
+{
+  tlb_info_t before[NCPUS_MAX], after[NCPUS_MAX];
+  uint64_t start, elapsed, deferred, batches, shootdowns, ipis;
+  vm_offset_t addr;
+  int i, j, err;
+
+  for (i = 0; i < NTHREADS; i++)
+    test_thread_start(mach_task_self(), spinner, NULL);
+
+  get_info(before);
+  start = uptime_usec();
+
+  for (j = 0; j < NROUNDS; j++)
+    {
+      err = vm_allocate(mach_task_self(), &addr, NPAGES * vm_page_size, TRUE);
+      ASSERT_RET(err, "vm_allocate");
+      for (i = 0; i < NPAGES; i++)
+        *(volatile int *)(addr + i * vm_page_size) = i;
+
+      /* Split the region in an entry per page */
+      for (i = 0; i < NPAGES; i += 2)
+        {
+          err = vm_protect(mach_task_self(), addr + i * vm_page_size,
+                           vm_page_size, FALSE, VM_PROT_READ);
+          ASSERT_RET(err, "vm_protect page");
+        }
+
+      err = vm_protect(mach_task_self(), addr, NPAGES * vm_page_size,
+                       FALSE, VM_PROT_READ);
+      ASSERT_RET(err, "vm_protect region");
+      for (i = 0; i < NPAGES; i++)
+        ASSERT(*(volatile int *)(addr + i * vm_page_size) == i,
+               "page lost its contents");
+
+      err = vm_deallocate(mach_task_self(), addr, NPAGES * vm_page_size);
+      ASSERT_RET(err, "vm_deallocate");
+    }
+
+  elapsed = uptime_usec() - start;
+  get_info(after);
+
+  stop = 1;
+  while (__atomic_load_n(&stopped, __ATOMIC_RELAXED) < NTHREADS)
+    msleep(10);
+
+  if (elapsed == 0)
+    elapsed = 1;
+  deferred = after[0].tlbi_deferred - before[0].tlbi_deferred;
+  batches = after[0].tlbi_batches - before[0].tlbi_batches;
+  shootdowns = after[0].tlbi_shootdowns - before[0].tlbi_shootdowns;
+  ipis = after[0].tlbi_ipis - before[0].tlbi_ipis;
+  printf("%llu updates deferred in %llu batches\n", deferred, batches);
+  printf("%llu shootdowns/s, %llu IPIs/s\n",
+         shootdowns * 1000000 / elapsed, ipis * 1000000 / elapsed);
+
+  ASSERT(batches >= NROUNDS, "too few batches");
+  ASSERT(deferred > batches, "updates not coalesced");
+  return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ *  Copyright (C) 2024 Free Software Foundation
+ *
+ * This program is free software ; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY ; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the program ; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Throughput of the virtio block driver: 4 KiB random reads from
+ * several threads at once, to keep every request queue busy, then
+ * large sequential reads.  QEMU provides a null disk that reads as
+ * zeroes, so that the host side costs as little as possible.
+ */
+
+#include <syscalls.h>
+#include <testlib.h>
+
+#include <mach/machine/vm_param.h>
+#include <mach/std_types.h>
+#include <mach/mach_types.h>
+#include <device/device_types.h>
+
+#include <device.user.h>
+#include <gnumach.user.h>
+#include <mach.user.h>
+#include <mach_host.user.h>
+
+#define BLOCK_SIZE	4096
+#define RANDOM_THREADS	4
+#define RANDOM_READS	2000	/* per thread */
+#define SEQ_CHUNK	(128 * 1024)
+#define SEQ_TOTAL	(32 * 1024 * 1024)
+
+static mach_port_t disk;
+static uint64_t disk_size;
+static unsigned int record_size;
+static volatile int random_done;
+
+static uint64_t uptime_usec(void)
+{
+  time_value64_t now;
+  int err;
+
+  err = host_get_uptime64(mach_host_self(), &now);
+  ASSERT_RET(err, "host_get_uptime64");
+  return now.seconds * 1000000ULL + now.nanoseconds / 1000;
+}
+
+static void read_block(recnum_t recnum, int size)
+{
+  io_buf_ptr_t data;
+  mach_msg_type_number_t count;
+  int err;
+
+  err = device_read(disk, 0, recnum, size, &data, &count);
+  ASSERT_RET(err, "device_read");
+  ASSERT(count == size, "short read");
+  ASSERT(data[0] == 0 && data[count - 1] == 0, "null disk should read zeroes");
+  err = vm_deallocate(mach_task_self(), (vm_address_t)data, count);
+  ASSERT_RET(err, "vm_deallocate");
+}
+
+static void open_disk(void)
+{
+  int status[DEV_GET_SIZE_COUNT];
+  mach_msg_type_number_t count = DEV_GET_SIZE_COUNT;
+  int err;
+
+  err = device_open(device_priv(), D_READ, "vd0", &disk);
+  ASSERT_RET(err, "device_open vd0");
+
+  err = device_get_status(disk, DEV_GET_SIZE, status, &count);
+  ASSERT_RET(err, "device_get_status DEV_GET_SIZE");
+  disk_size = (unsigned int)status[DEV_GET_SIZE_DEVICE_SIZE];
+  record_size = status[DEV_GET_SIZE_RECORD_SIZE];
+  printf("vd0: %u bytes, %u byte records\n",
+         (unsigned int)disk_size, record_size);
+  ASSERT(disk_size >= SEQ_TOTAL, "disk too small");
+  ASSERT(record_size > 0 && BLOCK_SIZE % record_size == 0,
+         "unexpected record size");
+}
+
+static void random_reader(void *arg)
+{
+  uint32_t seed = (uint32_t)(uintptr_t)arg * 2654435761U + 1;
+  uint64_t blocks = disk_size / BLOCK_SIZE;
+  int i;
+
+  for (i = 0; i < RANDOM_READS; i++)
+    {
+      seed = seed * 1103515245 + 12345;
+      read_block((seed >> 8) % blocks * (BLOCK_SIZE / record_size),
+                 BLOCK_SIZE);
+    }
+
+  __atomic_add_fetch(&random_done, 1, __ATOMIC_SEQ_CST);
+  thread_terminate(mach_thread_self());
+  FAILURE("thread_terminate");
+}
+
+static void test_random_read(void)
+{
+  uint64_t start, elapsed;
+  int i;
+
+  start = uptime_usec();
+  for (i = 0; i < RANDOM_THREADS; i++)
+    test_thread_start(mach_task_self(), random_reader, (void *)(uintptr_t)i);
+  while (__atomic_load_n(&random_done, __ATOMIC_SEQ_CST) < RANDOM_THREADS)
+    msleep(1);
+  elapsed = uptime_usec() - start;
+  if (elapsed == 0)
+    elapsed = 1;
+
+  printf("random 4k read: %u reads in %u us, %u IOPS\n",
+         RANDOM_THREADS * RANDOM_READS, (unsigned int)elapsed,
+         (unsigned int)(RANDOM_THREADS * RANDOM_READS * 1000000ULL / elapsed));
+}
+
+static void test_sequential_read(void)
+{
+  uint64_t start, elapsed;
+  uint64_t offset;
+
+  start = uptime_usec();
+  for (offset = 0; offset < SEQ_TOTAL; offset += SEQ_CHUNK)
+    read_block(offset / record_size, SEQ_CHUNK);
+  elapsed = uptime_usec() - start;
+  if (elapsed == 0)
+    elapsed = 1;
+
+  printf("sequential read: %u KiB in %u us, %u MB/s\n",
+         SEQ_TOTAL / 1024, (unsigned int)elapsed,
+         (unsigned int)(SEQ_TOTAL / elapsed));
+}
+
+int main(int argc, char *argv[], int envc, char *envp[])
+{
+  open_disk();
+  test_random_read();
+  test_sequential_read();
+  return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ *  Copyright (C) 2024 Free Software Foundation
+ *
+ * This program is free software ; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY ; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the program ; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Replay a trace mixing random accesses to a small hot set with
+ * sequential scans of a large region touched once, and check that no
+ * page loses its contents.  Print how many pages had to be brought
+ * back in, and how the page replacement aged the pages meanwhile.
+ */
+
+#include <syscalls.h>
+#include <testlib.h>
+
+#include <mach/std_types.h>
+#include <mach/mach_types.h>
+#include <mach/vm_statistics.h>
+#include <mach_debug/mach_debug_types.h>
+
+#include <mach.user.h>
+#include <mach_debug.user.h>
+
+#define HOT_PAGES	256
+#define MAX_SCAN_SIZE	(128 * 1024 * 1024)
+#define NROUNDS		64
+#define NACCESSES	4096
+
+static uint32_t seed = 1;
+
+static uint32_t next_random(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 16;
+}
+
+static uint64_t uptime_usec(void)
+{
+  time_value64_t uptime;
+  int err;
+
+  err = host_get_uptime64(mach_host_self(), &uptime);
+  ASSERT_RET(err, "host_get_uptime64");
+  return uptime.seconds * 1000000ULL + uptime.nanoseconds / 1000;
+}
+
+/* Pages faulted back from the compressed pool or the default pager */
+static uint64_t refaults(void)
+{
+  vm_compress_info_t info;
+  int err;
+
+  err = host_vm_compress_info(mach_host_self(), &info);
+  ASSERT_RET(err, "host_vm_compress_info");
+  return info.vci_decompressed + info.vci_misses;
+}
+
+int main(int argc, char *argv[], int envc, char *envp[])
+{
+  vm_statistics_data_t stats_before, stats_after;
+  vm_lru_info_t lru_before, lru_after;
+  uint64_t refaults_before, start, elapsed;
+  vm_offset_t hot, scan, va;
+  vm_size_t scan_size, chunk;
+  int i, j, err;
+
+  /* Stay well below the free memory, there may be no default pager */
+  err = vm_statistics(mach_task_self(), &stats_before);
+  ASSERT_RET(err, "vm_statistics");
+  scan_size = (vm_size_t)stats_before.free_count / 4 * vm_page_size;
+  if (scan_size > MAX_SCAN_SIZE)
+    scan_size = MAX_SCAN_SIZE;
+  chunk = scan_size / NROUNDS / vm_page_size * vm_page_size;
+  ASSERT(chunk > 0, "not enough free memory");
+  scan_size = chunk * NROUNDS;
+
+  err = vm_allocate(mach_task_self(), &hot, HOT_PAGES * vm_page_size, TRUE);
+  ASSERT_RET(err, "vm_allocate hot");
+  err = vm_allocate(mach_task_self(), &scan, scan_size, TRUE);
+  ASSERT_RET(err, "vm_allocate scan");
+
+  for (va = hot; va < hot + HOT_PAGES * vm_page_size; va += vm_page_size)
+    *(volatile vm_offset_t *)va = va;
+
+  err = host_vm_lru_info(mach_host_self(), &lru_before);
+  ASSERT_RET(err, "host_vm_lru_info");
+  refaults_before = refaults();
+
+  start = uptime_usec();
+  for (i = 0; i < NROUNDS; i++)
+    {
+      for (va = scan + i * chunk; va < scan + (i + 1) * chunk;
+           va += vm_page_size)
+        *(volatile vm_offset_t *)va = va;
+
+      for (j = 0; j < NACCESSES; j++)
+        {
+          va = hot + (next_random() % HOT_PAGES) * vm_page_size;
+          ASSERT(*(volatile vm_offset_t *)va == va, "hot page changed");
+        }
+    }
+  elapsed = uptime_usec() - start;
+
+  for (va = scan; va < scan + scan_size; va += vm_page_size)
+    ASSERT(*(volatile vm_offset_t *)va == va, "scanned page changed");
+
+  err = vm_statistics(mach_task_self(), &stats_after);
+  ASSERT_RET(err, "vm_statistics");
+  err = host_vm_lru_info(mach_host_self(), &lru_after);
+  ASSERT_RET(err, "host_vm_lru_info");
+
+  printf("replayed %d rounds over %u MB in %llu us\n", NROUNDS,
+         (unsigned) (scan_size >> 20), (unsigned long long) elapsed);
+  printf("refaults %llu reactivations %d\n",
+         (unsigned long long) (refaults() - refaults_before),
+         stats_after.reactivations - stats_before.reactivations);
+  printf("promoted %llu deactivated %llu active %llu inactive %llu\n",
+         (unsigned long long) (lru_after.vli_promoted
+                               - lru_before.vli_promoted),
+         (unsigned long long) (lru_after.vli_deactivated
+                               - lru_before.vli_deactivated),
+         (unsigned long long) lru_after.vli_active,
+         (unsigned long long) lru_after.vli_inactive);
+  printf("pagevec flushes %llu pages %llu\n",
+         (unsigned long long) (lru_after.vli_pagevec_flushes
+                               - lru_before.vli_pagevec_flushes),
+         (unsigned long long) (lru_after.vli_pagevec_pages
+                               - lru_before.vli_pagevec_pages));
+
+  err = vm_deallocate(mach_task_self(), scan, scan_size);
+  ASSERT_RET(err, "vm_deallocate scan");
+  err = vm_deallocate(mach_task_self(), hot, HOT_PAGES * vm_page_size);
+  ASSERT_RET(err, "vm_deallocate hot");
+  return 0;
+}
@@ -0,0 +1,140 @@
+/*
+ *  Copyright (C) 2024 Free Software Foundation
+ *
+ * This program is free software ; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY ; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the program ; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Have several threads map, fault, protect and unmap disjoint ranges
+ * of the same address space at the same time, while another one keeps
+ * faulting on a shared region, and check that no page gets mixed up.
+ * Print how many rounds per second all the threads made.
+ */
+
+#include <syscalls.h>
+#include <testlib.h>
+
+#include <mach/std_types.h>
+#include <mach/mach_types.h>
+
+#include <mach.user.h>
+
+#define NTHREADS	4
+#define NPAGES		16
+#define NROUNDS		500
+#define SHARED_PAGES	64
+
+static vm_offset_t shared;
+static volatile int stop;
+static volatile int done;
+
+static uint64_t uptime_usec(void)
+{
+  time_value64_t uptime;
+  int err;
+
+  err = host_get_uptime64(mach_host_self(), &uptime);
+  ASSERT_RET(err, "host_get_uptime64");
+  return uptime.seconds * 1000000ULL + uptime.nanoseconds / 1000;
+}
+
+static void mapper(void *arg)
+{
+  int id = (int)(long)arg;
+  vm_offset_t addr;
+  int i, j, err;
+
+  for (j = 0; j < NROUNDS; j++)
+    {
+      err = vm_allocate(mach_task_self(), &addr, NPAGES * vm_page_size, TRUE);
+      ASSERT_RET(err, "vm_allocate");
+      for (i = 0; i < NPAGES; i++)
+        *(volatile int *)(addr + i * vm_page_size) = id * NPAGES + i;
+
+      err = vm_protect(mach_task_self(), addr, NPAGES / 2 * vm_page_size,
+                       FALSE, VM_PROT_READ);
+      ASSERT_RET(err, "vm_protect read");
+      for (i = 0; i < NPAGES; i++)
+        ASSERT(*(volatile int *)(addr + i * vm_page_size) == id * NPAGES + i,
+               "page lost its contents");
+
+      err = vm_protect(mach_task_self(), addr, NPAGES / 2 * vm_page_size,
+                       FALSE, VM_PROT_READ | VM_PROT_WRITE);
+      ASSERT_RET(err, "vm_protect write");
+      *(volatile int *)addr = -1;
+
+      /* Unmap the second half first, so that the region spans entries */
+      err = vm_deallocate(mach_task_self(), addr + NPAGES / 2 * vm_page_size,
+                          NPAGES / 2 * vm_page_size);
+      ASSERT_RET(err, "vm_deallocate half");
+      err = vm_deallocate(mach_task_self(), addr, NPAGES / 2 * vm_page_size);
+      ASSERT_RET(err, "vm_deallocate");
+    }
+
+  __atomic_add_fetch(&done, 1, __ATOMIC_RELEASE);
+  thread_terminate(mach_thread_self());
+  FAILURE("thread_terminate");
+}
+
+static void faulter(void *arg)
+{
+  vm_offset_t va;
+
+  while (!stop)
+    for (va = shared; va < shared + SHARED_PAGES * vm_page_size;
+         va += vm_page_size)
+      ASSERT(*(volatile vm_offset_t *)va == va, "shared page changed");
+
+  __atomic_add_fetch(&done, 1, __ATOMIC_RELEASE);
+  thread_terminate(mach_thread_self());
+  FAILURE("thread_terminate");
+}
+
+int main(int argc, char *argv[], int envc, char *envp[])
+{
+  uint64_t start, elapsed;
+  vm_offset_t va;
+  int i, err;
+
+  err = vm_allocate(mach_task_self(), &shared, SHARED_PAGES * vm_page_size,
+                    TRUE);
+  ASSERT_RET(err, "vm_allocate shared");
+  for (va = shared; va < shared + SHARED_PAGES * vm_page_size;
+       va += vm_page_size)
+    *(volatile vm_offset_t *)va = va;
+
+  test_thread_start(mach_task_self(), faulter, NULL);
+
+  start = uptime_usec();
+  for (i = 0; i < NTHREADS; i++)
+    test_thread_start(mach_task_self(), mapper, (void *)(long)i);
+  while (__atomic_load_n(&done, __ATOMIC_ACQUIRE) < NTHREADS)
+    msleep(10);
+  elapsed = uptime_usec() - start;
+
+  stop = 1;
+  while (__atomic_load_n(&done, __ATOMIC_ACQUIRE) < NTHREADS + 1)
+    msleep(10);
+
+  if (elapsed == 0)
+    elapsed = 1;
+  printf("%llu rounds/s with %d threads\n",
+         (unsigned long long) NTHREADS * NROUNDS * 1000000 / elapsed,
+         NTHREADS);
+
+  err = vm_deallocate(mach_task_self(), shared, SHARED_PAGES * vm_page_size);
+  ASSERT_RET(err, "vm_deallocate shared");
+  return 0;
+}
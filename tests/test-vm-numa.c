@@ -0,0 +1,133 @@
+/*
+ *  Copyright (C) 2024 Free Software Foundation
+ *
+ * This program is free software ; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY ; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the program ; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Touch a region from each processor in turn, and check that the NUMA
+ * nodes reported by the kernel add up, and that the pages were
+ * allocated from them.  Print the nodes, and how many allocations were
+ * made on the node of the processor that made them.
+ */
+
+#include <syscalls.h>
+#include <testlib.h>
+
+#include <mach/std_types.h>
+#include <mach/mach_types.h>
+#include <mach/vm_statistics.h>
+#include <mach_debug/mach_debug_types.h>
+
+#include <mach.user.h>
+#include <mach_debug.user.h>
+
+#define MAX_NODES	8
+#define REGION_SIZE	(16 * 1024 * 1024)
+
+static vm_offset_t region;
+static volatile int done;
+
+/* Sum the statistics of the nodes in total */
+static int get_info(vm_node_info_t *info, vm_node_info_t *total)
+{
+  vm_node_info_t *infos = info;
+  mach_msg_type_number_t count = MAX_NODES;
+  int i, err;
+
+  err = host_vm_numa_info(mach_host_self(), &infos, &count);
+  ASSERT_RET(err, "host_vm_numa_info");
+  ASSERT(count >= 1 && count <= MAX_NODES, "bad node count");
+  if (infos != info)
+    {
+      memcpy(info, infos, count * sizeof *info);
+      vm_deallocate(mach_task_self(), (vm_offset_t)infos,
+                    count * sizeof *info);
+    }
+
+  memset(total, 0, sizeof *total);
+  for (i = 0; i < count; i++)
+    {
+      ASSERT(info[i].vni_free <= info[i].vni_pages, "more free than pages");
+      total->vni_pages += info[i].vni_pages;
+      total->vni_free += info[i].vni_free;
+      total->vni_cpus += info[i].vni_cpus;
+      total->vni_hits += info[i].vni_hits;
+      total->vni_misses += info[i].vni_misses;
+      total->vni_foreign += info[i].vni_foreign;
+    }
+  ASSERT(total->vni_misses == total->vni_foreign,
+         "misses and foreign allocations differ");
+  return count;
+}
+
+static void toucher(void *arg)
+{
+  int id = (int)(long)arg;
+  vm_offset_t va;
+
+  for (va = region + id * REGION_SIZE; va < region + (id + 1) * REGION_SIZE;
+       va += vm_page_size)
+    *(volatile vm_offset_t *)va = va;
+
+  __atomic_add_fetch(&done, 1, __ATOMIC_RELEASE);
+  thread_terminate(mach_thread_self());
+  FAILURE("thread_terminate");
+}
+
+int main(int argc, char *argv[], int envc, char *envp[])
+{
+  vm_node_info_t before[MAX_NODES], after[MAX_NODES];
+  vm_node_info_t total_before, total_after;
+  int i, nodes, nthreads, err;
+  vm_offset_t va;
+
+  nodes = get_info(before, &total_before);
+  ASSERT(total_before.vni_cpus >= 1, "no processor in any node");
+  nthreads = total_before.vni_cpus;
+
+  err = vm_allocate(mach_task_self(), &region, nthreads * REGION_SIZE, TRUE);
+  ASSERT_RET(err, "vm_allocate");
+
+  for (i = 0; i < nthreads; i++)
+    test_thread_start(mach_task_self(), toucher, (void *)(long)i);
+  while (__atomic_load_n(&done, __ATOMIC_ACQUIRE) < nthreads)
+    msleep(10);
+
+  for (va = region; va < region + nthreads * REGION_SIZE; va += vm_page_size)
+    ASSERT(*(volatile vm_offset_t *)va == va, "page lost its contents");
+
+  ASSERT(get_info(after, &total_after) == nodes, "node count changed");
+  ASSERT(total_after.vni_pages == total_before.vni_pages,
+         "node size changed");
+  ASSERT(total_after.vni_hits + total_after.vni_misses
+         > total_before.vni_hits + total_before.vni_misses,
+         "no allocation accounted");
+
+  for (i = 0; i < nodes; i++)
+    printf("node %d: cpus %llu pages %llu free %llu "
+           "hits %llu misses %llu foreign %llu\n", i,
+           (unsigned long long) after[i].vni_cpus,
+           (unsigned long long) after[i].vni_pages,
+           (unsigned long long) after[i].vni_free,
+           (unsigned long long) (after[i].vni_hits - before[i].vni_hits),
+           (unsigned long long) (after[i].vni_misses - before[i].vni_misses),
+           (unsigned long long) (after[i].vni_foreign
+                                 - before[i].vni_foreign));
+
+  err = vm_deallocate(mach_task_self(), region, nthreads * REGION_SIZE);
+  ASSERT_RET(err, "vm_deallocate");
+  return 0;
+}
@@ -0,0 +1,105 @@
+/*
+ *  Copyright (C) 2024 Free Software Foundation
+ *
+ * This program is free software ; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY ; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with the program ; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Make the kernel wait on events by suspending running threads,
+ * which waits for them to stop, and check that the wait event hash
+ * table accounts for it.  Print its chain lengths and lock hold times.
+ */
+
+#include <syscalls.h>
+#include <testlib.h>
+
+#include <mach/std_types.h>
+#include <mach/mach_types.h>
+#include <mach_debug/mach_debug_types.h>
+
+#include <mach.user.h>
+#include <mach_debug.user.h>
+
+#define NTHREADS	16
+#define NROUNDS		100
+
+static volatile int stop;
+
+static void spinner(void *arg)
+{
+  while (!stop)
+    ;
+
+  thread_terminate(mach_thread_self());
+  FAILURE("thread_terminate");
+}
+
+static void get_info(wait_table_info_t *info)
+{
+  int err;
+
+  err = host_wait_table_info(mach_host_self(), info);
+  ASSERT_RET(err, "host_wait_table_info");
+}
+
+int main(int argc, char *argv[], int envc, char *envp[])
+{
+  wait_table_info_t before, after;
+  thread_t threads[NTHREADS];
+  int i, j, err;
+
+  for (i = 0; i < NTHREADS; i++)
+    threads[i] = test_thread_start(mach_task_self(), spinner, NULL);
+
+  get_info(&before);
+  ASSERT(before.wti_buckets >= 1024, "wait table too small");
+  ASSERT((before.wti_buckets & (before.wti_buckets - 1)) == 0,
+         "wait table size not a power of 2");
+
+  for (j = 0; j < NROUNDS; j++)
+    for (i = 0; i < NTHREADS; i++)
+      {
+        err = thread_suspend(threads[i]);
+        ASSERT_RET(err, "thread_suspend");
+        err = thread_resume(threads[i]);
+        ASSERT_RET(err, "thread_resume");
+      }
+
+  get_info(&after);
+  stop = 1;
+
+  ASSERT(after.wti_buckets == before.wti_buckets, "wait table resized");
+  ASSERT(after.wti_waits > before.wti_waits, "waits not accounted");
+  ASSERT(after.wti_wakeups > before.wti_wakeups, "wakeups not accounted");
+  ASSERT(after.wti_woken > before.wti_woken, "nothing woken up");
+  ASSERT(after.wti_locks > before.wti_locks, "buckets never locked");
+  ASSERT(after.wti_max_chain_seen >= 1, "no chain ever");
+  ASSERT(after.wti_max_chain <= after.wti_max_chain_seen,
+         "chain longer than ever");
+
+  printf("%u buckets, %u events waited on, longest chain %u (ever %u)\n",
+         after.wti_buckets, after.wti_events, after.wti_max_chain,
+         after.wti_max_chain_seen);
+  printf("%u waits, %u wakeups, %u threads woken\n",
+         (unsigned int)(after.wti_waits - before.wti_waits),
+         (unsigned int)(after.wti_wakeups - before.wti_wakeups),
+         (unsigned int)(after.wti_woken - before.wti_woken));
+  if (after.wti_locks > 0)
+    printf("buckets held %u cycles on average, %u at most\n",
+           (unsigned int)(after.wti_hold_cycles / after.wti_locks),
+           (unsigned int)after.wti_max_hold_cycles);
+
+  return 0;
+}
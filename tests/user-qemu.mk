@@ -220,6 +220,44 @@ tests/test-console-timestamps: tests/test-console-timestamps.iso $(srcdir)/tests
 	@echo "# Verify console timestamps like [seconds.milliseconds] appear in kernel log" >> $@
 	@echo "grep -Eq '^\\[[0-9]+\\.[0-9]{2,3}\\] ' \"$$log\" || { echo 'missing console timestamps'; exit 98; }" >> $@
 
+# The virtio block test needs a disk, with several processors and
+# request queues.  The null disk reads as zeroes and costs the host
+# next to nothing, so that the guest side is what gets measured.
+VIRTIO_BLK_QEMU_OPTS = -smp 4 \
+	-blockdev driver=null-co,node-name=vd0,size=67108864,read-zeroes=on \
+	-device virtio-blk-pci,drive=vd0,num-queues=4
+
+tests/test-virtio-blk: tests/test-virtio-blk.iso $(srcdir)/tests/run-qemu.sh.template
+	< $(srcdir)/tests/run-qemu.sh.template			\
+		sed -e "s|TESTNAME|$(subst tests/test-,,$@)|g"	\
+		    -e "s/QEMU_OPTS/$(QEMU_OPTS) $(VIRTIO_BLK_QEMU_OPTS)/g"	\
+		    -e "s/QEMU_BIN/$(QEMU_BIN)/g"			\
+		    -e "s/TEST_START_MARKER/$(TEST_START_MARKER)/g"	\
+		    -e "s/TEST_SUCCESS_MARKER/$(TEST_SUCCESS_MARKER)/g"	\
+		    -e "s/TEST_FAILURE_MARKER/$(TEST_FAILURE_MARKER)/g"	\
+		>$@
+	chmod +x $@
+
+# The NUMA test needs two nodes, each with a processor and half of the
+# memory, further apart than the default distance.
+VM_NUMA_QEMU_OPTS = -smp 2 \
+	-object memory-backend-ram,id=m0,size=1024M \
+	-object memory-backend-ram,id=m1,size=1023M \
+	-numa node,nodeid=0,cpus=0,memdev=m0 \
+	-numa node,nodeid=1,cpus=1,memdev=m1 \
+	-numa dist,src=0,dst=1,val=21
+
+tests/test-vm-numa: tests/test-vm-numa.iso $(srcdir)/tests/run-qemu.sh.template
+	< $(srcdir)/tests/run-qemu.sh.template			\
+		sed -e "s|TESTNAME|$(subst tests/test-,,$@)|g"	\
+		    -e "s/QEMU_OPTS/$(QEMU_OPTS) $(VM_NUMA_QEMU_OPTS)/g"	\
+		    -e "s/QEMU_BIN/$(QEMU_BIN)/g"			\
+		    -e "s/TEST_START_MARKER/$(TEST_START_MARKER)/g"	\
+		    -e "s/TEST_SUCCESS_MARKER/$(TEST_SUCCESS_MARKER)/g"	\
+		    -e "s/TEST_FAILURE_MARKER/$(TEST_FAILURE_MARKER)/g"	\
+		>$@
+	chmod +x $@
+
 clean-test-%:
 	rm -f tests/test-$* tests/test-$*.iso tests/test-$*.log tests/test-$*.raw tests/test-$*.trs tests/module-$*
 
@@ -264,6 +302,19 @@ USER_TESTS := \
 	tests/test-smp-threads \
 	tests/test-lttng \
 	tests/test-dtrace-instrumentation \
+	tests/test-dtrace-rings \
+	tests/test-ipc-kobject-stats \
+	tests/test-sched-stress \
+	tests/test-wait-table \
+	tests/test-ipc-lockless \
+	tests/test-ipc-kmsg-cache \
+	tests/test-tlb-shootdown \
+	tests/test-large-pages \
+	tests/test-vm-map-stress \
+	tests/test-vm-lru \
+	tests/test-vm-numa \
+	tests/test-slab-depot \
+	tests/test-slab-shrink \
 	tests/test-enhanced-instrumentation \
 	tests/test-phase4-instrumentation \
 	tests/test-whole-system-debugging \
@@ -271,6 +322,7 @@ USER_TESTS := \
 	tests/test-vdso \
 	tests/test-mach5-research \
 	tests/test-virtio \
+	tests/test-virtio-blk \
 	tests/test-kernel-feature \
 	tests/test-cognitive
 
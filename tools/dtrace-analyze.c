@@ -16,6 +16,13 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#ifdef __GNU__
+#include <mach.h>
+#include <mach_error.h>
+#include <mach_debug/mach_debug.h>
+#include <hurd.h>
+#endif
+
 /*
  * Copy of kernel structures for userspace analysis
  * Note: These must match the kernel definitions exactly
@@ -36,7 +43,7 @@ typedef enum {
 
 typedef struct dtrace_event {
     uint32_t    probe_id;       /* Which probe fired */
-    uint64_t    timestamp;      /* When it fired (nanoseconds) */
+    uint64_t    timestamp;      /* When it fired (TSC in rings, ns once read) */
     uint32_t    cpu_id;         /* Which CPU */
     uint32_t    thread_id;      /* Which thread */
     uint32_t    task_id;        /* Which task */
@@ -55,6 +62,31 @@ typedef struct dtrace_probe {
     void                *handler;      /* Probe handler function */
 } dtrace_probe_t;
 
+#define DTRACE_RING_MAGIC    0x44545243  /* "DTRC" */
+#define DTRACE_RING_VERSION  1
+#define DTRACE_TSC_SHIFT     24
+
+typedef struct dtrace_ring_header {
+    uint32_t    magic;          /* DTRACE_RING_MAGIC */
+    uint32_t    version;        /* DTRACE_RING_VERSION */
+    uint32_t    nrings;         /* Number of rings, one per processor */
+    uint32_t    ring_events;    /* Events per ring, a power of two */
+    uint32_t    ring_offset;    /* Offset of the first ring */
+    uint32_t    ring_stride;    /* Distance between two rings */
+    uint64_t    tsc_base;       /* TSC when tracing started */
+    uint64_t    tsc_mult;       /* Nanoseconds per TSC tick, fixed point */
+    uint64_t    ns_base;        /* Uptime when tracing started (ns) */
+} dtrace_ring_header_t;
+
+typedef struct dtrace_ring {
+    volatile uint32_t head;     /* Number of events ever written */
+    uint32_t    cpu;            /* Processor writing this ring */
+    uint64_t    fired;          /* Probes fired on this processor */
+    uint64_t    overhead;       /* TSC ticks spent firing probes */
+    uint64_t    reserved[5];    /* Keep events cache line aligned */
+    dtrace_event_t events[];    /* Ring entries */
+} dtrace_ring_t;
+
 typedef struct dtrace_metrics {
     uint64_t total_probes_fired;
     uint64_t total_events_captured;
@@ -199,17 +231,162 @@ static void show_help(const char *progname) {
     printf("The kernel must be built with MACH_DTRACE=1.\n");
 }
 
+#ifdef __GNU__
+/*
+ * The kernel event rings, mapped read-only, and where we stand in
+ * each of them.
+ */
+static const dtrace_ring_header_t *rings;
+static uint32_t *ring_pos;
+static uint64_t events_lost;
+
+static const dtrace_ring_t *get_ring(uint32_t i) {
+    return (const dtrace_ring_t *)((const char *)rings + rings->ring_offset
+                                   + (size_t)i * rings->ring_stride);
+}
+
+static uint64_t ring_time_to_ns(uint64_t ts) {
+    uint64_t delta = ts - rings->tsc_base;
+
+    return rings->ns_base
+           + (((delta >> 32) * rings->tsc_mult) << (32 - DTRACE_TSC_SHIFT))
+           + (((delta & 0xffffffff) * rings->tsc_mult) >> DTRACE_TSC_SHIFT);
+}
+
+static int map_kernel_rings(void) {
+    mach_port_t host_priv;
+    vm_address_t addr;
+    vm_size_t size;
+    kern_return_t kr;
+
+    kr = get_privileged_ports(&host_priv, NULL);
+    if (kr != KERN_SUCCESS) {
+        fprintf(stderr, "Cannot get the privileged host port: %s\n",
+                mach_error_string(kr));
+        return -1;
+    }
+
+    kr = host_dtrace_map(host_priv, mach_task_self(), &addr, &size);
+    if (kr != KERN_SUCCESS) {
+        fprintf(stderr, "host_dtrace_map: %s\n", mach_error_string(kr));
+        return -1;
+    }
+
+    rings = (const dtrace_ring_header_t *)addr;
+    if (rings->magic != DTRACE_RING_MAGIC
+        || rings->version != DTRACE_RING_VERSION) {
+        fprintf(stderr, "Unknown kernel event ring format\n");
+        return -1;
+    }
+
+    /* Start from what the rings still hold */
+    ring_pos = calloc(rings->nrings, sizeof(*ring_pos));
+    if (!ring_pos) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < rings->nrings; i++) {
+        uint32_t head = __atomic_load_n(&get_ring(i)->head, __ATOMIC_ACQUIRE);
+        ring_pos[i] = head > rings->ring_events - 1
+                      ? head - (rings->ring_events - 1) : 0;
+    }
+
+    return 0;
+}
+
+/*
+ * Copy the next event of a ring, skipping those the kernel overwrote
+ * before we got to them.  Returns 0 if the ring has nothing new.
+ */
+static int peek_ring(uint32_t i, dtrace_event_t *event) {
+    const dtrace_ring_t *ring = get_ring(i);
+    uint32_t size = rings->ring_events;
+    uint32_t head;
+
+    for (;;) {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head == ring_pos[i]) {
+            return 0;
+        }
+        if (head - ring_pos[i] >= size) {
+            events_lost += head - ring_pos[i] - (size - 1);
+            ring_pos[i] = head - (size - 1);
+        }
+
+        *event = ring->events[ring_pos[i] & (size - 1)];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        if (head - ring_pos[i] < size) {
+            return 1;
+        }
+    }
+}
+
+/*
+ * Drain the kernel rings, merging them into timestamp order
+ */
+static int read_kernel_events(dtrace_event_t *events, int max_events) {
+    dtrace_event_t *next;
+    int *valid;
+    int count = 0;
+
+    if (!rings && map_kernel_rings() != 0) {
+        return 0;
+    }
+
+    next = calloc(rings->nrings, sizeof(*next));
+    valid = calloc(rings->nrings, sizeof(*valid));
+    if (!next || !valid) {
+        free(next);
+        free(valid);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < rings->nrings; i++) {
+        valid[i] = peek_ring(i, &next[i]);
+    }
+
+    while (count < max_events) {
+        int best = -1;
+
+        for (uint32_t i = 0; i < rings->nrings; i++) {
+            if (valid[i] && (best < 0
+                || next[i].timestamp < next[best].timestamp)) {
+                best = i;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+
+        events[count] = next[best];
+        events[count].timestamp = ring_time_to_ns(next[best].timestamp);
+        count++;
+
+        ring_pos[best]++;
+        valid[best] = peek_ring(best, &next[best]);
+    }
+
+    if (events_lost > 0) {
+        printf("%llu events were overwritten before they could be read\n",
+               (unsigned long long)events_lost);
+    }
+
+    free(next);
+    free(valid);
+    return count;
+}
+#else /* !__GNU__ */
 /*
  * Simulate kernel data reading for demonstration
- * In a real implementation, this would interface with the kernel
- * through a device file, system call, or other mechanism.
+ * The kernel rings can only be mapped on GNU/Hurd.
  */
 static int read_kernel_events(dtrace_event_t *events, int max_events) {
     static int first_call = 1;
     
     if (first_call) {
         printf("NOTE: This is a demonstration version.\n");
-        printf("In a real implementation, this would read data from the kernel.\n\n");
+        printf("Kernel event rings can only be read on GNU/Hurd.\n\n");
         first_call = 0;
     }
     
@@ -232,6 +409,7 @@ static int read_kernel_events(dtrace_event_t *events, int max_events) {
     
     return count;
 }
+#endif /* __GNU__ */
 
 /*
  * Read probe information from kernel
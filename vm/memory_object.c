@@ -55,6 +55,7 @@
  *	Implementation dependencies:
  */
 #include <vm/memory_object.h>
+#include <vm/vm_block_cache.h>
 #include <vm/vm_page.h>
 #include <vm/vm_pageout.h>
 #include <vm/pmap.h>		/* For copy_to_phys, pmap_clear_modify */
@@ -137,6 +138,11 @@ kern_return_t memory_object_data_supply(
 	vm_object_paging_begin(object);
 	offset -= object->paging_offset;
 
+	/*
+	 *	The supplied data replaces whatever the block cache has.
+	 */
+	block_cache_invalidate(object, offset, data_cnt);
+
 	/*
 	 *	Loop over copy stealing pages for pagein.
 	 */
@@ -593,11 +599,8 @@ static memory_object_lock_result_t memory_object_lock_page(
 		 */
 
 		if (vm_page_deactivate_hint &&
-		    (should_return != MEMORY_OBJECT_RETURN_NONE)) {
-			vm_page_lock_queues();
-			vm_page_deactivate(m);
-			vm_page_unlock_queues();
-		}
+		    (should_return != MEMORY_OBJECT_RETURN_NONE))
+			vm_page_deactivate_deferred(m);
 	}
 
 	return(MEMORY_OBJECT_LOCK_RESULT_DONE);
@@ -671,6 +674,13 @@ memory_object_lock_request(
 	vm_object_paging_begin(object);
 	offset -= object->paging_offset;
 
+	/*
+	 *	Pages flushed by the memory manager mustn't come back
+	 *	from the block cache.
+	 */
+	if (should_flush)
+		block_cache_invalidate(object, offset, size);
+
 	/*
 	 *	To avoid blocking while scanning for pages, save
 	 *	dirty pages to be cleaned all at once.
@@ -177,6 +177,44 @@ extern void		pmap_copy(pmap_t, pmap_t, vm_offset_t, vm_size_t,
 extern kern_return_t	pmap_attribute(void);
 #endif	/* pmap_attribute */
 
+/*
+ *	Batching of TLB updates.  Between pmap_batch_start and
+ *	pmap_batch_finish, the TLB invalidations that pmap_remove and
+ *	pmap_protect need on behalf of the current thread are deferred
+ *	and coalesced, so that the other processors using the pmap are
+ *	interrupted once for the whole batch rather than once per call.
+ *	pmap_batch_flush and pmap_batch_finish make the pending
+ *	invalidations; the caller must use one of them before freeing
+ *	the pages it unmapped.  The pmap module makes them itself
+ *	before changing the mappings of a physical page.
+ */
+#ifndef	PMAP_BATCH
+#define	pmap_batch_start(pmap)
+#define	pmap_batch_flush(pmap)
+#define	pmap_batch_finish(pmap)
+#endif	/* PMAP_BATCH */
+
+/*
+ *	Large pages.  A pmap module which defines PMAP_LARGE_PAGE_SIZE
+ *	can map that many bytes of physically contiguous memory, aligned
+ *	on that size both physically and virtually, with a single entry:
+ *	pmap_enter_large returns whether it did.  The pages must not be
+ *	mapped anywhere yet.  The mapping behaves as that of each of its
+ *	pages otherwise; the pmap module splits it back to small pages
+ *	whenever an operation only applies to some of them.
+ */
+
+/*
+ *	Speculative entry.  A pmap module which defines
+ *	PMAP_ENTER_SPECULATIVE provides pmap_enter_speculative, which
+ *	acts as pmap_enter, but only if *seqp still equals seq once the
+ *	pmap is locked, and returns whether it did.  When the mappings
+ *	of a range are changed only after bumping the sequence number,
+ *	this lets a caller that looked the range up without locking
+ *	enter a mapping that is guaranteed to be removed or updated
+ *	along with the others.
+ */
+
 /*
  *	Grab a physical page:
  *	the standard memory allocation mechanism
@@ -9,31 +9,178 @@
 
 /*
  * Block-level cache implementation for GNU Mach
+ *
+ * All entries, the replacement queues and the statistics are protected
+ * by block_cache_lock.  It is taken with the object locked, possibly
+ * with the page queues locked too, so pages are never freed while
+ * holding it.  The count of pages an object has in the cache changes
+ * with both the object and block_cache_lock locked.
  */
 
 #include <string.h>
 #include <kern/assert.h>
 #include <kern/debug.h>
-#include <kern/kalloc.h>
+#include <kern/list.h>
+#include <kern/lock.h>
+#include <kern/printf.h>
 #include <kern/slab.h>
-#include <kern/queue.h>
 #include <mach/vm_param.h>
+#include <util/atoi.h>
 #include <vm/vm_block_cache.h>
-#include <vm/vm_page.h>
-#include <vm/vm_object.h>
 #include <vm/vm_kern.h>
+#include <vm/vm_object.h>
+#include <vm/vm_page.h>
+
+extern char *kernel_cmdline;
+
+/*
+ * Default limit of the cache, in percent of physical memory.  It can
+ * be changed with the block_cache=N boot option, 0 disabling the cache.
+ */
+#define BLOCK_CACHE_DEFAULT_PERCENT	10
 
-/* Global block cache statistics */
-static unsigned int total_cache_hits = 0;
-static unsigned int total_cache_misses = 0;
-static unsigned int total_blocks_cached = 0;
+/*
+ * Blocks seen once are evicted first while they hold more than this
+ * fraction of the cache limit (Kin in 2Q).
+ */
+#define BLOCK_CACHE_A1IN_DENOM		4
 
-/* Slab cache for block cache entries */
 static struct kmem_cache block_cache_entry_cache;
 static struct kmem_cache block_cache_cache;
+static struct kmem_shrinker block_cache_shrinker;
+
+static simple_lock_data_t block_cache_lock;
+static struct list *block_cache_table;
+static unsigned long block_cache_mask;
+static boolean_t block_cache_enabled = FALSE;
+
+/*
+ * Replacement queues, most recent first.  Idle entries have no page
+ * cached; those pushed out of A1in are the ghosts of 2Q (A1out).
+ */
+static struct list block_cache_a1in;
+static struct list block_cache_am;
+static struct list block_cache_idle;
+
+static unsigned long block_cache_nr_pages;
+static unsigned long block_cache_max_pages;
+static unsigned long block_cache_a1in_pages;
+static unsigned long block_cache_nr_idle;
+static unsigned long block_cache_max_idle;
+
+static inline struct list *
+block_cache_bucket(const struct block_cache *cache, vm_offset_t block_offset)
+{
+	unsigned long hash;
+
+	hash = ((unsigned long)cache / sizeof(*cache))
+	       + (block_offset / cache->block_size);
+	return &block_cache_table[hash & block_cache_mask];
+}
+
+static block_cache_entry_t
+block_cache_find(const struct block_cache *cache, vm_offset_t block_offset)
+{
+	block_cache_entry_t entry;
+
+	list_for_each_entry(block_cache_bucket(cache, block_offset),
+			    entry, hash_node)
+		if ((entry->cache == cache)
+		    && (entry->block_offset == block_offset))
+			return entry;
+
+	return NULL;
+}
+
+/*
+ * Move an entry to the head of the queue of the given state.
+ */
+static void
+block_cache_entry_set_state(block_cache_entry_t entry,
+			    block_cache_state_t state)
+{
+	list_remove(&entry->queue_node);
+	if (entry->state == BLOCK_CACHE_IDLE)
+		block_cache_nr_idle--;
+	else if (entry->state == BLOCK_CACHE_A1IN)
+		block_cache_a1in_pages -= entry->nr_pages;
+
+	entry->state = state;
+
+	switch (state) {
+	case BLOCK_CACHE_IDLE:
+		list_insert_head(&block_cache_idle, &entry->queue_node);
+		block_cache_nr_idle++;
+		break;
+	case BLOCK_CACHE_A1IN:
+		list_insert_head(&block_cache_a1in, &entry->queue_node);
+		block_cache_a1in_pages += entry->nr_pages;
+		break;
+	case BLOCK_CACHE_AM:
+		list_insert_head(&block_cache_am, &entry->queue_node);
+		break;
+	}
+}
+
+/*
+ * Detach a page from its entry.  The caller moves the entry to the
+ * idle queue once it has no page left.
+ */
+static vm_page_t
+block_cache_entry_take(block_cache_entry_t entry, unsigned int i)
+{
+	vm_page_t page;
+
+	page = entry->pages[i];
+	assert(page != VM_PAGE_NULL);
+	entry->pages[i] = VM_PAGE_NULL;
+	entry->nr_pages--;
+	block_cache_nr_pages--;
+	if (entry->state == BLOCK_CACHE_A1IN)
+		block_cache_a1in_pages--;
+
+	return page;
+}
+
+static void
+block_cache_entry_free(block_cache_entry_t entry)
+{
+	assert(entry->state == BLOCK_CACHE_IDLE);
+	assert(entry->nr_pages == 0);
+
+	list_remove(&entry->hash_node);
+	list_remove(&entry->queue_node);
+	list_remove(&entry->object_node);
+	block_cache_nr_idle--;
+	entry->cache->nr_blocks--;
+	kmem_cache_free(&block_cache_entry_cache, (vm_offset_t)entry);
+}
+
+/*
+ * Forget the least recently used idle entries beyond the limit.
+ */
+static void
+block_cache_trim_idle(void)
+{
+	while (block_cache_nr_idle > block_cache_max_idle)
+		block_cache_entry_free(list_last_entry(&block_cache_idle,
+						       struct block_cache_entry,
+						       queue_node));
+}
 
-/* Global lock for cache statistics */
-static simple_lock_data_t block_cache_stats_lock;
+static void
+block_cache_free_pages(vm_page_t *pages, unsigned int nr_pages)
+{
+	unsigned int i;
+
+	if (nr_pages == 0)
+		return;
+
+	vm_page_lock_queues();
+	for (i = 0; i < nr_pages; i++)
+		vm_page_free(pages[i]);
+	vm_page_unlock_queues();
+}
 
 /*
  * Initialize the block cache subsystem
@@ -41,11 +188,59 @@ static simple_lock_data_t block_cache_stats_lock;
 void
 vm_block_cache_init(void)
 {
+	unsigned long i, nr_buckets, percent;
+	vm_offset_t addr;
+	vm_size_t size;
+	char *arg;
+	int n;
+
 	kmem_cache_init(&block_cache_entry_cache, "block_cache_entry",
 			sizeof(struct block_cache_entry), 0, NULL, 0);
-	kmem_cache_init(&block_cache_cache, "block_cache", 
+	kmem_cache_init(&block_cache_cache, "block_cache",
 			sizeof(struct block_cache), 0, NULL, 0);
-	simple_lock_init(&block_cache_stats_lock);
+	simple_lock_init(&block_cache_lock);
+	list_init(&block_cache_a1in);
+	list_init(&block_cache_am);
+	list_init(&block_cache_idle);
+
+	percent = BLOCK_CACHE_DEFAULT_PERCENT;
+	arg = strstr(kernel_cmdline, "block_cache=");
+	if (arg != NULL) {
+		n = MACH_ATOI_DEFAULT;
+		mach_atoi((const u_char *)arg + strlen("block_cache="), &n);
+		if ((n >= 0) && (n <= 100))
+			percent = n;
+	}
+
+	if (percent == 0)
+		return;
+
+	block_cache_max_pages = vm_page_atop(vm_page_mem_size()) * percent / 100;
+
+	/*
+	 * Remember twice as many blocks as the cache holds when full of
+	 * blocks of the default size.
+	 */
+	block_cache_max_idle = 2 * block_cache_max_pages
+			       / (BLOCK_CACHE_DEFAULT_BLOCK_SIZE / PAGE_SIZE);
+
+	nr_buckets = 256;
+	while (nr_buckets < block_cache_max_idle * 2)
+		nr_buckets <<= 1;
+
+	size = round_page(nr_buckets * sizeof(struct list));
+	if (kmem_alloc_wired(kernel_map, &addr, size) != KERN_SUCCESS) {
+		printf("block_cache: unable to allocate the hash table\n");
+		return;
+	}
+
+	block_cache_table = (struct list *)addr;
+	block_cache_mask = nr_buckets - 1;
+	for (i = 0; i < nr_buckets; i++)
+		list_init(&block_cache_table[i]);
+
+	block_cache_enabled = TRUE;
+	kmem_shrinker_register(&block_cache_shrinker);
 }
 
 /*
@@ -55,383 +250,440 @@ block_cache_t
 block_cache_create(vm_object_t object, vm_size_t block_size)
 {
 	block_cache_t cache;
-	int i;
-	
+
 	assert(object != VM_OBJECT_NULL);
 	assert(block_size >= BLOCK_CACHE_MIN_BLOCK_SIZE);
 	assert(block_size <= BLOCK_CACHE_MAX_BLOCK_SIZE);
 	assert((block_size & (block_size - 1)) == 0); /* Power of 2 */
-	
+
+	if (!block_cache_enabled)
+		return NULL;
+
 	cache = (block_cache_t)kmem_cache_alloc(&block_cache_cache);
 	if (cache == NULL)
 		return NULL;
-	
-	/* Initialize cache structure */
-	cache->block_size = block_size;
-	cache->max_blocks = BLOCK_CACHE_DEFAULT_BLOCKS;
-	cache->total_blocks = 0;
-	cache->hits = 0;
-	cache->misses = 0;
-	cache->reads = 0;
-	cache->writes = 0;
+
 	cache->object = object;
-	
-	/* Initialize hash table */
-	for (i = 0; i < BLOCK_CACHE_HASH_SIZE; i++) {
-		queue_init(&cache->hash_buckets[i]);
-	}
-	
-	/* Initialize LRU queue and block list */
-	queue_init(&cache->lru_queue);
-	queue_init(&cache->block_list);
-	
-	/* Initialize lock */
-	simple_lock_init(&cache->lock);
-	
+	cache->block_size = block_size;
+	list_init(&cache->blocks);
+	cache->nr_blocks = 0;
+	memset(&cache->stats, 0, sizeof(cache->stats));
 	return cache;
 }
 
 /*
- * Destroy a block cache and free all associated resources
+ * Release the cached pages of the object between offset and end.
+ * The object must be locked.
+ */
+static void
+block_cache_release(block_cache_t cache, vm_offset_t offset, vm_offset_t end)
+{
+	vm_page_t pages[BLOCK_CACHE_MAX_PAGES * 2];
+	block_cache_entry_t entry;
+	vm_offset_t page_offset;
+	unsigned int i, nr_pages;
+
+	do {
+		nr_pages = 0;
+		simple_lock(&block_cache_lock);
+
+		list_for_each_entry(&cache->blocks, entry, object_node) {
+			if ((entry->nr_pages == 0)
+			    || (entry->block_offset >= end)
+			    || (entry->block_offset + cache->block_size
+				<= offset))
+				continue;
+
+			for (i = 0; i < cache->block_size / PAGE_SIZE; i++) {
+				page_offset = entry->block_offset
+					      + i * PAGE_SIZE;
+				if ((entry->pages[i] != VM_PAGE_NULL)
+				    && (page_offset >= offset)
+				    && (page_offset < end))
+					pages[nr_pages++] =
+						block_cache_entry_take(entry, i);
+			}
+
+			if (entry->nr_pages == 0)
+				block_cache_entry_set_state(entry,
+							    BLOCK_CACHE_IDLE);
+
+			if (nr_pages >= BLOCK_CACHE_MAX_PAGES)
+				break;
+		}
+
+		cache->stats.vbci_invalidated += nr_pages;
+		simple_unlock(&block_cache_lock);
+
+		cache->object->block_cache_page_count -= nr_pages;
+		block_cache_free_pages(pages, nr_pages);
+	} while (nr_pages != 0);
+}
+
+/*
+ * Destroy a block cache and free all associated resources.
+ * The object must be locked.
  */
 void
 block_cache_destroy(block_cache_t cache)
 {
-	block_cache_entry_t entry;
-	
 	assert(cache != NULL);
-	
-	simple_lock(&cache->lock);
-	
-	/* Free all cached blocks */
-	entry = (block_cache_entry_t)queue_first(&cache->block_list);
-	while (!queue_end(&cache->block_list, (queue_entry_t)entry)) {
-		block_cache_entry_t next_entry = (block_cache_entry_t)queue_next(&entry->object_link);
-		
-		queue_remove(&cache->block_list, entry, 
-			    block_cache_entry_t, object_link);
-		queue_remove(&cache->lru_queue, entry,
-			    block_cache_entry_t, lru_link);
-		queue_remove(&cache->hash_buckets[block_cache_hash(entry->block_offset)],
-			    entry, block_cache_entry_t, hash_link);
-		
-		/* Free associated pages if any */
-		if (entry->pages != NULL) {
-			kfree((vm_offset_t)entry->pages, entry->page_count * sizeof(vm_page_t));
-		}
-		
-		kmem_cache_free(&block_cache_entry_cache, (vm_offset_t)entry);
-		entry = next_entry;
-	}
-	
-	simple_unlock(&cache->lock);
+
+	block_cache_release(cache, 0, ~(vm_offset_t)0);
+
+	simple_lock(&block_cache_lock);
+	while (!list_empty(&cache->blocks))
+		block_cache_entry_free(list_first_entry(&cache->blocks,
+						      struct block_cache_entry,
+						      object_node));
+	simple_unlock(&block_cache_lock);
+
 	kmem_cache_free(&block_cache_cache, (vm_offset_t)cache);
 }
 
 /*
- * Find a block cache entry for the given offset
+ * Keep a clean page chosen for eviction in the cache.  The page
+ * queues and the object must be locked, and the page busy, with no
+ * mapping.  On success, the page is removed from its object.
+ *
+ * Only pages of blocks previously requested from the memory manager
+ * are kept, since entries can't be allocated here.
  */
-static block_cache_entry_t
-block_cache_lookup(block_cache_t cache, vm_offset_t block_offset)
+boolean_t
+block_cache_insert(vm_page_t page)
 {
 	block_cache_entry_t entry;
-	unsigned int hash = block_cache_hash(block_offset);
-	
-	assert(simple_lock_taken(&cache->lock));
-	
-	queue_iterate(&cache->hash_buckets[hash], entry, 
-		     block_cache_entry_t, hash_link) {
-		if (entry->block_offset == block_offset) {
-			/* Update access time for LRU - use simple counter */
-			entry->access_time++;
-			entry->access_frequency++;
-			
-			/* Move to front of LRU queue */
-			queue_remove(&cache->lru_queue, entry,
-				    block_cache_entry_t, lru_link);
-			queue_enter_first(&cache->lru_queue, entry,
-					  block_cache_entry_t, lru_link);
-			
-			return entry;
-		}
+	block_cache_t cache;
+	vm_object_t object;
+	vm_offset_t block_offset;
+	unsigned int i;
+
+	object = page->object;
+	cache = object->block_cache;
+
+	if (cache == NULL)
+		return FALSE;
+
+	assert(!page->dirty && !page->precious);
+	assert(!page->fictitious && !page->private && !page->absent);
+
+	block_offset = block_cache_trunc_block(page->offset, cache->block_size);
+	i = (page->offset - block_offset) / PAGE_SIZE;
+
+	simple_lock(&block_cache_lock);
+
+	if (block_cache_nr_pages >= block_cache_max_pages) {
+		simple_unlock(&block_cache_lock);
+		return FALSE;
 	}
-	
-	return NULL;
+
+	entry = block_cache_find(cache, block_offset);
+
+	if (entry == NULL) {
+		simple_unlock(&block_cache_lock);
+		return FALSE;
+	}
+
+	assert(entry->pages[i] == VM_PAGE_NULL);
+
+	if (entry->state == BLOCK_CACHE_IDLE)
+		block_cache_entry_set_state(entry, entry->reused
+						   ? BLOCK_CACHE_AM
+						   : BLOCK_CACHE_A1IN);
+
+	entry->pages[i] = page;
+	entry->nr_pages++;
+	block_cache_nr_pages++;
+	if (entry->state == BLOCK_CACHE_A1IN)
+		block_cache_a1in_pages++;
+
+	cache->stats.vbci_inserted++;
+	simple_unlock(&block_cache_lock);
+
+	vm_page_remove(page);
+	object->block_cache_page_count++;
+	page->reference = FALSE;
+	PAGE_WAKEUP_DONE(page);
+	return TRUE;
 }
 
 /*
- * Allocate a new block cache entry
+ * Take the page at the given offset of the object out of the cache,
+ * if it's there.  The object must be locked.  The caller inserts the
+ * page in the object.
  */
-static block_cache_entry_t
-block_cache_entry_alloc(block_cache_t cache, vm_offset_t block_offset)
+vm_page_t
+block_cache_lookup(vm_object_t object, vm_offset_t offset)
 {
 	block_cache_entry_t entry;
-	unsigned int hash;
-	unsigned int pages_needed;
-	
-	assert(simple_lock_taken(&cache->lock));
-	
-	/* Check if we need to evict an entry first */
-	if (cache->total_blocks >= cache->max_blocks) {
-		/* Evict least recently used clean block */
-		block_cache_entry_t lru_entry;
-		
-		/* Find a clean block to evict from the end of LRU queue */
-		/* Simple iteration from end using queue_last and queue_prev */
-		if (!queue_empty(&cache->lru_queue)) {
-			lru_entry = (block_cache_entry_t)queue_last(&cache->lru_queue);
-			
-			while (!queue_end(&cache->lru_queue, (queue_entry_t)lru_entry)) {
-				if (lru_entry->state == BLOCK_CACHE_CLEAN && 
-				    lru_entry->ref_count == 0) {
-					/* Remove from all queues and hash table */
-					queue_remove(&cache->lru_queue, lru_entry,
-						    block_cache_entry_t, lru_link);
-					queue_remove(&cache->block_list, lru_entry,
-						    block_cache_entry_t, object_link);
-					hash = block_cache_hash(lru_entry->block_offset);
-					queue_remove(&cache->hash_buckets[hash], lru_entry,
-						    block_cache_entry_t, hash_link);
-					
-					/* Free associated pages */
-					if (lru_entry->pages != NULL) {
-						kfree((vm_offset_t)lru_entry->pages, 
-						     lru_entry->page_count * sizeof(vm_page_t));
-					}
-					
-					kmem_cache_free(&block_cache_entry_cache, (vm_offset_t)lru_entry);
-					cache->total_blocks--;
-					break;
-				}
-				lru_entry = (block_cache_entry_t)queue_prev(&lru_entry->lru_link);
-			}
-		}
-		
-		/* If still at capacity, allocation will fail */
-		if (cache->total_blocks >= cache->max_blocks) {
-			return NULL;
-		}
-	}
-	
-	/* Allocate new entry */
-	entry = (block_cache_entry_t)kmem_cache_alloc(&block_cache_entry_cache);
-	if (entry == NULL)
-		return NULL;
-	
-	/* Initialize entry */
-	memset(entry, 0, sizeof(*entry));
-	entry->object = cache->object;
-	entry->block_offset = block_offset;
-	entry->block_size = cache->block_size;
-	entry->state = BLOCK_CACHE_CLEAN;
-	entry->ref_count = 0;
-	entry->access_time = 1;  /* Simple counter instead of ticks */
-	entry->access_frequency = 1;
-	
-	/* Calculate number of pages needed for this block */
-	pages_needed = (cache->block_size + PAGE_SIZE - 1) / PAGE_SIZE;
-	entry->page_count = pages_needed;
-	
-		/* Allocate page array */
-		if (pages_needed > 0) {
-			entry->pages = (vm_page_t *)kalloc(pages_needed * sizeof(vm_page_t));
-			if (entry->pages == NULL) {
-				kmem_cache_free(&block_cache_entry_cache, (vm_offset_t)entry);
-				return NULL;
-			}
-		memset(entry->pages, 0, pages_needed * sizeof(vm_page_t));
+	block_cache_t cache;
+	vm_offset_t block_offset;
+	vm_page_t page;
+
+	cache = object->block_cache;
+
+	if (cache == NULL)
+		return VM_PAGE_NULL;
+
+	block_offset = block_cache_trunc_block(offset, cache->block_size);
+
+	simple_lock(&block_cache_lock);
+
+	entry = block_cache_find(cache, block_offset);
+
+	if ((entry == NULL)
+	    || (entry->pages[(offset - block_offset) / PAGE_SIZE]
+		== VM_PAGE_NULL)) {
+		simple_unlock(&block_cache_lock);
+		return VM_PAGE_NULL;
 	}
-	
-	simple_lock_init(&entry->lock);
-	
-	/* Add to hash table */
-	hash = block_cache_hash(block_offset);
-	queue_enter(&cache->hash_buckets[hash], entry, 
-		   block_cache_entry_t, hash_link);
-	
-	/* Add to LRU queue (at front, since it's most recently accessed) */
-	queue_enter_first(&cache->lru_queue, entry, 
-			 block_cache_entry_t, lru_link);
-	
-	/* Add to object block list */
-	queue_enter(&cache->block_list, entry, 
-		   block_cache_entry_t, object_link);
-	
-	cache->total_blocks++;
-	
-	return entry;
+
+	page = block_cache_entry_take(entry,
+				      (offset - block_offset) / PAGE_SIZE);
+	entry->reused = TRUE;
+	block_cache_entry_set_state(entry, (entry->nr_pages == 0)
+					   ? BLOCK_CACHE_IDLE
+					   : BLOCK_CACHE_AM);
+	cache->stats.vbci_hits++;
+	simple_unlock(&block_cache_lock);
+
+	object->block_cache_page_count--;
+	return page;
 }
 
 /*
- * Read data from the block cache
+ * Record that the page at the given offset of the object is being
+ * requested from the memory manager, creating the cache of the object
+ * and the entry of the block as needed.  The object must be unlocked,
+ * with a paging reference held.
  */
-kern_return_t
-block_cache_read(block_cache_t cache, vm_offset_t offset, 
-		vm_size_t size, void **data)
+void
+block_cache_miss(vm_object_t object, vm_offset_t offset)
 {
+	block_cache_entry_t entry, new_entry;
+	block_cache_t cache;
 	vm_offset_t block_offset;
-	block_cache_entry_t entry;
-	kern_return_t result = KERN_SUCCESS;
-	
-	assert(cache != NULL);
-	assert(data != NULL);
-	
-	/* Align to block boundaries */
-	block_offset = offset & ~(cache->block_size - 1);
-	
-	simple_lock(&cache->lock);
-	
-	/* Look up block in cache */
-	entry = block_cache_lookup(cache, block_offset);
+
+	if (!block_cache_enabled)
+		return;
+
+	if ((object->block_cache == NULL)
+	    && (vm_object_enable_block_cache(object,
+					     BLOCK_CACHE_DEFAULT_BLOCK_SIZE)
+		!= KERN_SUCCESS))
+		return;
+
+	cache = object->block_cache;
+	block_offset = block_cache_trunc_block(offset, cache->block_size);
+	new_entry = NULL;
+
+	simple_lock(&block_cache_lock);
+
+	entry = block_cache_find(cache, block_offset);
+
+	if (entry == NULL) {
+		simple_unlock(&block_cache_lock);
+
+		new_entry = (block_cache_entry_t)
+			kmem_cache_alloc(&block_cache_entry_cache);
+
+		if (new_entry == NULL)
+			return;
+
+		simple_lock(&block_cache_lock);
+		entry = block_cache_find(cache, block_offset);
+	}
+
 	if (entry != NULL) {
-		/* Cache hit */
-		cache->hits++;
-		simple_lock(&block_cache_stats_lock);
-		total_cache_hits++;
-		simple_unlock(&block_cache_stats_lock);
-		
-		simple_lock(&entry->lock);
-		entry->ref_count++;
-		simple_unlock(&entry->lock);
-		
-		simple_unlock(&cache->lock);
-		
-		/* TODO: Return data from cached block */
-		/* For now, just indicate success */
-		*data = NULL;
-		
-		simple_lock(&entry->lock);
-		entry->ref_count--;
-		simple_unlock(&entry->lock);
-		
-	} else {
-		/* Cache miss - need to allocate and read from storage */
-		cache->misses++;
-		simple_lock(&block_cache_stats_lock);
-		total_cache_misses++;
-		simple_unlock(&block_cache_stats_lock);
-		
-		entry = block_cache_entry_alloc(cache, block_offset);
-		if (entry == NULL) {
-			simple_unlock(&cache->lock);
-			return KERN_RESOURCE_SHORTAGE;
+		/* A ghost read again goes to Am next time */
+		if (entry->ghost) {
+			entry->ghost = FALSE;
+			entry->reused = TRUE;
 		}
-		
-		simple_lock(&entry->lock);
-		entry->ref_count++;
-		entry->state = BLOCK_CACHE_READING;
-		simple_unlock(&entry->lock);
-		
-		simple_unlock(&cache->lock);
-		
-		/* TODO: Initiate read from storage device */
-		/* This would integrate with the existing page-based I/O system */
-		
-		/* For now, simulate successful read */
-		simple_lock(&entry->lock);
-		entry->state = BLOCK_CACHE_CLEAN;
-		entry->ref_count--;
-		simple_unlock(&entry->lock);
-		
-		*data = NULL;
+	} else {
+		entry = new_entry;
+		new_entry = NULL;
+		memset(entry, 0, sizeof(*entry));
+		entry->cache = cache;
+		entry->block_offset = block_offset;
+		entry->state = BLOCK_CACHE_IDLE;
+		list_insert_head(block_cache_bucket(cache, block_offset),
+				 &entry->hash_node);
+		list_insert_tail(&cache->blocks, &entry->object_node);
+		list_insert_head(&block_cache_idle, &entry->queue_node);
+		block_cache_nr_idle++;
+		cache->nr_blocks++;
+		block_cache_trim_idle();
 	}
-	
-	cache->reads++;
-	return result;
+
+	cache->stats.vbci_misses++;
+	simple_unlock(&block_cache_lock);
+
+	if (new_entry != NULL)
+		kmem_cache_free(&block_cache_entry_cache,
+				(vm_offset_t)new_entry);
+}
+
+/*
+ * Drop the cached pages in the given range of the object, whose data
+ * the memory manager is about to change.  The object must be locked.
+ */
+void
+block_cache_invalidate(vm_object_t object, vm_offset_t offset, vm_size_t size)
+{
+	vm_offset_t end;
+
+	if ((object->block_cache == NULL)
+	    || (object->block_cache_page_count == 0))
+		return;
+
+	end = offset + size;
+	if (end < offset)
+		end = ~(vm_offset_t)0;
+
+	block_cache_release(object->block_cache, offset, end);
+}
+
+void
+block_cache_note_clustered(block_cache_t cache, unsigned int nr_pages)
+{
+	simple_lock(&block_cache_lock);
+	cache->stats.vbci_clustered += nr_pages;
+	simple_unlock(&block_cache_lock);
 }
 
 /*
- * Write data to the block cache
+ * Pick the block to evict, with its object locked, or return NULL if
+ * all objects are busy.  Blocks seen once go first while they use too
+ * much of the cache.
  */
-kern_return_t
-block_cache_write(block_cache_t cache, vm_offset_t offset,
-		 vm_size_t size, void *data)
+static block_cache_entry_t
+block_cache_pick_victim(void)
 {
-	vm_offset_t block_offset;
 	block_cache_entry_t entry;
-	kern_return_t result = KERN_SUCCESS;
-	
-	assert(cache != NULL);
-	
-	/* Align to block boundaries */
-	block_offset = offset & ~(cache->block_size - 1);
-	
-	simple_lock(&cache->lock);
-	
-	/* Look up or create block entry */
-	entry = block_cache_lookup(cache, block_offset);
-	if (entry == NULL) {
-		entry = block_cache_entry_alloc(cache, block_offset);
-		if (entry == NULL) {
-			simple_unlock(&cache->lock);
-			return KERN_RESOURCE_SHORTAGE;
-		}
+	struct list *queues[2];
+	unsigned int i;
+
+	if ((block_cache_a1in_pages
+	     > block_cache_max_pages / BLOCK_CACHE_A1IN_DENOM)
+	    || list_empty(&block_cache_am)) {
+		queues[0] = &block_cache_a1in;
+		queues[1] = &block_cache_am;
+	} else {
+		queues[0] = &block_cache_am;
+		queues[1] = &block_cache_a1in;
 	}
-	
-	simple_lock(&entry->lock);
-	entry->ref_count++;
-	entry->state = BLOCK_CACHE_DIRTY;
-	simple_unlock(&entry->lock);
-	
-	simple_unlock(&cache->lock);
-	
-	/* TODO: Update block data */
-	/* This would modify the cached block data and mark pages as dirty */
-	
-	simple_lock(&entry->lock);
-	entry->ref_count--;
-	simple_unlock(&entry->lock);
-	
-	cache->writes++;
-	return result;
+
+	for (i = 0; i < 2; i++)
+		list_for_each_entry_reverse(queues[i], entry, queue_node)
+			if (vm_object_lock_try(entry->cache->object))
+				return entry;
+
+	return NULL;
+}
+
+/*
+ * Shrinker interface, through which the pageout daemon releases cached
+ * pages on memory pressure.
+ */
+static unsigned long
+block_cache_shrink_count(void)
+{
+	/* Harmless unsynchronized access, the count is only a hint */
+	return block_cache_nr_pages;
 }
 
 /*
- * Flush dirty blocks to storage
+ * Release at least nr_to_scan cached pages, whole blocks at a time, in
+ * replacement order.  Called with nothing locked.
  */
-kern_return_t
-block_cache_flush(block_cache_t cache, vm_offset_t offset, vm_size_t size)
+static unsigned long
+block_cache_shrink_scan(unsigned long nr_to_scan)
 {
+	vm_page_t pages[BLOCK_CACHE_MAX_PAGES];
 	block_cache_entry_t entry;
-	vm_offset_t end_offset = offset + size;
-	
-	assert(cache != NULL);
-	
-	simple_lock(&cache->lock);
-	
-	/* Iterate through all blocks that intersect the flush range */
-	queue_iterate(&cache->block_list, entry, 
-		     block_cache_entry_t, object_link) {
-		vm_offset_t entry_end = entry->block_offset + entry->block_size;
-		
-		/* Check if block intersects with flush range */
-		if (entry->block_offset < end_offset && entry_end > offset) {
-			simple_lock(&entry->lock);
-			if (entry->state == BLOCK_CACHE_DIRTY) {
-				entry->state = BLOCK_CACHE_WRITING;
-				/* TODO: Initiate write to storage */
-				entry->state = BLOCK_CACHE_CLEAN;
-			}
-			simple_unlock(&entry->lock);
-		}
+	vm_object_t object;
+	unsigned long target, nr_freed;
+	unsigned int i, nr_pages;
+
+	nr_freed = 0;
+
+	simple_lock(&block_cache_lock);
+	target = (nr_to_scan < block_cache_nr_pages)
+		 ? block_cache_nr_pages - nr_to_scan : 0;
+
+	while (block_cache_nr_pages > target) {
+		entry = block_cache_pick_victim();
+
+		if (entry == NULL)
+			break;
+
+		object = entry->cache->object;
+		nr_pages = 0;
+
+		for (i = 0; i < entry->cache->block_size / PAGE_SIZE; i++)
+			if (entry->pages[i] != VM_PAGE_NULL)
+				pages[nr_pages++] =
+					block_cache_entry_take(entry, i);
+
+		if (entry->state == BLOCK_CACHE_A1IN)
+			entry->ghost = TRUE;
+
+		block_cache_entry_set_state(entry, BLOCK_CACHE_IDLE);
+		entry->cache->stats.vbci_evicted += nr_pages;
+		simple_unlock(&block_cache_lock);
+
+		object->block_cache_page_count -= nr_pages;
+		block_cache_free_pages(pages, nr_pages);
+		nr_freed += nr_pages;
+
+		/*
+		 *	An unreferenced object is either cached or being
+		 *	terminated.  Only collect the former.
+		 */
+		if (object->cached && vm_object_collectable(object))
+			vm_object_collect(object);
+		else
+			vm_object_unlock(object);
+
+		simple_lock(&block_cache_lock);
 	}
-	
-	simple_unlock(&cache->lock);
-	return KERN_SUCCESS;
+
+	block_cache_trim_idle();
+	simple_unlock(&block_cache_lock);
+
+	return nr_freed;
 }
 
+static struct kmem_shrinker block_cache_shrinker = {
+	.name = "block_cache",
+	.count = block_cache_shrink_count,
+	.scan = block_cache_shrink_scan,
+};
+
 /*
- * Get cache statistics
+ * Get the statistics of the cache of an object.  The object must be
+ * locked.
  */
 void
-block_cache_get_stats(block_cache_t cache, unsigned int *hits,
-		     unsigned int *misses, unsigned int *total_blocks)
+block_cache_get_stats(vm_object_t object, vm_block_cache_info_t *info)
 {
-	assert(cache != NULL);
-	
-	simple_lock(&cache->lock);
-	if (hits) *hits = cache->hits;
-	if (misses) *misses = cache->misses;
-	if (total_blocks) *total_blocks = cache->total_blocks;
-	simple_unlock(&cache->lock);
-}
\ No newline at end of file
+	block_cache_t cache;
+
+	cache = object->block_cache;
+
+	simple_lock(&block_cache_lock);
+
+	if (cache == NULL) {
+		memset(info, 0, sizeof(*info));
+	} else {
+		*info = cache->stats;
+		info->vbci_block_size = cache->block_size;
+		info->vbci_blocks = cache->nr_blocks;
+	}
+
+	info->vbci_pages = object->block_cache_page_count;
+	info->vbci_cache_pages = block_cache_nr_pages;
+	info->vbci_max_cache_pages = block_cache_max_pages;
+	simple_unlock(&block_cache_lock);
+}
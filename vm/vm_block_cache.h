@@ -14,114 +14,91 @@
 
 /*
  * Block-level cache layer for GNU Mach
- * 
- * This module provides a block-aware caching layer that sits between
- * the memory object interface and the page management system, optimizing
- * for block-oriented I/O operations while maintaining full compatibility
- * with the existing page-based memory object model.
+ *
+ * Clean pages of external memory objects chosen for eviction are set
+ * aside in the block cache instead of being freed.  Page faults look
+ * into it before asking the memory manager for data, so that reading
+ * recently evicted file data again doesn't go to the pager and the
+ * disk behind it.  Dirty pages are written back a block at a time.
+ *
+ * The cache is organized in blocks of consecutive pages of an object.
+ * A block is created when the memory manager is first asked for one
+ * of its pages, and records the pages of the block that are in the
+ * cache.  Pages in the cache are removed from their object, but keep
+ * it from being collected (see vm_object_collectable).
+ *
+ * Replacement follows 2Q: blocks enter a FIFO when their pages are
+ * first cached, and go to an LRU queue instead once one of them has
+ * been faulted back in.  Blocks pushed out of the FIFO are remembered
+ * for a while, and go to the LRU queue too if read again in the
+ * meantime.  This way, reading a large file once can't flush the
+ * blocks that are actually reused.
  */
 
 #ifndef _VM_BLOCK_CACHE_H_
 #define _VM_BLOCK_CACHE_H_
 
 #include <mach/boolean.h>
+#include <mach/vm_param.h>
+#include <mach_debug/vm_info.h>
+#include <kern/list.h>
 #include <vm/vm_types.h>
-#include <kern/queue.h>
-#include <kern/lock.h>
 #include <vm/vm_object.h>
 #include <vm/vm_page.h>
 
 /*
  * Block cache configuration
  */
-#define BLOCK_CACHE_MIN_BLOCK_SIZE	512		/* Minimum block size */
-#define BLOCK_CACHE_MAX_BLOCK_SIZE	65536		/* Maximum block size */
-#define BLOCK_CACHE_DEFAULT_BLOCKS	1024		/* Default cache size in blocks */
-#define BLOCK_CACHE_HASH_SIZE		256		/* Hash table size */
+#define BLOCK_CACHE_MIN_BLOCK_SIZE	PAGE_SIZE
+#define BLOCK_CACHE_MAX_BLOCK_SIZE	65536
+#define BLOCK_CACHE_DEFAULT_BLOCK_SIZE	65536
+#define BLOCK_CACHE_MAX_PAGES	(BLOCK_CACHE_MAX_BLOCK_SIZE / PAGE_SIZE)
 
 /*
  * Block cache entry states
  */
 typedef enum {
-	BLOCK_CACHE_CLEAN = 0,		/* Block is clean, matches storage */
-	BLOCK_CACHE_DIRTY = 1,		/* Block has been modified */
-	BLOCK_CACHE_READING = 2,	/* Block is being read from storage */
-	BLOCK_CACHE_WRITING = 3,	/* Block is being written to storage */
-	BLOCK_CACHE_ERROR = 4		/* I/O error occurred */
+	BLOCK_CACHE_IDLE = 0,		/* No page cached */
+	BLOCK_CACHE_A1IN = 1,		/* Pages cached, block seen once */
+	BLOCK_CACHE_AM = 2		/* Pages cached, block reused */
 } block_cache_state_t;
 
 /*
  * Block cache entry
- * 
- * Represents a cached block that may span multiple pages.
- * Maintains both block-level metadata and links to constituent pages.
+ *
+ * Describes a block of an object, and the pages of the block which
+ * are in the cache.  Entries are protected by the global block cache
+ * lock.
  */
 struct block_cache_entry {
-	queue_chain_t	hash_link;	/* Hash table linkage */
-	queue_chain_t	lru_link;	/* LRU queue linkage */
-	queue_chain_t	object_link;	/* Per-object linkage */
-	
-	vm_object_t	object;		/* Associated memory object */
+	struct list	hash_node;	/* In its hash bucket */
+	struct list	queue_node;	/* In A1in, Am or the idle queue */
+	struct list	object_node;	/* In the blocks of its cache */
+	struct block_cache *cache;	/* Cache of the object */
 	vm_offset_t	block_offset;	/* Block offset within object */
-	vm_size_t	block_size;	/* Size of this block */
-	
-	block_cache_state_t state;	/* Current block state */
-	
-	unsigned int	ref_count;	/* Reference count */
-	unsigned int	access_time;	/* For LRU replacement */
-	unsigned int	access_frequency; /* Access frequency counter */
-	
-	boolean_t	read_ahead_hint; /* Block was fetched via read-ahead */
-	boolean_t	write_cluster_hint; /* Block should be clustered for write */
-	
-	/* Page management */
-	unsigned int	page_count;	/* Number of pages in this block */
-	vm_page_t	*pages;		/* Array of constituent pages */
-	
-	/* Synchronization */
-	simple_lock_data_t lock;	/* Per-block lock */
-	int		waiters;	/* Number of waiters on this block */
+	block_cache_state_t state;
+	boolean_t	reused;		/* Next pages cached go to Am */
+	boolean_t	ghost;		/* Pushed out of A1in */
+	unsigned int	nr_pages;	/* Number of pages cached */
+	vm_page_t	pages[BLOCK_CACHE_MAX_PAGES];
 };
 
 typedef struct block_cache_entry *block_cache_entry_t;
 
 /*
  * Block cache
- * 
- * Main data structure managing the block cache for a memory object.
- * Each memory object that benefits from block caching has an associated
- * block cache structure.
+ *
+ * Per-object part of the cache.  The object holds the only pointer
+ * to it, and destroys it when terminated.
  */
 struct block_cache {
-	/* Configuration */
+	vm_object_t	object;		/* Associated memory object */
 	vm_size_t	block_size;	/* Block size for this cache */
-	unsigned int	max_blocks;	/* Maximum blocks to cache */
-	
-	/* Statistics */
-	unsigned int	total_blocks;	/* Current number of cached blocks */
-	unsigned int	hits;		/* Cache hits */
-	unsigned int	misses;		/* Cache misses */
-	unsigned int	reads;		/* Read operations */
-	unsigned int	writes;		/* Write operations */
-	
-	/* Hash table for block lookup */
-	queue_head_t	hash_buckets[BLOCK_CACHE_HASH_SIZE];
-	
-	/* LRU queue for replacement policy */
-	queue_head_t	lru_queue;
-	
-	/* Per-object block list */
-	queue_head_t	block_list;
-	
-	/* Synchronization */
-	simple_lock_data_t lock;	/* Cache-wide lock */
-	
-	/* Associated memory object */
-	vm_object_t	object;
+	struct list	blocks;		/* Entries of the object */
+	unsigned int	nr_blocks;
+	vm_block_cache_info_t stats;
 };
 
-typedef struct block_cache *block_cache_t;
-
 /*
  * Block cache operations
  */
@@ -133,60 +110,32 @@ void vm_block_cache_init(void);
 block_cache_t block_cache_create(vm_object_t object, vm_size_t block_size);
 void block_cache_destroy(block_cache_t cache);
 
-/* Block operations */
-kern_return_t block_cache_read(block_cache_t cache, vm_offset_t offset,
-			      vm_size_t size, void **data);
-kern_return_t block_cache_write(block_cache_t cache, vm_offset_t offset,
-			       vm_size_t size, void *data);
-kern_return_t block_cache_flush(block_cache_t cache, vm_offset_t offset,
-			       vm_size_t size);
-
-/* Cache management */
-void block_cache_set_read_ahead(block_cache_t cache, boolean_t enable);
-void block_cache_set_write_clustering(block_cache_t cache, boolean_t enable);
-void block_cache_memory_pressure(block_cache_t cache, vm_size_t target_free);
+/*
+ * Page operations.  See vm_block_cache.c for the locking rules.
+ */
+boolean_t block_cache_insert(vm_page_t page);
+vm_page_t block_cache_lookup(vm_object_t object, vm_offset_t offset);
+void block_cache_miss(vm_object_t object, vm_offset_t offset);
+void block_cache_invalidate(vm_object_t object, vm_offset_t offset,
+			    vm_size_t size);
+void block_cache_note_clustered(block_cache_t cache, unsigned int nr_pages);
 
 /* Statistics and debugging */
-void block_cache_get_stats(block_cache_t cache, 
-			  unsigned int *hits, unsigned int *misses,
-			  unsigned int *total_blocks);
+void block_cache_get_stats(vm_object_t object, vm_block_cache_info_t *info);
 
 /*
  * Integration with existing memory object system
  */
-kern_return_t vm_object_enable_block_cache(vm_object_t object, 
+kern_return_t vm_object_enable_block_cache(vm_object_t object,
 					   vm_size_t block_size);
 void vm_object_disable_block_cache(vm_object_t object);
 boolean_t vm_object_has_block_cache(vm_object_t object);
 
-/*
- * Page-block bridge operations
- * 
- * These functions handle the translation between page-based memory
- * object operations and block-based cache operations.
- */
-kern_return_t vm_page_to_block_read(vm_object_t object, vm_offset_t offset,
-				   vm_page_t *pages, unsigned int page_count);
-kern_return_t vm_page_to_block_write(vm_object_t object, vm_offset_t offset,
-				    vm_page_t *pages, unsigned int page_count);
-
 /* Internal utilities */
-static inline unsigned int
-block_cache_hash(vm_offset_t offset)
-{
-	return (offset >> PAGE_SHIFT) % BLOCK_CACHE_HASH_SIZE;
-}
-
-static inline boolean_t
-block_cache_offset_aligned(vm_offset_t offset, vm_size_t block_size)
-{
-	return (offset & (block_size - 1)) == 0;
-}
-
-static inline vm_size_t
-block_cache_round_to_block(vm_size_t size, vm_size_t block_size)
+static inline vm_offset_t
+block_cache_trunc_block(vm_offset_t offset, vm_size_t block_size)
 {
-	return (size + block_size - 1) & ~(block_size - 1);
+	return offset & ~(block_size - 1);
 }
 
-#endif /* _VM_BLOCK_CACHE_H_ */
\ No newline at end of file
+#endif /* _VM_BLOCK_CACHE_H_ */
@@ -10,122 +10,497 @@
 /*
  * Memory compression implementation for GNU Mach
  * Provides compressed memory storage to extend effective memory capacity
+ *
+ * Pages are compressed with an LZ4 block format codec, and stored in
+ * a pool of wired pages, each cut into chunks of a single size class.
+ * The pool grabs and releases its pages directly, without blocking,
+ * since it's filled by the pageout daemon when memory is short.
+ * Zero-filled pages are recognized and stored without data.
  */
 
 #include <string.h>
 #include <kern/assert.h>
 #include <kern/debug.h>
-#include <kern/kalloc.h>
-#include <kern/slab.h>
+#include <kern/list.h>
 #include <kern/lock.h>
-#include <kern/queue.h>
+#include <kern/printf.h>
 #include <mach/vm_param.h>
+#include <ipc/ipc_port.h>
+#include <util/atoi.h>
+#include <vm/pmap.h>
 #include <vm/vm_compress.h>
-#include <vm/vm_page.h>
 #include <vm/vm_kern.h>
+#include <vm/vm_page.h>
+
+#if MACH_DEBUG
+#include <kern/host.h>
+#include <kern/mach_debug.server.h>
+#endif /* MACH_DEBUG */
+
+extern char *kernel_cmdline;
+
+/*
+ * Default limit of the pool, in percent of physical memory.  It can
+ * be changed with the vm_compress=N boot option, 0 disabling the pool.
+ */
+#define VM_COMPRESS_DEFAULT_PERCENT	25
+
+/*
+ * Pool pages start with a slab header, and are then cut into chunks
+ * of a multiple of VM_COMPRESS_CHUNK bytes.  Pages that don't
+ * compress enough to share a pool page with another one are left to
+ * the default pager.
+ */
+struct vm_compress_slab {
+	struct list		node;		/* in the list of its class */
+	unsigned short		class;		/* size class of the chunks */
+	unsigned short		nr_free;	/* number of free chunks */
+	unsigned short		free;		/* offset of first free chunk */
+};
+
+#define VM_COMPRESS_CHUNK	64
+#define VM_COMPRESS_SLAB_HDR	((sizeof(struct vm_compress_slab) + 15) & ~15UL)
+#define VM_COMPRESS_SLAB_DATA	(PAGE_SIZE - VM_COMPRESS_SLAB_HDR)
+#define VM_COMPRESS_NR_CLASSES	((VM_COMPRESS_SLAB_DATA / 2) / VM_COMPRESS_CHUNK)
+
+#define vm_compress_chunk_size(class)	(((class) + 1) * VM_COMPRESS_CHUNK)
+#define vm_compress_nr_chunks(class) \
+	(VM_COMPRESS_SLAB_DATA / vm_compress_chunk_size(class))
 
-/* Global compression statistics */
-static unsigned int total_compressed_pages = 0;
-static unsigned int total_decompressed_pages = 0;
-static unsigned int compression_ratio_sum = 0;  /* For average calculation */
+/*
+ * Compressed page, named by memory object and offset in it.
+ */
+struct vm_compress_entry {
+	struct list		hash_node;	/* in its hash bucket */
+	struct list		pager_node;	/* in the list of its pager */
+	struct vm_compress_pager *pager;
+	vm_offset_t		offset;		/* in the memory object */
+	unsigned short		size;		/* of data, 0 for a zero page */
+	unsigned char		data[];
+};
 
-/* Slab cache for compressed page entries */
-static struct kmem_cache compressed_page_cache;
+#define VM_COMPRESS_MAX_SIZE \
+	(vm_compress_chunk_size(VM_COMPRESS_NR_CLASSES - 1) \
+	 - offsetof(struct vm_compress_entry, data))
 
-/* Global lock for compression statistics */
-static simple_lock_data_t compress_stats_lock;
+/*
+ * Memory object with compressed pages, so that they can all be
+ * released with it.
+ */
+struct vm_compress_pager {
+	struct list		hash_node;	/* in its hash bucket */
+	struct list		entries;	/* its compressed pages */
+	ipc_port_t		port;
+};
 
-/* Hash table for compressed page lookup */
-#define VM_COMPRESS_HASH_SIZE 512
-static queue_head_t compress_hash_buckets[VM_COMPRESS_HASH_SIZE];
-static simple_lock_data_t compress_hash_locks[VM_COMPRESS_HASH_SIZE];
+#define VM_COMPRESS_PAGER_TABLE_SIZE	256
+
+/*
+ * The pool, its hash tables and statistics are protected by
+ * vm_compress_lock.  It is taken with the object of the page
+ * locked, and is never held when taking other VM locks, except
+ * for the free page queue.
+ */
+static simple_lock_data_t vm_compress_lock;
+static struct list vm_compress_classes[VM_COMPRESS_NR_CLASSES];
+static struct list *vm_compress_entry_table;
+static unsigned long vm_compress_entry_mask;
+static struct list vm_compress_pager_table[VM_COMPRESS_PAGER_TABLE_SIZE];
+static vm_compress_info_t vm_compress_stats;
+static boolean_t vm_compress_enabled = FALSE;
 
 /*
- * Simple hash function for compressed page lookup
+ * Compression state, and a bounce buffer for pages outside of the
+ * direct physical mapping, protected by vm_compress_scratch_lock.
+ * It is taken before vm_compress_lock.
  */
+#define VM_COMPRESS_HASH_LOG	12
+
+static simple_lock_data_t vm_compress_scratch_lock;
+static unsigned short vm_compress_htab[1 << VM_COMPRESS_HASH_LOG];
+static unsigned char vm_compress_buf[VM_COMPRESS_MAX_SIZE];
+static unsigned long vm_compress_bounce[PAGE_SIZE / sizeof(unsigned long)];
+
+/*
+ * LZ4 block format codec.
+ *
+ * A block is a sequence of literal runs, each followed by a match,
+ * except the last one.  A sequence starts with a token holding the
+ * literal length in its high nibble and the match length minus 4
+ * in its low one, a value of 15 meaning that more length bytes
+ * follow, until one isn't 255.  The literals are followed by the
+ * 16-bit little endian match offset, then the match length bytes.
+ * The last 5 bytes are always literals, and the last match starts
+ * at least 12 bytes before the end.
+ */
+#define LZ4_MINMATCH		4
+#define LZ4_LASTLITERALS	5
+#define LZ4_MFLIMIT		12
+#define LZ4_MAX_OFFSET		65535
+
+static inline uint32_t
+lz4_read32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
 static inline unsigned int
-vm_compress_hash(vm_object_t object, vm_offset_t offset)
+lz4_hash(uint32_t v)
 {
-	unsigned long hash = (unsigned long)object ^ (offset >> PAGE_SHIFT);
-	return hash % VM_COMPRESS_HASH_SIZE;
+	return (v * 2654435761U) >> (32 - VM_COMPRESS_HASH_LOG);
+}
+
+static inline unsigned char *
+lz4_put_length(unsigned char *op, vm_size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
 }
 
 /*
- * Simple compression algorithm (RLE-like for demonstration)
- * In a production system, this would use zlib, lz4, or similar
+ * Compress SRC into DST, returning the compressed size, or 0 if it
+ * wouldn't fit in DST_LEN bytes.  SRC_LEN is at most 64 KiB, so that
+ * positions fit in the hash table entries.
  */
 static vm_size_t
-simple_compress(const void *src, vm_size_t src_len, void *dst, vm_size_t dst_len)
+vm_compress_lz4(const unsigned char *src, vm_size_t src_len,
+		unsigned char *dst, vm_size_t dst_len)
 {
-	const unsigned char *input = (const unsigned char *)src;
-	unsigned char *output = (unsigned char *)dst;
-	vm_size_t in_pos = 0, out_pos = 0;
-	
-	if (dst_len < src_len / 2) {
-		/* Not enough space for worst-case compression */
-		return 0;
-	}
-	
-	while (in_pos < src_len && out_pos < dst_len - 2) {
-		unsigned char current = input[in_pos];
-		vm_size_t run_length = 1;
-		
-		/* Count consecutive identical bytes */
-		while (in_pos + run_length < src_len && 
-		       input[in_pos + run_length] == current &&
-		       run_length < 255) {
-			run_length++;
+	const unsigned char *ip, *anchor, *ref, *end, *mflimit, *matchlimit;
+	unsigned char *op, *oend, *token;
+	vm_size_t lit_len, match_len;
+	unsigned int h;
+	uint32_t seq;
+
+	ip = src;
+	anchor = src;
+	end = src + src_len;
+	mflimit = end - LZ4_MFLIMIT;
+	matchlimit = end - LZ4_LASTLITERALS;
+	op = dst;
+	oend = dst + dst_len;
+
+	memset(vm_compress_htab, 0, sizeof(vm_compress_htab));
+
+	if (src_len < LZ4_MFLIMIT + 1)
+		goto last_literals;
+
+	ip++;
+
+	while (ip < mflimit) {
+		seq = lz4_read32(ip);
+		h = lz4_hash(seq);
+		ref = src + vm_compress_htab[h];
+		vm_compress_htab[h] = ip - src;
+
+		if ((ref >= ip) || (ip - ref > LZ4_MAX_OFFSET)
+		    || (lz4_read32(ref) != seq)) {
+			/* Skip faster over data that doesn't compress */
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+
+		while ((ip > anchor) && (ref > src) && (ip[-1] == ref[-1])) {
+			ip--;
+			ref--;
+		}
+
+		match_len = LZ4_MINMATCH;
+		while ((ip + match_len < matchlimit)
+		       && (ip[match_len] == ref[match_len]))
+			match_len++;
+
+		lit_len = ip - anchor;
+		if (op + 1 + lit_len / 255 + 1 + lit_len + 2
+		    + (match_len - LZ4_MINMATCH) / 255 + 1 > oend)
+			return 0;
+
+		token = op++;
+		if (lit_len >= 15) {
+			*token = 15 << 4;
+			op = lz4_put_length(op, lit_len - 15);
+		} else {
+			*token = lit_len << 4;
 		}
-		
-		if (run_length > 3 || current == 0) {
-			/* Use RLE encoding */
-			output[out_pos++] = 0xFF;  /* Escape marker */
-			output[out_pos++] = (unsigned char)run_length;
-			output[out_pos++] = current;
+
+		memcpy(op, anchor, lit_len);
+		op += lit_len;
+
+		*op++ = (ip - ref) & 0xff;
+		*op++ = (ip - ref) >> 8;
+
+		if (match_len - LZ4_MINMATCH >= 15) {
+			*token |= 15;
+			op = lz4_put_length(op, match_len - LZ4_MINMATCH - 15);
 		} else {
-			/* Direct copy */
-			for (vm_size_t i = 0; i < run_length && out_pos < dst_len; i++) {
-				output[out_pos++] = current;
-			}
+			*token |= match_len - LZ4_MINMATCH;
 		}
-		
-		in_pos += run_length;
+
+		ip += match_len;
+		anchor = ip;
+
+		if (ip < mflimit)
+			vm_compress_htab[lz4_hash(lz4_read32(ip - 2))]
+				= ip - 2 - src;
 	}
-	
-	return (out_pos < dst_len) ? out_pos : 0;
+
+last_literals:
+	lit_len = end - anchor;
+	if (op + 1 + lit_len / 255 + 1 + lit_len > oend)
+		return 0;
+
+	if (lit_len >= 15) {
+		*op++ = 15 << 4;
+		op = lz4_put_length(op, lit_len - 15);
+	} else {
+		*op++ = lit_len << 4;
+	}
+
+	memcpy(op, anchor, lit_len);
+	op += lit_len;
+
+	return op - dst;
 }
 
 /*
- * Simple decompression algorithm
+ * Decompress SRC into DST, which must be filled exactly.  Every
+ * length and offset is checked, so that corrupted data can't lead
+ * outside of the buffers.
  */
 static boolean_t
-simple_decompress(const void *src, vm_size_t src_len, void *dst, vm_size_t dst_len)
+vm_compress_lz4_decode(const unsigned char *src, vm_size_t src_len,
+		       unsigned char *dst, vm_size_t dst_len)
 {
-	const unsigned char *input = (const unsigned char *)src;
-	unsigned char *output = (unsigned char *)dst;
-	vm_size_t in_pos = 0, out_pos = 0;
-	
-	while (in_pos < src_len && out_pos < dst_len) {
-		if (input[in_pos] == 0xFF && in_pos + 2 < src_len) {
-			/* RLE encoded run */
-			unsigned char run_length = input[in_pos + 1];
-			unsigned char value = input[in_pos + 2];
-			
-			if (out_pos + run_length > dst_len) {
-				return FALSE;  /* Output buffer overflow */
-			}
-			
-			for (unsigned char i = 0; i < run_length; i++) {
-				output[out_pos++] = value;
-			}
-			in_pos += 3;
-		} else {
-			/* Direct copy */
-			output[out_pos++] = input[in_pos++];
+	const unsigned char *ip, *iend, *ref;
+	unsigned char *op, *oend;
+	vm_size_t len, offset;
+	unsigned char token, b;
+
+	ip = src;
+	iend = src + src_len;
+	op = dst;
+	oend = dst + dst_len;
+
+	for (;;) {
+		if (ip >= iend)
+			return FALSE;
+
+		token = *ip++;
+
+		len = token >> 4;
+		if (len == 15) {
+			do {
+				if (ip >= iend)
+					return FALSE;
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+
+		if ((len > iend - ip) || (len > oend - op))
+			return FALSE;
+
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return FALSE;
+
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		if ((offset == 0) || (offset > op - dst))
+			return FALSE;
+
+		len = token & 15;
+		if (len == 15) {
+			do {
+				if (ip >= iend)
+					return FALSE;
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		}
+		len += LZ4_MINMATCH;
+
+		if (len > oend - op)
+			return FALSE;
+
+		/* Matches may overlap their output */
+		for (ref = op - offset; len > 0; len--)
+			*op++ = *ref++;
+	}
+
+	return op == oend;
+}
+
+static boolean_t
+vm_compress_is_zero(const void *data)
+{
+	const unsigned long *p = data;
+	unsigned int i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(*p); i++)
+		if (p[i] != 0)
+			return FALSE;
+
+	return TRUE;
+}
+
+/*
+ * Chunk allocator.  Slabs with free chunks are kept in the list of
+ * their class, and released as soon as they're empty.
+ */
+static void *
+vm_compress_alloc(vm_size_t size)
+{
+	struct vm_compress_slab *slab;
+	unsigned int class, i;
+	vm_page_t page;
+	char *chunk;
+
+	assert(size > 0);
+	class = (size - 1) / VM_COMPRESS_CHUNK;
+	assert(class < VM_COMPRESS_NR_CLASSES);
+
+	if (list_empty(&vm_compress_classes[class])) {
+		if (vm_compress_stats.vci_pool_pages
+		    >= vm_compress_stats.vci_max_pool_pages)
+			return NULL;
+
+		page = vm_page_grab(VM_PAGE_DIRECTMAP);
+		if (page == VM_PAGE_NULL)
+			return NULL;
+
+		slab = (struct vm_compress_slab *)
+			phystokv(vm_page_to_pa(page));
+		slab->class = class;
+		slab->nr_free = vm_compress_nr_chunks(class);
+		slab->free = VM_COMPRESS_SLAB_HDR;
+
+		for (i = 0; i < slab->nr_free; i++) {
+			chunk = (char *)slab + VM_COMPRESS_SLAB_HDR
+				+ i * vm_compress_chunk_size(class);
+			*(unsigned short *)chunk = (i + 1 < slab->nr_free)
+				? chunk + vm_compress_chunk_size(class)
+				  - (char *)slab
+				: 0;
 		}
+
+		list_insert_head(&vm_compress_classes[class], &slab->node);
+		vm_compress_stats.vci_pool_pages++;
+	}
+
+	slab = list_first_entry(&vm_compress_classes[class],
+				struct vm_compress_slab, node);
+	chunk = (char *)slab + slab->free;
+	slab->free = *(unsigned short *)chunk;
+	slab->nr_free--;
+
+	if (slab->nr_free == 0)
+		list_remove(&slab->node);
+
+	return chunk;
+}
+
+static void
+vm_compress_free(void *chunk)
+{
+	struct vm_compress_slab *slab;
+	vm_page_t page;
+
+	slab = (struct vm_compress_slab *)vm_page_trunc((vm_offset_t)chunk);
+
+	if (slab->nr_free == 0)
+		list_insert_head(&vm_compress_classes[slab->class], &slab->node);
+
+	*(unsigned short *)chunk = slab->free;
+	slab->free = (char *)chunk - (char *)slab;
+	slab->nr_free++;
+
+	if (slab->nr_free == vm_compress_nr_chunks(slab->class)) {
+		list_remove(&slab->node);
+		page = vm_page_lookup_pa(kvtophys((vm_offset_t)slab));
+		assert(page != VM_PAGE_NULL);
+		vm_page_release(page, FALSE, FALSE);
+		vm_compress_stats.vci_pool_pages--;
+	}
+}
+
+static inline struct list *
+vm_compress_entry_bucket(const struct vm_compress_pager *pager,
+			 vm_offset_t offset)
+{
+	unsigned long hash;
+
+	hash = ((unsigned long)pager >> 4) + (offset >> PAGE_SHIFT);
+	return &vm_compress_entry_table[(hash * 2654435761UL)
+					& vm_compress_entry_mask];
+}
+
+static inline struct list *
+vm_compress_pager_bucket(ipc_port_t port)
+{
+	return &vm_compress_pager_table[((unsigned long)port >> 4)
+					% VM_COMPRESS_PAGER_TABLE_SIZE];
+}
+
+static struct vm_compress_pager *
+vm_compress_pager_lookup(ipc_port_t port)
+{
+	struct vm_compress_pager *pager;
+
+	list_for_each_entry(vm_compress_pager_bucket(port), pager, hash_node)
+		if (pager->port == port)
+			return pager;
+
+	return NULL;
+}
+
+static struct vm_compress_entry *
+vm_compress_entry_lookup(ipc_port_t port, vm_offset_t offset)
+{
+	struct vm_compress_pager *pager;
+	struct vm_compress_entry *entry;
+
+	pager = vm_compress_pager_lookup(port);
+	if (pager == NULL)
+		return NULL;
+
+	list_for_each_entry(vm_compress_entry_bucket(pager, offset),
+			    entry, hash_node)
+		if ((entry->pager == pager) && (entry->offset == offset))
+			return entry;
+
+	return NULL;
+}
+
+/*
+ * Remove an entry, and its pager if it was the last one.
+ */
+static void
+vm_compress_entry_free(struct vm_compress_entry *entry)
+{
+	struct vm_compress_pager *pager = entry->pager;
+
+	list_remove(&entry->hash_node);
+	list_remove(&entry->pager_node);
+	vm_compress_stats.vci_stored--;
+	vm_compress_stats.vci_data_bytes -= entry->size;
+	if (entry->size == 0)
+		vm_compress_stats.vci_zero--;
+	vm_compress_free(entry);
+
+	if (list_empty(&pager->entries)) {
+		list_remove(&pager->hash_node);
+		vm_compress_free(pager);
 	}
-	
-	return (out_pos == dst_len);
 }
 
 /*
@@ -134,17 +509,53 @@ simple_decompress(const void *src, vm_size_t src_len, void *dst, vm_size_t dst_l
 void
 vm_compress_init(void)
 {
-	int i;
-	
-	kmem_cache_init(&compressed_page_cache, "compressed_page",
-			sizeof(struct vm_compressed_page), 0, NULL, 0);
-	simple_lock_init(&compress_stats_lock);
-	
-	/* Initialize hash table */
-	for (i = 0; i < VM_COMPRESS_HASH_SIZE; i++) {
-		queue_init(&compress_hash_buckets[i]);
-		simple_lock_init(&compress_hash_locks[i]);
+	unsigned long percent, nr_buckets, i;
+	vm_offset_t addr;
+	vm_size_t size;
+	char *arg;
+	int n;
+
+	simple_lock_init(&vm_compress_lock);
+	simple_lock_init(&vm_compress_scratch_lock);
+
+	for (i = 0; i < VM_COMPRESS_NR_CLASSES; i++)
+		list_init(&vm_compress_classes[i]);
+
+	for (i = 0; i < VM_COMPRESS_PAGER_TABLE_SIZE; i++)
+		list_init(&vm_compress_pager_table[i]);
+
+	percent = VM_COMPRESS_DEFAULT_PERCENT;
+	arg = strstr(kernel_cmdline, "vm_compress=");
+	if (arg != NULL) {
+		n = MACH_ATOI_DEFAULT;
+		mach_atoi((const u_char *)arg + strlen("vm_compress="), &n);
+		if ((n >= 0) && (n <= 100))
+			percent = n;
+	}
+
+	if (percent == 0)
+		return;
+
+	vm_compress_stats.vci_max_pool_pages =
+		vm_page_atop(vm_page_mem_size()) * percent / 100;
+
+	/* About one bucket per page stored when the pool is full */
+	nr_buckets = 1024;
+	while (nr_buckets < vm_compress_stats.vci_max_pool_pages * 2)
+		nr_buckets <<= 1;
+
+	size = round_page(nr_buckets * sizeof(struct list));
+	if (kmem_alloc_wired(kernel_map, &addr, size) != KERN_SUCCESS) {
+		printf("vm_compress: unable to allocate the hash table\n");
+		return;
 	}
+
+	vm_compress_entry_table = (struct list *)addr;
+	vm_compress_entry_mask = nr_buckets - 1;
+	for (i = 0; i < nr_buckets; i++)
+		list_init(&vm_compress_entry_table[i]);
+
+	vm_compress_enabled = TRUE;
 }
 
 /*
@@ -153,73 +564,91 @@ vm_compress_init(void)
 kern_return_t
 vm_page_compress(vm_object_t object, vm_offset_t offset, vm_page_t page)
 {
-	struct vm_compressed_page *comp_page;
-	unsigned int hash;
-	vm_size_t compressed_size;
-	void *page_data, *compressed_data;
-	
+	struct vm_compress_pager *pager;
+	struct vm_compress_entry *entry;
+	const void *data;
+	vm_size_t size;
+	boolean_t zero;
+
 	assert(object != VM_OBJECT_NULL);
 	assert(page != VM_PAGE_NULL);
-	
-	/* Allocate compressed page structure */
-	comp_page = (struct vm_compressed_page *)kmem_cache_alloc(&compressed_page_cache);
-	if (comp_page == NULL) {
-		return KERN_RESOURCE_SHORTAGE;
+	assert(page->busy && !page->absent && !page->fictitious);
+
+	if (!vm_compress_enabled || (object->pager == IP_NULL))
+		return KERN_FAILURE;
+
+	simple_lock(&vm_compress_scratch_lock);
+
+	if (page->phys_addr < VM_PAGE_DIRECTMAP_LIMIT) {
+		data = (const void *)phystokv(page->phys_addr);
+	} else {
+		copy_from_phys(page->phys_addr,
+			       (vm_offset_t)vm_compress_bounce, PAGE_SIZE);
+		data = vm_compress_bounce;
 	}
-	
-	/* Allocate temporary compression buffer */
-	compressed_data = (void *)kalloc(PAGE_SIZE);
-	if (compressed_data == NULL) {
-		kmem_cache_free(&compressed_page_cache, (vm_offset_t)comp_page);
-		return KERN_RESOURCE_SHORTAGE;
+
+	zero = vm_compress_is_zero(data);
+	size = zero ? 0 : vm_compress_lz4(data, PAGE_SIZE, vm_compress_buf,
+					  sizeof(vm_compress_buf));
+
+	simple_lock(&vm_compress_lock);
+
+	/* Whatever happens, a previous copy is now stale */
+	entry = vm_compress_entry_lookup(object->pager, offset);
+	if (entry != NULL)
+		vm_compress_entry_free(entry);
+
+	if ((size == 0) && !zero) {
+		vm_compress_stats.vci_incompressible++;
+		goto failure;
 	}
-	
-	/* Get page data */
-	page_data = (void *)phystokv(page->phys_addr);
-	
-	/* Compress the page */
-	compressed_size = simple_compress(page_data, PAGE_SIZE, 
-					 compressed_data, PAGE_SIZE);
-	
-	if (compressed_size == 0 || compressed_size >= PAGE_SIZE) {
-		/* Compression failed or not beneficial */
-		kfree((vm_offset_t)compressed_data, PAGE_SIZE);
-		kmem_cache_free(&compressed_page_cache, (vm_offset_t)comp_page);
-		return KERN_FAILURE;
+
+	pager = vm_compress_pager_lookup(object->pager);
+	if (pager == NULL) {
+		pager = vm_compress_alloc(sizeof(*pager));
+		if (pager == NULL)
+			goto full;
+
+		list_init(&pager->entries);
+		pager->port = object->pager;
+		list_insert_head(vm_compress_pager_bucket(pager->port),
+				 &pager->hash_node);
 	}
-	
-	/* Allocate final compressed data storage */
-	comp_page->compressed_data = (void *)kalloc(compressed_size);
-	if (comp_page->compressed_data == NULL) {
-		kfree((vm_offset_t)compressed_data, PAGE_SIZE);
-		kmem_cache_free(&compressed_page_cache, (vm_offset_t)comp_page);
-		return KERN_RESOURCE_SHORTAGE;
+
+	entry = vm_compress_alloc(offsetof(struct vm_compress_entry, data)
+				  + size);
+	if (entry == NULL) {
+		if (list_empty(&pager->entries)) {
+			list_remove(&pager->hash_node);
+			vm_compress_free(pager);
+		}
+		goto full;
 	}
-	
-	/* Copy compressed data */
-	memcpy(comp_page->compressed_data, compressed_data, compressed_size);
-	kfree((vm_offset_t)compressed_data, PAGE_SIZE);
-	
-	/* Initialize compressed page structure */
-	comp_page->object = object;
-	comp_page->offset = offset;
-	comp_page->compressed_size = compressed_size;
-	comp_page->access_time = 1;
-	
-	/* Add to hash table */
-	hash = vm_compress_hash(object, offset);
-	simple_lock(&compress_hash_locks[hash]);
-	queue_enter(&compress_hash_buckets[hash], comp_page, 
-		   struct vm_compressed_page *, hash_link);
-	simple_unlock(&compress_hash_locks[hash]);
-	
-	/* Update statistics */
-	simple_lock(&compress_stats_lock);
-	total_compressed_pages++;
-	compression_ratio_sum += (PAGE_SIZE * 100) / compressed_size;
-	simple_unlock(&compress_stats_lock);
-	
+
+	entry->pager = pager;
+	entry->offset = offset;
+	entry->size = size;
+	memcpy(entry->data, vm_compress_buf, size);
+	list_insert_head(vm_compress_entry_bucket(pager, offset),
+			 &entry->hash_node);
+	list_insert_tail(&pager->entries, &entry->pager_node);
+
+	vm_compress_stats.vci_stored++;
+	vm_compress_stats.vci_compressed++;
+	vm_compress_stats.vci_data_bytes += size;
+	if (size == 0)
+		vm_compress_stats.vci_zero++;
+
+	simple_unlock(&vm_compress_lock);
+	simple_unlock(&vm_compress_scratch_lock);
 	return KERN_SUCCESS;
+
+full:
+	vm_compress_stats.vci_pool_full++;
+failure:
+	simple_unlock(&vm_compress_lock);
+	simple_unlock(&vm_compress_scratch_lock);
+	return KERN_FAILURE;
 }
 
 /*
@@ -228,54 +657,57 @@ vm_page_compress(vm_object_t object, vm_offset_t offset, vm_page_t page)
 kern_return_t
 vm_page_decompress(vm_object_t object, vm_offset_t offset, vm_page_t page)
 {
-	struct vm_compressed_page *comp_page;
-	unsigned int hash;
-	void *page_data;
-	boolean_t found = FALSE;
-	
+	struct vm_compress_entry *entry;
+	boolean_t direct, ok;
+	void *data;
+
 	assert(object != VM_OBJECT_NULL);
 	assert(page != VM_PAGE_NULL);
-	
-	/* Look up in hash table */
-	hash = vm_compress_hash(object, offset);
-	simple_lock(&compress_hash_locks[hash]);
-	
-	queue_iterate(&compress_hash_buckets[hash], comp_page,
-		     struct vm_compressed_page *, hash_link) {
-		if (comp_page->object == object && comp_page->offset == offset) {
-			/* Remove from hash table */
-			queue_remove(&compress_hash_buckets[hash], comp_page,
-				    struct vm_compressed_page *, hash_link);
-			found = TRUE;
-			break;
-		}
+	assert(page->busy && !page->fictitious);
+
+	if (!vm_compress_enabled || (object->pager == IP_NULL))
+		return KERN_FAILURE;
+
+	direct = (page->phys_addr < VM_PAGE_DIRECTMAP_LIMIT);
+	if (direct)
+		data = (void *)phystokv(page->phys_addr);
+	else {
+		simple_lock(&vm_compress_scratch_lock);
+		data = vm_compress_bounce;
 	}
-	
-	simple_unlock(&compress_hash_locks[hash]);
-	
-	if (!found) {
+
+	simple_lock(&vm_compress_lock);
+
+	entry = vm_compress_entry_lookup(object->pager, offset);
+	if (entry == NULL) {
+		vm_compress_stats.vci_misses++;
+		simple_unlock(&vm_compress_lock);
+		if (!direct)
+			simple_unlock(&vm_compress_scratch_lock);
 		return KERN_FAILURE;
 	}
-	
-	/* Get page data */
-	page_data = (void *)phystokv(page->phys_addr);
-	
-	/* Decompress the page */
-	if (!simple_decompress(comp_page->compressed_data, comp_page->compressed_size,
-			      page_data, PAGE_SIZE)) {
-		/* Decompression failed - should not happen */
-		panic("vm_page_decompress: decompression failed");
+
+	if (entry->size == 0) {
+		memset(data, 0, PAGE_SIZE);
+		ok = TRUE;
+	} else {
+		ok = vm_compress_lz4_decode(entry->data, entry->size,
+					    data, PAGE_SIZE);
+	}
+
+	if (!ok)
+		panic("vm_page_decompress: corrupted page");
+
+	vm_compress_entry_free(entry);
+	vm_compress_stats.vci_decompressed++;
+	simple_unlock(&vm_compress_lock);
+
+	if (!direct) {
+		copy_to_phys((vm_offset_t)vm_compress_bounce,
+			     page->phys_addr, PAGE_SIZE);
+		simple_unlock(&vm_compress_scratch_lock);
 	}
-	
-	/* Free compressed data */
-	kfree((vm_offset_t)comp_page->compressed_data, comp_page->compressed_size);
-	kmem_cache_free(&compressed_page_cache, (vm_offset_t)comp_page);
-	
-	/* Update statistics */
-	simple_lock(&compress_stats_lock);
-	total_decompressed_pages++;
-	simple_unlock(&compress_stats_lock);
-	
+
 	return KERN_SUCCESS;
 }
 
@@ -285,49 +717,77 @@ vm_page_decompress(vm_object_t object, vm_offset_t offset, vm_page_t page)
 kern_return_t
 vm_page_compress_remove(vm_object_t object, vm_offset_t offset)
 {
-	struct vm_compressed_page *comp_page;
-	unsigned int hash;
-	boolean_t found = FALSE;
-	
-	/* Look up in hash table */
-	hash = vm_compress_hash(object, offset);
-	simple_lock(&compress_hash_locks[hash]);
-	
-	queue_iterate(&compress_hash_buckets[hash], comp_page,
-		     struct vm_compressed_page *, hash_link) {
-		if (comp_page->object == object && comp_page->offset == offset) {
-			/* Remove from hash table */
-			queue_remove(&compress_hash_buckets[hash], comp_page,
-				    struct vm_compressed_page *, hash_link);
-			found = TRUE;
-			break;
-		}
-	}
-	
-	simple_unlock(&compress_hash_locks[hash]);
-	
-	if (!found) {
+	struct vm_compress_entry *entry;
+
+	if (!vm_compress_enabled || (object->pager == IP_NULL))
 		return KERN_FAILURE;
+
+	simple_lock(&vm_compress_lock);
+
+	entry = vm_compress_entry_lookup(object->pager, offset);
+	if (entry != NULL)
+		vm_compress_entry_free(entry);
+
+	simple_unlock(&vm_compress_lock);
+
+	return (entry != NULL) ? KERN_SUCCESS : KERN_FAILURE;
+}
+
+/*
+ * Remove all compressed pages of a memory object
+ */
+void
+vm_compress_pager_release(ipc_port_t port)
+{
+	struct vm_compress_pager *pager;
+	struct vm_compress_entry *entry;
+	boolean_t last;
+
+	if (!vm_compress_enabled)
+		return;
+
+	simple_lock(&vm_compress_lock);
+
+	pager = vm_compress_pager_lookup(port);
+	if (pager != NULL) {
+		/* The pager goes away with its last entry */
+		do {
+			entry = list_first_entry(&pager->entries,
+						 struct vm_compress_entry,
+						 pager_node);
+			last = list_singular(&pager->entries);
+			vm_compress_entry_free(entry);
+			vm_compress_stats.vci_discarded++;
+		} while (!last);
 	}
-	
-	/* Free compressed data */
-	kfree((vm_offset_t)comp_page->compressed_data, comp_page->compressed_size);
-	kmem_cache_free(&compressed_page_cache, (vm_offset_t)comp_page);
-	
-	return KERN_SUCCESS;
+
+	simple_unlock(&vm_compress_lock);
 }
 
 /*
  * Get compression statistics
  */
 void
-vm_compress_get_stats(struct vm_compress_stats *stats)
+vm_compress_get_stats(vm_compress_info_t *info)
+{
+	simple_lock(&vm_compress_lock);
+	*info = vm_compress_stats;
+	simple_unlock(&vm_compress_lock);
+}
+
+#if MACH_DEBUG
+/*
+ *	Routine:	host_vm_compress_info [kernel call]
+ *	Purpose:
+ *		Return the state and statistics of the compressed pool.
+ */
+kern_return_t
+host_vm_compress_info(host_t host, vm_compress_info_t *info)
 {
-	simple_lock(&compress_stats_lock);
-	stats->compressed_pages = total_compressed_pages;
-	stats->decompressed_pages = total_decompressed_pages;
-	stats->average_compression_ratio = 
-		(total_compressed_pages > 0) ? 
-		(compression_ratio_sum / total_compressed_pages) : 0;
-	simple_unlock(&compress_stats_lock);
-}
\ No newline at end of file
+	if (host == HOST_NULL)
+		return KERN_INVALID_HOST;
+
+	vm_compress_get_stats(info);
+	return KERN_SUCCESS;
+}
+#endif /* MACH_DEBUG */
@@ -9,56 +9,52 @@
 
 /*
  * Memory compression interface for GNU Mach
+ *
+ * Dirty anonymous pages chosen for eviction are first compressed into
+ * a pool of wired memory, and only handed to the default pager when
+ * they don't compress well or the pool is full.  Faults look into the
+ * pool before asking the default pager.
+ *
+ * Compressed pages are named like the data of the default pager, by
+ * memory object and offset in it, so that they follow the pager when
+ * objects are collapsed.  The pool always holds the most recent copy
+ * of a page it has.
  */
 
 #ifndef _VM_COMPRESS_H_
 #define _VM_COMPRESS_H_
 
 #include <mach/boolean.h>
+#include <mach_debug/vm_info.h>
+#include <ipc/ipc_types.h>
 #include <vm/vm_types.h>
 #include <vm/vm_object.h>
 #include <vm/vm_page.h>
-#include <kern/queue.h>
-#include <kern/lock.h>
 
-/*
- * Compressed page structure
- */
-struct vm_compressed_page {
-	queue_chain_t		hash_link;	/* Hash table linkage */
-	vm_object_t		object;		/* Source object */
-	vm_offset_t		offset;		/* Offset within object */
-	void			*compressed_data;	/* Compressed page data */
-	vm_size_t		compressed_size;	/* Size of compressed data */
-	unsigned int		access_time;	/* For LRU eviction */
-};
+/* Initialize compression subsystem */
+void vm_compress_init(void);
 
 /*
- * Compression statistics
+ * Compress a page of an internal object and store it, as the data at
+ * the given offset of the object's memory object.  The object must be
+ * locked and the page busy.  On success, the page may be freed.
  */
-struct vm_compress_stats {
-	unsigned int		compressed_pages;	/* Pages compressed */
-	unsigned int		decompressed_pages;	/* Pages decompressed */
-	unsigned int		average_compression_ratio;  /* Percentage */
-};
+kern_return_t vm_page_compress(vm_object_t object, vm_offset_t offset, vm_page_t page);
 
 /*
- * Function prototypes
+ * Find, decompress into the given page and remove the data at
+ * the given offset of the object's memory object.  The object must be
+ * locked and the page busy.
  */
-
-/* Initialize compression subsystem */
-void vm_compress_init(void);
-
-/* Compress a page and store it */
-kern_return_t vm_page_compress(vm_object_t object, vm_offset_t offset, vm_page_t page);
-
-/* Find and decompress a page */
 kern_return_t vm_page_decompress(vm_object_t object, vm_offset_t offset, vm_page_t page);
 
 /* Remove a compressed page without decompressing */
 kern_return_t vm_page_compress_remove(vm_object_t object, vm_offset_t offset);
 
+/* Remove all compressed pages of a memory object that goes away */
+void vm_compress_pager_release(ipc_port_t pager);
+
 /* Get compression statistics */
-void vm_compress_get_stats(struct vm_compress_stats *stats);
+void vm_compress_get_stats(vm_compress_info_t *info);
 
-#endif /* _VM_COMPRESS_H_ */
\ No newline at end of file
+#endif /* _VM_COMPRESS_H_ */
@@ -44,6 +44,7 @@
 #include <mach_debug/vm_info.h>
 #include <mach_debug/hash_info.h>
 #include <vm/vm_map.h>
+#include <vm/vm_block_cache.h>
 #include <vm/vm_kern.h>
 #include <vm/vm_object.h>
 #include <kern/mach_debug.server.h>
@@ -460,6 +461,31 @@ _mach_vm_object_pages(
 	return KERN_SUCCESS;
 }
 
+/*
+ *	Routine:	mach_vm_object_block_cache_info [kernel call]
+ *	Purpose:
+ *		Retrieve the statistics of the block cache of a VM object.
+ *	Conditions:
+ *		Nothing locked.
+ *	Returns:
+ *		KERN_SUCCESS		Retrieved the statistics.
+ *		KERN_INVALID_ARGUMENT	The object is null.
+ */
+
+kern_return_t
+mach_vm_object_block_cache_info(
+	vm_object_t 		object,
+	vm_block_cache_info_t 	*infop)
+{
+	if (object == VM_OBJECT_NULL)
+		return KERN_INVALID_ARGUMENT;
+
+	vm_object_lock(object);
+	block_cache_get_stats(object, infop);
+	vm_object_unlock(object);
+	return KERN_SUCCESS;
+}
+
 kern_return_t
 mach_vm_object_pages(
 	vm_object_t 		object,
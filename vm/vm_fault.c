@@ -42,6 +42,8 @@
 #include <kern/thread.h>
 #include <kern/sched_prim.h>
 #include <kern/dtrace.h>
+#include <vm/vm_block_cache.h>
+#include <vm/vm_compress.h>
 #include <vm/vm_map.h>
 #include <vm/vm_object.h>
 #include <vm/vm_page.h>
@@ -94,6 +96,20 @@ boolean_t	vm_fault_interruptible = TRUE;
 
 boolean_t	software_reference_bits = TRUE;
 
+#ifdef	PMAP_LARGE_PAGE_SIZE
+boolean_t	vm_fault_large_pages = TRUE;
+unsigned long	vm_fault_large_count;	/* large pages entered */
+#endif	/* PMAP_LARGE_PAGE_SIZE */
+
+unsigned int	vm_fault_around_pages = 16;	/* 0 disables fault-around */
+unsigned long	vm_fault_around_count;		/* pages mapped by it */
+
+#ifdef	PMAP_ENTER_SPECULATIVE
+boolean_t	vm_fault_speculative_enabled = TRUE;
+unsigned long	vm_fault_speculative_count;	/* faults handled */
+unsigned long	vm_fault_speculative_aborts;	/* map changed before entry */
+#endif	/* PMAP_ENTER_SPECULATIVE */
+
 #if	MACH_KDB
 extern struct db_watchpoint *db_watchpoint_list;
 #endif	/* MACH_KDB */
@@ -615,17 +631,55 @@ vm_fault_return_t vm_fault_page(
 					vm_fault_cleanup(object, first_m);
 					return(VM_FAULT_MEMORY_SHORTAGE);
 				}
-			} else if (object->absent_count >
-						vm_object_absent_max) {
+
 				/*
-				 *	If there are too many outstanding page
-				 *	requests pending on this object, we
-				 *	wait for them to be resolved now.
+				 *	The compressed pool has the most
+				 *	recent copy of the page, if any.
+				 *	The default pager doesn't, so the
+				 *	page is dirty.  Retry to find it
+				 *	resident.
 				 */
 
-				vm_object_absent_assert_wait(object, interruptible);
-				VM_PAGE_FREE(m);
-				goto block_and_backoff;
+				if (vm_page_decompress(object,
+					m->offset + object->paging_offset, m)
+				    == KERN_SUCCESS) {
+					m->dirty = TRUE;
+					PAGE_WAKEUP_DONE(m);
+					continue;
+				}
+			} else {
+				vm_page_t	cached_m;
+
+				/*
+				 *	Clean pages of files evicted recently
+				 *	may still be in the block cache.  Put
+				 *	the page back, and retry to find it
+				 *	resident.
+				 */
+
+				cached_m = block_cache_lookup(object, offset);
+				if (cached_m != VM_PAGE_NULL) {
+					VM_PAGE_FREE(m);
+					vm_page_lock_queues();
+					vm_page_insert(cached_m, object, offset);
+					vm_page_unlock_queues();
+					continue;
+				}
+
+				if (object->absent_count >
+						vm_object_absent_max) {
+					/*
+					 *	If there are too many outstanding
+					 *	page requests pending on this
+					 *	object, we wait for them to be
+					 *	resolved now.
+					 */
+
+					vm_object_absent_assert_wait(object,
+						interruptible);
+					VM_PAGE_FREE(m);
+					goto block_and_backoff;
+				}
 			}
 
 			/*
@@ -642,6 +696,9 @@ vm_fault_return_t vm_fault_page(
 			 */
 			vm_object_unlock(object);
 
+			if (!object->internal)
+				block_cache_miss(object, offset);
+
 			/*
 			 *	Call the memory manager to retrieve the data.
 			 */
@@ -1112,6 +1169,294 @@ vm_fault_return_t vm_fault_page(
 #undef	RELEASE_PAGE
 }
 
+#ifdef	PMAP_LARGE_PAGE_SIZE
+/*
+ *	Routine:	vm_fault_large
+ *	Purpose:
+ *		Resolve a fault on fresh anonymous memory with a large
+ *		page, zero-filled, covering the aligned range around the
+ *		faulting address, if the map entry covers all of it and
+ *		none of its pages exist yet.
+ *	In/out conditions:
+ *		The object must be locked, referenced and marked as
+ *		paging, as for vm_fault_page, and still is on return.
+ *		Returns whether the mapping was entered; nothing changed
+ *		otherwise.
+ */
+static boolean_t
+vm_fault_large(
+	vm_map_t		map,
+	vm_map_version_t	*version,
+	vm_offset_t		vaddr,
+	vm_object_t		object,
+	vm_offset_t		offset,
+	vm_prot_t		prot)
+{
+	vm_offset_t		start, first_offset, end_offset;
+	vm_map_entry_t		entry;
+	vm_page_t		pages, m;
+	unsigned int		i, npages;
+	boolean_t		entered;
+
+	npages = PMAP_LARGE_PAGE_SIZE / PAGE_SIZE;
+	start = vaddr & ~(PMAP_LARGE_PAGE_SIZE - 1);
+	if (offset < vaddr - start)
+		return FALSE;
+	first_offset = offset - (vaddr - start);
+	end_offset = first_offset + PMAP_LARGE_PAGE_SIZE;
+
+	/*
+	 *	The pages must not exist anywhere else than in the
+	 *	object, and not be written through a copy strategy.
+	 *	The object size is that of the entry which created it:
+	 *	a cheap hint that the entry covers the range, which is
+	 *	checked below.
+	 */
+	if (!vm_fault_large_pages || vm_fault_dirty_handling
+	    || (map->pmap == kernel_pmap)
+	    || !object->internal || object->pager_created
+	    || (object->shadow != VM_OBJECT_NULL)
+	    || (object->copy != VM_OBJECT_NULL)
+	    || (end_offset > object->size)
+	    || current_thread()->vm_privilege)
+		return FALSE;
+
+	if (object->resident_page_count < npages) {
+		queue_iterate(&object->memq, m, vm_page_t, listq)
+			if ((m->offset >= first_offset)
+			    && (m->offset < end_offset))
+				return FALSE;
+	} else {
+		for (i = 0; i < npages; i++)
+			if (vm_page_lookup(object, first_offset
+					   + i * PAGE_SIZE) != VM_PAGE_NULL)
+				return FALSE;
+	}
+
+	pages = vm_page_grab_contig(PMAP_LARGE_PAGE_SIZE, VM_PAGE_SEL_HIGHMEM);
+	if (pages == VM_PAGE_NULL)
+		return FALSE;
+	assert((pages->phys_addr & (PMAP_LARGE_PAGE_SIZE - 1)) == 0);
+
+	/*
+	 *	The pages are busy: faults on them wait while the
+	 *	object is unlocked.
+	 */
+	vm_page_lock_queues();
+	for (i = 0; i < npages; i++)
+		vm_page_insert(&pages[i], object, first_offset + i * PAGE_SIZE);
+	vm_page_unlock_queues();
+	vm_object_unlock(object);
+
+	for (i = 0; i < npages; i++) {
+		vm_page_zero_fill(&pages[i]);
+		pmap_clear_modify(pages[i].phys_addr);
+	}
+
+	entered = FALSE;
+	if (vm_map_verify(map, version)) {
+		if (vm_map_lookup_entry(map, start, &entry)
+		    && (entry->vme_end >= start + PMAP_LARGE_PAGE_SIZE)
+		    && !entry->is_sub_map
+		    && (entry->object.vm_object == object)
+		    && (entry->offset + (start - entry->vme_start)
+			== first_offset)
+		    && !entry->needs_copy
+		    && (entry->wired_count == 0)
+		    && (entry->projected_on == 0))
+			entered = pmap_enter_large(map->pmap, start,
+						   pages->phys_addr, prot,
+						   FALSE);
+		if (!entered)
+			vm_map_verify_done(map, version);
+	}
+
+	vm_object_lock(object);
+	vm_page_lock_queues();
+	for (i = 0; i < npages; i++) {
+		m = &pages[i];
+		if (!entered)
+			vm_page_free(m);
+		else
+			vm_page_activate(m);
+	}
+	vm_page_unlock_queues();
+
+	if (!entered)
+		return FALSE;
+
+	vm_map_verify_done(map, version);
+	pages[atop(vaddr - start)].reference = TRUE;
+	for (i = 0; i < npages; i++)
+		PAGE_WAKEUP_DONE(&pages[i]);
+
+	vm_stat.zero_fill_count += npages;
+	current_task()->zero_fills += npages;
+	vm_fault_large_count++;
+	return TRUE;
+}
+#endif	/* PMAP_LARGE_PAGE_SIZE */
+
+/*
+ *	Routine:	vm_fault_around
+ *	Purpose:
+ *		After a read fault in a paged object, map read-only the
+ *		pages of the object already resident around the faulting
+ *		address, in the same map entry, so that accessing them
+ *		doesn't take faults of its own.  The window is aligned on
+ *		its size, unless the object is being read sequentially,
+ *		in which case it starts at the faulting address.
+ *	In/out conditions:
+ *		The map must be verified, and the object referenced
+ *		and marked as paging, but not locked.
+ */
+static void
+vm_fault_around(
+	vm_map_t	map,
+	vm_offset_t	vaddr,
+	vm_object_t	object,
+	vm_offset_t	offset,
+	vm_prot_t	prot)
+{
+	vm_map_entry_t	entry;
+	vm_offset_t	start, end, va, page_offset;
+	vm_page_t	m;
+
+	if (vm_fault_around_pages == 0)
+		return;
+
+	if (!vm_map_lookup_entry(map, vaddr, &entry)
+	    || entry->is_sub_map
+	    || (entry->object.vm_object != object)
+	    || (entry->offset + (vaddr - entry->vme_start) != offset)
+	    || (entry->wired_count != 0))
+		return;
+
+	if (object->readahead_count >= 2)
+		start = vaddr;
+	else
+		start = vaddr - (atop(vaddr) % vm_fault_around_pages)
+				* PAGE_SIZE;
+	end = start + ptoa(vm_fault_around_pages);
+	if (start < entry->vme_start)
+		start = entry->vme_start;
+	if ((end > entry->vme_end) || (end < start))
+		end = entry->vme_end;
+
+	prot &= ~VM_PROT_WRITE;
+
+	for (va = start; va < end; va += PAGE_SIZE) {
+		if (va == vaddr)
+			continue;
+
+		page_offset = offset + (va - vaddr);
+		if ((page_offset >= object->size)
+		    || (pmap_extract(map->pmap, va) != 0))
+			continue;
+
+		vm_object_lock(object);
+		m = vm_page_lookup(object, page_offset);
+		if ((m == VM_PAGE_NULL) || m->busy || m->absent || m->error
+		    || m->fictitious || (m->page_lock & prot)) {
+			vm_object_unlock(object);
+			continue;
+		}
+		m->busy = TRUE;
+		vm_object_unlock(object);
+
+		PMAP_ENTER(map->pmap, va, m, prot, FALSE);
+
+		vm_object_lock(object);
+		vm_page_activate_deferred(m);
+		PAGE_WAKEUP_DONE(m);
+		vm_object_unlock(object);
+
+		vm_fault_around_count++;
+	}
+}
+
+#ifdef	PMAP_ENTER_SPECULATIVE
+/*
+ *	Routine:	vm_fault_speculative
+ *	Purpose:
+ *		Handle a fault that doesn't need to change the map
+ *		without locking it.  The address is looked up with
+ *		vm_map_lookup_speculative, the page is gotten as usual,
+ *		and it is entered only if the map hasn't changed since
+ *		the lookup.  Returns whether the fault was handled;
+ *		vm_fault takes the usual path otherwise.
+ */
+static boolean_t
+vm_fault_speculative(
+	vm_map_t	map,
+	vm_offset_t	vaddr,
+	vm_prot_t	fault_type)
+{
+	vm_object_t		object;
+	vm_offset_t		offset;
+	vm_prot_t		prot;
+	vm_page_t		m, top_page;
+	vm_fault_return_t	result;
+	unsigned int		seq;
+	boolean_t		entered;
+
+	if (!vm_fault_speculative_enabled
+	    || !vm_map_lookup_speculative(map, vaddr, fault_type, &seq,
+					  &object, &offset, &prot))
+		return FALSE;
+
+#ifdef	PMAP_LARGE_PAGE_SIZE
+	/*
+	 *	Leave the faults that could get a large page to
+	 *	vm_fault_large.
+	 */
+	if (vm_fault_large_pages && object->internal
+	    && !object->pager_created
+	    && (vm_page_lookup(object, offset) == VM_PAGE_NULL)) {
+		vm_object_unlock(object);
+		return FALSE;
+	}
+#endif	/* PMAP_LARGE_PAGE_SIZE */
+
+	assert(object->ref_count > 0);
+	object->ref_count++;
+	vm_object_paging_begin(object);
+
+	result = vm_fault_page(object, offset, fault_type, FALSE, TRUE,
+			       &prot, &m, &top_page,
+			       FALSE, (void (*)()) 0);
+	if (result != VM_FAULT_SUCCESS) {
+		vm_object_deallocate(object);
+		return FALSE;
+	}
+
+	vm_object_unlock(m->object);
+	entered = pmap_enter_speculative(map->pmap, vaddr, m->phys_addr,
+					 prot & ~m->page_lock, FALSE,
+					 &map->timestamp, seq);
+	vm_object_lock(m->object);
+
+	if (entered && software_reference_bits) {
+		vm_page_activate_deferred(m);
+	} else {
+		vm_page_lock_queues();
+		if (!m->active && !m->inactive)
+			vm_page_activate(m);
+		vm_page_unlock_queues();
+	}
+
+	PAGE_WAKEUP_DONE(m);
+	vm_fault_cleanup(m->object, top_page);
+	vm_object_deallocate(object);
+
+	if (entered)
+		vm_fault_speculative_count++;
+	else
+		vm_fault_speculative_aborts++;
+	return entered;
+}
+#endif	/* PMAP_ENTER_SPECULATIVE */
+
 /*
  *	Routine:	vm_fault
  *	Purpose:
@@ -1211,6 +1556,13 @@ kern_return_t vm_fault(
 
 	}
 
+#ifdef	PMAP_ENTER_SPECULATIVE
+	if (!change_wiring && vm_fault_speculative(map, vaddr, fault_type)) {
+		kr = KERN_SUCCESS;
+		goto done;
+	}
+#endif	/* PMAP_ENTER_SPECULATIVE */
+
     RetryFault: ;
 
 	/*
@@ -1244,6 +1596,16 @@ kern_return_t vm_fault(
 	object->ref_count++;
 	vm_object_paging_begin(object);
 
+#ifdef	PMAP_LARGE_PAGE_SIZE
+	if (!change_wiring && !wired
+	    && vm_fault_large(map, &version, vaddr, object, offset, prot)) {
+		vm_fault_cleanup(object, VM_PAGE_NULL);
+		vm_object_deallocate(object);
+		kr = KERN_SUCCESS;
+		goto done;
+	}
+#endif	/* PMAP_LARGE_PAGE_SIZE */
+
 	if (continuation != vm_fault_no_continuation) {
 		vm_fault_state_t *state =
 			(vm_fault_state_t *) current_thread()->ith_other;
@@ -1447,26 +1809,34 @@ kern_return_t vm_fault(
 
 	PMAP_ENTER(map->pmap, vaddr, m, prot, wired);
 
+	/*
+	 *	Map the resident neighbours of the page as well,
+	 *	while it is still busy.
+	 */
+	if (!(fault_type & VM_PROT_WRITE) && !change_wiring && !wired
+	    && !object->internal)
+		vm_fault_around(map, vaddr, object, offset, prot);
+
 	/*
 	 *	If the page is not wired down and isn't already
 	 *	on a pageout queue, then put it where the
 	 *	pageout daemon can find it.
 	 */
 	vm_object_lock(m->object);
-	vm_page_lock_queues();
 	if (change_wiring) {
+		vm_page_lock_queues();
 		if (wired)
 			vm_page_wire(m);
 		else
 			vm_page_unwire(m);
+		vm_page_unlock_queues();
 	} else if (software_reference_bits) {
-		if (!m->active && !m->inactive)
-			vm_page_activate(m);
-		m->reference = TRUE;
+		vm_page_activate_deferred(m);
 	} else {
+		vm_page_lock_queues();
 		vm_page_activate(m);
+		vm_page_unlock_queues();
 	}
-	vm_page_unlock_queues();
 
 	/*
 	 *	Unlock everything, and return
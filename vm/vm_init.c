@@ -46,6 +46,7 @@
 #include <vm/memory_object.h>
 #include <vm/memory_object_proxy.h>
 #include <vm/vm_block_cache.h>
+#include <vm/vm_compress.h>
 
 
 /*
@@ -71,7 +72,6 @@ void vm_mem_bootstrap(void)
 
 	slab_bootstrap();
 	vm_object_bootstrap();
-	vm_block_cache_init();
 	vm_map_init();
 	kmem_init(start, end);
 	pmap_init();
@@ -86,5 +86,7 @@ void vm_mem_init(void)
 {
 	vm_object_init();
 	memory_object_proxy_init();
+	vm_compress_init();
+	vm_block_cache_init();
 	vm_page_info_all();
 }
@@ -371,6 +371,8 @@ void vm_map_setup(
 	vm_map_lock_init(map);
 	simple_lock_init(&map->ref_lock);
 	simple_lock_init(&map->hint_lock);
+	list_init(&map->ranges);
+	simple_lock_init(&map->range_lock);
 }
 
 /*
@@ -426,7 +428,7 @@ void vm_map_lock(struct vm_map *map)
 		assert(current_thread()->vm_privilege != 0);
 	}
 
-	map->timestamp++;
+	vm_map_seq_write_begin(map);
 }
 
 void vm_map_unlock(struct vm_map *map)
@@ -435,6 +437,7 @@ void vm_map_unlock(struct vm_map *map)
 		current_thread()->vm_privilege--;
 	}
 
+	vm_map_seq_write_end(map);
 	lock_write_done(&map->lock);
 }
 
@@ -1909,6 +1912,83 @@ static void vm_map_pageable_scan(
 	}
 }
 
+/*
+ *	vm_map_range_wait:	[ internal use only ]
+ *
+ *	Wait until no range lock overlaps the given range.
+ *	The map must be write locked; it is unlocked while
+ *	waiting.  Returns whether it was.
+ */
+static boolean_t vm_map_range_wait(
+	vm_map_t	map,
+	vm_offset_t	start,
+	vm_offset_t	end)
+{
+	struct vm_map_range	*range;
+	boolean_t		waited;
+
+	waited = FALSE;
+
+    again:
+	simple_lock(&map->range_lock);
+	list_for_each_entry(&map->ranges, range, node) {
+		if ((range->start < end) && (start < range->end)) {
+			range->waiters = TRUE;
+			assert_wait((event_t) range, FALSE);
+			simple_unlock(&map->range_lock);
+			vm_map_unlock(map);
+			thread_block((void (*)()) 0);
+			vm_map_lock(map);
+			waited = TRUE;
+			goto again;
+		}
+	}
+	simple_unlock(&map->range_lock);
+
+	return waited;
+}
+
+/*
+ *	vm_map_range_lock:	[ internal use only ]
+ *
+ *	Lock the given range, which no range lock may overlap.
+ *	The map must be write locked.
+ */
+static void vm_map_range_lock(
+	vm_map_t		map,
+	struct vm_map_range	*range,
+	vm_offset_t		start,
+	vm_offset_t		end)
+{
+	range->start = start;
+	range->end = end;
+	range->waiters = FALSE;
+
+	simple_lock(&map->range_lock);
+	list_insert_tail(&map->ranges, &range->node);
+	simple_unlock(&map->range_lock);
+}
+
+/*
+ *	vm_map_range_unlock:	[ internal use only ]
+ *
+ *	Release a range lock.  The map need not be locked.
+ */
+static void vm_map_range_unlock(
+	vm_map_t		map,
+	struct vm_map_range	*range)
+{
+	boolean_t		waiters;
+
+	simple_lock(&map->range_lock);
+	list_remove(&range->node);
+	waiters = range->waiters;
+	simple_unlock(&map->range_lock);
+
+	if (waiters)
+		thread_wakeup((event_t) range);
+}
+
 /*
  *	vm_map_protect:
  *
@@ -1927,10 +2007,13 @@ kern_return_t vm_map_protect(
 	vm_map_entry_t		current;
 	vm_map_entry_t		entry;
 	vm_map_entry_t		next;
+	struct vm_map_range	range;
+	boolean_t		lowered;
 
 	vm_map_lock(map);
 
 	VM_MAP_RANGE_CHECK(map, start, end);
+	vm_map_range_wait(map, start, end);
 
 	if (vm_map_lookup_entry(map, start, &entry)) {
 		vm_map_clip_start(map, entry, start);
@@ -1966,6 +2049,7 @@ kern_return_t vm_map_protect(
 	 */
 
 	current = entry;
+	lowered = FALSE;
 
 	while ((current != vm_map_to_entry(map)) &&
 	       (current->vme_start < end)) {
@@ -1993,15 +2077,8 @@ kern_return_t vm_map_protect(
 			current->wired_access = current->protection;
 		}
 
-		/*
-		 *	Update physical map if necessary.
-		 */
-
-		if (current->protection != old_prot) {
-			pmap_protect(map->pmap, current->vme_start,
-					current->vme_end,
-					current->protection);
-		}
+		if ((old_prot & ~current->protection) != VM_PROT_NONE)
+			lowered = TRUE;
 
 		next = current->vme_next;
 		vm_map_coalesce_entries(map, current);
@@ -2012,10 +2089,29 @@ kern_return_t vm_map_protect(
 	if (vm_map_coalesce_entries(map, current))
 		current = next;
 
+	/*
+	 *	The physical map is updated once the map is unlocked,
+	 *	with the range locked meanwhile.  New mappings already
+	 *	get the new protection, and pmap_protect only removes
+	 *	rights, so the whole range can be done at once.  The
+	 *	TLB updates are batched.
+	 */
+
+	if (lowered)
+		vm_map_range_lock(map, &range, start, end);
+
 	/* Returns with the map read-locked if successful */
 	vm_map_pageable_scan(map, entry, end);
 
 	vm_map_unlock(map);
+
+	if (lowered) {
+		pmap_batch_start(map->pmap);
+		pmap_protect(map->pmap, start, end, new_prot);
+		pmap_batch_finish(map->pmap);
+		vm_map_range_unlock(map, &range);
+	}
+
 	return(KERN_SUCCESS);
 }
 
@@ -2267,23 +2363,23 @@ vm_map_pageable_all(struct vm_map *map, vm_wire_t flags)
 }
 
 /*
- *	vm_map_entry_delete:	[ internal use only ]
+ *	vm_map_entry_unmap:	[ internal use only ]
  *
- *	Deallocate the given entry from the target map.
+ *	Remove the pmap entries of the given entry from
+ *	the pmap of the map, if it owns them.  Returns
+ *	whether the entry may be deleted.
+ *
+ *	The TLB update of pmap_remove may be pending in a
+ *	batch, which must be flushed before the entry is
+ *	released with vm_map_entry_release.
  */
-void vm_map_entry_delete(
+static boolean_t vm_map_entry_unmap(
 	vm_map_t	map,
 	vm_map_entry_t	entry)
 {
-	vm_offset_t		s, e;
-	vm_size_t		size;
 	vm_object_t		object;
 	extern vm_object_t	kernel_object;
 
-	s = entry->vme_start;
-	e = entry->vme_end;
-	size = e - s;
-
 	/*Check if projected buffer*/
 	if (map != kernel_map && entry->projected_on != 0) {
 	  /*Check if projected kernel entry is persistent;
@@ -2291,7 +2387,7 @@ void vm_map_entry_delete(
 	  if (entry->projected_on->projected_on == 0)
 	    entry->wired_count = 0;    /*Avoid unwire fault*/
 	  else
-	    return;
+	    return FALSE;
 	}
 
 	/*
@@ -2311,6 +2407,38 @@ void vm_map_entry_delete(
 		vm_fault_unwire(map, entry);
 	    }
 
+	    /*
+	     *	The pages of the kernel object and of shared
+	     *	objects are unmapped through the object, by
+	     *	vm_map_entry_release.
+	     */
+
+	    if ((object != kernel_object) && !entry->is_shared)
+		pmap_remove(map->pmap, entry->vme_start, entry->vme_end);
+	}
+
+	return TRUE;
+}
+
+/*
+ *	vm_map_entry_release:	[ internal use only ]
+ *
+ *	Release the pages and the object of the given
+ *	entry, which has been unmapped and unlinked from
+ *	the map, and deallocate it.
+ */
+static void vm_map_entry_release(
+	vm_map_t	map,
+	vm_map_entry_t	entry)
+{
+	vm_size_t		size;
+	vm_object_t		object;
+	extern vm_object_t	kernel_object;
+
+	size = entry->vme_end - entry->vme_start;
+
+	if ((object = entry->object.vm_object) != VM_OBJECT_NULL) {
+
 	    /*
 	     *	If the object is shared, we must remove
 	     *	*all* references to this data, since we can't
@@ -2328,7 +2456,6 @@ void vm_map_entry_delete(
 				 entry->offset,
 				 entry->offset + size);
 	    } else {
-		pmap_remove(map->pmap, s, e);
 		/*
 		 *	If this object has no pager and our
 		 *	reference to the object is the only
@@ -2357,26 +2484,47 @@ void vm_map_entry_delete(
 	else
 	 	vm_object_deallocate(entry->object.vm_object);
 
+	vm_map_entry_dispose(map, entry);
+}
+
+/*
+ *	vm_map_entry_delete:	[ internal use only ]
+ *
+ *	Deallocate the given entry from the target map.
+ */
+void vm_map_entry_delete(
+	vm_map_t	map,
+	vm_map_entry_t	entry)
+{
+	if (!vm_map_entry_unmap(map, entry))
+		return;
+
 	vm_map_entry_unlink(map, entry);
-	map->size -= size;
+	map->size -= entry->vme_end - entry->vme_start;
 
-	vm_map_entry_dispose(map, entry);
+	vm_map_entry_release(map, entry);
 }
 
 /*
- *	vm_map_delete:	[ internal use only ]
+ *	vm_map_delete_range:	[ internal use only ]
  *
  *	Deallocates the given address range from the target
- *	map.
+ *	map.  If deferred isn't null, the entries which can
+ *	be released once the map is unlocked are returned
+ *	there, linked through vme_next, for the caller to pass
+ *	to vm_map_entry_release.
  */
 
-kern_return_t vm_map_delete(
+static kern_return_t vm_map_delete_range(
 	vm_map_t		map,
 	vm_offset_t		start,
-	vm_offset_t		end)
+	vm_offset_t		end,
+	vm_map_entry_t		*deferred)
 {
 	vm_map_entry_t		entry;
 	vm_map_entry_t		first_entry;
+	vm_map_entry_t		released;
+	extern vm_object_t	kernel_object;
 
 	if (map->pmap == kernel_pmap && (start < kernel_virtual_start || end > kernel_virtual_end))
 		panic("vm_map_delete(%lx-%lx) falls in physical memory area!\n", (unsigned long) start, (unsigned long) end);
@@ -2412,9 +2560,16 @@ kern_return_t vm_map_delete(
 		map->first_free = entry->vme_prev;
 
 	/*
-	 *	Step through all entries in this region
+	 *	Step through all entries in this region.  Their
+	 *	TLB updates are batched, so that the other processors
+	 *	using the pmap are interrupted once for the whole
+	 *	region, and the entries released only after the batch
+	 *	is flushed.
 	 */
 
+	released = VM_MAP_ENTRY_NULL;
+	pmap_batch_start(map->pmap);
+
 	while ((entry != vm_map_to_entry(map)) && (entry->vme_start < end)) {
 		vm_map_entry_t		next;
 
@@ -2430,6 +2585,7 @@ kern_return_t vm_map_delete(
                          * Say that we are waiting, and wait for entry.
                          */
                         entry->needs_wakeup = TRUE;
+                        pmap_batch_flush(map->pmap);
                         vm_map_entry_wait(map, FALSE);
                         vm_map_lock(map);
 
@@ -2445,10 +2601,37 @@ kern_return_t vm_map_delete(
 
 		next = entry->vme_next;
 
-		vm_map_entry_delete(map, entry);
+		if (vm_map_entry_unmap(map, entry)) {
+			vm_map_entry_unlink(map, entry);
+			map->size -= entry->vme_end - entry->vme_start;
+			entry->vme_next = released;
+			released = entry;
+		}
 		entry = next;
 	}
 
+	pmap_batch_finish(map->pmap);
+
+	/*
+	 *	The pages of the kernel object and of shared objects
+	 *	are only unmapped when releasing their entries, which
+	 *	must then be done before the range can be reused.
+	 */
+
+	while (released != VM_MAP_ENTRY_NULL) {
+		vm_map_entry_t		next;
+
+		next = released->vme_next;
+		if ((deferred != NULL) && !released->is_sub_map &&
+		    (released->object.vm_object != kernel_object) &&
+		    !released->is_shared) {
+			released->vme_next = *deferred;
+			*deferred = released;
+		} else
+			vm_map_entry_release(map, released);
+		released = next;
+	}
+
 	/*
 	 *	After deletion, try to coalesce adjacent entries
 	 *	to reduce fragmentation. Start from the entry before
@@ -2467,11 +2650,31 @@ kern_return_t vm_map_delete(
 	return(KERN_SUCCESS);
 }
 
+/*
+ *	vm_map_delete:	[ internal use only ]
+ *
+ *	Deallocates the given address range from the target
+ *	map.  Range locks aren't waited for, as callers may
+ *	rely on the map staying locked; a protection change
+ *	still under way on the range can then only remove
+ *	rights from new mappings, which faults restore.
+ */
+
+kern_return_t vm_map_delete(
+	vm_map_t		map,
+	vm_offset_t		start,
+	vm_offset_t		end)
+{
+	return vm_map_delete_range(map, start, end, NULL);
+}
+
 /*
  *	vm_map_remove:
  *
  *	Remove the given address range from the target map.
- *	This is the exported form of vm_map_delete.
+ *	This is the exported form of vm_map_delete.  Releasing
+ *	the objects of the entries, which may free their pages,
+ *	is done after unlocking the map.
  */
 kern_return_t vm_map_remove(
 	vm_map_t	map,
@@ -2479,12 +2682,29 @@ kern_return_t vm_map_remove(
 	vm_offset_t	end)
 {
 	kern_return_t	result;
+	vm_map_entry_t	deferred, next;
+
+	deferred = VM_MAP_ENTRY_NULL;
 
 	vm_map_lock(map);
 	VM_MAP_RANGE_CHECK(map, start, end);
-	result = vm_map_delete(map, start, end);
+
+	/*
+	 *	Let the operations still working on the range finish
+	 *	before looking at its entries, so that the map isn't
+	 *	unlocked once the deletion has started.
+	 */
+	vm_map_range_wait(map, start, end);
+
+	result = vm_map_delete_range(map, start, end, &deferred);
 	vm_map_unlock(map);
 
+	while (deferred != VM_MAP_ENTRY_NULL) {
+		next = deferred->vme_next;
+		vm_map_entry_release(map, deferred);
+		deferred = next;
+	}
+
 	return(result);
 }
 
@@ -3099,7 +3319,7 @@ start_pass_1:
 
 			start += copy_size;
 			vm_map_lock(dst_map);
-			if ((version.main_timestamp + 1) == dst_map->timestamp) {
+			if ((version.main_timestamp + 2) == dst_map->timestamp) {
 				/* We can safely use saved tmp_entry value */
 
 				vm_map_clip_end(dst_map, tmp_entry, start);
@@ -4044,9 +4264,10 @@ kern_return_t vm_map_copyin(
 		 *	changed while the copy was being made.
 		 */
 
-		vm_map_lock(src_map);	/* Increments timestamp once! */
+		vm_map_lock(src_map);	/* Increments timestamp twice
+					   with the unlock! */
 
-		if ((version.main_timestamp + 1) == src_map->timestamp)
+		if ((version.main_timestamp + 2) == src_map->timestamp)
 			goto CopySuccessful;
 
 		/*
@@ -5168,7 +5389,6 @@ kern_return_t vm_map_lookup(
 			if (vm_map_lock_read_to_write(map)) {
 				goto RetryLookup;
 			}
-			map->timestamp++;
 
 			vm_object_shadow(
 			    &entry->object.vm_object,
@@ -5253,6 +5473,79 @@ boolean_t	vm_map_verify(
 	return(result);
 }
 
+/*
+ *	vm_map_lookup_speculative:
+ *
+ *	Like vm_map_lookup, for a fault which doesn't need to
+ *	change the map, but without locking it: the hint must
+ *	be the entry of the address, and the timestamp tells
+ *	whether it was valid.  Returns FALSE if the lookup
+ *	can't be made this way, in which case vm_map_lookup
+ *	must be used instead.  On success, the object is
+ *	returned locked, and *seq is the timestamp to pass to
+ *	pmap_enter_speculative.
+ */
+boolean_t	vm_map_lookup_speculative(
+	vm_map_t		map,
+	vm_offset_t		vaddr,
+	vm_prot_t		fault_type,
+	unsigned int		*seq,		/* OUT */
+	vm_object_t		*object,	/* OUT */
+	vm_offset_t		*offset,	/* OUT */
+	vm_prot_t		*out_prot)	/* OUT */
+{
+	vm_map_entry_t		entry;
+	vm_object_t		entry_object;
+	vm_prot_t		prot;
+	boolean_t		locked;
+
+	if (!vm_map_seq_begin(map, seq))
+		return FALSE;
+
+	entry = __atomic_load_n(&map->hint, __ATOMIC_RELAXED);
+	if ((entry == vm_map_to_entry(map)) ||
+	    (vaddr < entry->vme_start) || (vaddr >= entry->vme_end) ||
+	    entry->is_sub_map || (entry->wired_count != 0))
+		return FALSE;
+
+	prot = entry->protection;
+	if ((fault_type & prot) != fault_type)
+		return FALSE;
+
+	if (entry->needs_copy) {
+		if (fault_type & VM_PROT_WRITE)
+			return FALSE;
+		prot &= ~VM_PROT_WRITE;
+	}
+
+	entry_object = entry->object.vm_object;
+	if (entry_object == VM_OBJECT_NULL)
+		return FALSE;
+
+	*offset = (vaddr - entry->vme_start) + entry->offset;
+	*out_prot = prot;
+
+	/*
+	 *	The entry holds a reference to the object as long as
+	 *	the map doesn't change.  Holding the interlock of the
+	 *	map lock keeps writers out until the object is locked;
+	 *	one may have the lock without having bumped the
+	 *	timestamp yet, though.
+	 */
+
+	simple_lock(&map->lock.interlock);
+	locked = !map->lock.want_write && !map->lock.want_upgrade &&
+		 vm_map_seq_valid(map, *seq) &&
+		 vm_object_lock_try(entry_object);
+	simple_unlock(&map->lock.interlock);
+
+	if (!locked)
+		return FALSE;
+
+	*object = entry_object;
+	return TRUE;
+}
+
 /*
  *	vm_map_verify_done:
  *
@@ -173,6 +173,25 @@ struct vm_map_header {
 	int			nentries;	/* Number of entries */
 };
 
+/*
+ *	Type:		struct vm_map_range
+ *
+ *	Description:
+ *		A range of a map locked by an operation for the work
+ *		it does after unlocking the map.  Range locks are taken
+ *		with the map write locked, and released without it.
+ *		Operations that change the mappings of a range wait
+ *		for the range locks overlapping it to be released,
+ *		so that operations on disjoint ranges only serialize
+ *		on the map lock for their updates of the entries.
+ */
+struct vm_map_range {
+	struct list		node;		/* link in the map */
+	vm_offset_t		start;
+	vm_offset_t		end;
+	boolean_t		waiters;	/* someone waits for it */
+};
+
 /*
  *	Type:		vm_map_t [exported; contents invisible]
  *
@@ -203,6 +222,8 @@ struct vm_map {
 	vm_map_entry_t		hint;		/* hint for quick lookups */
 	decl_simple_lock_data(,	hint_lock)	/* lock for hint storage */
 	vm_map_entry_t		first_free;	/* First free space hint */
+	struct list		ranges;		/* locked ranges */
+	decl_simple_lock_data(,	range_lock)	/* lock for ranges */
 
 	/* Flags */
 	unsigned int	wait_for_space:1,	/* Should callers wait
@@ -211,7 +232,8 @@ struct vm_map {
 	/* boolean_t */ aslr_enabled:1,	/* Address space layout randomization enabled */
 	/* boolean_t */ prefer_high_addr:1;	/* Prefer high addresses for performance */
 
-	unsigned int		timestamp;	/* Version number */
+	unsigned int		timestamp;	/* Version number, odd
+						   while write locked */
 	unsigned int		aslr_entropy_bits;	/* Number of bits for ASLR entropy (default 8) */
 
 	const char		*name;		/* Associated name */
@@ -365,6 +387,41 @@ typedef	struct vm_map_copyin_args_data {
 
 #define	VM_MAP_COPYIN_ARGS_NULL	((vm_map_copyin_args_t) 0)
 
+/*
+ *	Macros:		vm_map_seq_*
+ *	Description:
+ *		The timestamp of a map is bumped when it gets write
+ *		locked, and again when it stops being, so that it can
+ *		serve as a sequence count: a lookup made without locking
+ *		is valid if the timestamp was even at the start and
+ *		hasn't changed at the end.  Map entries are allocated
+ *		from physical memory, so reading a stale one is harmless.
+ */
+
+#define vm_map_seq_write_begin(map)			\
+MACRO_BEGIN						\
+	(map)->timestamp++;				\
+	__atomic_thread_fence(__ATOMIC_RELEASE);	\
+MACRO_END
+
+#define vm_map_seq_write_end(map)			\
+	__atomic_store_n(&(map)->timestamp, (map)->timestamp + 1, \
+			 __ATOMIC_RELEASE)
+
+static inline boolean_t
+vm_map_seq_begin(const struct vm_map *map, unsigned int *seq)
+{
+	*seq = __atomic_load_n(&map->timestamp, __ATOMIC_ACQUIRE);
+	return (*seq & 1) == 0;
+}
+
+static inline boolean_t
+vm_map_seq_valid(const struct vm_map *map, unsigned int seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&map->timestamp, __ATOMIC_RELAXED) == seq;
+}
+
 /*
  *	Macros:		vm_map_lock, etc. [internal use only]
  *	Description:
@@ -382,10 +439,13 @@ void vm_map_unlock(struct vm_map *map);
 
 #define vm_map_lock_read(map)	lock_read(&(map)->lock)
 #define vm_map_unlock_read(map)	lock_read_done(&(map)->lock)
-#define vm_map_lock_write_to_read(map) \
-		lock_write_to_read(&(map)->lock)
+#define vm_map_lock_write_to_read(map)			\
+MACRO_BEGIN						\
+	vm_map_seq_write_end(map);			\
+	lock_write_to_read(&(map)->lock);		\
+MACRO_END
 #define vm_map_lock_read_to_write(map) \
-		(lock_read_to_write(&(map)->lock) || (((map)->timestamp++), 0))
+		(lock_read_to_write(&(map)->lock) || (vm_map_seq_write_begin(map), 0))
 #define vm_map_lock_set_recursive(map) \
 		lock_set_recursive(&(map)->lock)
 #define vm_map_lock_clear_recursive(map) \
@@ -432,6 +492,11 @@ extern kern_return_t	vm_map_inherit(vm_map_t, vm_offset_t, vm_offset_t,
 extern kern_return_t	vm_map_lookup(vm_map_t *, vm_offset_t, vm_prot_t, boolean_t,
 				      vm_map_version_t *, vm_object_t *,
 				      vm_offset_t *, vm_prot_t *, boolean_t *);
+/* Look up an address without locking the map, for simple faults */
+extern boolean_t	vm_map_lookup_speculative(vm_map_t, vm_offset_t,
+						  vm_prot_t, unsigned int *,
+						  vm_object_t *, vm_offset_t *,
+						  vm_prot_t *);
 /* Find a map entry */
 extern boolean_t	vm_map_lookup_entry(vm_map_t, vm_offset_t,
 					    vm_map_entry_t *);
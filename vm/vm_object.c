@@ -51,6 +51,8 @@
 #include <kern/xpr.h>
 #include <kern/slab.h>
 #include <vm/memory_object.h>
+#include <vm/vm_block_cache.h>
+#include <vm/vm_compress.h>
 #include <vm/vm_fault.h>
 #include <vm/vm_map.h>
 #include <vm/vm_object.h>
@@ -315,6 +317,7 @@ void vm_object_bootstrap(void)
 	/* Initialize block cache fields */
 	vm_object_template.block_cache = NULL;
 	vm_object_template.block_cache_enabled = FALSE;
+	vm_object_template.block_cache_page_count = 0;
 
 #if	MACH_PAGEMAP
 	vm_object_template.existence_info = VM_EXTERNAL_NULL;
@@ -471,7 +474,9 @@ void vm_object_deallocate(
 		 *	See whether this object can persist.  If so, enter
 		 *	it in the cache.
 		 */
-		if (object->can_persist && (object->resident_page_count > 0)) {
+		if (object->can_persist &&
+		    ((object->resident_page_count > 0) ||
+		     (object->block_cache_page_count > 0))) {
 			vm_object_cache_add(object);
 			vm_object_cache_unlock();
 			vm_object_unlock(object);
@@ -625,6 +630,12 @@ void vm_object_terminate(
 		}
 	}
 
+	if (object->block_cache != NULL) {
+		block_cache_destroy(object->block_cache);
+		object->block_cache = NULL;
+		object->block_cache_enabled = FALSE;
+	}
+
 	assert(object->ref_count == 0);
 	assert(object->paging_in_progress == 0);
 	assert(!object->cached);
@@ -716,6 +727,11 @@ void memory_object_release(
 	 */
 	ip_reference(pager);
 
+	/*
+	 *	Its compressed pages won't be asked for again.
+	 */
+	vm_compress_pager_release(pager);
+
 	/*
 	 *	Terminate the pager.
 	 */
@@ -1941,6 +1957,7 @@ void vm_object_destroy(
 	 *	because the memory_object itself is dead.
 	 */
 
+	vm_compress_pager_release(pager);
 	ipc_port_release_send(pager);
 	if (old_request != IP_NULL)
 		ipc_port_dealloc_kernel(old_request);
@@ -3068,7 +3085,6 @@ void vm_object_print(
 /*
  * Block cache integration with VM objects
  */
-#include <vm/vm_block_cache.h>
 
 /*
  * Enable block-level caching for a memory object
@@ -3086,21 +3102,20 @@ vm_object_enable_block_cache(vm_object_t object, vm_size_t block_size)
 	    (block_size & (block_size - 1)) != 0)
 		return KERN_INVALID_ARGUMENT;
 	
+	/* Create block cache, which may block */
+	cache = block_cache_create(object, block_size);
+	if (cache == NULL)
+		return KERN_RESOURCE_SHORTAGE;
+	
 	vm_object_lock(object);
 	
 	/* Check if block cache is already enabled */
 	if (object->block_cache_enabled) {
+		block_cache_destroy(cache);
 		vm_object_unlock(object);
 		return KERN_SUCCESS;
 	}
 	
-	/* Create block cache */
-	cache = block_cache_create(object, block_size);
-	if (cache == NULL) {
-		vm_object_unlock(object);
-		return KERN_RESOURCE_SHORTAGE;
-	}
-	
 	object->block_cache = cache;
 	object->block_cache_enabled = TRUE;
 	
@@ -3109,13 +3124,12 @@ vm_object_enable_block_cache(vm_object_t object, vm_size_t block_size)
 }
 
 /*
- * Disable block-level caching for a memory object
+ * Disable block-level caching for a memory object, releasing
+ * the pages it holds.
  */
 void
 vm_object_disable_block_cache(vm_object_t object)
 {
-	block_cache_t cache;
-	
 	if (object == VM_OBJECT_NULL)
 		return;
 		
@@ -3126,15 +3140,11 @@ vm_object_disable_block_cache(vm_object_t object)
 		return;
 	}
 	
-	cache = object->block_cache;
+	block_cache_destroy(object->block_cache);
 	object->block_cache = NULL;
 	object->block_cache_enabled = FALSE;
 	
 	vm_object_unlock(object);
-	
-	/* Destroy the block cache */
-	if (cache != NULL)
-		block_cache_destroy(cache);
 }
 
 /*
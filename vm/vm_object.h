@@ -174,6 +174,10 @@ struct vm_object {
 	/* Block-level cache integration */
 	block_cache_t		block_cache;	/* Associated block cache (if any) */
 	boolean_t		block_cache_enabled;/* Block caching enabled flag */
+	unsigned int		block_cache_page_count;
+						/* Pages removed from the object
+						 * but kept in its block cache
+						 */
 #if	MACH_PAGEMAP
 	vm_external_t		existence_info;
 #endif	/* MACH_PAGEMAP */
@@ -323,7 +327,8 @@ kern_return_t vm_object_get_memory_stats(vm_object_t object,
 
 #define vm_object_collectable(object)					\
 	(((object)->ref_count == 0)					\
-	&& ((object)->resident_page_count == 0))
+	&& ((object)->resident_page_count == 0)				\
+	&& ((object)->block_cache_page_count == 0))
 
 #define	vm_object_paging_begin(object) 					\
 	((object)->paging_in_progress++)
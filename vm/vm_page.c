@@ -46,14 +46,19 @@
 #include <ipc/ipc_port.h>
 #include <sys/types.h>
 #include <vm/memory_object.h>
+#include <vm/vm_block_cache.h>
 #include <vm/vm_page.h>
 #include <vm/vm_pageout.h>
 
-#define DEBUG 0
+#if MACH_DEBUG
+#include <kern/host.h>
+#include <kern/mach_debug.server.h>
+#include <kern/smp.h>
+#include <vm/vm_kern.h>
+#include <vm/vm_map.h>
+#endif /* MACH_DEBUG */
 
-#ifndef INT_MAX
-#define INT_MAX 2147483647
-#endif
+#define DEBUG 0
 
 #define __init
 #define __initdata
@@ -95,6 +100,51 @@ struct vm_page_cpu_pool {
     struct list pages;
 } __aligned(CPU_L1_SIZE);
 
+/*
+ * Number of pages a page vector holds before it is flushed.
+ */
+#define VM_PAGE_PAGEVEC_SIZE 15
+
+/*
+ * Per-processor vector of pages whose move to a page queue is deferred,
+ * so that moves are applied in batches under a single acquisition of
+ * the page queues lock.
+ */
+struct vm_page_pagevec {
+    simple_lock_data_t lock;
+    unsigned int nr_pages;
+    struct vm_page *pages[VM_PAGE_PAGEVEC_SIZE];
+    boolean_t deactivate[VM_PAGE_PAGEVEC_SIZE];
+} __aligned(CPU_L1_SIZE);
+
+/*
+ * Maximum number of physical address ranges describing the NUMA nodes.
+ */
+#define VM_PAGE_NUMA_MAX_RANGES 32
+
+/*
+ * The node of a page is stored in a 3-bit field.
+ */
+#if VM_PAGE_MAX_NODES > 8
+#error VM_PAGE_MAX_NODES invalid
+#endif /* VM_PAGE_MAX_NODES > 8 */
+
+/*
+ * Default relative distances between NUMA nodes, on the scale of the
+ * ACPI System Locality Information Table.
+ */
+#define VM_PAGE_NUMA_LOCAL_DISTANCE     10
+#define VM_PAGE_NUMA_REMOTE_DISTANCE    20
+
+/*
+ * Physical address range of a NUMA node.
+ */
+struct vm_page_numa_range {
+    phys_addr_t start;
+    phys_addr_t end;
+    unsigned int node;
+};
+
 /*
  * Special order value for pages that aren't in a free list. Such pages are
  * either allocated, or part of a free block of pages but not the head page.
@@ -176,12 +226,31 @@ struct vm_page_free_list {
 #define VM_PAGE_HIGH_ACTIVE_PAGE_DENOM  3
 
 /*
- * Adaptive cache sizing parameters
+ * Active pages are sorted in generations. Generations are numbered by
+ * ever increasing sequence numbers, from min_seq, the oldest, to max_seq,
+ * the youngest, and there are at most VM_PAGE_NR_GENS of them at once.
+ *
+ * Each time the inactive queue is refilled, a new generation is created
+ * if there is room for it, and the pages of the oldest generations are
+ * aged : those referenced since they were last aged move up one more
+ * generation than the last time, up to VM_PAGE_MAX_REFS, and the others
+ * are deactivated. Once the oldest generation is empty, the next one
+ * becomes the oldest.
+ *
+ * Newly activated pages start in the oldest generation, so that pages
+ * touched once, e.g. by a sequential scan, are deactivated before those
+ * repeatedly referenced, however many of them the scan brings in.
  */
-#define VM_PAGE_CACHE_ADAPT_INTERVAL    100    /* Adaptation interval in page operations */
-#define VM_PAGE_CACHE_MIN_SCALE         50     /* Minimum cache scale percentage */
-#define VM_PAGE_CACHE_MAX_SCALE         200    /* Maximum cache scale percentage */
-#define VM_PAGE_CACHE_PRESSURE_THRESHOLD 90    /* Memory pressure threshold percentage */
+#define VM_PAGE_NR_GENS     4
+#define VM_PAGE_MAX_REFS    3
+
+#if VM_PAGE_NR_GENS > 4
+#error VM_PAGE_NR_GENS invalid
+#endif /* VM_PAGE_NR_GENS > 4 */
+
+#if VM_PAGE_MAX_REFS >= VM_PAGE_NR_GENS
+#error VM_PAGE_MAX_REFS invalid
+#endif /* VM_PAGE_MAX_REFS >= VM_PAGE_NR_GENS */
 
 /*
  * Page cache queue.
@@ -217,7 +286,8 @@ struct vm_page_seg {
     struct vm_page *pages;
     struct vm_page *pages_end;
     simple_lock_data_t lock;
-    struct vm_page_free_list free_lists[VM_PAGE_NR_FREE_LISTS];
+    struct vm_page_free_list free_lists[VM_PAGE_MAX_NODES]
+                                       [VM_PAGE_NR_FREE_LISTS];
     unsigned long nr_free_pages;
 
     /* Free memory thresholds */
@@ -227,18 +297,25 @@ struct vm_page_seg {
                                       unprivileged allocations resume */
 
     /* Page cache related data */
-    struct vm_page_queue active_pages;
+    struct vm_page_queue active_gens[VM_PAGE_NR_GENS];
+    unsigned long nr_gen_pages[VM_PAGE_NR_GENS];
+    unsigned long min_seq;
+    unsigned long max_seq;
     unsigned long nr_active_pages;
     unsigned long high_active_pages;
     struct vm_page_queue inactive_pages;
     unsigned long nr_inactive_pages;
-    
-    /* Adaptive cache sizing data */
-    unsigned long cache_scale_percent;     /* Current cache scaling factor (50-200%) */
-    unsigned long adapt_counter;           /* Operations counter for adaptation interval */
-    unsigned long cache_hits;              /* Cache hit counter for adaptation */
-    unsigned long cache_misses;            /* Cache miss counter for adaptation */
-    unsigned long base_high_active_pages;  /* Base threshold before scaling */
+
+    /* Aging statistics */
+    unsigned long nr_promoted;
+    unsigned long nr_deactivated;
+
+    /* NUMA statistics, per node */
+    unsigned long nr_node_pages[VM_PAGE_MAX_NODES];
+    unsigned long nr_node_free_pages[VM_PAGE_MAX_NODES];
+    unsigned long node_hits[VM_PAGE_MAX_NODES];     /* Allocated locally */
+    unsigned long node_misses[VM_PAGE_MAX_NODES];   /* Fell back elsewhere */
+    unsigned long node_foreign[VM_PAGE_MAX_NODES];  /* Taken by another node */
 };
 
 /*
@@ -294,6 +371,45 @@ static unsigned int vm_page_segs_size __read_mostly;
  */
 static boolean_t vm_page_alloc_paused;
 
+/*
+ * Page vectors, and statistics about their flushes : how many times
+ * the page queues lock was taken to flush a vector, how many pages
+ * were flushed in total, and the largest batch.
+ *
+ * The page queues lock must be held when updating the statistics.
+ */
+static struct vm_page_pagevec vm_page_pagevecs[NCPUS];
+unsigned long vm_page_pagevec_flushes;
+unsigned long vm_page_pagevec_pages;
+unsigned int vm_page_pagevec_max_batch;
+
+/*
+ * NUMA topology.
+ *
+ * Free blocks are sorted by node in each segment. Allocations are made
+ * on the node of the processor they're made from, and fall back to the
+ * other nodes by increasing distance, in the order given by the node
+ * table of the local node. As pages are allocated on first access by
+ * the faulting thread, memory is placed on the node it's first used.
+ *
+ * The topology is described once at boot, before other processors are
+ * started, and never changes afterwards, which is why it isn't locked.
+ */
+static struct vm_page_numa_range vm_page_numa_ranges[VM_PAGE_NUMA_MAX_RANGES];
+static unsigned int vm_page_numa_nr_ranges;
+static unsigned int vm_page_nr_nodes __read_mostly = 1;
+static unsigned char vm_page_cpu_nodes[NCPUS] __read_mostly;
+static unsigned int vm_page_node_distances[VM_PAGE_MAX_NODES]
+                                          [VM_PAGE_MAX_NODES];
+static unsigned char vm_page_node_orders[VM_PAGE_MAX_NODES]
+                                        [VM_PAGE_MAX_NODES] __read_mostly;
+
+/*
+ * Topology being described, applied by vm_page_numa_setup.
+ */
+static unsigned int vm_page_boot_nr_nodes __initdata;
+static unsigned char vm_page_boot_cpu_nodes[NCPUS] __initdata;
+
 static void __init
 vm_page_init_pa(struct vm_page *page, unsigned short seg_index, phys_addr_t pa)
 {
@@ -378,14 +494,22 @@ vm_page_free_list_remove(struct vm_page_free_list *free_list,
     list_remove(&page->node);
 }
 
+static inline unsigned int
+vm_page_local_node(void)
+{
+    return vm_page_cpu_nodes[cpu_number()];
+}
+
 static struct vm_page *
-vm_page_seg_alloc_from_buddy(struct vm_page_seg *seg, unsigned int order)
+vm_page_seg_alloc_from_buddy(struct vm_page_seg *seg, unsigned int order,
+                             unsigned int node)
 {
     struct vm_page_free_list *free_list = free_list;
     struct vm_page *page, *buddy;
-    unsigned int i;
+    unsigned int i, j, free_node;
 
     assert(order < VM_PAGE_NR_FREE_LISTS);
+    assert(node < vm_page_nr_nodes);
 
     if (vm_page_alloc_paused && current_thread()
         && !current_thread()->vm_privilege) {
@@ -400,28 +524,40 @@ vm_page_seg_alloc_from_buddy(struct vm_page_seg *seg, unsigned int order)
         }
     }
 
-    for (i = order; i < VM_PAGE_NR_FREE_LISTS; i++) {
-        free_list = &seg->free_lists[i];
+    for (i = 0; i < vm_page_nr_nodes; i++) {
+        free_node = vm_page_node_orders[node][i];
 
-        if (free_list->size != 0)
-            break;
+        for (j = order; j < VM_PAGE_NR_FREE_LISTS; j++) {
+            free_list = &seg->free_lists[free_node][j];
+
+            if (free_list->size != 0)
+                goto found;
+        }
     }
 
-    if (i == VM_PAGE_NR_FREE_LISTS)
-        return NULL;
+    return NULL;
 
+found:
     page = list_first_entry(&free_list->blocks, struct vm_page, node);
     vm_page_free_list_remove(free_list, page);
     page->order = VM_PAGE_ORDER_UNLISTED;
 
-    while (i > order) {
-        i--;
-        buddy = &page[1 << i];
-        vm_page_free_list_insert(&seg->free_lists[i], buddy);
-        buddy->order = i;
+    while (j > order) {
+        j--;
+        buddy = &page[1 << j];
+        vm_page_free_list_insert(&seg->free_lists[free_node][j], buddy);
+        buddy->order = j;
     }
 
     seg->nr_free_pages -= (1 << order);
+    seg->nr_node_free_pages[free_node] -= (1 << order);
+
+    if (free_node == node) {
+        seg->node_hits[node]++;
+    } else {
+        seg->node_misses[node]++;
+        seg->node_foreign[free_node]++;
+    }
 
     if (seg->nr_free_pages < seg->min_free_pages) {
         vm_page_alloc_paused = TRUE;
@@ -436,7 +572,7 @@ vm_page_seg_free_to_buddy(struct vm_page_seg *seg, struct vm_page *page,
 {
     struct vm_page *buddy;
     phys_addr_t pa, buddy_pa;
-    unsigned int nr_pages;
+    unsigned int nr_pages, node;
 
     assert(page >= seg->pages);
     assert(page < seg->pages_end);
@@ -445,6 +581,7 @@ vm_page_seg_free_to_buddy(struct vm_page_seg *seg, struct vm_page *page,
 
     nr_pages = (1 << order);
     pa = page->phys_addr;
+    node = page->numa_node;
 
     while (order < (VM_PAGE_NR_FREE_LISTS - 1)) {
         buddy_pa = pa ^ vm_page_ptoa(1ULL << order);
@@ -454,19 +591,21 @@ vm_page_seg_free_to_buddy(struct vm_page_seg *seg, struct vm_page *page,
 
         buddy = &seg->pages[vm_page_atop(buddy_pa - seg->start)];
 
-        if (buddy->order != order)
+        /* Blocks never span nodes */
+        if ((buddy->order != order) || (buddy->numa_node != node))
             break;
 
-        vm_page_free_list_remove(&seg->free_lists[order], buddy);
+        vm_page_free_list_remove(&seg->free_lists[node][order], buddy);
         buddy->order = VM_PAGE_ORDER_UNLISTED;
         order++;
         pa &= -vm_page_ptoa(1ULL << order);
         page = &seg->pages[vm_page_atop(pa - seg->start)];
     }
 
-    vm_page_free_list_insert(&seg->free_lists[order], page);
+    vm_page_free_list_insert(&seg->free_lists[node][order], page);
     page->order = order;
     seg->nr_free_pages += nr_pages;
+    seg->nr_node_free_pages[node] += nr_pages;
 }
 
 static void __init
@@ -508,7 +647,7 @@ vm_page_cpu_pool_push(struct vm_page_cpu_pool *cpu_pool, struct vm_page *page)
 
 static int
 vm_page_cpu_pool_fill(struct vm_page_cpu_pool *cpu_pool,
-                      struct vm_page_seg *seg)
+                      struct vm_page_seg *seg, unsigned int node)
 {
     struct vm_page *page;
     int i;
@@ -518,7 +657,7 @@ vm_page_cpu_pool_fill(struct vm_page_cpu_pool *cpu_pool,
     simple_lock(&seg->lock);
 
     for (i = 0; i < cpu_pool->transfer_size; i++) {
-        page = vm_page_seg_alloc_from_buddy(seg, 0);
+        page = vm_page_seg_alloc_from_buddy(seg, 0, node);
 
         if (page == NULL)
             break;
@@ -651,7 +790,7 @@ vm_page_seg_init(struct vm_page_seg *seg, phys_addr_t start, phys_addr_t end,
 {
     phys_addr_t pa;
     int pool_size;
-    unsigned int i;
+    unsigned int i, j;
 
     seg->start = start;
     seg->end = end;
@@ -665,23 +804,35 @@ vm_page_seg_init(struct vm_page_seg *seg, phys_addr_t start, phys_addr_t end,
     simple_lock_init(&seg->lock);
 
     for (i = 0; i < ARRAY_SIZE(seg->free_lists); i++)
-        vm_page_free_list_init(&seg->free_lists[i]);
+        for (j = 0; j < ARRAY_SIZE(seg->free_lists[i]); j++)
+            vm_page_free_list_init(&seg->free_lists[i][j]);
 
     seg->nr_free_pages = 0;
 
     vm_page_seg_compute_pageout_thresholds(seg);
 
-    vm_page_queue_init(&seg->active_pages);
+    for (i = 0; i < ARRAY_SIZE(seg->active_gens); i++) {
+        vm_page_queue_init(&seg->active_gens[i]);
+        seg->nr_gen_pages[i] = 0;
+    }
+
+    seg->min_seq = 0;
+    seg->max_seq = 0;
     seg->nr_active_pages = 0;
     vm_page_queue_init(&seg->inactive_pages);
     seg->nr_inactive_pages = 0;
-    
-    /* Initialize adaptive cache sizing */
-    seg->cache_scale_percent = 100;    /* Start with 100% base scaling */
-    seg->adapt_counter = 0;
-    seg->cache_hits = 0;
-    seg->cache_misses = 0;
-    seg->base_high_active_pages = 0;
+    seg->nr_promoted = 0;
+    seg->nr_deactivated = 0;
+
+    for (i = 0; i < ARRAY_SIZE(seg->nr_node_pages); i++) {
+        seg->nr_node_pages[i] = 0;
+        seg->nr_node_free_pages[i] = 0;
+        seg->node_hits[i] = 0;
+        seg->node_misses[i] = 0;
+        seg->node_foreign[i] = 0;
+    }
+
+    seg->nr_node_pages[0] = vm_page_atop(vm_page_seg_size(seg));
 
     i = vm_page_seg_index(seg);
 
@@ -695,6 +846,7 @@ vm_page_seg_alloc(struct vm_page_seg *seg, unsigned int order,
 {
     struct vm_page_cpu_pool *cpu_pool;
     struct vm_page *page;
+    unsigned int node;
     int filled;
 
     assert(order < VM_PAGE_NR_FREE_LISTS);
@@ -705,7 +857,8 @@ vm_page_seg_alloc(struct vm_page_seg *seg, unsigned int order,
         simple_lock(&cpu_pool->lock);
 
         if (cpu_pool->nr_pages == 0) {
-            filled = vm_page_cpu_pool_fill(cpu_pool, seg);
+            filled = vm_page_cpu_pool_fill(cpu_pool, seg,
+                                           vm_page_local_node());
 
             if (!filled) {
                 simple_unlock(&cpu_pool->lock);
@@ -718,8 +871,11 @@ vm_page_seg_alloc(struct vm_page_seg *seg, unsigned int order,
         simple_unlock(&cpu_pool->lock);
         thread_unpin();
     } else {
+        thread_pin();
+        node = vm_page_local_node();
+        thread_unpin();
         simple_lock(&seg->lock);
-        page = vm_page_seg_alloc_from_buddy(seg, order);
+        page = vm_page_seg_alloc_from_buddy(seg, order, node);
         simple_unlock(&seg->lock);
 
         if (page == NULL)
@@ -744,24 +900,41 @@ vm_page_seg_free(struct vm_page_seg *seg, struct vm_page *page,
 
     if (order == 0) {
         thread_pin();
-        cpu_pool = vm_page_cpu_pool_get(seg);
-        simple_lock(&cpu_pool->lock);
 
-        if (cpu_pool->nr_pages == cpu_pool->size)
-            vm_page_cpu_pool_drain(cpu_pool, seg);
+        /*
+         * CPU pools only cache pages of the local node, return pages
+         * freed by processors of other nodes to their free lists.
+         */
+        if (page->numa_node == vm_page_local_node()) {
+            cpu_pool = vm_page_cpu_pool_get(seg);
+            simple_lock(&cpu_pool->lock);
+
+            if (cpu_pool->nr_pages == cpu_pool->size)
+                vm_page_cpu_pool_drain(cpu_pool, seg);
+
+            vm_page_cpu_pool_push(cpu_pool, page);
+            simple_unlock(&cpu_pool->lock);
+            thread_unpin();
+            return;
+        }
 
-        vm_page_cpu_pool_push(cpu_pool, page);
-        simple_unlock(&cpu_pool->lock);
         thread_unpin();
-    } else {
-        simple_lock(&seg->lock);
-        vm_page_seg_free_to_buddy(seg, page, order);
-        simple_unlock(&seg->lock);
     }
+
+    simple_lock(&seg->lock);
+    vm_page_seg_free_to_buddy(seg, page, order);
+    simple_unlock(&seg->lock);
+}
+
+static inline unsigned int
+vm_page_seq_gen(unsigned long seq)
+{
+    return seq % VM_PAGE_NR_GENS;
 }
 
 static void
-vm_page_seg_add_active_page(struct vm_page_seg *seg, struct vm_page *page)
+vm_page_seg_add_active_page_to(struct vm_page_seg *seg,
+                               struct vm_page *page, unsigned int gen)
 {
     assert(simple_lock_taken(&seg->lock));
     assert(page->object != NULL);
@@ -771,11 +944,31 @@ vm_page_seg_add_active_page(struct vm_page_seg *seg, struct vm_page *page)
     assert(!page->free && !page->active && !page->inactive);
     page->active = TRUE;
     page->reference = TRUE;
-    vm_page_queue_push(&seg->active_pages, page);
+    page->gen = gen;
+    vm_page_queue_push(&seg->active_gens[gen], page);
+    seg->nr_gen_pages[gen]++;
     seg->nr_active_pages++;
     vm_page_active_count++;
 }
 
+/*
+ * Add a page to the generation its references earned it, counting from
+ * the oldest one.
+ */
+static void
+vm_page_seg_add_active_page(struct vm_page_seg *seg, struct vm_page *page)
+{
+    unsigned long seq;
+
+    seq = seg->min_seq + page->refs;
+
+    if (seq > seg->max_seq) {
+        seq = seg->max_seq;
+    }
+
+    vm_page_seg_add_active_page_to(seg, page, vm_page_seq_gen(seq));
+}
+
 static void
 vm_page_seg_remove_active_page(struct vm_page_seg *seg, struct vm_page *page)
 {
@@ -786,7 +979,8 @@ vm_page_seg_remove_active_page(struct vm_page_seg *seg, struct vm_page *page)
     assert(page->order == VM_PAGE_ORDER_UNLISTED);
     assert(!page->free && page->active && !page->inactive);
     page->active = FALSE;
-    vm_page_queue_remove(&seg->active_pages, page);
+    vm_page_queue_remove(&seg->active_gens[page->gen], page);
+    seg->nr_gen_pages[page->gen]--;
     seg->nr_active_pages--;
     vm_page_active_count--;
 }
@@ -834,7 +1028,7 @@ vm_page_next_page_list(struct list* cur_page_list,
 }
 
 /*
- * Attempt to pull an active page.
+ * Attempt to pull an active page, from the oldest generation first.
  *
  * If successful, the object containing the page is locked.
  */
@@ -842,48 +1036,54 @@ static struct vm_page *
 vm_page_seg_pull_active_page(struct vm_page_seg *seg, boolean_t external_only)
 {
     struct vm_page *page, *first;
+    struct vm_page_queue *queue;
     struct list* page_list;
+    unsigned long seq;
+    unsigned int gen;
     boolean_t locked;
 
-    first = NULL;
+    for (seq = seg->min_seq; seq <= seg->max_seq; seq++) {
+        gen = vm_page_seq_gen(seq);
+        queue = &seg->active_gens[gen];
+        first = NULL;
+        page_list = &queue->external_pages;
 
-    page_list = &seg->active_pages.external_pages;
+        for (;;) {
 
-    for (;;) {
+            page = (list_empty(page_list)
+                    ? NULL
+                    : list_first_entry(page_list, struct vm_page, node));
 
-        page = (list_empty(page_list)
-		? NULL
-		: list_first_entry(page_list, struct vm_page, node));
+            if (page == NULL || page == first) {
+              page_list = vm_page_next_page_list(page_list, queue, external_only);
 
-        if (page == NULL || page == first) {
-          page_list = vm_page_next_page_list(page_list, &seg->active_pages, external_only);
-
-          if (page_list == NULL)
-            break;
-          else
-            {
-              first = NULL;
-              continue;
+              if (page_list == NULL)
+                break;
+              else
+                {
+                  first = NULL;
+                  continue;
+                }
+            } else if (first == NULL) {
+                first = page;
             }
-        } else if (first == NULL) {
-            first = page;
-        }
 
-        vm_page_seg_remove_active_page(seg, page);
-        locked = vm_object_lock_try(page->object);
+            vm_page_seg_remove_active_page(seg, page);
+            locked = vm_object_lock_try(page->object);
 
-        if (!locked) {
-            vm_page_seg_add_active_page(seg, page);
-            continue;
-        }
+            if (!locked) {
+                vm_page_seg_add_active_page_to(seg, page, gen);
+                continue;
+            }
 
-        if (!vm_page_can_move(page)) {
-            vm_page_seg_add_active_page(seg, page);
-            vm_object_unlock(page->object);
-            continue;
-        }
+            if (!vm_page_can_move(page)) {
+                vm_page_seg_add_active_page_to(seg, page, gen);
+                vm_object_unlock(page->object);
+                continue;
+            }
 
-        return page;
+            return page;
+        }
     }
 
     return NULL;
@@ -948,70 +1148,16 @@ vm_page_seg_pull_inactive_page(struct vm_page_seg *seg, boolean_t external_only)
 }
 
 /*
- * Enhanced cache replacement policy - select best candidate for eviction
- * This is a simplified version that works with existing infrastructure
+ * Increment the number of times a page was found referenced in a row.
  */
-static struct vm_page *
-vm_page_seg_select_best_inactive_page(struct vm_page_seg *seg, boolean_t external_only)
+static inline void
+vm_page_inc_refs(struct vm_page *page)
 {
-    struct vm_page *page, *best_candidate = NULL;
-    struct list* page_list;
-    struct list* node;
-    int best_score = INT_MAX;
-    int score, count = 0;
-    const int max_search = 16;  /* Limit search to avoid performance impact */
-    
-    /* Search inactive pages first - they are primary candidates */
-    page_list = external_only ? &seg->inactive_pages.external_pages 
-                              : &seg->inactive_pages.internal_pages;
-    
-    /* Simple linear search of first few pages to find best candidate */
-    if (!list_empty(page_list)) {
-        for (node = list_first(page_list); 
-             node != page_list && count < max_search; 
-             node = list_next(node), count++) {
-            
-            page = list_entry(node, struct vm_page, node);
-            
-            if (!page->busy && !page->absent) {
-                /* Calculate eviction score (lower is better) */
-                score = (page->access_frequency * 4) + page->aging_time;
-                
-                if (score < best_score || best_candidate == NULL) {
-                    best_score = score;
-                    best_candidate = page;
-                }
-            }
-        }
+    if (page->refs < VM_PAGE_MAX_REFS) {
+        page->refs++;
     }
-    
-    return best_candidate;
 }
 
-/*
- * Update page access frequency and aging for replacement policy
- */
-static void
-vm_page_update_replacement_data(struct vm_page *page, boolean_t accessed)
-{
-    if (accessed) {
-        /* Increment access frequency (saturating at 15) */
-        if (page->access_frequency < 15) {
-            page->access_frequency++;
-        }
-        /* Reset aging time on access */
-        page->aging_time = 0;
-    } else {
-        /* Age the page (increment aging time, saturating at 15) */
-        if (page->aging_time < 15) {
-            page->aging_time++;
-        }
-        /* Decay access frequency slowly */
-        if (page->access_frequency > 0 && page->aging_time > 8) {
-            page->access_frequency--;
-        }
-    }
-}
 /*
  * Attempt to pull a page cache page.
  *
@@ -1024,37 +1170,20 @@ vm_page_seg_pull_cache_page(struct vm_page_seg *seg,
 {
     struct vm_page *page;
 
-    /* Try enhanced selection for inactive pages first */
-    page = vm_page_seg_select_best_inactive_page(seg, external_only);
-    
-    if (page != NULL) {
-        vm_page_seg_remove_inactive_page(seg, page);
-        /* Update replacement data to reflect access */
-        vm_page_update_replacement_data(page, FALSE);  /* Mark as being evicted */
-        *was_active = FALSE;
-        seg->cache_hits++;  /* Track cache hit */
-        return page;
-    }
-
-    /* Fall back to original inactive page selection */
     page = vm_page_seg_pull_inactive_page(seg, external_only);
 
     if (page != NULL) {
         *was_active = FALSE;
-        seg->cache_hits++;  /* Track cache hit */
         return page;
     }
 
-    /* Try active pages as last resort */
     page = vm_page_seg_pull_active_page(seg, external_only);
 
     if (page != NULL) {
         *was_active = TRUE;
-        seg->cache_hits++;  /* Track cache hit */
         return page;
     }
 
-    seg->cache_misses++;  /* Track cache miss */
     return NULL;
 }
 
@@ -1131,7 +1260,7 @@ vm_page_seg_balance_page(struct vm_page_seg *seg,
     assert(src->type != VM_PT_FREE);
     assert(src->order == VM_PAGE_ORDER_UNLISTED);
 
-    dest = vm_page_seg_alloc_from_buddy(remote_seg, 0);
+    dest = vm_page_seg_alloc_from_buddy(remote_seg, 0, src->numa_node);
     assert(dest != NULL);
 
     vm_page_seg_double_unlock(seg, remote_seg);
@@ -1257,6 +1386,7 @@ restart:
 
     if (!was_active
         && (page->reference || pmap_is_referenced(page->phys_addr))) {
+        vm_page_inc_refs(page);
         vm_page_seg_add_active_page(seg, page);
         simple_unlock(&seg->lock);
         vm_object_unlock(object);
@@ -1319,7 +1449,14 @@ out:
     }
 
     if (reclaim) {
-        vm_page_free(page);
+        /*
+         * Clean pages of files are set aside in the block cache, in
+         * case they're read again soon.
+         */
+        if (!block_cache_insert(page)) {
+            vm_page_free(page);
+        }
+
         vm_page_unlock_queues();
 
         if (vm_object_collectable(object)) {
@@ -1370,99 +1507,72 @@ vm_page_seg_compute_high_active_page(struct vm_page_seg *seg)
     unsigned long nr_pages;
 
     nr_pages = seg->nr_active_pages + seg->nr_inactive_pages;
-    seg->base_high_active_pages = nr_pages * VM_PAGE_HIGH_ACTIVE_PAGE_NUM
-                                  / VM_PAGE_HIGH_ACTIVE_PAGE_DENOM;
-    
-    /* Apply adaptive scaling */
-    seg->high_active_pages = (seg->base_high_active_pages * seg->cache_scale_percent) / 100;
+    seg->high_active_pages = nr_pages * VM_PAGE_HIGH_ACTIVE_PAGE_NUM
+                             / VM_PAGE_HIGH_ACTIVE_PAGE_DENOM;
 }
 
 /*
- * Adaptive cache sizing - adjust cache size based on memory pressure and hit rate
+ * Drop the oldest generations while they're empty, and create a new
+ * generation if there is room for it.
  */
 static void
-vm_page_seg_adapt_cache_size(struct vm_page_seg *seg)
-{
-    unsigned long memory_pressure, hit_rate;
-    unsigned long new_scale;
-    
-    seg->adapt_counter++;
-    
-    /* Only adapt every VM_PAGE_CACHE_ADAPT_INTERVAL operations */
-    if (seg->adapt_counter < VM_PAGE_CACHE_ADAPT_INTERVAL) {
-        return;
+vm_page_seg_update_gens(struct vm_page_seg *seg)
+{
+    while ((seg->min_seq < seg->max_seq)
+           && (seg->nr_gen_pages[vm_page_seq_gen(seg->min_seq)] == 0)) {
+        seg->min_seq++;
     }
-    
-    /* Reset counter and calculate metrics */
-    seg->adapt_counter = 0;
-    
-    /* Calculate memory pressure as percentage of free pages vs thresholds */
-    if (seg->nr_free_pages <= seg->min_free_pages) {
-        memory_pressure = 100;  /* Critical pressure */
-    } else if (seg->nr_free_pages <= seg->low_free_pages) {
-        memory_pressure = 80 + (20 * (seg->low_free_pages - seg->nr_free_pages)) 
-                          / (seg->low_free_pages - seg->min_free_pages);
-    } else {
-        memory_pressure = (80 * (seg->high_free_pages - seg->nr_free_pages)) 
-                         / (seg->high_free_pages - seg->low_free_pages);
+
+    if ((seg->max_seq - seg->min_seq + 1) < VM_PAGE_NR_GENS) {
+        seg->max_seq++;
     }
-    
-    /* Calculate cache hit rate */
-    if (seg->cache_hits + seg->cache_misses > 0) {
-        hit_rate = (seg->cache_hits * 100) / (seg->cache_hits + seg->cache_misses);
-    } else {
-        hit_rate = 50;  /* Default neutral hit rate */
-    }
-    
-    /* Adjust cache size based on pressure and hit rate */
-    new_scale = seg->cache_scale_percent;
-    
-    if (memory_pressure > VM_PAGE_CACHE_PRESSURE_THRESHOLD) {
-        /* High memory pressure - reduce cache size */
-        new_scale = (new_scale * 90) / 100;
-    } else if (memory_pressure < 50 && hit_rate > 80) {
-        /* Low pressure and good hit rate - increase cache size */
-        new_scale = (new_scale * 110) / 100;
-    } else if (hit_rate < 30) {
-        /* Poor hit rate - reduce cache size */
-        new_scale = (new_scale * 95) / 100;
-    }
-    
-    /* Clamp to valid range */
-    if (new_scale < VM_PAGE_CACHE_MIN_SCALE) {
-        new_scale = VM_PAGE_CACHE_MIN_SCALE;
-    } else if (new_scale > VM_PAGE_CACHE_MAX_SCALE) {
-        new_scale = VM_PAGE_CACHE_MAX_SCALE;
-    }
-    
-    seg->cache_scale_percent = new_scale;
-    
-    /* Reset counters for next interval */
-    seg->cache_hits = 0;
-    seg->cache_misses = 0;
 }
 
 static void
 vm_page_seg_refill_inactive(struct vm_page_seg *seg)
 {
     struct vm_page *page;
+    unsigned long nr_scan;
+    boolean_t referenced;
 
     simple_lock(&seg->lock);
 
-    /* Apply adaptive cache sizing */
-    vm_page_seg_adapt_cache_size(seg);
     vm_page_seg_compute_high_active_page(seg);
+    vm_page_seg_update_gens(seg);
+
+    /*
+     * Promoted pages go back to the active generations, so limit the scan
+     * to make sure it ends.
+     */
+    nr_scan = seg->nr_active_pages;
 
-    while (seg->nr_active_pages > seg->high_active_pages) {
+    while ((seg->nr_active_pages > seg->high_active_pages) && (nr_scan > 0)) {
         page = vm_page_seg_pull_active_page(seg, FALSE);
 
         if (page == NULL) {
             break;
         }
 
+        nr_scan--;
+        referenced = page->reference || pmap_is_referenced(page->phys_addr);
         page->reference = FALSE;
         pmap_clear_reference(page->phys_addr);
-        vm_page_seg_add_inactive_page(seg, page);
+
+        if (referenced) {
+            /*
+             * Leave the reference bit clear, so that the page moves up
+             * again only if referenced again.
+             */
+            vm_page_inc_refs(page);
+            vm_page_seg_add_active_page(seg, page);
+            page->reference = FALSE;
+            seg->nr_promoted++;
+        } else {
+            page->refs = 0;
+            vm_page_seg_add_inactive_page(seg, page);
+            seg->nr_deactivated++;
+        }
+
         vm_object_unlock(page->object);
     }
 
@@ -1660,6 +1770,11 @@ vm_page_setup(void)
         table += vm_page_atop(vm_page_seg_size(seg));
     }
 
+    for (i = 0; i < ARRAY_SIZE(vm_page_pagevecs); i++) {
+        simple_lock_init(&vm_page_pagevecs[i].lock);
+        vm_page_pagevecs[i].nr_pages = 0;
+    }
+
     while (va < (unsigned long)table) {
         pa = pmap_extract(kernel_pmap, va);
         page = vm_page_lookup_pa(pa);
@@ -1681,6 +1796,246 @@ vm_page_manage(struct vm_page *page)
     vm_page_seg_free_to_buddy(&vm_page_segs[page->seg_index], page, 0);
 }
 
+void __init
+vm_page_numa_add_range(unsigned int node, phys_addr_t start, phys_addr_t end)
+{
+    struct vm_page_numa_range *range;
+
+    assert(node < VM_PAGE_MAX_NODES);
+    assert(start < end);
+
+    if (vm_page_numa_nr_ranges == ARRAY_SIZE(vm_page_numa_ranges)) {
+        printf("vm_page: too many NUMA ranges, ignoring %llx:%llx\n",
+               (unsigned long long)start, (unsigned long long)end);
+        return;
+    }
+
+    range = &vm_page_numa_ranges[vm_page_numa_nr_ranges];
+    range->start = vm_page_trunc(start);
+    range->end = vm_page_round(end);
+    range->node = node;
+    vm_page_numa_nr_ranges++;
+
+    if (node >= vm_page_boot_nr_nodes)
+        vm_page_boot_nr_nodes = node + 1;
+}
+
+void __init
+vm_page_numa_set_cpu(unsigned int cpu, unsigned int node)
+{
+    assert(cpu < NCPUS);
+    assert(node < VM_PAGE_MAX_NODES);
+
+    vm_page_boot_cpu_nodes[cpu] = node;
+
+    if (node >= vm_page_boot_nr_nodes)
+        vm_page_boot_nr_nodes = node + 1;
+}
+
+void __init
+vm_page_numa_set_distance(unsigned int from, unsigned int to,
+                          unsigned int distance)
+{
+    assert(from < VM_PAGE_MAX_NODES);
+    assert(to < VM_PAGE_MAX_NODES);
+
+    vm_page_node_distances[from][to] = distance;
+}
+
+static unsigned int __init
+vm_page_numa_lookup(phys_addr_t pa)
+{
+    const struct vm_page_numa_range *range;
+    unsigned int i;
+
+    for (i = 0; i < vm_page_numa_nr_ranges; i++) {
+        range = &vm_page_numa_ranges[i];
+
+        if ((pa >= range->start) && (pa < range->end))
+            return range->node;
+    }
+
+    return 0;
+}
+
+/*
+ * Sort key of the given node in the fallback order of another one. The
+ * local node always comes first, whatever its reported distance.
+ */
+static unsigned int __init
+vm_page_numa_sort_key(unsigned int from, unsigned int to)
+{
+    return (from == to) ? 0 : vm_page_node_distances[from][to];
+}
+
+static void __init
+vm_page_numa_compute_orders(unsigned int nr_nodes)
+{
+    unsigned int i, j, k, key;
+
+    for (i = 0; i < nr_nodes; i++) {
+        for (j = 0; j < nr_nodes; j++) {
+            if (vm_page_node_distances[i][j] == 0)
+                vm_page_node_distances[i][j] = (i == j)
+                                               ? VM_PAGE_NUMA_LOCAL_DISTANCE
+                                               : VM_PAGE_NUMA_REMOTE_DISTANCE;
+        }
+    }
+
+    for (i = 0; i < nr_nodes; i++) {
+        for (j = 0; j < nr_nodes; j++) {
+            key = vm_page_numa_sort_key(i, j);
+
+            for (k = j; k > 0; k--) {
+                if (vm_page_numa_sort_key(i, vm_page_node_orders[i][k - 1])
+                    <= key)
+                    break;
+
+                vm_page_node_orders[i][k] = vm_page_node_orders[i][k - 1];
+            }
+
+            vm_page_node_orders[i][k] = j;
+        }
+    }
+}
+
+/*
+ * Release a free block to the buddy allocator, splitting it until its
+ * pieces each belong to a single node.
+ */
+static void __init
+vm_page_seg_free_numa_block(struct vm_page_seg *seg, struct vm_page *page,
+                            unsigned int order)
+{
+    unsigned int i, nr_pages;
+
+    nr_pages = 1 << order;
+
+    for (i = 1; i < nr_pages; i++)
+        if (page[i].numa_node != page->numa_node)
+            break;
+
+    if (i == nr_pages) {
+        vm_page_seg_free_to_buddy(seg, page, order);
+        return;
+    }
+
+    order--;
+    vm_page_seg_free_numa_block(seg, page, order);
+    vm_page_seg_free_numa_block(seg, &page[1 << order], order);
+}
+
+/*
+ * Assign the pages of a segment to their node, and sort its free blocks
+ * accordingly.
+ *
+ * The free page queue lock must be held.
+ */
+static void __init
+vm_page_seg_numa_setup(struct vm_page_seg *seg)
+{
+    struct vm_page_cpu_pool *cpu_pool;
+    struct vm_page_free_list *free_list;
+    struct vm_page *page;
+    struct list blocks;
+    unsigned int i, j, order;
+
+    /* CPU pools may cache pages of the wrong node from now on */
+    for (i = 0; i < ARRAY_SIZE(seg->cpu_pools); i++) {
+        cpu_pool = &seg->cpu_pools[i];
+        simple_lock(&cpu_pool->lock);
+        simple_lock(&seg->lock);
+
+        while (cpu_pool->nr_pages != 0) {
+            page = vm_page_cpu_pool_pop(cpu_pool);
+            vm_page_seg_free_to_buddy(seg, page, 0);
+        }
+
+        simple_unlock(&seg->lock);
+        simple_unlock(&cpu_pool->lock);
+    }
+
+    simple_lock(&seg->lock);
+
+    list_init(&blocks);
+
+    for (i = 0; i < ARRAY_SIZE(seg->free_lists); i++) {
+        for (j = 0; j < ARRAY_SIZE(seg->free_lists[i]); j++) {
+            free_list = &seg->free_lists[i][j];
+
+            while (!list_empty(&free_list->blocks)) {
+                page = list_first_entry(&free_list->blocks,
+                                        struct vm_page, node);
+                vm_page_free_list_remove(free_list, page);
+                list_insert_tail(&blocks, &page->node);
+            }
+        }
+    }
+
+    seg->nr_free_pages = 0;
+
+    for (i = 0; i < ARRAY_SIZE(seg->nr_node_pages); i++) {
+        seg->nr_node_pages[i] = 0;
+        seg->nr_node_free_pages[i] = 0;
+    }
+
+    for (page = seg->pages; page < seg->pages_end; page++) {
+        page->numa_node = vm_page_numa_lookup(page->phys_addr);
+        seg->nr_node_pages[page->numa_node]++;
+    }
+
+    while (!list_empty(&blocks)) {
+        page = list_first_entry(&blocks, struct vm_page, node);
+        list_remove(&page->node);
+        order = page->order;
+        page->order = VM_PAGE_ORDER_UNLISTED;
+        vm_page_seg_free_numa_block(seg, page, order);
+    }
+
+    simple_unlock(&seg->lock);
+}
+
+void __init
+vm_page_numa_setup(void)
+{
+    unsigned long nr_pages;
+    unsigned int i, j, nr_nodes;
+
+    nr_nodes = vm_page_boot_nr_nodes;
+
+    if (nr_nodes <= 1)
+        return;
+
+    vm_page_numa_compute_orders(nr_nodes);
+
+    simple_lock(&vm_page_queue_free_lock);
+
+    for (i = 0; i < vm_page_segs_size; i++)
+        vm_page_seg_numa_setup(&vm_page_segs[i]);
+
+    for (i = 0; i < ARRAY_SIZE(vm_page_cpu_nodes); i++)
+        vm_page_cpu_nodes[i] = vm_page_boot_cpu_nodes[i];
+
+    vm_page_nr_nodes = nr_nodes;
+
+    simple_unlock(&vm_page_queue_free_lock);
+
+    for (i = 0; i < nr_nodes; i++) {
+        nr_pages = 0;
+
+        for (j = 0; j < vm_page_segs_size; j++)
+            nr_pages += vm_page_segs[j].nr_node_pages[i];
+
+        printf("vm_page: node %u: pages: %lu (%luM), fallback:", i,
+               nr_pages, nr_pages >> (20 - PAGE_SHIFT));
+
+        for (j = 1; j < nr_nodes; j++)
+            printf(" %u", vm_page_node_orders[i][j]);
+
+        printf("\n");
+    }
+}
+
 struct vm_page *
 vm_page_lookup_pa(phys_addr_t pa)
 {
@@ -2011,6 +2366,7 @@ vm_page_deactivate(struct vm_page *page)
         }
 
         page->reference = FALSE;
+        page->refs = 0;
         vm_page_queues_remove(page);
     }
 
@@ -2033,6 +2389,7 @@ void
 vm_page_activate(struct vm_page *page)
 {
     struct vm_page_seg *seg;
+    boolean_t was_queued;
 
     assert(vm_page_locked_queues());
 
@@ -2040,8 +2397,10 @@ vm_page_activate(struct vm_page *page)
 
     /*
      * Unconditionally remove so that, even if the page was already
-     * active, it gets back to the end of the active queue.
+     * active, it gets back to the end of its generation, or moves up
+     * since it's used again.
      */
+    was_queued = page->active || page->inactive;
     vm_page_queues_remove(page);
 
     if ((page->wire_count == 0) && !page->fictitious && !page->private) {
@@ -2050,8 +2409,8 @@ vm_page_activate(struct vm_page *page)
         if (page->active)
             panic("vm_page_activate: already active");
 
-        /* Update replacement policy data - page is being accessed */
-        vm_page_update_replacement_data(page, TRUE);
+        if (was_queued)
+            vm_page_inc_refs(page);
 
         simple_lock(&seg->lock);
         vm_page_seg_add_active_page(seg, page);
@@ -2085,6 +2444,262 @@ vm_page_queues_remove(struct vm_page *page)
     simple_unlock(&seg->lock);
 }
 
+/*
+ * Whether a page found in a page vector may still be moved.
+ *
+ * The page may have been freed, and even reused, since it was added.
+ * Only pages still on a queue are moved : evicting or freeing a page
+ * first removes it from the queues with the page queues locked, so a
+ * queued page is in the middle of neither, and moving it within the
+ * queues at worst misplaces a reused page.  Busy, absent and laundry
+ * pages are left to whoever works on them.
+ */
+static boolean_t
+vm_page_pagevec_eligible(const struct vm_page *page)
+{
+    return (page->active || page->inactive)
+           && (page->type != VM_PT_FREE) && !page->free && page->tabled
+           && (page->object != NULL) && (page->wire_count == 0)
+           && !page->fictitious && !page->private
+           && !page->busy && !page->absent && !page->laundry;
+}
+
+static void
+vm_page_pagevec_flush(struct vm_page **pages, const boolean_t *deactivate,
+                      unsigned int nr_pages)
+{
+    struct vm_page *page;
+    unsigned int i;
+
+    if (nr_pages == 0)
+        return;
+
+    vm_page_lock_queues();
+
+    for (i = 0; i < nr_pages; i++) {
+        page = pages[i];
+
+        if (!vm_page_pagevec_eligible(page))
+            continue;
+
+        if (deactivate[i]) {
+            vm_page_deactivate(page);
+        } else {
+            page->reference = TRUE;
+        }
+    }
+
+    vm_page_pagevec_flushes++;
+    vm_page_pagevec_pages += nr_pages;
+
+    if (nr_pages > vm_page_pagevec_max_batch)
+        vm_page_pagevec_max_batch = nr_pages;
+
+    vm_page_unlock_queues();
+}
+
+static void
+vm_page_pagevec_add(struct vm_page *page, boolean_t deactivate)
+{
+    struct vm_page *pages[VM_PAGE_PAGEVEC_SIZE];
+    boolean_t deactivates[VM_PAGE_PAGEVEC_SIZE];
+    struct vm_page_pagevec *pagevec;
+    unsigned int nr_pages;
+
+    assert(!vm_page_locked_queues());
+
+    thread_pin();
+    pagevec = &vm_page_pagevecs[cpu_number()];
+    simple_lock(&pagevec->lock);
+    pagevec->pages[pagevec->nr_pages] = page;
+    pagevec->deactivate[pagevec->nr_pages] = deactivate;
+    pagevec->nr_pages++;
+    nr_pages = pagevec->nr_pages;
+
+    if (nr_pages == VM_PAGE_PAGEVEC_SIZE) {
+        memcpy(pages, pagevec->pages, sizeof(pages));
+        memcpy(deactivates, pagevec->deactivate, sizeof(deactivates));
+        pagevec->nr_pages = 0;
+    }
+
+    simple_unlock(&pagevec->lock);
+    thread_unpin();
+
+    if (nr_pages == VM_PAGE_PAGEVEC_SIZE)
+        vm_page_pagevec_flush(pages, deactivates, nr_pages);
+}
+
+void
+vm_page_activate_deferred(struct vm_page *page)
+{
+    if (page->active || page->inactive) {
+        vm_page_pagevec_add(page, FALSE);
+        return;
+    }
+
+    vm_page_lock_queues();
+
+    if (!page->active && !page->inactive)
+        vm_page_activate(page);
+    else
+        page->reference = TRUE;
+
+    vm_page_unlock_queues();
+}
+
+void
+vm_page_deactivate_deferred(struct vm_page *page)
+{
+    if (page->active || page->inactive) {
+        vm_page_pagevec_add(page, TRUE);
+        return;
+    }
+
+    vm_page_lock_queues();
+    vm_page_deactivate(page);
+    vm_page_unlock_queues();
+}
+
+void
+vm_page_pagevec_drain(void)
+{
+    struct vm_page *pages[VM_PAGE_PAGEVEC_SIZE];
+    boolean_t deactivates[VM_PAGE_PAGEVEC_SIZE];
+    struct vm_page_pagevec *pagevec;
+    unsigned int i, nr_pages;
+
+    for (i = 0; i < ARRAY_SIZE(vm_page_pagevecs); i++) {
+        pagevec = &vm_page_pagevecs[i];
+        simple_lock(&pagevec->lock);
+        nr_pages = pagevec->nr_pages;
+        memcpy(pages, pagevec->pages, nr_pages * sizeof(pages[0]));
+        memcpy(deactivates, pagevec->deactivate,
+               nr_pages * sizeof(deactivates[0]));
+        pagevec->nr_pages = 0;
+        simple_unlock(&pagevec->lock);
+
+        vm_page_pagevec_flush(pages, deactivates, nr_pages);
+    }
+}
+
+#if MACH_DEBUG
+/*
+ *	Routine:	host_vm_lru_info [kernel call]
+ *	Purpose:
+ *		Return the state and statistics of the page replacement.
+ */
+kern_return_t
+host_vm_lru_info(host_t host, vm_lru_info_t *info)
+{
+    struct vm_page_seg *seg;
+    unsigned int i;
+
+    if (host == HOST_NULL)
+        return KERN_INVALID_HOST;
+
+    memset(info, 0, sizeof(*info));
+
+    vm_page_lock_queues();
+
+    for (i = 0; i < vm_page_segs_size; i++) {
+        seg = vm_page_seg_get(i);
+        simple_lock(&seg->lock);
+        info->vli_active += seg->nr_active_pages;
+        info->vli_inactive += seg->nr_inactive_pages;
+        info->vli_oldest += seg->nr_gen_pages[vm_page_seq_gen(seg->min_seq)];
+        info->vli_youngest += seg->nr_gen_pages[vm_page_seq_gen(seg->max_seq)];
+        info->vli_promoted += seg->nr_promoted;
+        info->vli_deactivated += seg->nr_deactivated;
+        simple_unlock(&seg->lock);
+    }
+
+    info->vli_pagevec_flushes = vm_page_pagevec_flushes;
+    info->vli_pagevec_pages = vm_page_pagevec_pages;
+
+    vm_page_unlock_queues();
+
+    return KERN_SUCCESS;
+}
+
+/*
+ *	Routine:	host_vm_numa_info [kernel call]
+ *	Purpose:
+ *		Return the size and allocation statistics of the NUMA nodes.
+ *	Conditions:
+ *		Nothing locked.  Obeys CountInOut protocol.
+ *	Returns:
+ *		KERN_SUCCESS		Returned information.
+ *		KERN_INVALID_HOST	The host is null.
+ *		KERN_RESOURCE_SHORTAGE	Couldn't allocate memory.
+ */
+kern_return_t
+host_vm_numa_info(host_t host, vm_node_info_array_t *infop,
+                  mach_msg_type_number_t *infoCntp)
+{
+    vm_node_info_t info[VM_PAGE_MAX_NODES];
+    struct vm_page_seg *seg;
+    unsigned int i, j, nr_nodes;
+    vm_size_t info_size;
+    kern_return_t kr;
+
+    if (host == HOST_NULL)
+        return KERN_INVALID_HOST;
+
+    nr_nodes = vm_page_nr_nodes;
+    info_size = nr_nodes * sizeof(*info);
+    memset(info, 0, sizeof(info));
+
+    simple_lock(&vm_page_queue_free_lock);
+
+    for (i = 0; i < vm_page_segs_size; i++) {
+        seg = vm_page_seg_get(i);
+        simple_lock(&seg->lock);
+
+        for (j = 0; j < nr_nodes; j++) {
+            info[j].vni_pages += seg->nr_node_pages[j];
+            info[j].vni_free += seg->nr_node_free_pages[j];
+            info[j].vni_hits += seg->node_hits[j];
+            info[j].vni_misses += seg->node_misses[j];
+            info[j].vni_foreign += seg->node_foreign[j];
+        }
+
+        simple_unlock(&seg->lock);
+    }
+
+    simple_unlock(&vm_page_queue_free_lock);
+
+    for (i = 0; i < smp_get_numcpus(); i++)
+        info[vm_page_cpu_nodes[i]].vni_cpus++;
+
+    if (nr_nodes <= *infoCntp) {
+        memcpy(*infop, info, info_size);
+    } else {
+        vm_offset_t info_addr;
+        vm_size_t total_size;
+        vm_map_copy_t copy;
+
+        kr = kmem_alloc_pageable(ipc_kernel_map, &info_addr, info_size);
+
+        if (kr != KERN_SUCCESS)
+            return KERN_RESOURCE_SHORTAGE;
+
+        memcpy((char *)info_addr, info, info_size);
+        total_size = round_page(info_size);
+
+        if (info_size < total_size)
+            memset((char *)(info_addr + info_size), 0,
+                   total_size - info_size);
+
+        kr = vm_map_copyin(ipc_kernel_map, info_addr, info_size, TRUE, &copy);
+        assert(kr == KERN_SUCCESS);
+        *infop = (vm_node_info_t *)copy;
+    }
+
+    *infoCntp = nr_nodes;
+    return KERN_SUCCESS;
+}
+#endif /* MACH_DEBUG */
+
 /*
  * Check whether segments are all usable for unprivileged allocations.
  *
@@ -2384,6 +2999,14 @@ void db_show_vmstat(void)
 			vm_page_segs[i].high_active_pages / PAGES_PER_MB);
 		db_printf("%-20s %10uM\n", "inactive:",
 			vm_page_segs[i].nr_inactive_pages / PAGES_PER_MB);
+		db_printf("%-20s %10lu\n", "oldest gen:",
+			vm_page_segs[i].min_seq);
+		db_printf("%-20s %10lu\n", "youngest gen:",
+			vm_page_segs[i].max_seq);
+		db_printf("%-20s %10lu\n", "promoted:",
+			vm_page_segs[i].nr_promoted);
+		db_printf("%-20s %10lu\n", "deactivated:",
+			vm_page_segs[i].nr_deactivated);
 	}
 }
 #endif /* MACH_KDB */
@@ -124,16 +124,17 @@ struct vm_page {
 
 	vm_prot_t	page_lock:3;	/* Uses prohibited by data manager (O) */
 	vm_prot_t	unlock_request:3;	/* Outstanding unlock request (O) */
-	
-	/* Cache replacement policy enhancements */
-	unsigned char	access_frequency:4;	/* Access frequency counter (0-15) */
-	unsigned char	aging_time:4;		/* Aging counter for replacement policy */
+
+	unsigned char	gen:2;		/* generation of an active page (P) */
+	unsigned char	refs:2;		/* times found referenced in a row
+					   when aged (P) */
 
 	struct {} vm_page_footer;
 
 	unsigned short type:2;
 	unsigned short seg_index:2;
 	unsigned short order:4;
+	unsigned short numa_node:3;
 };
 
 #define VM_PAGE_BODY_SIZE					\
@@ -234,6 +235,7 @@ extern void		vm_page_remove(
 
 extern void		vm_page_zero_fill(vm_page_t);
 extern void		vm_page_copy(vm_page_t src_m, vm_page_t dest_m);
+extern void		vm_page_copy_nocache(vm_page_t src_m, vm_page_t dest_m);
 
 extern void		vm_page_wire(vm_page_t);
 extern void		vm_page_unwire(vm_page_t);
@@ -417,6 +419,26 @@ void vm_page_load(unsigned int seg_index, phys_addr_t start, phys_addr_t end);
 void vm_page_load_heap(unsigned int seg_index, phys_addr_t start,
                        phys_addr_t end);
 
+/*
+ * NUMA topology.
+ *
+ * Once the vm_page module is set up, and before other processors are
+ * started, architecture-specific code can describe which node each range
+ * of physical memory and each processor belongs to, and the relative
+ * distances between nodes, then call vm_page_numa_setup to apply the
+ * description. Nodes are numbered from 0. Memory not covered by any range
+ * and processors not assigned a node belong to node 0. Unknown distances
+ * default to 10 within a node and 20 between nodes.
+ */
+#define VM_PAGE_MAX_NODES 8
+
+void vm_page_numa_add_range(unsigned int node, phys_addr_t start,
+                            phys_addr_t end);
+void vm_page_numa_set_cpu(unsigned int cpu, unsigned int node);
+void vm_page_numa_set_distance(unsigned int from, unsigned int to,
+                               unsigned int distance);
+void vm_page_numa_setup(void);
+
 /*
  * Return true if the vm_page module is completely initialized, false
  * otherwise, in which case only vm_page_bootalloc() can be used for
@@ -520,6 +542,24 @@ unsigned long vm_page_mem_free(void);
  */
 void vm_page_queues_remove(struct vm_page *page);
 
+/*
+ * Deferred page queue moves.
+ *
+ * vm_page_activate_deferred puts the given page on the active queue
+ * if it isn't on any queue, and marks it referenced otherwise, as done
+ * when a page is mapped.  vm_page_deactivate_deferred acts as
+ * vm_page_deactivate.  For a page already on a queue, both only record
+ * the move in a per-processor vector, and apply the moves of a full
+ * vector at once, which saves taking the page queues lock for each
+ * page.  A page off the queues is moved at once.  The object of the
+ * page must be locked, and the page queues must not be.  The pageout
+ * daemon drains all vectors with vm_page_pagevec_drain before
+ * scanning, so that it sees the latest references.
+ */
+void vm_page_activate_deferred(struct vm_page *page);
+void vm_page_deactivate_deferred(struct vm_page *page);
+void vm_page_pagevec_drain(void);
+
 /*
  * Balance physical pages among segments.
  *
@@ -34,7 +34,6 @@
  *	The proverbial page-out daemon.
  */
 
-#include <device/net_io.h>
 #include <mach/mach_types.h>
 #include <mach/memory_object.h>
 #include <vm/memory_object_default.user.h>
@@ -49,6 +48,8 @@
 #include <kern/printf.h>
 #include <vm/memory_object.h>
 #include <vm/pmap.h>
+#include <vm/vm_block_cache.h>
+#include <vm/vm_compress.h>
 #include <vm/vm_map.h>
 #include <vm/vm_object.h>
 #include <vm/vm_page.h>
@@ -74,6 +75,13 @@ static int vm_pageout_requested;
  */
 static int vm_pageout_continue;
 
+/*
+ * Priority of the next kernel memory reclaim, lowered at each scan
+ * that didn't make enough free pages, so that the shrinkers release
+ * more as the memory pressure persists.
+ */
+static unsigned int vm_pageout_shrink_priority = KMEM_SHRINK_PRIORITY_MAX;
+
 /*
  *	Routine:	vm_pageout_setup
  *	Purpose:
@@ -194,7 +202,7 @@ vm_pageout_setup(
 		 *	Copy the data into the new page,
 		 *	and mark the new page as clean.
 		 */
-		vm_page_copy(m, new_m);
+		vm_page_copy_nocache(m, new_m);
 
 		vm_object_lock(old_object);
 		m->dirty = FALSE;
@@ -291,6 +299,88 @@ vm_pageout_setup(
 	return (flush ? holding_page : VM_PAGE_NULL);
 }
 
+/*
+ *	Routine:	vm_pageout_cluster_page
+ *	Purpose:
+ *		Prepare the page at the given offset of the object to
+ *		be written back along with a neighbour, if it's dirty
+ *		and not in use.  The page is made busy, unmapped and
+ *		taken off the pageout queues.
+ *
+ *		The object must be locked.
+ */
+static boolean_t
+vm_pageout_cluster_page(
+	vm_object_t		object,
+	vm_offset_t		offset)
+{
+	vm_page_t		p;
+
+	p = vm_page_lookup(object, offset);
+
+	if ((p == VM_PAGE_NULL) || p->busy || p->absent || p->error ||
+	    p->fictitious || p->private || p->precious || p->overwriting ||
+	    p->laundry || p->external_laundry || (p->wire_count != 0))
+		return FALSE;
+
+	if (!p->dirty && !pmap_is_modified(p->phys_addr))
+		return FALSE;
+
+	p->busy = TRUE;
+	pmap_page_protect(p->phys_addr, VM_PROT_NONE);
+	p->dirty = TRUE;
+
+	vm_page_lock_queues();
+	VM_PAGE_QUEUES_REMOVE(p);
+	vm_page_unlock_queues();
+
+	return TRUE;
+}
+
+/*
+ *	Routine:	vm_pageout_cluster
+ *	Purpose:
+ *		Gather the dirty pages around the given one, within
+ *		its block in the block cache of the object, so that
+ *		the memory manager gets them in a single request.
+ *
+ *		Returns the number of pages, stored in pages in the
+ *		order of their offsets.
+ *
+ *		The object must be locked.
+ */
+static unsigned int
+vm_pageout_cluster(
+	vm_page_t		m,
+	vm_page_t		*pages)
+{
+	vm_object_t		object = m->object;
+	vm_offset_t		block_start, block_end, first, last, offset;
+	unsigned int		nr_pages;
+
+	block_start = block_cache_trunc_block(m->offset,
+					      object->block_cache->block_size);
+	block_end = block_start + object->block_cache->block_size;
+
+	for (first = m->offset;
+	     (first > block_start) &&
+	     vm_pageout_cluster_page(object, first - PAGE_SIZE);
+	     first -= PAGE_SIZE)
+		continue;
+
+	for (last = m->offset + PAGE_SIZE;
+	     (last < block_end) && vm_pageout_cluster_page(object, last);
+	     last += PAGE_SIZE)
+		continue;
+
+	nr_pages = 0;
+	for (offset = first; offset < last; offset += PAGE_SIZE)
+		pages[nr_pages++] = (offset == m->offset)
+				    ? m : vm_page_lookup(object, offset);
+
+	return nr_pages;
+}
+
 /*
  *	Routine:	vm_pageout_page
  *	Purpose:
@@ -306,6 +396,9 @@ vm_pageout_setup(
  *		should be flushed from the object.  If not, a
  *		copy of the data is sent to the memory object.
  *
+ *		Dirty neighbours of a flushed page of an object
+ *		with a block cache are flushed along with it.
+ *
  *	In/out conditions:
  *		The page in question must not be on any pageout queues.
  *		The object to which it belongs must be locked.
@@ -322,7 +415,9 @@ vm_pageout_page(
 	vm_map_copy_t		copy;
 	vm_object_t		old_object;
 	vm_object_t		new_object;
-	vm_page_t		holding_page;
+	vm_page_t		pages[BLOCK_CACHE_MAX_PAGES];
+	vm_page_t		holding_pages[BLOCK_CACHE_MAX_PAGES];
+	unsigned int		i, nr_pages;
 	vm_offset_t		paging_offset;
 	kern_return_t		rc;
 	boolean_t		precious_clean;
@@ -351,30 +446,72 @@ vm_pageout_page(
 		return;
 	}
 
+	old_object = m->object;
+	paging_offset = m->offset + old_object->paging_offset;
+
+	/*
+	 *	Evicted anonymous memory goes to the compressed pool
+	 *	first, and only reaches the default pager if it doesn't
+	 *	fit there.  Whatever the pool had for this page is stale
+	 *	once the default pager gets the new data.
+	 */
+	if (old_object->internal) {
+		if (flush && !initial
+		    && (vm_page_compress(old_object, paging_offset, m)
+			== KERN_SUCCESS)) {
+#if	MACH_PAGEMAP
+			vm_external_state_set(old_object->existence_info,
+					      paging_offset,
+					      VM_EXTERNAL_STATE_EXISTS);
+#endif	/* MACH_PAGEMAP */
+			VM_PAGE_FREE(m);
+			return;
+		}
+
+		vm_page_compress_remove(old_object, paging_offset);
+	}
+
+	/*
+	 *	Write the dirty neighbours of a page of a file along
+	 *	with it.  Pages being double paged to the default pager
+	 *	are written alone.
+	 */
+	if (flush && !initial && !precious_clean && !m->laundry
+	    && (old_object->block_cache != NULL)) {
+		nr_pages = vm_pageout_cluster(m, pages);
+		paging_offset = pages[0]->offset + old_object->paging_offset;
+
+		if (nr_pages > 1)
+			block_cache_note_clustered(old_object->block_cache,
+						   nr_pages - 1);
+	} else {
+		pages[0] = m;
+		nr_pages = 1;
+	}
+
 	/*
 	 *	Create a paging reference to let us play with the object.
 	 */
-	old_object = m->object;
-	paging_offset = m->offset + old_object->paging_offset;
 	vm_object_paging_begin(old_object);
 	vm_object_unlock(old_object);
 
 	/*
-	 *	Allocate a new object into which we can put the page.
+	 *	Allocate a new object into which we can put the pages.
 	 */
-	new_object = vm_object_allocate(PAGE_SIZE);
+	new_object = vm_object_allocate(nr_pages * PAGE_SIZE);
 	new_object->used_for_pageout = TRUE;
 
 	/*
-	 *	Move the page into the new object.
+	 *	Move the pages into the new object.
 	 */
-	holding_page = vm_pageout_setup(m,
-				paging_offset,
-				new_object,
-				0,		/* new offset */
-				flush);		/* flush */
-
-	rc = vm_map_copyin_object(new_object, 0, PAGE_SIZE, &copy);
+	for (i = 0; i < nr_pages; i++)
+		holding_pages[i] = vm_pageout_setup(pages[i],
+					paging_offset + i * PAGE_SIZE,
+					new_object,
+					i * PAGE_SIZE,	/* new offset */
+					flush);		/* flush */
+
+	rc = vm_map_copyin_object(new_object, 0, nr_pages * PAGE_SIZE, &copy);
 	assert(rc == KERN_SUCCESS);
 
 	if (initial) {
@@ -387,7 +524,8 @@ vm_pageout_page(
 		rc = memory_object_data_return(
 			 old_object->pager,
 			 old_object->pager_request,
-			 paging_offset, (pointer_t) copy, PAGE_SIZE,
+			 paging_offset, (pointer_t) copy,
+			 nr_pages * PAGE_SIZE,
 			 !precious_clean, !flush);
 	}
 
@@ -398,8 +536,9 @@ vm_pageout_page(
 	 *	Clean up.
 	 */
 	vm_object_lock(old_object);
-	if (holding_page != VM_PAGE_NULL)
-	    VM_PAGE_FREE(holding_page);
+	for (i = 0; i < nr_pages; i++)
+		if (holding_pages[i] != VM_PAGE_NULL)
+			VM_PAGE_FREE(holding_pages[i]);
 	vm_object_paging_end(old_object);
 }
 
@@ -417,6 +556,12 @@ static boolean_t vm_pageout_scan(boolean_t *should_wait)
 {
 	boolean_t done;
 
+	/*
+	 *	Apply the deferred page queue moves, so that the pages
+	 *	recently mapped can be found on the queues.
+	 */
+	vm_page_pagevec_drain();
+
 	/*
 	 *	Try balancing pages among segments first, since this
 	 *	may be enough to resume unprivileged allocations.
@@ -426,6 +571,7 @@ static boolean_t vm_pageout_scan(boolean_t *should_wait)
 	done = vm_page_balance();
 
 	if (done) {
+		vm_pageout_shrink_priority = KMEM_SHRINK_PRIORITY_MAX;
 		return TRUE;
 	}
 
@@ -437,22 +583,30 @@ static boolean_t vm_pageout_scan(boolean_t *should_wait)
 	 */
 
 	stack_collect();
-	net_kmsg_collect();
 	consider_task_collect();
 	if (0)	/* XXX: pcb_collect doesn't do anything yet, so it is
 		   pointless to call consider_thread_collect.  */
 	consider_thread_collect();
 
 	/*
-	 *	slab_collect should be last, because the other operations
-	 *	might return memory to caches.
+	 *	slab_shrink should be last, because the other operations
+	 *	might return memory to caches.  It runs the shrinkers of
+	 *	the subsystems (block cache, network and kmsg buffers)
+	 *	before reaping the caches.
 	 */
-	slab_collect();
+	slab_shrink(vm_pageout_shrink_priority);
 
 	vm_page_refill_inactive();
 
 	/* This function returns with vm_page_queue_free_lock held */
-	return vm_page_evict(should_wait);
+	done = vm_page_evict(should_wait);
+
+	if (done)
+		vm_pageout_shrink_priority = KMEM_SHRINK_PRIORITY_MAX;
+	else if (vm_pageout_shrink_priority > 0)
+		vm_pageout_shrink_priority--;
+
+	return done;
 }
 
 void vm_pageout(void)
@@ -718,10 +718,8 @@ static void vm_page_init_template(vm_page_t m)
 
 	m->page_lock = VM_PROT_NONE;
 	m->unlock_request = VM_PROT_NONE;
-	
-	/* Initialize cache replacement policy fields */
-	m->access_frequency = 0;
-	m->aging_time = 0;
+	m->gen = 0;
+	m->refs = 0;
 }
 
 /*
@@ -1135,6 +1133,23 @@ void vm_page_copy(
 	pmap_copy_page(src_m->phys_addr, dest_m->phys_addr);
 }
 
+/*
+ *	vm_page_copy_nocache:
+ *
+ *	Copy one page to another which is not likely to be
+ *	accessed soon, e.g. because it is on its way out.
+ */
+
+void vm_page_copy_nocache(
+	vm_page_t	src_m,
+	vm_page_t	dest_m)
+{
+	VM_PAGE_CHECK(src_m);
+	VM_PAGE_CHECK(dest_m);
+
+	pmap_copy_page_nocache(src_m->phys_addr, dest_m->phys_addr);
+}
+
 #if	MACH_VM_DEBUG
 /*
  *	Routine:	vm_page_info